@@ -0,0 +1,703 @@
+#include "restart_cleaner_standalone.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+/**
+ * Shape of the synthetic restart hierarchy
+ */
+struct TreeSpec {
+    int num_dirs = 20;
+    int num_ranks = 64;
+    int files_per_rank = 4;
+    std::string size_dist = "fixed:4K";
+    bool sparse = false;
+    unsigned int seed = 1;
+};
+
+/**
+ * Benchmark settings collected from the command line
+ */
+struct BenchOptions {
+    TreeSpec tree;
+    std::vector<std::string> engines = {"PARALLEL", "URING", "SERIAL"};
+    std::vector<std::string> strategies = {"KEEP_RECENT_N"};
+    std::vector<std::string> unlink_orders = {"READDIR"};
+    std::string work_dir = "bench_restart_tree";
+    std::string format = "csv";
+    std::string output;
+    std::string label;
+    std::uintmax_t max_bytes = 0;
+    int keep_count = 2;
+    int num_jobs = 0;
+    int gen_threads = 0;
+    int match_names = 0;
+};
+
+/**
+ * Timings and counts of one engine/strategy combination
+ */
+struct BenchResult {
+    std::string engine;
+    std::string strategy;
+    std::string unlink_order;
+    std::uintmax_t total_files = 0;
+    std::uintmax_t total_bytes = 0;
+    double generate_s = 0.0;
+    double scan_s = 0.0;
+    double plan_s = 0.0;
+    double cleanup_s = 0.0;
+    std::size_t found = 0;
+    std::size_t remaining = 0;
+};
+
+/**
+ * Throughput of one directory name matcher
+ */
+struct MatchResult {
+    std::string matcher;
+    std::size_t names = 0;
+    std::size_t matched = 0;
+    double seconds = 0.0;
+};
+
+/**
+ * Function: show_usage
+ * Purpose: Display usage information
+ */
+void show_usage(const char* program_name) {
+    std::cout << "IBAMR Restart Cleanup Benchmark" << std::endl;
+    std::cout << "Usage: " << program_name << " [options]" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Tree options:" << std::endl;
+    std::cout << "  --dirs N            Number of restore.XXXXXX directories (default: 20)" << std::endl;
+    std::cout << "  --ranks N           Number of ranks per restore directory (default: 64)" << std::endl;
+    std::cout << "  --files-per-rank N  Files per rank: samrai.*, hier_data.* and N-2 patch files in proc.* (default: 4)" << std::endl;
+    std::cout << "  --size-dist D       File sizes: fixed:S, uniform:MIN:MAX or lognormal:MEDIAN:SIGMA (default: fixed:4K)" << std::endl;
+    std::cout << "  --sparse            Create sparse files (ftruncate) instead of writing data" << std::endl;
+    std::cout << "  --seed N            Seed of the file size generator (default: 1)" << std::endl;
+    std::cout << "  --gen-threads N     Threads used to generate the tree (default: number of cores)" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Cleanup options:" << std::endl;
+    std::cout << "  --engines E,...     Engines to time: parallel, uring, serial (default: parallel,uring,serial; uring is" << std::endl;
+    std::cout << "                      reported as parallel where the kernel lacks io_uring unlinkat)" << std::endl;
+    std::cout << "  --strategies S,...  Strategies to time: recent, smart, max-bytes (default: recent)" << std::endl;
+    std::cout << "  --keep N            Restore directories kept by each strategy (default: 2)" << std::endl;
+    std::cout << "  --max-bytes S       Budget of the max-bytes strategy (default: half of the generated bytes)" << std::endl;
+    std::cout << "  --jobs N            Number of deletion worker threads (default: number of cores)" << std::endl;
+    std::cout << "  --unlink-orders O,...  Unlink orders to time with the parallel engine: readdir, inode, reverse" << std::endl;
+    std::cout << "                      (default: readdir)" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Name matching:" << std::endl;
+    std::cout << "  --match-names N     Instead of cleaning up trees, time the directory name matchers on N names" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Output options:" << std::endl;
+    std::cout << "  --work-dir DIR      Directory the trees are generated in (default: bench_restart_tree)" << std::endl;
+    std::cout << "  --format F          Result format: csv (default) or json" << std::endl;
+    std::cout << "  --output FILE       Write the results to FILE instead of standard output" << std::endl;
+    std::cout << "  --label L           Label stored with every result, e.g. a version or commit" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Phases (each on a freshly generated tree, times in seconds):" << std::endl;
+    std::cout << "  scan_s     Building the restart index" << std::endl;
+    std::cout << "  plan_s     A dry run: scan and victim selection, including size measurement for max-bytes" << std::endl;
+    std::cout << "  cleanup_s  A real cleanup: scan, selection and deletion" << std::endl;
+    std::cout << std::endl;
+    std::cout << "Examples:" << std::endl;
+    std::cout << "  " << program_name << " --dirs 50 --ranks 1024 --files-per-rank 8 --sparse --format json" << std::endl;
+    std::cout << "  " << program_name << " --size-dist lognormal:1M:1.5 --strategies recent,max-bytes --label v1.2" << std::endl;
+    std::cout << "  " << program_name << " --match-names 5000000 --format json" << std::endl;
+    std::cout << "  " << program_name << " --engines parallel --unlink-orders readdir,inode,reverse --ranks 4096" << std::endl;
+}
+
+/**
+ * Function: parse_positive
+ * Purpose: Parse a positive integer option value, printing an error on failure
+ */
+bool parse_positive(const std::string& text, int& value) {
+    try {
+        value = std::stoi(text);
+    } catch (const std::exception&) {
+        std::cerr << "Error: '" << text << "' is not a valid number." << std::endl;
+        return false;
+    }
+    if (value <= 0) {
+        std::cerr << "Error: Expected a positive number, got " << value << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Function: parse_bytes
+ * Purpose: Parse a byte count with an optional binary suffix, e.g. "4K" or "1.5MiB"
+ */
+bool parse_bytes(const std::string& text, std::uintmax_t& bytes) {
+    std::size_t pos = 0;
+    double value = -1.0;
+    try {
+        value = std::stod(text, &pos);
+    } catch (const std::exception&) {
+        pos = 0;
+    }
+
+    std::string suffix = text.substr(pos);
+    if (suffix == "B") suffix.clear();
+    if (suffix.size() == 3 && suffix.substr(1) == "iB") suffix.resize(1);
+
+    const std::string units = "KMGTP";
+    double scale = 1.0;
+    if (!suffix.empty()) {
+        std::size_t unit = suffix.size() == 1 ? units.find(std::toupper(suffix[0])) : std::string::npos;
+        if (unit == std::string::npos) pos = 0;
+        for (std::size_t i = 0; i <= unit && unit != std::string::npos; ++i) scale *= 1024.0;
+    }
+
+    if (pos == 0 || value < 0.0) {
+        std::cerr << "Error: '" << text << "' is not a valid size." << std::endl;
+        return false;
+    }
+    bytes = static_cast<std::uintmax_t>(value * scale);
+    return true;
+}
+
+/**
+ * Function: split_list
+ * Purpose: Split a comma separated option value
+ */
+std::vector<std::string> split_list(const std::string& text) {
+    std::vector<std::string> items;
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        if (!item.empty()) items.push_back(item);
+    }
+    return items;
+}
+
+/**
+ * Function: make_size_generator
+ * Purpose: Build a file size generator from a distribution specification
+ */
+bool make_size_generator(const std::string& spec, std::function<std::uintmax_t(std::mt19937_64&)>& generator) {
+    std::vector<std::string> parts;
+    std::stringstream stream(spec);
+    std::string part;
+    while (std::getline(stream, part, ':')) parts.push_back(part);
+
+    std::uintmax_t a = 0, b = 0;
+    if (parts.size() == 2 && parts[0] == "fixed" && parse_bytes(parts[1], a)) {
+        generator = [a](std::mt19937_64&) { return a; };
+        return true;
+    }
+    if (parts.size() == 3 && parts[0] == "uniform" && parse_bytes(parts[1], a) && parse_bytes(parts[2], b) && a <= b) {
+        generator = [a, b](std::mt19937_64& rng) { return std::uniform_int_distribution<std::uintmax_t>(a, b)(rng); };
+        return true;
+    }
+    if (parts.size() == 3 && parts[0] == "lognormal" && parse_bytes(parts[1], a) && a > 0) {
+        double sigma = 0.0;
+        try {
+            sigma = std::stod(parts[2]);
+        } catch (const std::exception&) {
+            sigma = -1.0;
+        }
+        if (sigma >= 0.0) {
+            const double mu = std::log(static_cast<double>(a));
+            generator = [mu, sigma](std::mt19937_64& rng) {
+                return static_cast<std::uintmax_t>(std::lognormal_distribution<double>(mu, sigma)(rng));
+            };
+            return true;
+        }
+    }
+    std::cerr << "Error: Invalid size distribution '" << spec << "'." << std::endl;
+    return false;
+}
+
+/**
+ * Function: write_file
+ * Purpose: Create one file of the given size relative to a directory descriptor
+ */
+bool write_file(int dir_fd, const std::string& name, std::uintmax_t size, bool sparse, const std::vector<char>& block) {
+    int fd = ::openat(dir_fd, name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return false;
+    bool ok = true;
+    if (sparse) {
+        ok = ::ftruncate(fd, static_cast<off_t>(size)) == 0;
+    } else {
+        for (std::uintmax_t written = 0; written < size && ok;) {
+            std::size_t chunk = static_cast<std::size_t>(std::min<std::uintmax_t>(block.size(), size - written));
+            ssize_t n = ::write(fd, block.data(), chunk);
+            ok = n > 0;
+            written += ok ? static_cast<std::uintmax_t>(n) : 0;
+        }
+    }
+    ::close(fd);
+    return ok;
+}
+
+/**
+ * Function: generate_tree
+ * Purpose: Generate the synthetic restart hierarchy, one restore directory per task
+ *
+ * Every restore directory gets, per rank, "samrai.<rank>", "hier_data.<rank>.samrai.<rank>"
+ * and files_per_rank - 2 patch files in "proc.<rank>/".  File sizes are drawn
+ * per restore directory from a generator seeded with (seed, directory), so the
+ * tree is reproducible regardless of the number of threads.
+ */
+void generate_tree(const std::string& dir, const TreeSpec& spec, int num_threads,
+                   std::uintmax_t& total_files, std::uintmax_t& total_bytes) {
+    std::function<std::uintmax_t(std::mt19937_64&)> next_size;
+    make_size_generator(spec.size_dist, next_size);
+
+    fs::remove_all(dir);
+    fs::create_directories(dir);
+
+    std::atomic<int> next_dir{0};
+    std::atomic<std::uintmax_t> files{0};
+    std::atomic<std::uintmax_t> bytes{0};
+    std::atomic<bool> failed{false};
+
+    auto worker = [&]() {
+        std::vector<char> block(1 << 20, 'x');
+        for (int d = next_dir++; d < spec.num_dirs && !failed; d = next_dir++) {
+            std::mt19937_64 rng(spec.seed * 1000003ULL + static_cast<unsigned long long>(d));
+            char name[32];
+            std::snprintf(name, sizeof(name), "restore.%06d", (d + 1) * 10);
+            const std::string restore_path = dir + "/" + name;
+            if (::mkdir(restore_path.c_str(), 0755) != 0) {
+                failed = true;
+                break;
+            }
+            int restore_fd = ::open(restore_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+            for (int rank = 0; rank < spec.num_ranks && restore_fd >= 0; ++rank) {
+                char rank_name[16];
+                std::snprintf(rank_name, sizeof(rank_name), "%05d", rank);
+                std::vector<std::pair<int, std::string>> targets = {
+                    {restore_fd, std::string("samrai.") + rank_name},
+                    {restore_fd, std::string("hier_data.") + rank_name + ".samrai." + rank_name}};
+
+                int proc_fd = -1;
+                if (spec.files_per_rank > 2) {
+                    std::string proc_name = std::string("proc.") + rank_name;
+                    ::mkdirat(restore_fd, proc_name.c_str(), 0755);
+                    proc_fd = ::openat(restore_fd, proc_name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                    for (int k = 0; k + 2 < spec.files_per_rank && proc_fd >= 0; ++k) {
+                        char patch_name[32];
+                        std::snprintf(patch_name, sizeof(patch_name), "patch.%05d", k);
+                        targets.emplace_back(proc_fd, patch_name);
+                    }
+                }
+
+                for (std::size_t t = 0; t < targets.size() && t < static_cast<std::size_t>(spec.files_per_rank); ++t) {
+                    std::uintmax_t size = next_size(rng);
+                    if (!write_file(targets[t].first, targets[t].second, size, spec.sparse, block)) failed = true;
+                    files += 1;
+                    bytes += size;
+                }
+                if (proc_fd >= 0) ::close(proc_fd);
+            }
+            if (restore_fd < 0) failed = true;
+            else ::close(restore_fd);
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < std::max(1, num_threads); ++t) threads.emplace_back(worker);
+    for (auto& thread : threads) thread.join();
+
+    if (failed) {
+        throw std::runtime_error("Failed to generate the restart tree in " + dir);
+    }
+    total_files = files;
+    total_bytes = bytes;
+}
+
+/**
+ * Function: seconds_since
+ * Purpose: Elapsed wall-clock time in seconds
+ */
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * Function: create_cleaner
+ * Purpose: Create a RestartCleaner for one engine/strategy combination
+ */
+std::unique_ptr<RestartCleaner> create_cleaner(const BenchOptions& options, const std::string& engine,
+                                               const std::string& strategy, const std::string& unlink_order,
+                                               std::uintmax_t budget, bool dry_run) {
+    auto cleaner = std::make_unique<RestartCleaner>(options.work_dir, options.keep_count, strategy, dry_run);
+    cleaner->setDeletionEngine(engine);
+    cleaner->setUnlinkOrder(unlink_order);
+    if (options.num_jobs > 0) cleaner->setNumJobs(options.num_jobs);
+    if (strategy == "MAX_BYTES") cleaner->setMaxBytes(std::max<std::uintmax_t>(1, budget));
+    return cleaner;
+}
+
+/**
+ * Function: run_case
+ * Purpose: Generate a fresh tree and time the scan, plan and cleanup phases
+ */
+BenchResult run_case(const BenchOptions& options, const std::string& engine, const std::string& strategy,
+                     const std::string& unlink_order) {
+    BenchResult result;
+    result.engine = engine;
+    result.strategy = strategy;
+    result.unlink_order = unlink_order;
+
+    int gen_threads = options.gen_threads > 0 ? options.gen_threads : static_cast<int>(std::thread::hardware_concurrency());
+    auto start = std::chrono::steady_clock::now();
+    generate_tree(options.work_dir, options.tree, gen_threads, result.total_files, result.total_bytes);
+    ::sync();
+    result.generate_s = seconds_since(start);
+
+    std::uintmax_t budget = options.max_bytes > 0 ? options.max_bytes : result.total_bytes / 2;
+
+    // The cleaner reports every directory; keep that out of the measurements
+    std::ostringstream discard;
+    std::streambuf* saved = std::cout.rdbuf(discard.rdbuf());
+    try {
+        start = std::chrono::steady_clock::now();
+        result.found = create_cleaner(options, engine, strategy, unlink_order, budget, true)->getRestartIndex().size();
+        result.scan_s = seconds_since(start);
+
+        start = std::chrono::steady_clock::now();
+        create_cleaner(options, engine, strategy, unlink_order, budget, true)->cleanup();
+        result.plan_s = seconds_since(start);
+
+        auto cleaner = create_cleaner(options, engine, strategy, unlink_order, budget, false);
+        start = std::chrono::steady_clock::now();
+        result.engine = cleaner->cleanup().engine;
+        result.cleanup_s = seconds_since(start);
+        result.remaining = cleaner->getAvailableIterations().size();
+    } catch (...) {
+        std::cout.rdbuf(saved);
+        throw;
+    }
+    std::cout.rdbuf(saved);
+
+    std::cerr << engine << "/" << strategy << "/" << unlink_order << ": " << result.total_files << " files, cleanup "
+              << result.cleanup_s << " s" << std::endl;
+    return result;
+}
+
+/**
+ * Function: parse_iteration_legacy
+ * Purpose: The original parser (substr and std::stoi), kept as the baseline for --match-names
+ */
+int parse_iteration_legacy(const std::string& dirname) {
+    if (dirname.length() != 14 || dirname.substr(0, 8) != "restore.") {
+        return -1;
+    }
+    std::string number_part = dirname.substr(8);
+    for (char c : number_part) {
+        if (!std::isdigit(static_cast<unsigned char>(c))) {
+            return -1;
+        }
+    }
+    try {
+        return std::stoi(number_part);
+    } catch (const std::exception&) {
+        return -1;
+    }
+}
+
+/**
+ * Function: run_match_names
+ * Purpose: Time the legacy parser, the compile-time matcher and RestartNamePattern on the same names
+ */
+std::vector<MatchResult> run_match_names(int num_names, unsigned int seed) {
+    // Mostly restore directories, with the near misses a restart directory collects
+    std::mt19937_64 rng(seed);
+    std::uniform_int_distribution<int> iteration(0, 999999);
+    std::uniform_int_distribution<int> kind(0, 9);
+    std::vector<std::string> names;
+    names.reserve(num_names);
+    char name[64];
+    for (int i = 0; i < num_names; ++i) {
+        switch (kind(rng)) {
+        case 0:
+            std::snprintf(name, sizeof(name), "restore.%07d", iteration(rng) + 1000000);
+            break;
+        case 1:
+            std::snprintf(name, sizeof(name), "restore.%06d.tmp", iteration(rng));
+            break;
+        case 2:
+            std::snprintf(name, sizeof(name), "visit_dump.%05d", iteration(rng) % 100000);
+            break;
+        default:
+            std::snprintf(name, sizeof(name), "restore.%06d", iteration(rng));
+            break;
+        }
+        names.emplace_back(name);
+    }
+
+    const RestartNamePattern default_pattern;
+    const RestartNamePattern runtime_pattern("restore.{6+}");
+    const std::vector<std::pair<std::string, std::function<int(const std::string&)>>> matchers = {
+        {"legacy", parse_iteration_legacy},
+        {"compile-time", [](const std::string& n) { return matchIterationName<RestoreDirNames>(n); }},
+        {"pattern:" + default_pattern.getSpec(), [&](const std::string& n) { return default_pattern.match(n); }},
+        {"pattern:" + runtime_pattern.getSpec(), [&](const std::string& n) { return runtime_pattern.match(n); }},
+    };
+
+    // The matchers are called through std::function alike, so the
+    // differences are those of the matching itself
+    std::vector<MatchResult> results;
+    for (const auto& matcher : matchers) {
+        MatchResult result;
+        result.matcher = matcher.first;
+        result.names = names.size();
+        long long checksum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (const auto& n : names) {
+            const int iter = matcher.second(n);
+            if (iter >= 0) {
+                ++result.matched;
+                checksum += iter;
+            }
+        }
+        result.seconds = seconds_since(start);
+        std::cerr << matcher.first << ": " << result.seconds * 1e9 / std::max<std::size_t>(1, names.size())
+                  << " ns/name (checksum " << checksum << ")" << std::endl;
+        results.push_back(result);
+    }
+    return results;
+}
+
+/**
+ * Function: json_string
+ * Purpose: Quote a string for JSON output
+ */
+std::string json_string(const std::string& text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"' || c == '\\') quoted += '\\';
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+/**
+ * Function: write_results
+ * Purpose: Write all results as CSV (one row per case) or as a JSON array
+ */
+void write_results(std::ostream& out, const BenchOptions& options, const std::vector<BenchResult>& results) {
+    const TreeSpec& tree = options.tree;
+    const int jobs = options.num_jobs > 0 ? options.num_jobs : static_cast<int>(std::thread::hardware_concurrency());
+
+    if (options.format == "csv") {
+        out << "label,engine,strategy,unlink_order,dirs,ranks,files_per_rank,size_dist,sparse,jobs,total_files,total_bytes,"
+               "generate_s,scan_s,plan_s,cleanup_s,found,remaining\n";
+        for (const auto& r : results) {
+            out << options.label << ',' << r.engine << ',' << r.strategy << ',' << r.unlink_order << ','
+                << tree.num_dirs << ',' << tree.num_ranks << ',' << tree.files_per_rank << ',' << tree.size_dist << ','
+                << (tree.sparse ? 1 : 0) << ',' << jobs << ',' << r.total_files << ',' << r.total_bytes << ','
+                << r.generate_s << ',' << r.scan_s << ',' << r.plan_s << ',' << r.cleanup_s << ',' << r.found << ','
+                << r.remaining << '\n';
+        }
+        return;
+    }
+
+    out << "[\n";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        out << "  {\"label\": " << json_string(options.label) << ", \"engine\": " << json_string(r.engine)
+            << ", \"strategy\": " << json_string(r.strategy) << ", \"unlink_order\": " << json_string(r.unlink_order)
+            << ", \"dirs\": " << tree.num_dirs
+            << ", \"ranks\": " << tree.num_ranks << ", \"files_per_rank\": " << tree.files_per_rank
+            << ", \"size_dist\": " << json_string(tree.size_dist) << ", \"sparse\": " << (tree.sparse ? "true" : "false")
+            << ", \"jobs\": " << jobs << ", \"total_files\": " << r.total_files << ", \"total_bytes\": " << r.total_bytes
+            << ", \"generate_s\": " << r.generate_s << ", \"scan_s\": " << r.scan_s << ", \"plan_s\": " << r.plan_s
+            << ", \"cleanup_s\": " << r.cleanup_s << ", \"found\": " << r.found << ", \"remaining\": " << r.remaining
+            << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]\n";
+}
+
+/**
+ * Function: write_match_results
+ * Purpose: Write the name matching results as CSV or as a JSON array
+ */
+void write_match_results(std::ostream& out, const BenchOptions& options, const std::vector<MatchResult>& results) {
+    if (options.format == "csv") {
+        out << "label,matcher,names,matched,seconds,ns_per_name\n";
+        for (const auto& r : results) {
+            out << options.label << ',' << r.matcher << ',' << r.names << ',' << r.matched << ',' << r.seconds << ','
+                << r.seconds * 1e9 / std::max<std::size_t>(1, r.names) << '\n';
+        }
+        return;
+    }
+
+    out << "[\n";
+    for (std::size_t i = 0; i < results.size(); ++i) {
+        const MatchResult& r = results[i];
+        out << "  {\"label\": " << json_string(options.label) << ", \"matcher\": " << json_string(r.matcher)
+            << ", \"names\": " << r.names << ", \"matched\": " << r.matched << ", \"seconds\": " << r.seconds
+            << ", \"ns_per_name\": " << r.seconds * 1e9 / std::max<std::size_t>(1, r.names) << "}"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]\n";
+}
+
+/**
+ * Function: main
+ * Purpose: Program entry point, handles command line arguments
+ */
+int main(int argc, char* argv[]) {
+    BenchOptions options;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--help" || arg == "-h") {
+            show_usage(argv[0]);
+            return 0;
+        } else if (arg == "--sparse") {
+            options.tree.sparse = true;
+            continue;
+        } else if (arg.rfind("--", 0) != 0 || i + 1 >= argc) {
+            std::cerr << "Error: Unknown argument or missing value '" << arg << "'." << std::endl;
+            show_usage(argv[0]);
+            return 1;
+        }
+
+        std::string value = argv[++i];
+        bool ok = true;
+        if (arg == "--dirs") {
+            ok = parse_positive(value, options.tree.num_dirs);
+        } else if (arg == "--ranks") {
+            ok = parse_positive(value, options.tree.num_ranks);
+        } else if (arg == "--files-per-rank") {
+            ok = parse_positive(value, options.tree.files_per_rank);
+        } else if (arg == "--size-dist") {
+            std::function<std::uintmax_t(std::mt19937_64&)> generator;
+            options.tree.size_dist = value;
+            ok = make_size_generator(value, generator);
+        } else if (arg == "--seed") {
+            int seed = 0;
+            ok = parse_positive(value, seed);
+            options.tree.seed = static_cast<unsigned int>(seed);
+        } else if (arg == "--gen-threads") {
+            ok = parse_positive(value, options.gen_threads);
+        } else if (arg == "--engines") {
+            options.engines.clear();
+            for (std::string engine : split_list(value)) {
+                std::transform(engine.begin(), engine.end(), engine.begin(), ::toupper);
+                if (engine != "PARALLEL" && engine != "URING" && engine != "SERIAL") {
+                    std::cerr << "Error: Unknown engine '" << engine << "'." << std::endl;
+                    ok = false;
+                }
+                options.engines.push_back(engine);
+            }
+        } else if (arg == "--strategies") {
+            options.strategies.clear();
+            for (const auto& strategy : split_list(value)) {
+                if (strategy == "recent") options.strategies.push_back("KEEP_RECENT_N");
+                else if (strategy == "smart") options.strategies.push_back("SMART_RETENTION");
+                else if (strategy == "max-bytes") options.strategies.push_back("MAX_BYTES");
+                else {
+                    std::cerr << "Error: Unknown strategy '" << strategy << "'." << std::endl;
+                    ok = false;
+                }
+            }
+        } else if (arg == "--unlink-orders") {
+            options.unlink_orders.clear();
+            for (std::string order : split_list(value)) {
+                std::transform(order.begin(), order.end(), order.begin(), ::toupper);
+                if (order != "READDIR" && order != "INODE" && order != "REVERSE") {
+                    std::cerr << "Error: Unknown unlink order '" << order << "'." << std::endl;
+                    ok = false;
+                }
+                options.unlink_orders.push_back(order);
+            }
+        } else if (arg == "--keep") {
+            ok = parse_positive(value, options.keep_count);
+        } else if (arg == "--max-bytes") {
+            ok = parse_bytes(value, options.max_bytes);
+        } else if (arg == "--jobs") {
+            ok = parse_positive(value, options.num_jobs);
+        } else if (arg == "--match-names") {
+            ok = parse_positive(value, options.match_names);
+        } else if (arg == "--work-dir") {
+            options.work_dir = value;
+        } else if (arg == "--format") {
+            options.format = value;
+            ok = value == "csv" || value == "json";
+            if (!ok) std::cerr << "Error: Unknown format '" << value << "'." << std::endl;
+        } else if (arg == "--output") {
+            options.output = value;
+        } else if (arg == "--label") {
+            options.label = value;
+        } else {
+            std::cerr << "Error: Unknown flag '" << arg << "'." << std::endl;
+            show_usage(argv[0]);
+            return 1;
+        }
+        if (!ok) return 1;
+    }
+
+    if (options.match_names > 0) {
+        const std::vector<MatchResult> results = run_match_names(options.match_names, options.tree.seed);
+        if (options.output.empty()) {
+            write_match_results(std::cout, options, results);
+            return 0;
+        }
+        std::ofstream out(options.output);
+        write_match_results(out, options, results);
+        if (!out) {
+            std::cerr << "Error: Cannot write " << options.output << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+
+    std::vector<BenchResult> results;
+    try {
+        for (const auto& strategy : options.strategies) {
+            for (const auto& engine : options.engines) {
+                // The serial engine leaves the order to std::filesystem::remove_all()
+                for (const auto& order : options.unlink_orders) {
+                    if (engine == "SERIAL" && order != options.unlink_orders.front()) continue;
+                    results.push_back(run_case(options, engine, strategy, order));
+                }
+            }
+        }
+        fs::remove_all(options.work_dir);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        fs::remove_all(options.work_dir);
+        return 1;
+    }
+
+    if (options.output.empty()) {
+        write_results(std::cout, options, results);
+    } else {
+        std::ofstream out(options.output);
+        write_results(out, options, results);
+        if (!out) {
+            std::cerr << "Error: Cannot write " << options.output << std::endl;
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -1,5 +1,12 @@
 #include "restart_cleaner_standalone.h"
+#include <algorithm>
+#include <cctype>
+#include <csignal>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <sstream>
+#include <thread>
 
 /**
  * Function: show_usage
@@ -7,17 +14,361 @@
  */
 void show_usage(const char* program_name) {
     std::cout << "IBAMR Restart Cleanup Tool" << std::endl;
-    std::cout << "Usage: " << program_name << " --recent N <restart_dir> [--dry-run]" << std::endl;
+    std::cout << "Usage: " << program_name << " (--recent N | --smart N [--tiers T] | --max-bytes SIZE [--recent N]" << std::endl;
+    std::cout << "       " << std::string(std::char_traits<char>::length(program_name), ' ')
+              << "  | --keep-within D [--one-per D] [--max-age D] [--recent N])" << std::endl;
+    std::cout << "       " << std::string(std::char_traits<char>::length(program_name), ' ')
+              << " (<restart_dir>... | --batch <root>) [--jobs N] [--engine E] [--unlink-order O] [--tombstone] [--verify[-full]]" << std::endl;
+    std::cout << "       " << std::string(std::char_traits<char>::length(program_name), ' ')
+              << " [--max-unlink-rate N] [--max-free-rate SIZE] [--adaptive-throttle] [--migrate DIR | --pack]" << std::endl;
+    std::cout << "       " << std::string(std::char_traits<char>::length(program_name), ' ')
+              << " [--report json [--report-file F]] [--watch [--quiescence S] [--marker NAME]] [--pattern P] [--dry-run]" << std::endl;
+    std::cout << "       " << std::string(std::char_traits<char>::length(program_name), ' ')
+              << " [--dedup | --dedup-reflink] [--lock skip|wait|off] [--partition I/N] [--pin ITER,...] [--plan FILE]" << std::endl;
+    std::cout << "       " << std::string(std::char_traits<char>::length(program_name), ' ')
+              << " [--pin-markers] [--rebuild-catalog | --no-catalog]" << std::endl;
+    std::cout << "       " << program_name << " --execute FILE [--jobs N] [--engine E] [--lock M] [--dry-run] ..." << std::endl;
+    std::cout << "       " << program_name << " --unpack <restore_dir>.pack" << std::endl;
     std::cout << std::endl;
     std::cout << "Options:" << std::endl;
     std::cout << "  --recent N     Keep the N most recent restore directories" << std::endl;
+    std::cout << "  --smart N      Keep the N most recent restore directories, then thin out older ones in tiers" << std::endl;
+    std::cout << "  --tiers T      Tiers for --smart as STRIDE:COUNT,... (default: 10:N,100:0; COUNT 0 = unlimited)" << std::endl;
+    std::cout << "  --max-bytes S  Delete the oldest restore directories until they use at most S bytes" << std::endl;
+    std::cout << "                 (suffixes K, M, G, T, P are powers of 1024; --recent N sets the minimum kept, default 1)" << std::endl;
+    std::cout << "  --keep-within D  Keep every restore directory completed within the last D, e.g. 6h, then thin out" << std::endl;
+    std::cout << "                 older ones (durations take s, m, h, d or w; --recent N sets the minimum kept, default 1)" << std::endl;
+    std::cout << "  --one-per D    Keep one restore directory per D beyond --keep-within (default: 1d)" << std::endl;
+    std::cout << "  --max-age D    With --keep-within, delete restore directories completed more than D ago" << std::endl;
+    std::cout << "  --jobs N       Number of deletion worker threads (default: number of cores)" << std::endl;
+    std::cout << "  --engine E     Deletion engine: 'parallel' (default), 'uring' (parallel with batched io_uring unlinks," << std::endl;
+    std::cout << "                 falls back to 'parallel' without kernel support) or 'serial' (std::filesystem::remove_all)" << std::endl;
+    std::cout << "  --unlink-order O       Order of the files unlinked in each directory by the parallel engine: 'readdir'" << std::endl;
+    std::cout << "                         (default), 'inode' (sorted by inode number) or 'reverse'" << std::endl;
+    std::cout << "  --max-unlink-rate N    Issue at most N unlink calls per second (parallel engine only)" << std::endl;
+    std::cout << "  --max-free-rate SIZE   Free at most SIZE bytes per second, e.g. 500M (stats every file first)" << std::endl;
+    std::cout << "  --adaptive-throttle    Lower the unlink rate while unlink latency rises, starting from --max-unlink-rate" << std::endl;
+    std::cout << "  --migrate DIR  Move old restore directories into DIR instead of deleting them (renamed on the" << std::endl;
+    std::cout << "                 same file system, otherwise copied in parallel and verified before the source is removed)" << std::endl;
+    std::cout << "  --pack         Replace old restore directories by one indexed file <name>.pack each (verified" << std::endl;
+    std::cout << "                 before the directory is removed; packs are listed but never deleted)" << std::endl;
+    std::cout << "  --pack-compression C   Compress packed files with 'none' (default), 'zstd' or 'lz4' if built in" << std::endl;
+    std::cout << "  --unpack FILE  Restore the directory packed into FILE next to it and exit" << std::endl;
+    std::cout << "  --report json  Print a JSON report with phase timings, counts, system calls and errors" << std::endl;
+    std::cout << "  --report-file F  Write the report to F instead of standard output" << std::endl;
+    std::cout << "  --watch        Keep running and clean up whenever a new restore directory is finalized (inotify)" << std::endl;
+    std::cout << "  --quiescence S Seconds without writes after which a new restore directory is finalized (default: 30)" << std::endl;
+    std::cout << "  --marker NAME  Finalize a new restore directory when a file NAME appears in it instead" << std::endl;
+    std::cout << "  --pattern P    Manage directories named like P instead of restore.{6}, e.g. 'restore.{6+}' for runs" << std::endl;
+    std::cout << "                 past iteration 999999, 'visit_dump.{5+}' or 'lag_data.cycle_{6+}' ({} = any width," << std::endl;
+    std::cout << "                 a suffix in [] is optional)" << std::endl;
+    std::cout << "  --lock M       Lock the restart directory against concurrent cleanups: 'skip' if another process" << std::endl;
+    std::cout << "                 is cleaning up (default), 'wait' for it, or 'off'" << std::endl;
+    std::cout << "  --partition I/N  Take only share I (0 <= I < N) of the old restore directories, so that N" << std::endl;
+    std::cout << "                 cooperating processes delete in parallel without overlapping" << std::endl;
+    std::cout << "  --pin ITER,... Never delete these iterations and do not count them as kept; restarts can also be" << std::endl;
+    std::cout << "                 pinned by a line in <restart_dir>/.restart_cleaner_pins" << std::endl;
+    std::cout << "  --plan FILE    Select and measure the old restore directories and predict the time to delete them," << std::endl;
+    std::cout << "                 then save the plan to FILE instead of deleting anything" << std::endl;
+    std::cout << "  --execute FILE Delete the restore directories of a saved plan that still exist unchanged" << std::endl;
+    std::cout << "  --batch ROOT   Clean up every restart directory found below ROOT through one shared worker pool" << std::endl;
+    std::cout << "                 (also used when several restart directories are given)" << std::endl;
     std::cout << std::endl;
     std::cout << "Flags:" << std::endl;
     std::cout << "  --dry-run      Preview mode - show what would be deleted without actual deletion" << std::endl;
+    std::cout << "  --tombstone    Rename old restore directories into .trash and remove them in the background" << std::endl;
+    std::cout << "  --verify       Check kept restore directories first; a damaged one protects the next older one" << std::endl;
+    std::cout << "                 (checksums are recorded in the base directory and only new or changed files are read)" << std::endl;
+    std::cout << "  --verify-full  Like --verify, but re-read every file and compare against the recorded checksums" << std::endl;
+    std::cout << "  --dedup        Afterwards, share identical files of the kept restore directories through reflinks," << std::endl;
+    std::cout << "                 or hard links where reflinks are not supported (checksums cached in the base directory)" << std::endl;
+    std::cout << "  --dedup-reflink  Like --dedup, but only with reflinks" << std::endl;
+    std::cout << "  --pin-markers  Also pin restore directories that contain a .pinned file (one stat per directory)" << std::endl;
+    std::cout << "  --rebuild-catalog  Rebuild <restart_dir>/.restart_cleaner_catalog from the file system instead of" << std::endl;
+    std::cout << "                 answering from it (the catalog lists restore directories, their sizes and states" << std::endl;
+    std::cout << "                 while the restart directory is unchanged)" << std::endl;
+    std::cout << "  --no-catalog   Neither read nor write the catalog" << std::endl;
     std::cout << std::endl;
     std::cout << "Examples:" << std::endl;
     std::cout << "  " << program_name << " --recent 5 ./restart_IB2d" << std::endl;
     std::cout << "  " << program_name << " --recent 3 ./restart_IB2d --dry-run" << std::endl;
+    std::cout << "  " << program_name << " --recent 3 ./restart_IB2d --jobs 16" << std::endl;
+    std::cout << "  " << program_name << " --smart 5 ./restart_IB2d --tiers 10:20,100:0" << std::endl;
+    std::cout << "  " << program_name << " --max-bytes 2T --recent 2 ./restart_IB2d" << std::endl;
+    std::cout << "  " << program_name << " --keep-within 6h --one-per 1d --recent 2 ./restart_IB2d" << std::endl;
+    std::cout << "  " << program_name << " --recent 2 --batch ./sweep --jobs 32" << std::endl;
+    std::cout << "  " << program_name << " --recent 2 ./restart_IB2d --verify" << std::endl;
+    std::cout << "  " << program_name << " --recent 5 ./restart_IB2d --migrate /archive/restart_IB2d" << std::endl;
+    std::cout << "  " << program_name << " --recent 10 ./viz_IB2d --pattern 'visit_dump.{5+}'" << std::endl;
+    std::cout << "  " << program_name << " --recent 5 ./restart_IB2d --pack" << std::endl;
+    std::cout << "  " << program_name << " --recent 5 ./restart_IB2d --dedup" << std::endl;
+    std::cout << "  " << program_name << " --recent 5 ./restart_IB2d --partition 0/4" << std::endl;
+    std::cout << "  " << program_name << " --recent 5 ./restart_IB2d --pin 5000,12000" << std::endl;
+    std::cout << "  " << program_name << " --recent 5 ./restart_IB2d --plan cleanup.plan" << std::endl;
+    std::cout << "  " << program_name << " --execute cleanup.plan --jobs 32" << std::endl;
+    std::cout << "  " << program_name << " --max-bytes 2T ./restart_IB2d --rebuild-catalog" << std::endl;
+    std::cout << "  " << program_name << " --unpack ./restart_IB2d/restore.000100.pack" << std::endl;
+}
+
+/**
+ * Function: parse_positive
+ * Purpose: Parse a positive integer option value, printing an error on failure
+ */
+bool parse_positive(const std::string& text, int& value) {
+    try {
+        value = std::stoi(text);
+    } catch (const std::invalid_argument&) {
+        std::cerr << "Error: '" << text << "' is not a valid number." << std::endl;
+        return false;
+    } catch (const std::out_of_range&) {
+        std::cerr << "Error: Number '" << text << "' is out of range." << std::endl;
+        return false;
+    }
+    if (value <= 0) {
+        std::cerr << "Error: Expected a positive number, got " << value << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Function: parse_partition
+ * Purpose: Parse a partition given as I/N with 0 <= I < N, printing an error on failure
+ */
+bool parse_partition(const std::string& text, int& index, int& count) {
+    const std::size_t slash = text.find('/');
+    const auto is_number = [](const std::string& part) {
+        return !part.empty() && part.size() < 10 && std::all_of(part.begin(), part.end(), ::isdigit);
+    };
+    if (slash == std::string::npos || !is_number(text.substr(0, slash)) || !is_number(text.substr(slash + 1))) {
+        std::cerr << "Error: Expected a partition I/N, got '" << text << "'." << std::endl;
+        return false;
+    }
+    index = std::stoi(text.substr(0, slash));
+    count = std::stoi(text.substr(slash + 1));
+    if (count < 1 || index >= count) {
+        std::cerr << "Error: Partition index must be below the partition count, got '" << text << "'." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Function: parse_bytes
+ * Purpose: Parse a byte count with an optional binary suffix, e.g. "2T" or "512MiB"
+ */
+bool parse_bytes(const std::string& text, std::uintmax_t& bytes) {
+    std::size_t pos = 0;
+    double value = 0.0;
+    try {
+        value = std::stod(text, &pos);
+    } catch (const std::exception&) {
+        pos = 0;
+    }
+
+    std::string suffix = text.substr(pos);
+    if (suffix == "B") suffix.clear();
+    if (suffix.size() == 3 && suffix.substr(1) == "iB") suffix.resize(1);
+
+    const std::string units = "KMGTP";
+    double scale = 1.0;
+    if (!suffix.empty()) {
+        std::size_t unit = suffix.size() == 1 ? units.find(std::toupper(suffix[0])) : std::string::npos;
+        if (unit == std::string::npos) pos = 0;
+        for (std::size_t i = 0; i <= unit && unit != std::string::npos; ++i) scale *= 1024.0;
+    }
+
+    if (pos == 0 || value <= 0.0) {
+        std::cerr << "Error: '" << text << "' is not a valid size." << std::endl;
+        return false;
+    }
+    bytes = static_cast<std::uintmax_t>(value * scale);
+    return true;
+}
+
+/**
+ * Function: parse_duration
+ * Purpose: Parse a duration in seconds with an optional unit, e.g. "90", "6h" or "2w"
+ */
+bool parse_duration(const std::string& text, std::int64_t& seconds) {
+    std::size_t pos = 0;
+    long long value = 0;
+    try {
+        value = std::stoll(text, &pos);
+    } catch (const std::exception&) {
+        pos = 0;
+    }
+
+    const std::string units = "smhdw";
+    const std::int64_t scales[] = {1, 60, 3600, 86400, 7 * 86400};
+    std::size_t unit = 0;
+    if (pos > 0 && pos < text.size()) {
+        unit = pos + 1 == text.size() ? units.find(text[pos]) : std::string::npos;
+        if (unit == std::string::npos) pos = 0;
+    }
+
+    if (pos == 0 || value < 0) {
+        std::cerr << "Error: '" << text << "' is not a valid duration." << std::endl;
+        return false;
+    }
+    seconds = value * scales[unit];
+    return true;
+}
+
+/**
+ * Function: parse_pins
+ * Purpose: Parse a list of pinned iterations of the form ITER[,ITER...]
+ */
+bool parse_pins(const std::string& text, std::vector<int>& pins) {
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        std::size_t pos = 0;
+        try {
+            pins.push_back(std::stoi(item, &pos));
+        } catch (const std::exception&) {
+            pos = 0;
+        }
+        if (pos == 0 || pos != item.size() || pins.back() < 0) {
+            std::cerr << "Error: Invalid pinned iteration '" << item << "'." << std::endl;
+            return false;
+        }
+    }
+    return !pins.empty();
+}
+
+/**
+ * Function: parse_tiers
+ * Purpose: Parse a retention tier list of the form STRIDE:COUNT[,STRIDE:COUNT...]
+ */
+bool parse_tiers(const std::string& text, std::vector<RestartCleaner::RetentionTier>& tiers) {
+    std::stringstream stream(text);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        std::size_t colon = item.find(':');
+        try {
+            if (colon == std::string::npos) throw std::invalid_argument(item);
+            tiers.push_back({std::stoi(item.substr(0, colon)), std::stoi(item.substr(colon + 1))});
+        } catch (const std::exception&) {
+            std::cerr << "Error: Invalid retention tier '" << item << "', expected STRIDE:COUNT." << std::endl;
+            return false;
+        }
+    }
+    return !tiers.empty();
+}
+
+/**
+ * Cleanup settings collected from the command line
+ */
+struct CleanupOptions {
+    std::string strategy = "KEEP_RECENT_N";
+    std::string engine = "PARALLEL";
+    std::string unlink_order = "READDIR";
+    std::vector<RestartCleaner::RetentionTier> tiers;
+    std::uintmax_t max_bytes = 0;
+    bool time_based = false;
+    RestartCleaner::TimeRetention time_retention;
+    int keep_count = 0;
+    int num_jobs = 0;
+    bool dry_run = false;
+    bool use_tombstones = false;
+    std::string verify = "OFF";
+    RestartCleaner::RateLimits rate_limits;
+    std::string report_format;
+    std::string report_file;
+    bool watch = false;
+    double quiescence_seconds = 30.0;
+    std::string marker_name;
+    RestartNamePattern name_pattern;
+    std::string archive_path;
+    bool pack = false;
+    std::string pack_compression = "NONE";
+    std::string dedup = "OFF";
+    std::string lock_mode = "SKIP";
+    int partition_index = 0;
+    int partition_count = 1;
+    std::vector<int> pins;
+    bool pin_markers = false;
+    std::string catalog = "ON";
+};
+
+/**
+ * Watcher stopped by SIGINT and SIGTERM in --watch mode
+ */
+RestartWatcher* g_watcher = nullptr;
+
+/**
+ * Function: handle_stop_signal
+ * Purpose: Stop the watcher; RestartWatcher::stop() is async-signal-safe
+ */
+extern "C" void handle_stop_signal(int) {
+    if (g_watcher) g_watcher->stop();
+}
+
+/**
+ * Function: create_cleaner
+ * Purpose: Create a RestartCleaner for one restart directory with the given settings
+ */
+std::unique_ptr<RestartCleaner> create_cleaner(const std::string& restart_dir, const CleanupOptions& options) {
+    auto cleaner = std::make_unique<RestartCleaner>(restart_dir, options.keep_count, options.strategy, options.dry_run);
+    cleaner->setDeletionEngine(options.engine);
+    cleaner->setUnlinkOrder(options.unlink_order);
+    if (!options.tiers.empty()) {
+        cleaner->setRetentionTiers(options.tiers);
+    }
+    if (options.max_bytes > 0) {
+        cleaner->setMaxBytes(options.max_bytes);
+    }
+    if (options.time_based) {
+        cleaner->setTimeRetention(options.time_retention);
+    }
+    if (options.num_jobs > 0) {
+        cleaner->setNumJobs(options.num_jobs);
+    }
+    cleaner->setTombstoneDeletion(options.use_tombstones);
+    cleaner->setVerification(options.verify);
+    cleaner->setRateLimits(options.rate_limits);
+    cleaner->setNamePattern(options.name_pattern);
+    if (!options.archive_path.empty()) {
+        cleaner->setAction("MIGRATE", options.archive_path);
+    } else if (options.pack) {
+        cleaner->setAction("PACK");
+    }
+    cleaner->setPackCompression(options.pack_compression);
+    cleaner->setDeduplication(options.dedup);
+    cleaner->setLocking(options.lock_mode);
+    cleaner->setPartition(options.partition_index, options.partition_count);
+    cleaner->setPinnedIterations(options.pins);
+    cleaner->setPinMarkers(options.pin_markers);
+    cleaner->setCatalog(options.catalog);
+    return cleaner;
+}
+
+/**
+ * Function: run_batch
+ * Purpose: Clean up several restart directories through one shared worker pool
+ */
+int run_batch(const std::vector<std::string>& restart_dirs, const CleanupOptions& options) {
+    int num_threads = options.num_jobs > 0 ? options.num_jobs : static_cast<int>(std::thread::hardware_concurrency());
+    auto pool = std::make_shared<RestartWorkerPool>(std::max(1, num_threads));
+
+    std::vector<std::unique_ptr<RestartCleaner>> cleaners;
+    std::vector<RestartCleaner*> cleaner_ptrs;
+    for (const auto& restart_dir : restart_dirs) {
+        cleaners.push_back(create_cleaner(restart_dir, options));
+        cleaners.back()->setWorkerPool(pool);
+        cleaner_ptrs.push_back(cleaners.back().get());
+    }
+
+    RestartCleaner::BatchSummary summary = RestartCleaner::cleanupBatch(cleaner_ptrs);
+
+    std::cout << "\nBatch result: " << summary.num_runs << " runs, " << summary.num_found
+              << " restart directories found, " << summary.num_selected
+              << (options.dry_run ? " would be deleted" : " selected for deletion") << ", "
+              << summary.num_deleted << " deleted, " << summary.num_failed << " failed";
+    if (summary.num_skipped > 0) std::cout << ", " << summary.num_skipped << " runs skipped (locked by another process)";
+    std::cout << "." << std::endl;
+    return summary.num_failed == 0 ? 0 : 1;
 }
 
 /**
@@ -25,65 +376,287 @@ void show_usage(const char* program_name) {
  * Purpose: Program entry point, handles command line arguments
  */
 int main(int argc, char* argv[]) {
-    // Check command line arguments
-    if (argc < 4 || argc > 5) {
-        show_usage(argv[0]);
-        return 1;
+    CleanupOptions options;
+    std::vector<std::string> restart_dirs;
+    std::string batch_root;
+    std::string unpack_file;
+    std::string plan_file;
+    std::string execute_file;
+
+    // Parse options in any order; positional arguments are restart directories
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+
+        if (arg == "--recent" || arg == "--smart" || arg == "--tiers" || arg == "--max-bytes" || arg == "--jobs" ||
+            arg == "--engine" || arg == "--batch" || arg == "--report" || arg == "--report-file" ||
+            arg == "--max-unlink-rate" || arg == "--max-free-rate" || arg == "--quiescence" || arg == "--marker" ||
+            arg == "--pattern" || arg == "--migrate" || arg == "--pack-compression" || arg == "--unpack" ||
+            arg == "--unlink-order" || arg == "--lock" || arg == "--partition" || arg == "--keep-within" ||
+            arg == "--one-per" || arg == "--max-age" || arg == "--plan" || arg == "--execute" ||
+            arg == "--pin") {
+            if (!has_value) {
+                std::cerr << "Error: Option '" << arg << "' requires a value." << std::endl;
+                show_usage(argv[0]);
+                return 1;
+            }
+            std::string value = argv[++i];
+            if (arg == "--recent" || arg == "--smart") {
+                if (!parse_positive(value, options.keep_count)) return 1;
+                options.strategy = arg == "--recent" ? "KEEP_RECENT_N" : "SMART_RETENTION";
+            } else if (arg == "--tiers") {
+                if (!parse_tiers(value, options.tiers)) return 1;
+            } else if (arg == "--max-bytes") {
+                if (!parse_bytes(value, options.max_bytes)) return 1;
+            } else if (arg == "--keep-within") {
+                if (!parse_duration(value, options.time_retention.keep_all_seconds)) return 1;
+                options.time_based = true;
+            } else if (arg == "--one-per") {
+                if (!parse_duration(value, options.time_retention.interval_seconds)) return 1;
+            } else if (arg == "--max-age") {
+                if (!parse_duration(value, options.time_retention.max_age_seconds)) return 1;
+            } else if (arg == "--jobs") {
+                if (!parse_positive(value, options.num_jobs)) return 1;
+            } else if (arg == "--batch") {
+                batch_root = value;
+            } else if (arg == "--lock") {
+                if (value != "skip" && value != "wait" && value != "off") {
+                    std::cerr << "Error: Unknown lock mode '" << value << "'." << std::endl;
+                    return 1;
+                }
+                std::transform(value.begin(), value.end(), value.begin(), ::toupper);
+                options.lock_mode = value;
+            } else if (arg == "--partition") {
+                if (!parse_partition(value, options.partition_index, options.partition_count)) return 1;
+            } else if (arg == "--unlink-order") {
+                if (value != "readdir" && value != "inode" && value != "reverse") {
+                    std::cerr << "Error: Unknown unlink order '" << value << "'." << std::endl;
+                    return 1;
+                }
+                std::transform(value.begin(), value.end(), value.begin(), ::toupper);
+                options.unlink_order = value;
+            } else if (arg == "--report") {
+                if (value != "json") {
+                    std::cerr << "Error: Unknown report format '" << value << "'." << std::endl;
+                    return 1;
+                }
+                options.report_format = value;
+            } else if (arg == "--report-file") {
+                options.report_file = value;
+            } else if (arg == "--quiescence") {
+                int seconds = 0;
+                if (!parse_positive(value, seconds)) return 1;
+                options.quiescence_seconds = seconds;
+            } else if (arg == "--marker") {
+                options.marker_name = value;
+            } else if (arg == "--migrate") {
+                options.archive_path = value;
+            } else if (arg == "--pack-compression") {
+                if (value != "none" && value != "zstd" && value != "lz4") {
+                    std::cerr << "Error: Unknown pack compression '" << value << "'." << std::endl;
+                    return 1;
+                }
+                std::transform(value.begin(), value.end(), value.begin(), ::toupper);
+                options.pack_compression = value;
+            } else if (arg == "--unpack") {
+                unpack_file = value;
+            } else if (arg == "--pin") {
+                if (!parse_pins(value, options.pins)) return 1;
+            } else if (arg == "--plan") {
+                plan_file = value;
+            } else if (arg == "--execute") {
+                execute_file = value;
+            } else if (arg == "--pattern") {
+                try {
+                    options.name_pattern = RestartNamePattern(value);
+                } catch (const std::invalid_argument& e) {
+                    std::cerr << "Error: " << e.what() << std::endl;
+                    return 1;
+                }
+            } else if (arg == "--max-unlink-rate") {
+                int rate = 0;
+                if (!parse_positive(value, rate)) return 1;
+                options.rate_limits.unlinks_per_second = rate;
+            } else if (arg == "--max-free-rate") {
+                std::uintmax_t rate = 0;
+                if (!parse_bytes(value, rate)) return 1;
+                options.rate_limits.bytes_per_second = static_cast<double>(rate);
+            } else if (value == "parallel") {
+                options.engine = "PARALLEL";
+            } else if (value == "uring") {
+                options.engine = "URING";
+            } else if (value == "serial") {
+                options.engine = "SERIAL";
+            } else {
+                std::cerr << "Error: Unknown engine '" << value << "'." << std::endl;
+                show_usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--dry-run") {
+            options.dry_run = true;
+        } else if (arg == "--dedup" || arg == "--dedup-reflink") {
+            options.dedup = arg == "--dedup" ? "AUTO" : "REFLINK";
+        } else if (arg == "--pack") {
+            options.pack = true;
+        } else if (arg == "--tombstone") {
+            options.use_tombstones = true;
+        } else if (arg == "--watch") {
+            options.watch = true;
+        } else if (arg == "--adaptive-throttle") {
+            options.rate_limits.adaptive = true;
+        } else if (arg == "--verify" || arg == "--verify-full") {
+            options.verify = arg == "--verify" ? "INCREMENTAL" : "FULL";
+        } else if (arg == "--pin-markers") {
+            options.pin_markers = true;
+        } else if (arg == "--rebuild-catalog" || arg == "--no-catalog") {
+            options.catalog = arg == "--rebuild-catalog" ? "REBUILD" : "OFF";
+        } else if (arg.rfind("--", 0) == 0) {
+            std::cerr << "Error: Unknown flag '" << arg << "'." << std::endl;
+            show_usage(argv[0]);
+            return 1;
+        } else {
+            restart_dirs.push_back(arg);
+        }
     }
-    
-    std::string option = argv[1];
-    std::string restart_dir = argv[3];
-    
-    // Only support --recent for now
-    if (option != "--recent") {
-        std::cerr << "Error: Currently only --recent option is supported." << std::endl;
-        show_usage(argv[0]);
-        return 1;
+
+    if (!unpack_file.empty()) {
+        const std::string suffix = ".pack";
+        if (unpack_file.size() <= suffix.size() ||
+            unpack_file.compare(unpack_file.size() - suffix.size(), suffix.size(), suffix) != 0) {
+            std::cerr << "Error: --unpack expects a file named <restore_dir>.pack." << std::endl;
+            return 1;
+        }
+        const std::string dest = unpack_file.substr(0, unpack_file.size() - suffix.size());
+        try {
+            RestartPack(unpack_file).unpack(dest);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        std::cout << "Unpacked " << unpack_file << " into " << dest << std::endl;
+        return 0;
     }
-    
-    // Check for dry-run flag
-    bool dry_run = false;
-    if (argc == 5) {
-        if (std::string(argv[4]) == "--dry-run") {
-            dry_run = true;
-        } else {
-            std::cerr << "Error: Unknown flag '" << argv[4] << "'." << std::endl;
-            show_usage(argv[0]);
+
+    // A saved plan brings its restart directory, strategy and number of restarts kept
+    RestartCleaner::CleanupPlan plan;
+    if (!execute_file.empty()) {
+        if (!plan_file.empty() || !restart_dirs.empty() || !batch_root.empty() || options.watch) {
+            std::cerr << "Error: --execute takes no restart directory, --plan, --batch or --watch." << std::endl;
             return 1;
         }
+        try {
+            plan = RestartCleaner::CleanupPlan::load(execute_file);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        restart_dirs.push_back(plan.base_path);
+        options.strategy = plan.strategy;
+        options.keep_count = plan.keep_restart_count;
     }
-    
-    // Parse the number parameter
-    int keep_count;
-    try {
-        keep_count = std::stoi(argv[2]);
-    } catch (const std::invalid_argument&) {
-        std::cerr << "Error: '" << argv[2] << "' is not a valid number." << std::endl;
+
+    if (options.pack && !options.archive_path.empty()) {
+        std::cerr << "Error: --pack and --migrate cannot be combined." << std::endl;
         return 1;
-    } catch (const std::out_of_range&) {
-        std::cerr << "Error: Number '" << argv[2] << "' is out of range." << std::endl;
+    }
+
+    // With a byte budget, --recent N only sets the minimum number of restarts kept
+    if (options.max_bytes > 0 && options.time_based) {
+        std::cerr << "Error: --max-bytes and --keep-within cannot be combined." << std::endl;
         return 1;
     }
-    
-    // Validate keep_count
-    if (keep_count <= 0) {
-        std::cerr << "Error: Keep count must be positive, got " << keep_count << std::endl;
+
+    // With time windows, --recent N likewise only sets the minimum number kept
+    if (options.time_based) {
+        if (options.strategy == "SMART_RETENTION") {
+            std::cerr << "Error: --smart and --keep-within cannot be combined." << std::endl;
+            return 1;
+        }
+        const RestartCleaner::TimeRetention& retention = options.time_retention;
+        if (retention.interval_seconds <= 0 ||
+            (retention.max_age_seconds != 0 && retention.max_age_seconds < retention.keep_all_seconds)) {
+            std::cerr << "Error: --one-per must be positive and --max-age at least --keep-within." << std::endl;
+            return 1;
+        }
+        options.strategy = "TIME_BASED";
+        if (options.keep_count == 0) options.keep_count = 1;
+    }
+
+    if (options.max_bytes > 0) {
+        if (options.strategy == "SMART_RETENTION") {
+            std::cerr << "Error: --smart and --max-bytes cannot be combined." << std::endl;
+            return 1;
+        }
+        options.strategy = "MAX_BYTES";
+        if (options.keep_count == 0) options.keep_count = 1;
+    }
+
+    if (options.keep_count == 0 || (restart_dirs.empty() && batch_root.empty())) {
+        std::cerr << "Error: --recent N or --smart N and <restart_dir> are required." << std::endl;
+        show_usage(argv[0]);
         return 1;
     }
-    
+
     try {
+        if (!batch_root.empty()) {
+            std::vector<std::string> roots = RestartCleaner::findRestartRoots(batch_root, options.name_pattern);
+            std::cout << "Found " << roots.size() << " runs with restart data below " << batch_root << std::endl;
+            restart_dirs.insert(restart_dirs.end(), roots.begin(), roots.end());
+        }
+        if (options.watch) {
+            if (restart_dirs.size() != 1 || !batch_root.empty() || !options.report_format.empty() || !plan_file.empty()) {
+                std::cerr << "Error: --watch takes a single restart directory and no --batch, --report or --plan." << std::endl;
+                return 1;
+            }
+            std::unique_ptr<RestartCleaner> cleaner = create_cleaner(restart_dirs.front(), options);
+            RestartWatcher watcher(*cleaner, options.quiescence_seconds, options.marker_name);
+            g_watcher = &watcher;
+            std::signal(SIGINT, handle_stop_signal);
+            std::signal(SIGTERM, handle_stop_signal);
+            watcher.run();
+            g_watcher = nullptr;
+            std::cout << "\nWatch ended after " << watcher.getNumCleanups() << " cleanups." << std::endl;
+            return 0;
+        }
+        if (restart_dirs.size() != 1 || !batch_root.empty()) {
+            if (!plan_file.empty()) {
+                std::cerr << "Error: --plan is only supported for a single restart directory." << std::endl;
+                return 1;
+            }
+            if (!options.report_format.empty()) {
+                std::cerr << "Error: --report is only supported for a single restart directory." << std::endl;
+                return 1;
+            }
+            return run_batch(restart_dirs, options);
+        }
+
         // Create RestartCleaner and run cleanup
-        RestartCleaner cleaner(restart_dir, keep_count, "KEEP_RECENT_N", dry_run);
-        cleaner.cleanup();
-        
-        // Show final results
-        auto remaining = cleaner.getAvailableIterations();
+        std::unique_ptr<RestartCleaner> cleaner = create_cleaner(restart_dirs.front(), options);
+        if (!plan_file.empty()) {
+            cleaner->plan().save(plan_file);
+            std::cout << "\nPlan written to " << plan_file << std::endl;
+            return 0;
+        }
+        RestartCleaner::CleanupReport report = execute_file.empty() ? cleaner->cleanup() : cleaner->execute(plan);
+
+        // Show final results (answered from the index built by cleanup, no rescan)
+        auto remaining = cleaner->getAvailableIterations();
         std::cout << "\nFinal result: " << remaining.size() << " directories remaining." << std::endl;
-        
+
+        if (!options.report_format.empty()) {
+            if (options.report_file.empty()) {
+                std::cout << report.toJson() << std::endl;
+            } else if (!(std::ofstream(options.report_file) << report.toJson() << '\n')) {
+                std::cerr << "Error: Cannot write report to " << options.report_file << std::endl;
+                return 1;
+            }
+        }
+        if (!report.errors.empty()) return 1;
+
     } catch (const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
         return 1;
     }
-    
+
     return 0;
-}
\ No newline at end of file
+}
@@ -16,214 +16,7683 @@
 #include "restart_cleaner_standalone.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
 #include <filesystem>
+#include <fstream>
+#include <future>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/ioprio.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// The io_uring engine needs the kernel headers of Linux 5.11 or later, which
+// introduced IORING_OP_UNLINKAT together with IORING_FEAT_EXT_ARG.  Without
+// them, the URING engine falls back to PARALLEL.
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#endif
+#if defined(IORING_FEAT_EXT_ARG) && defined(__NR_io_uring_setup)
+#define RESTART_CLEANER_HAVE_URING 1
+#endif
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#if defined(RESTART_CLEANER_WITH_ZSTD)
+#include <zstd.h>
+#endif
+
+#if defined(RESTART_CLEANER_WITH_LZ4)
+#include <lz4.h>
+#endif
+
 namespace fs = std::filesystem;
 
 // Future IBAMR integration:
 // namespace IBTK {
 
-/////////////////////////////// PUBLIC ///////////////////////////////////////
+/////////////////////////////// NAMESPACE ////////////////////////////////////
 
-RestartCleaner::RestartCleaner(const std::string& restart_base_path,
-                               int keep_restart_count,
-                               const std::string& strategy,
-                               bool dry_run)
-    : d_restart_base_path(restart_base_path),
-      d_strategy(parseStrategy(strategy)),
-      d_keep_restart_count(keep_restart_count),
-      d_dry_run(dry_run)
+namespace
 {
-    if (keep_restart_count <= 0)
+// Size of the buffer handed to getdents64().
+static const std::size_t GETDENTS_BUFFER_SIZE = 64 * 1024;
+
+// Maximum number of file names unlinked by a single worker task.
+static const std::size_t UNLINK_BATCH_SIZE = 256;
+
+// Maximum number of file names stat'ed by a single worker task.
+static const std::size_t STATX_BATCH_SIZE = 256;
+
+// Name of the directory in the base directory that holds tombstones.
+static const char* const TRASH_DIRNAME = ".trash";
+
+// Name of the tombstone journal inside the trash directory.
+static const char* const JOURNAL_FILENAME = "journal";
+
+// Name of the lock file kept in the base directory.
+static const char* const LOCK_FILENAME = ".restart_cleaner.lock";
+
+// Name of the per-restart-directory size cache kept in the base directory.
+static const char* const SIZE_CACHE_FILENAME = ".restart_cleaner_sizes";
+
+// Name of the per-restart-directory completion time cache kept in the base directory.
+static const char* const TIME_CACHE_FILENAME = ".restart_cleaner_times";
+
+// Name of the binary restart catalog kept in the base directory.
+static const char* const CATALOG_FILENAME = ".restart_cleaner_catalog";
+
+// Magic number at the start of the restart catalog.
+static const char CATALOG_MAGIC[8] = { 'I', 'B', 'R', 'C', 'A', 'T', 'L', '1' };
+
+// Sizes of the catalog header and of one catalog record.
+static const std::size_t CATALOG_HEADER_SIZE = 64;
+static const std::size_t CATALOG_RECORD_SIZE = 48;
+
+// Records of removed restarts kept in the catalog, newest first.
+static const std::size_t CATALOG_MAX_REMOVED = 1024;
+
+// Minimum age of the base directory modification time when the catalog was
+// written (or the in-memory index was read) for it to stand in for a scan;
+// covers file systems with coarse timestamps, where a later change could
+// leave the time unchanged.
+static const std::int64_t CATALOG_SETTLE_NS = 1000000000;
+
+// Name of the file in the base directory that records the measured deletion cost per entry.
+static const char* const COST_FILENAME = ".restart_cleaner_cost";
+
+// Minimum number of entries a deletion must unlink to update the recorded cost.
+static const std::uintmax_t COST_MIN_ENTRIES = 1000;
+
+// Seconds per entry assumed by plan() until a deletion has been measured; a
+// serial unlink on a local file system, pessimistic for parallel engines.
+static const double DEFAULT_UNLINK_COST = 50e-6;
+
+// First line of a saved CleanupPlan.
+static const char* const PLAN_HEADER = "restart_cleaner_plan 1";
+
+// Name of the pin list kept in the base directory.
+static const char* const PIN_LIST_FILENAME = ".restart_cleaner_pins";
+
+// Name of the marker file that pins the restart directory containing it.
+static const char* const PIN_MARKER_FILENAME = ".pinned";
+
+// Name of the checksum manifest of the verified restart directories.
+static const char* const CHECKSUM_MANIFEST_FILENAME = ".restart_cleaner_checksums";
+
+// Seconds of traffic a rate limiter may let through in a burst.
+static const double THROTTLE_BURST_SECONDS = 0.1;
+
+// Minimum interval between two adjustments of an adaptive unlink rate.
+static const double THROTTLE_ADJUST_SECONDS = 0.1;
+
+// Events watched in the base directory of a RestartWatcher.
+static const std::uint32_t WATCH_BASE_MASK =
+    IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+// Events watched in restart directories that are still being written.
+static const std::uint32_t WATCH_PENDING_MASK = IN_CREATE | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE | IN_ONLYDIR;
+
+// Milliseconds a RestartWatcher waits before retrying a cleanup skipped
+// because another process held the lock on the base path.
+static const int WATCH_LOCK_RETRY_MS = 1000;
+
+// Size of the blocks read by a checksum task.
+static const std::size_t CHECKSUM_BLOCK_SIZE = 1024 * 1024;
+
+// Maximum number of bytes moved by one copy_file_range() or sendfile() call.
+static const std::size_t COPY_CHUNK_SIZE = 64 * 1024 * 1024;
+
+// Suffix of a restart directory that is still being copied into the archive.
+static const char* const MIGRATING_SUFFIX = ".migrating";
+
+// Suffix of a packed restart directory.
+static const std::string_view PACK_SUFFIX = ".pack";
+
+// Magic numbers at the start of a pack and at the end of its footer.
+static const char PACK_MAGIC[8] = { 'I', 'B', 'R', 'P', 'A', 'C', 'K', '1' };
+static const char PACK_FOOTER_MAGIC[8] = { 'I', 'B', 'R', 'P', 'I', 'D', 'X', '1' };
+
+// Size of the footer: index offset, index size, entry count, index CRC, reserved, magic.
+static const std::size_t PACK_FOOTER_SIZE = 8 + 8 + 8 + 4 + 4 + sizeof(PACK_FOOTER_MAGIC);
+
+// Name of the deduplication checksum manifest kept in the base directory.
+static const char* const DEDUP_MANIFEST_FILENAME = ".restart_cleaner_hashes";
+
+// Suffix of the temporary hard link that replaces a duplicate file.
+static const char* const DEDUP_LINK_SUFFIX = ".dedup.tmp";
+
+// Files smaller than this are not worth sharing.
+static const std::uintmax_t DEDUP_MIN_FILE_SIZE = 4096;
+
+// Bytes of file data read and compressed ahead of the pack writer.
+static const std::size_t PACK_INFLIGHT_BYTES = 256 * 1024 * 1024;
+
+// Compression level used for zstd.
+static const int PACK_ZSTD_LEVEL = 3;
+
+// The only fields the size accounting needs from statx().
+static const unsigned int SIZE_STATX_MASK = STATX_TYPE | STATX_NLINK | STATX_INO | STATX_BLOCKS;
+
+/*!
+ * \brief Layout of the records returned by the getdents64 system call.
+ */
+struct LinuxDirent64
+{
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+/*!
+ * \brief System call counters shared by the tasks of one cleanup.
+ */
+struct IoCounters
+{
+    std::atomic<std::uint64_t> open{ 0 };
+    std::atomic<std::uint64_t> getdents{ 0 };
+    std::atomic<std::uint64_t> stat{ 0 };
+    std::atomic<std::uint64_t> unlink{ 0 };
+    std::atomic<std::uint64_t> rmdir{ 0 };
+    std::atomic<std::uint64_t> rename{ 0 };
+};
+
+// Pool and queue of the worker running on this thread, if any.
+thread_local const RestartWorkerPool* t_current_pool = nullptr;
+thread_local std::size_t t_worker_index = 0;
+
+std::string
+errnoString(int err)
+{
+    return std::string(std::strerror(err));
+}
+
+/*!
+ * \brief Format a byte count for humans, e.g. "1.50 GiB".
+ */
+std::string
+formatBytes(std::uintmax_t bytes)
+{
+    static const char* const units[] = { "B", "KiB", "MiB", "GiB", "TiB", "PiB" };
+    double value = static_cast<double>(bytes);
+    std::size_t unit = 0;
+    while (value >= 1024.0 && unit + 1 < sizeof(units) / sizeof(units[0]))
     {
-        throw std::invalid_argument("RestartCleaner: keep_restart_count must be positive");
+        value /= 1024.0;
+        ++unit;
+    }
+    char buffer[32];
+    std::snprintf(buffer, sizeof(buffer), unit == 0 ? "%.0f %s" : "%.2f %s", value, units[unit]);
+    return buffer;
+}
+
+/*!
+ * \brief The current time in nanoseconds since the epoch, comparable to file times.
+ */
+std::int64_t
+getRealTimeNs()
+{
+    struct timespec now;
+    ::clock_gettime(CLOCK_REALTIME, &now);
+    return static_cast<std::int64_t>(now.tv_sec) * 1000000000 + now.tv_nsec;
+}
+
+/*!
+ * \brief Modification time in nanoseconds of the directory \p name below
+ * \p base_fd, or -1; sets \p inode to its inode number (0 if unknown).
+ */
+std::int64_t
+getDirIdentity(int base_fd, const std::string& name, std::uint64_t& inode)
+{
+    struct statx stx;
+    if (::statx(base_fd, name.c_str(), AT_SYMLINK_NOFOLLOW, STATX_INO | STATX_MTIME, &stx) != 0)
+    {
+        inode = 0;
+        return -1;
+    }
+    inode = stx.stx_ino;
+    return static_cast<std::int64_t>(stx.stx_mtime.tv_sec) * 1000000000 + stx.stx_mtime.tv_nsec;
+}
+
+/*!
+ * \brief Whether the restart directory \p name below \p base_fd contains a pin marker.
+ */
+bool
+hasPinMarker(int base_fd, std::string_view name)
+{
+    const std::string path = std::string(name) + "/" + PIN_MARKER_FILENAME;
+    struct stat st;
+    return ::fstatat(base_fd, path.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0;
+}
+
+/*!
+ * \brief Open the tombstone journal in \p trash_path and take its lock.
+ *
+ * Every process holds this lock while appending to or removing the journal.
+ * A journal found unlinked after waiting for the lock is opened again, or
+ * created again if \p create is set, so that no record is written to a
+ * removed journal.
+ *
+ * \return The locked descriptor, or -1 with errno set
+ */
+int
+openLockedJournal(const fs::path& trash_path, bool create)
+{
+    const fs::path journal_path = trash_path / JOURNAL_FILENAME;
+    for (;;)
+    {
+        if (create && ::mkdir(trash_path.c_str(), 0755) != 0 && errno != EEXIST) return -1;
+        const int fd = ::open(journal_path.c_str(), O_RDWR | O_APPEND | (create ? O_CREAT : 0) | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            // The trash directory may have been removed since the mkdir
+            if (create && errno == ENOENT) continue;
+            return -1;
+        }
+        
+        struct flock range = {};
+        range.l_type = F_WRLCK;
+        range.l_whence = SEEK_SET;
+        int result;
+        while ((result = ::fcntl(fd, F_OFD_SETLKW, &range)) != 0 && errno == EINTR)
+        {
+        }
+        struct stat st;
+        if (result != 0 || ::fstat(fd, &st) != 0)
+        {
+            const int err = errno;
+            ::close(fd);
+            errno = err;
+            return -1;
+        }
+        if (st.st_nlink > 0) return fd;
+        ::close(fd);
+        if (!create)
+        {
+            errno = ENOENT;
+            return -1;
+        }
+    }
+}
+
+/*!
+ * \brief Tombstones recorded in \p journal ("T <name>") without a record of
+ * their removal ("D <name>"), in journal order.
+ */
+std::vector<std::string>
+getPendingTombstones(std::istream& journal)
+{
+    std::vector<std::string> created;
+    std::unordered_set<std::string> done;
+    std::string tag, name;
+    while (journal >> tag >> name)
+    {
+        if (tag == "T") created.push_back(name);
+        if (tag == "D") done.insert(name);
     }
     
-    if (!fs::exists(restart_base_path))
+    std::vector<std::string> pending;
+    for (const auto& tombstone : created)
     {
-        throw std::invalid_argument("RestartCleaner: restart_base_path does not exist: " + restart_base_path);
+        if (done.count(tombstone) == 0) pending.push_back(tombstone);
+    }
+    return pending;
+}
+
+/*!
+ * \brief Format a number of seconds in its largest whole unit, e.g. "6h" or "1d".
+ */
+std::string
+formatDuration(std::int64_t seconds)
+{
+    static const std::pair<std::int64_t, char> units[] = { { 7 * 86400, 'w' }, { 86400, 'd' }, { 3600, 'h' }, { 60, 'm' } };
+    for (const auto& unit : units)
+    {
+        if (seconds != 0 && seconds % unit.first == 0) return std::to_string(seconds / unit.first) + unit.second;
+    }
+    return std::to_string(seconds) + 's';
+}
+
+/*!
+ * \brief Quote and escape a string for JSON output.
+ */
+std::string
+jsonString(const std::string& text)
+{
+    std::string quoted = "\"";
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            quoted += '\\';
+            quoted += c;
+        }
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char escaped[8];
+            std::snprintf(escaped, sizeof(escaped), "\\u%04x", static_cast<unsigned int>(c));
+            quoted += escaped;
+        }
+        else
+        {
+            quoted += c;
+        }
+    }
+    return quoted + "\"";
+}
+
+/*!
+ * \brief Read all entries of an open directory with getdents64().
+ *
+ * The callback is invoked for every entry except "." and "..".  The
+ * getdents64() calls are counted in \p counters, if given.
+ *
+ * \return 0 on success, otherwise the errno value of the failed read
+ */
+template <class Callback>
+int
+forEachDirEntry(int dir_fd, Callback&& callback, IoCounters* counters = nullptr)
+{
+    std::vector<char> buffer(GETDENTS_BUFFER_SIZE);
+    for (;;)
+    {
+        if (counters) ++counters->getdents;
+        const long nread = ::syscall(SYS_getdents64, dir_fd, buffer.data(), buffer.size());
+        if (nread < 0) return errno;
+        if (nread == 0) return 0;
+
+        for (long pos = 0; pos < nread;)
+        {
+            const auto* entry = reinterpret_cast<const LinuxDirent64*>(buffer.data() + pos);
+            pos += entry->d_reclen;
+
+            const char* name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+            callback(*entry);
+        }
+    }
+}
+
+/*!
+ * \brief Move the calling thread to the idle I/O scheduling class.
+ *
+ * Threads created afterwards by this thread inherit the priority, so this
+ * also covers the deletion workers.  Failure is not an error: the cleanup
+ * then simply runs at the default priority.
+ */
+void
+setIdleIoPriority()
+{
+    ::syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0));
+}
+
+/*!
+ * \brief Extend a CRC32C (Castagnoli) register one byte at a time.
+ */
+std::uint32_t
+crc32cSoftware(std::uint32_t crc, const unsigned char* data, std::size_t length)
+{
+    static const auto table = []() {
+        std::vector<std::uint32_t> entries(256);
+        for (std::uint32_t i = 0; i < 256; ++i)
+        {
+            std::uint32_t value = i;
+            for (int bit = 0; bit < 8; ++bit)
+            {
+                value = (value >> 1) ^ ((value & 1) ? 0x82F63B78u : 0u);
+            }
+            entries[i] = value;
+        }
+        return entries;
+    }();
+    
+    for (std::size_t i = 0; i < length; ++i)
+    {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+/*!
+ * \brief Extend a CRC32C register with the SSE4.2 crc32 instruction, 8 bytes per step.
+ */
+__attribute__((target("sse4.2"))) std::uint32_t
+crc32cHardware(std::uint32_t crc, const unsigned char* data, std::size_t length)
+{
+    std::uint64_t crc64 = crc;
+    for (; length >= 8; data += 8, length -= 8)
+    {
+        std::uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = static_cast<std::uint32_t>(crc64);
+    for (; length > 0; ++data, --length)
+    {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+    return crc;
+}
+#endif
+
+/*!
+ * \brief Extend a CRC32C register, using the crc32 instruction when the CPU has one.
+ *
+ * The register starts at 0xFFFFFFFF and the final checksum is its complement.
+ */
+std::uint32_t
+updateCrc32c(std::uint32_t crc, const void* data, std::size_t length)
+{
+    const auto* bytes = static_cast<const unsigned char*>(data);
+#if defined(__x86_64__)
+    static const bool have_sse42 = __builtin_cpu_supports("sse4.2");
+    if (have_sse42) return crc32cHardware(crc, bytes, length);
+#endif
+    return crc32cSoftware(crc, bytes, length);
+}
+
+/*!
+ * \brief Compute the CRC32C checksum of an open file, reading from its start.
+ *
+ * \return 0 on success or an errno value
+ */
+int
+checksumFile(int fd, std::uint32_t& checksum)
+{
+    std::vector<char> buffer(CHECKSUM_BLOCK_SIZE);
+    std::uint32_t crc = 0xFFFFFFFFu;
+    for (off_t offset = 0;;)
+    {
+        const ssize_t nread = ::pread(fd, buffer.data(), buffer.size(), offset);
+        if (nread < 0 && errno == EINTR) continue;
+        if (nread < 0) return errno;
+        if (nread == 0) break;
+        crc = updateCrc32c(crc, buffer.data(), static_cast<std::size_t>(nread));
+        offset += nread;
+    }
+    checksum = ~crc;
+    return 0;
+}
+
+/*!
+ * \brief Iteration number of a pack file name "<restart directory>.pack", or -1.
+ */
+int
+packIteration(const RestartNamePattern& pattern, std::string_view name)
+{
+    if (name.size() <= PACK_SUFFIX.size() || name.substr(name.size() - PACK_SUFFIX.size()) != PACK_SUFFIX) return -1;
+    return pattern.match(name.substr(0, name.size() - PACK_SUFFIX.size()));
+}
+
+/*!
+ * \brief Write all of \p data to \p fd.
+ *
+ * \return 0 on success or an errno value
+ */
+int
+writeAll(int fd, const char* data, std::size_t size)
+{
+    while (size > 0)
+    {
+        const ssize_t written = ::write(fd, data, size);
+        if (written < 0 && errno == EINTR) continue;
+        if (written < 0) return errno;
+        data += written;
+        size -= static_cast<std::size_t>(written);
+    }
+    return 0;
+}
+
+/*!
+ * \brief Append the integer \p value to \p out in little-endian byte order.
+ */
+template <class T>
+void
+appendLittleEndian(std::string& out, T value)
+{
+    auto bits = static_cast<std::make_unsigned_t<T>>(value);
+    for (std::size_t i = 0; i < sizeof(T); ++i)
+    {
+        out.push_back(static_cast<char>(bits & 0xFF));
+        bits = static_cast<std::make_unsigned_t<T>>(bits >> 8);
+    }
+}
+
+/*!
+ * \brief Read an integer of type \p T stored in little-endian byte order at \p data.
+ */
+template <class T>
+T
+loadLittleEndian(const char* data)
+{
+    std::make_unsigned_t<T> bits = 0;
+    for (std::size_t i = sizeof(T); i-- > 0;)
+    {
+        bits = static_cast<std::make_unsigned_t<T>>((bits << 8) | static_cast<unsigned char>(data[i]));
+    }
+    return static_cast<T>(bits);
+}
+
+/*!
+ * \brief Compress \p in with \p codec.
+ *
+ * \return Whether \p out holds compressed data that is smaller than \p in
+ */
+bool
+compressBlob(RestartPack::Codec codec, const std::string& in, std::string& out)
+{
+    (void)in;
+    (void)out;
+    switch (codec)
+    {
+#if defined(RESTART_CLEANER_WITH_ZSTD)
+    case RestartPack::Codec::ZSTD:
+    {
+        out.resize(ZSTD_compressBound(in.size()));
+        const std::size_t n = ZSTD_compress(&out[0], out.size(), in.data(), in.size(), PACK_ZSTD_LEVEL);
+        if (ZSTD_isError(n) || n >= in.size()) return false;
+        out.resize(n);
+        return true;
+    }
+#endif
+#if defined(RESTART_CLEANER_WITH_LZ4)
+    case RestartPack::Codec::LZ4:
+    {
+        if (in.size() > static_cast<std::size_t>(LZ4_MAX_INPUT_SIZE)) return false;
+        out.resize(LZ4_compressBound(static_cast<int>(in.size())));
+        const int n = LZ4_compress_default(in.data(), &out[0], static_cast<int>(in.size()), static_cast<int>(out.size()));
+        if (n <= 0 || static_cast<std::size_t>(n) >= in.size()) return false;
+        out.resize(n);
+        return true;
+    }
+#endif
+    default:
+        return false;
+    }
+}
+
+/*!
+ * \brief Decompress \p stored_size bytes at \p data into a buffer of \p size bytes.
+ *
+ * \return An empty string on success, or a description of the error
+ */
+std::string
+decompressBlob(RestartPack::Codec codec, const char* data, std::size_t stored_size, std::string& out)
+{
+    switch (codec)
+    {
+    case RestartPack::Codec::NONE:
+        out.assign(data, stored_size);
+        return std::string();
+#if defined(RESTART_CLEANER_WITH_ZSTD)
+    case RestartPack::Codec::ZSTD:
+    {
+        const std::size_t n = ZSTD_decompress(&out[0], out.size(), data, stored_size);
+        if (ZSTD_isError(n) || n != out.size()) return "zstd data is damaged";
+        return std::string();
+    }
+#endif
+#if defined(RESTART_CLEANER_WITH_LZ4)
+    case RestartPack::Codec::LZ4:
+    {
+        const int n = LZ4_decompress_safe(data, &out[0], static_cast<int>(stored_size), static_cast<int>(out.size()));
+        if (n < 0 || static_cast<std::size_t>(n) != out.size()) return "lz4 data is damaged";
+        return std::string();
+    }
+#endif
+    default:
+        return "compressed with a codec this build does not support";
+    }
+}
+
+/*!
+ * \brief Thread-safe token bucket.
+ *
+ * Callers reserve tokens and sleep until the reservation is covered, so the
+ * bucket may go negative; this keeps waiting callers in order and lets a
+ * single request exceed the burst size.
+ */
+class TokenBucket
+{
+public:
+    explicit TokenBucket(double rate)
+    {
+        setRate(rate);
+        d_tokens = d_burst;
+    }
+
+    void setRate(double rate)
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        refill();
+        d_rate = rate;
+        d_burst = std::max(1.0, rate * THROTTLE_BURST_SECONDS);
+    }
+
+    /*!
+     * \brief Take \p tokens, sleeping until they are available.  Returns the time slept.
+     */
+    double acquire(double tokens)
+    {
+        double wait_seconds = 0.0;
+        {
+            std::lock_guard<std::mutex> lock(d_mutex);
+            refill();
+            d_tokens -= tokens;
+            if (d_tokens < 0.0) wait_seconds = -d_tokens / d_rate;
+        }
+        if (wait_seconds > 0.0) std::this_thread::sleep_for(std::chrono::duration<double>(wait_seconds));
+        return wait_seconds;
+    }
+
+private:
+    void refill()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        const double elapsed = std::chrono::duration<double>(now - d_last).count();
+        d_last = now;
+        d_tokens = std::min(d_burst, d_tokens + elapsed * d_rate);
+    }
+
+    std::mutex d_mutex;
+    double d_rate = 0.0;
+    double d_burst = 1.0;
+    double d_tokens = 0.0;
+    std::chrono::steady_clock::time_point d_last = std::chrono::steady_clock::now();
+};
+
+/*!
+ * \brief Enforces RestartCleaner::RateLimits for the tasks of one removal.
+ *
+ * In adaptive mode the unlink rate follows an AIMD scheme: it is cut by 30%
+ * while the smoothed unlinkat() latency exceeds twice the lowest smoothed
+ * latency seen, and raised by 5% of the configured rate while the latency is
+ * within 25% of it.
+ */
+class DeletionThrottle
+{
+public:
+    explicit DeletionThrottle(const RestartCleaner::RateLimits& limits)
+        : d_limits(limits),
+          d_unlink_rate(limits.unlinks_per_second),
+          d_unlinks(limits.unlinks_per_second > 0.0 ? limits.unlinks_per_second : 1.0),
+          d_bytes(limits.bytes_per_second > 0.0 ? limits.bytes_per_second : 1.0)
+    {
+    }
+
+    bool limitsBytes() const
+    {
+        return d_limits.bytes_per_second > 0.0;
+    }
+
+    /*!
+     * \brief Wait until one unlink of \p bytes allocated bytes may proceed.
+     */
+    void acquire(std::uintmax_t bytes)
+    {
+        double waited = 0.0;
+        if (d_limits.unlinks_per_second > 0.0) waited += d_unlinks.acquire(1.0);
+        if (limitsBytes() && bytes > 0) waited += d_bytes.acquire(static_cast<double>(bytes));
+        if (waited > 0.0)
+        {
+            std::lock_guard<std::mutex> lock(d_mutex);
+            d_wait_seconds += waited;
+        }
+    }
+
+    bool isAdaptive() const
+    {
+        return d_limits.adaptive && d_limits.unlinks_per_second > 0.0;
+    }
+
+    /*!
+     * \brief Feed the latency of one unlinkat() call to the adaptive controller.
+     */
+    void recordLatency(double seconds)
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_latency = d_num_samples == 0 ? seconds : 0.9 * d_latency + 0.1 * seconds;
+        if (++d_num_samples < 16) return;
+        d_min_latency = d_min_latency > 0.0 ? std::min(d_min_latency, d_latency) : d_latency;
+
+        const auto now = std::chrono::steady_clock::now();
+        if (std::chrono::duration<double>(now - d_last_adjust).count() < THROTTLE_ADJUST_SECONDS) return;
+        d_last_adjust = now;
+
+        const double max_rate = d_limits.unlinks_per_second;
+        const double min_rate = std::max(1.0, 0.02 * max_rate);
+        double rate = d_unlink_rate;
+        if (d_latency > 2.0 * d_min_latency)
+        {
+            rate = std::max(min_rate, 0.7 * rate);
+        }
+        else if (d_latency < 1.25 * d_min_latency)
+        {
+            rate = std::min(max_rate, rate + 0.05 * max_rate);
+        }
+        if (rate != d_unlink_rate)
+        {
+            d_unlink_rate = rate;
+            d_unlinks.setRate(rate);
+        }
+    }
+
+    double getWaitSeconds() const
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        return d_wait_seconds;
+    }
+
+private:
+    const RestartCleaner::RateLimits d_limits;
+    mutable std::mutex d_mutex;
+    double d_unlink_rate;
+    double d_latency = 0.0;
+    double d_min_latency = 0.0;
+    std::size_t d_num_samples = 0;
+    double d_wait_seconds = 0.0;
+    std::chrono::steady_clock::time_point d_last_adjust = std::chrono::steady_clock::now();
+    TokenBucket d_unlinks;
+    TokenBucket d_bytes;
+};
+
+/*!
+ * \brief A small io_uring instance that runs batches of unlinkat() or statx() operations.
+ *
+ * The ring is driven through the raw system calls, so liburing is not needed.
+ * A batch of up to UNLINK_BATCH_SIZE operations is submitted and waited for
+ * with a single io_uring_enter(); the kernel runs the blocking operations on
+ * its own worker threads.  Rings are not shared between threads: every
+ * worker thread lazily sets up its own (see forThisThread()).
+ */
+#if defined(RESTART_CLEANER_HAVE_URING)
+class UringBatch
+{
+public:
+    /*!
+     * \brief Whether the kernel supports IORING_OP_UNLINKAT and IORING_OP_STATX.
+     *
+     * Probed once per process.  io_uring may also be missing because it is
+     * disabled by sysctl or by a seccomp filter of a container.
+     */
+    static bool isSupported()
+    {
+        static const bool supported = []() {
+            UringBatch ring(1);
+            if (!ring.isValid()) return false;
+            std::vector<char> buffer(sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op), 0);
+            auto* probe = reinterpret_cast<struct io_uring_probe*>(buffer.data());
+            if (::syscall(__NR_io_uring_register, ring.d_fd, IORING_REGISTER_PROBE, probe, 256) != 0) return false;
+            const auto has_op = [&](unsigned op) {
+                return op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+            };
+            return has_op(IORING_OP_UNLINKAT) && has_op(IORING_OP_STATX);
+        }();
+        return supported;
+    }
+
+    /*!
+     * \brief The ring of the calling thread, or nullptr if it cannot be used.
+     */
+    static UringBatch* forThisThread()
+    {
+        thread_local std::unique_ptr<UringBatch> ring;
+        if (!ring) ring = std::make_unique<UringBatch>(static_cast<unsigned>(UNLINK_BATCH_SIZE));
+        return ring->isValid() ? ring.get() : nullptr;
+    }
+
+    explicit UringBatch(unsigned entries)
+    {
+        struct io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        d_fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+        if (d_fd < 0) return;
+
+        d_sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        d_cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_mmap) d_sq_size = d_cq_size = std::max(d_sq_size, d_cq_size);
+        d_sq_ring = ::mmap(nullptr, d_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, d_fd,
+                           IORING_OFF_SQ_RING);
+        d_cq_ring = single_mmap ? d_sq_ring :
+                                  ::mmap(nullptr, d_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, d_fd,
+                                         IORING_OFF_CQ_RING);
+        d_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+        d_sqes = ::mmap(nullptr, d_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, d_fd,
+                        IORING_OFF_SQES);
+        if (d_sq_ring == MAP_FAILED || d_cq_ring == MAP_FAILED || d_sqes == MAP_FAILED) return;
+
+        char* const sq = static_cast<char*>(d_sq_ring);
+        char* const cq = static_cast<char*>(d_cq_ring);
+        d_sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        d_sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        d_sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        d_cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        d_cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        d_cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        d_cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+        d_capacity = params.sq_entries;
+        d_valid = true;
+    }
+
+    ~UringBatch()
+    {
+        if (d_sqes != MAP_FAILED) ::munmap(d_sqes, d_sqes_size);
+        if (d_cq_ring != MAP_FAILED && d_cq_ring != d_sq_ring) ::munmap(d_cq_ring, d_cq_size);
+        if (d_sq_ring != MAP_FAILED) ::munmap(d_sq_ring, d_sq_size);
+        if (d_fd >= 0) ::close(d_fd);
+    }
+
+    UringBatch(const UringBatch&) = delete;
+    UringBatch& operator=(const UringBatch&) = delete;
+
+    bool isValid() const
+    {
+        return d_valid;
+    }
+
+    /*!
+     * \brief unlinkat(dir_fd, names[i], flags) for all names; errors[i] is 0 or an errno value.
+     *
+     * \return false if the ring failed, in which case the outcome of the
+     * operations is unknown and the ring must not be used again
+     */
+    bool unlinkAll(int dir_fd, const std::vector<std::string>& names, int flags, std::vector<int>& errors)
+    {
+        return run(names.size(), errors, [&](struct io_uring_sqe& sqe, std::size_t i) {
+            sqe.opcode = IORING_OP_UNLINKAT;
+            sqe.fd = dir_fd;
+            sqe.addr = reinterpret_cast<std::uintptr_t>(names[i].c_str());
+            sqe.unlink_flags = static_cast<std::uint32_t>(flags);
+        });
+    }
+
+    /*!
+     * \brief statx(dir_fd, names[i], AT_SYMLINK_NOFOLLOW, mask) for all names into stxs[i].
+     *
+     * \return false if the ring failed, see unlinkAll()
+     */
+    bool statAll(int dir_fd,
+                 const std::vector<std::string>& names,
+                 unsigned mask,
+                 std::vector<struct statx>& stxs,
+                 std::vector<int>& errors)
+    {
+        stxs.resize(names.size());
+        return run(names.size(), errors, [&](struct io_uring_sqe& sqe, std::size_t i) {
+            sqe.opcode = IORING_OP_STATX;
+            sqe.fd = dir_fd;
+            sqe.addr = reinterpret_cast<std::uintptr_t>(names[i].c_str());
+            sqe.len = mask;
+            sqe.off = reinterpret_cast<std::uintptr_t>(&stxs[i]);
+            sqe.statx_flags = AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC;
+        });
+    }
+
+private:
+    template <typename Prepare>
+    bool run(std::size_t count, std::vector<int>& errors, Prepare prepare)
+    {
+        errors.assign(count, 0);
+        for (std::size_t first = 0; first < count && d_valid; first += d_capacity)
+        {
+            const std::size_t num_ops = std::min<std::size_t>(count - first, d_capacity);
+            
+            // This thread is the only producer, so the tail needs no atomic read
+            unsigned tail = *d_sq_tail;
+            for (std::size_t k = 0; k < num_ops; ++k)
+            {
+                const unsigned slot = tail & d_sq_mask;
+                struct io_uring_sqe& sqe = static_cast<struct io_uring_sqe*>(d_sqes)[slot];
+                std::memset(&sqe, 0, sizeof(sqe));
+                prepare(sqe, first + k);
+                sqe.user_data = first + k;
+                d_sq_array[slot] = slot;
+                ++tail;
+            }
+            __atomic_store_n(d_sq_tail, tail, __ATOMIC_RELEASE);
+            
+            std::size_t to_submit = num_ops;
+            std::size_t completed = 0;
+            while (completed < num_ops)
+            {
+                const long submitted = ::syscall(__NR_io_uring_enter, d_fd, to_submit, num_ops - completed,
+                                                 IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                {
+                    d_valid = false;
+                    break;
+                }
+                if (submitted > 0) to_submit -= static_cast<std::size_t>(submitted);
+                
+                unsigned head = *d_cq_head;
+                const unsigned cq_tail = __atomic_load_n(d_cq_tail, __ATOMIC_ACQUIRE);
+                for (; head != cq_tail; ++head, ++completed)
+                {
+                    const struct io_uring_cqe& cqe = d_cqes[head & d_cq_mask];
+                    errors[cqe.user_data] = cqe.res < 0 ? -cqe.res : 0;
+                }
+                __atomic_store_n(d_cq_head, head, __ATOMIC_RELEASE);
+            }
+        }
+        return d_valid;
+    }
+
+    int d_fd = -1;
+    bool d_valid = false;
+    unsigned d_capacity = 0;
+    void* d_sq_ring = MAP_FAILED;
+    void* d_cq_ring = MAP_FAILED;
+    void* d_sqes = MAP_FAILED;
+    std::size_t d_sq_size = 0;
+    std::size_t d_cq_size = 0;
+    std::size_t d_sqes_size = 0;
+    unsigned* d_sq_tail = nullptr;
+    unsigned d_sq_mask = 0;
+    unsigned* d_sq_array = nullptr;
+    unsigned* d_cq_head = nullptr;
+    unsigned* d_cq_tail = nullptr;
+    unsigned d_cq_mask = 0;
+    struct io_uring_cqe* d_cqes = nullptr;
+};
+#else
+/*!
+ * \brief Stand-in for UringBatch when built without io_uring headers; never supported.
+ */
+class UringBatch
+{
+public:
+    static constexpr bool isSupported()
+    {
+        return false;
+    }
+
+    static UringBatch* forThisThread()
+    {
+        return nullptr;
+    }
+
+    bool unlinkAll(int, const std::vector<std::string>&, int, std::vector<int>&)
+    {
+        return false;
+    }
+
+    bool statAll(int, const std::vector<std::string>&, unsigned, std::vector<struct statx>&, std::vector<int>&)
+    {
+        return false;
+    }
+};
+#endif
+
+/*!
+ * \brief Removes directory trees relative to directory file descriptors.
+ *
+ * Every directory is scanned by one task.  Files are handed to the pool in
+ * batches of UNLINK_BATCH_SIZE names and subdirectories are scanned by their
+ * own tasks.  By default a batch is submitted as soon as it is full, in
+ * directory order; with Order::INODE or Order::REVERSE a directory is read
+ * completely first and its names are sorted by inode number (as returned by
+ * getdents64(), without a stat) or reversed, so that each batch touches
+ * neighbouring inode table blocks.  Each directory keeps a count of
+ * outstanding tasks that refer to it; when the count drops to zero its
+ * descriptor is closed and the directory itself is removed from its parent,
+ * which in turn releases the parent.  The tree is therefore removed bottom-up
+ * without any global synchronization.
+ */
+class ParallelTreeRemover
+{
+public:
+    ParallelTreeRemover(RestartWorkerPool& pool,
+                        int base_fd,
+                        std::shared_ptr<std::atomic<bool>> cancel,
+                        IoCounters* counters = nullptr,
+                        DeletionThrottle* throttle = nullptr)
+        : d_pool(pool), d_base_fd(base_fd), d_cancel(std::move(cancel)), d_counters(counters), d_throttle(throttle)
+    {
+    }
+
+    /*!
+     * \brief Order in which the files of a directory are unlinked.
+     */
+    enum class Order
+    {
+        READDIR,
+        INODE,
+        REVERSE
+    };
+
+    /*!
+     * \brief Set the order of the files unlinked by trees scheduled afterwards.
+     */
+    void setOrder(Order order)
+    {
+        d_order = order;
+    }
+
+    /*!
+     * \brief Unlink the batches of trees scheduled afterwards through io_uring.
+     *
+     * Only call this if UringBatch::isSupported().  A worker thread whose ring
+     * cannot be set up falls back to unlinkat().
+     */
+    void setUring(bool use_uring)
+    {
+        d_use_uring = use_uring;
+    }
+
+    /*!
+     * \brief Schedule removal of the tree base_fd/name.  Returns an id for getError().
+     */
+    std::size_t remove(const std::string& name)
+    {
+        std::size_t root_id;
+        {
+            std::lock_guard<std::mutex> lock(d_mutex);
+            root_id = d_root_errors.size();
+            d_root_errors.emplace_back();
+            d_root_skipped.push_back(false);
+            d_root_entries.push_back(0);
+            d_root_start.emplace_back();
+            d_root_seconds.push_back(0.0);
+            ++d_outstanding_roots;
+        }
+        auto root = std::make_shared<DirNode>();
+        root->parent_fd = d_base_fd;
+        root->name = name;
+        root->path = name;
+        root->root_id = root_id;
+        d_pool.submit([this, root]() { scanDir(root); });
+        return root_id;
+    }
+
+    /*!
+     * \brief Block until all scheduled trees are removed.
+     */
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        d_cv.wait(lock, [this]() { return d_outstanding_roots == 0; });
+    }
+
+    /*!
+     * \brief First error recorded for a tree, or an empty string on success.
+     */
+    std::string getError(std::size_t root_id) const
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        return d_root_errors[root_id];
+    }
+
+    /*!
+     * \brief Whether a tree was left untouched because of cancellation.
+     */
+    bool wasSkipped(std::size_t root_id) const
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        return d_root_skipped[root_id];
+    }
+
+    /*!
+     * \brief Number of files and directories unlinked in a tree.
+     */
+    std::uintmax_t getEntries(std::size_t root_id) const
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        return d_root_entries[root_id];
+    }
+
+    /*!
+     * \brief Wall time from the start of a tree's removal until its root was removed.
+     */
+    double getSeconds(std::size_t root_id) const
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        return d_root_seconds[root_id];
+    }
+
+private:
+    struct DirNode
+    {
+        std::shared_ptr<DirNode> parent;
+        int parent_fd = -1;
+        int fd = -1;
+        std::string name;
+        std::string path;
+        std::size_t root_id = 0;
+        bool removed = false;
+        std::atomic<long> pending{ 1 };
+    };
+
+    void recordError(const DirNode& node, const std::string& what, int err)
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        std::string& slot = d_root_errors[node.root_id];
+        if (slot.empty()) slot = what + ": " + errnoString(err);
+    }
+
+    void addEntries(const DirNode& node, std::uintmax_t count)
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_root_entries[node.root_id] += count;
+    }
+
+    void scanDir(const std::shared_ptr<DirNode>& node)
+    {
+        // Cancellation only prevents trees from being started, so that no
+        // restart directory is ever left half deleted.
+        if (!node->parent && d_cancel && d_cancel->load())
+        {
+            {
+                std::lock_guard<std::mutex> lock(d_mutex);
+                d_root_skipped[node->root_id] = true;
+            }
+            node->removed = true;
+            release(node);
+            return;
+        }
+        if (!node->parent)
+        {
+            std::lock_guard<std::mutex> lock(d_mutex);
+            d_root_start[node->root_id] = std::chrono::steady_clock::now();
+        }
+
+        if (d_counters) ++d_counters->open;
+        node->fd = ::openat(node->parent_fd, node->name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (node->fd < 0)
+        {
+            const int err = errno;
+            const bool not_dir = err == ENOTDIR || err == ELOOP;
+            if (not_dir && d_counters) ++d_counters->unlink;
+            if (not_dir && d_throttle) d_throttle->acquire(0);
+            if (not_dir && ::unlinkat(node->parent_fd, node->name.c_str(), 0) == 0)
+            {
+                // Not a directory (e.g. a symbolic link to one): the entry itself is gone.
+                node->removed = true;
+                addEntries(*node, 1);
+            }
+            else if (err == ENOENT)
+            {
+                // Already removed, e.g. by an earlier reaper that was interrupted
+                node->removed = true;
+            }
+            else
+            {
+                recordError(*node, "cannot open " + node->path, err);
+            }
+            release(node);
+            return;
+        }
+
+        std::vector<std::string> batch;
+        batch.reserve(UNLINK_BATCH_SIZE);
+        std::vector<std::pair<ino64_t, std::string>> files;
+        const int err = forEachDirEntry(node->fd, [&](const LinuxDirent64& entry) {
+            const char* entry_name = entry.d_name;
+            bool is_dir = entry.d_type == DT_DIR;
+            if (entry.d_type == DT_UNKNOWN)
+            {
+                struct stat st;
+                if (d_counters) ++d_counters->stat;
+                if (::fstatat(node->fd, entry_name, &st, AT_SYMLINK_NOFOLLOW) == 0) is_dir = S_ISDIR(st.st_mode);
+            }
+
+            if (is_dir)
+            {
+                auto child = std::make_shared<DirNode>();
+                child->parent = node;
+                child->parent_fd = node->fd;
+                child->name = entry_name;
+                child->path = node->path + "/" + entry_name;
+                child->root_id = node->root_id;
+                node->pending.fetch_add(1);
+                d_pool.submit([this, child]() { scanDir(child); });
+            }
+            else if (d_order != Order::READDIR)
+            {
+                files.emplace_back(entry.d_ino, entry_name);
+            }
+            else
+            {
+                batch.emplace_back(entry_name);
+                if (batch.size() == UNLINK_BATCH_SIZE) submitBatch(node, batch);
+            }
+        }, d_counters);
+        if (err != 0) recordError(*node, "cannot read " + node->path, err);
+        
+        if (d_order == Order::INODE)
+        {
+            std::sort(files.begin(), files.end());
+        }
+        else if (d_order == Order::REVERSE)
+        {
+            std::reverse(files.begin(), files.end());
+        }
+        for (auto& file : files)
+        {
+            batch.push_back(std::move(file.second));
+            if (batch.size() == UNLINK_BATCH_SIZE) submitBatch(node, batch);
+        }
+        if (!batch.empty()) submitBatch(node, batch);
+        release(node);
+    }
+
+    void submitBatch(const std::shared_ptr<DirNode>& node, std::vector<std::string>& batch)
+    {
+        node->pending.fetch_add(1);
+        auto names = std::make_shared<std::vector<std::string>>(std::move(batch));
+        batch.clear();
+        batch.reserve(UNLINK_BATCH_SIZE);
+        const bool use_uring = d_use_uring;
+        d_pool.submit([this, node, names, use_uring]() {
+            UringBatch* ring = use_uring ? UringBatch::forThisThread() : nullptr;
+            if (ring && uringUnlinkBatch(*ring, node, *names))
+            {
+                release(node);
+                return;
+            }
+            std::uintmax_t num_unlinked = 0;
+            for (const auto& name : *names)
+            {
+                if (throttledUnlink(node->fd, name.c_str(), 0) == 0)
+                {
+                    ++num_unlinked;
+                }
+                else if (errno != ENOENT)
+                {
+                    recordError(*node, "cannot unlink " + node->path + "/" + name, errno);
+                }
+            }
+            if (d_counters) d_counters->unlink += names->size();
+            addEntries(*node, num_unlinked);
+            release(node);
+        });
+    }
+
+    /*!
+     * \brief Unlink a batch of files of one directory with a single io_uring submission.
+     *
+     * With a byte rate limit the sizes are read by one batch of statx
+     * operations first.  The throttle is charged for the whole batch before
+     * it is submitted, and the adaptive throttle sees the average latency.
+     *
+     * \return false if the ring failed; the caller then unlinks the batch itself
+     */
+    bool uringUnlinkBatch(UringBatch& ring, const std::shared_ptr<DirNode>& node, const std::vector<std::string>& names)
+    {
+        std::vector<int> errors;
+        if (d_throttle)
+        {
+            std::vector<struct statx> stxs;
+            const bool stat_sizes = d_throttle->limitsBytes();
+            if (stat_sizes && !ring.statAll(node->fd, names, STATX_BLOCKS | STATX_NLINK, stxs, errors)) return false;
+            if (stat_sizes && d_counters) d_counters->stat += names.size();
+            for (std::size_t i = 0; i < names.size(); ++i)
+            {
+                const bool counted = stat_sizes && errors[i] == 0 && stxs[i].stx_nlink <= 1;
+                d_throttle->acquire(counted ? static_cast<std::uintmax_t>(stxs[i].stx_blocks) * 512 : 0);
+            }
+        }
+        
+        const auto start = std::chrono::steady_clock::now();
+        if (!ring.unlinkAll(node->fd, names, 0, errors)) return false;
+        if (d_throttle && d_throttle->isAdaptive())
+        {
+            d_throttle->recordLatency(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() /
+                                      static_cast<double>(names.size()));
+        }
+        
+        std::uintmax_t num_unlinked = 0;
+        for (std::size_t i = 0; i < names.size(); ++i)
+        {
+            if (errors[i] == 0)
+            {
+                ++num_unlinked;
+            }
+            else if (errors[i] != ENOENT)
+            {
+                recordError(*node, "cannot unlink " + node->path + "/" + names[i], errors[i]);
+            }
+        }
+        if (d_counters) d_counters->unlink += names.size();
+        addEntries(*node, num_unlinked);
+        return true;
+    }
+
+    /*!
+     * \brief unlinkat(), after waiting for the throttle and reporting the latency to it.
+     */
+    int throttledUnlink(int dir_fd, const char* name, int flags)
+    {
+        if (!d_throttle) return ::unlinkat(dir_fd, name, flags);
+
+        std::uintmax_t bytes = 0;
+        if (d_throttle->limitsBytes() && (flags & AT_REMOVEDIR) == 0)
+        {
+            struct stat st;
+            if (d_counters) ++d_counters->stat;
+            if (::fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && st.st_nlink <= 1)
+            {
+                bytes = static_cast<std::uintmax_t>(st.st_blocks) * 512;
+            }
+        }
+        d_throttle->acquire(bytes);
+
+        if (!d_throttle->isAdaptive()) return ::unlinkat(dir_fd, name, flags);
+        const auto start = std::chrono::steady_clock::now();
+        const int result = ::unlinkat(dir_fd, name, flags);
+        const int err = errno;
+        d_throttle->recordLatency(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        errno = err;
+        return result;
+    }
+
+    void release(const std::shared_ptr<DirNode>& node)
+    {
+        if (node->pending.fetch_sub(1) != 1) return;
+
+        if (node->fd >= 0) ::close(node->fd);
+        if (!node->removed)
+        {
+            if (d_counters) ++d_counters->rmdir;
+            if (throttledUnlink(node->parent_fd, node->name.c_str(), AT_REMOVEDIR) == 0)
+            {
+                addEntries(*node, 1);
+            }
+            else if (errno != ENOENT)
+            {
+                recordError(*node, "cannot remove " + node->path, errno);
+            }
+        }
+
+        if (node->parent)
+        {
+            release(node->parent);
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock(d_mutex);
+            if (!d_root_skipped[node->root_id])
+            {
+                d_root_seconds[node->root_id] =
+                    std::chrono::duration<double>(std::chrono::steady_clock::now() - d_root_start[node->root_id])
+                        .count();
+            }
+            if (--d_outstanding_roots == 0) d_cv.notify_all();
+        }
+    }
+
+    RestartWorkerPool& d_pool;
+    const int d_base_fd;
+    const std::shared_ptr<std::atomic<bool>> d_cancel;
+    IoCounters* const d_counters;
+    DeletionThrottle* const d_throttle;
+    Order d_order = Order::READDIR;
+    bool d_use_uring = false;
+    mutable std::mutex d_mutex;
+    std::condition_variable d_cv;
+    std::size_t d_outstanding_roots = 0;
+    std::vector<std::string> d_root_errors;
+    std::vector<bool> d_root_skipped;
+    std::vector<std::uintmax_t> d_root_entries;
+    std::vector<std::chrono::steady_clock::time_point> d_root_start;
+    std::vector<double> d_root_seconds;
+};
+
+/*!
+ * \brief Directory descriptor shared by the tasks that still need it.
+ */
+struct SharedFd
+{
+    explicit SharedFd(int fd_in) : fd(fd_in)
+    {
+    }
+
+    ~SharedFd()
+    {
+        if (fd >= 0) ::close(fd);
+    }
+
+    const int fd;
+};
+
+/*!
+ * \brief Measures directory trees relative to directory file descriptors.
+ *
+ * Like ParallelTreeRemover, every directory is read by its own task and file
+ * names are stat'ed in batches on the pool.  statx() is called with the
+ * minimal mask needed and without forcing attribute synchronization with a
+ * network file system server.  Files with more than one hard link are counted
+ * once per tree.
+ */
+class ParallelTreeSizer
+{
+public:
+    ParallelTreeSizer(RestartWorkerPool& pool, int base_fd) : d_pool(pool), d_base_fd(base_fd)
+    {
+    }
+
+    /*!
+     * \brief Schedule measurement of the tree base_fd/name.  Returns an id for getSize().
+     */
+    std::size_t measure(const std::string& name)
+    {
+        const std::size_t root_id = d_roots.size();
+        d_roots.push_back(std::make_unique<Root>());
+        Root* root = d_roots.back().get();
+        submit([this, root, name]() { scanDir(*root, nullptr, name); });
+        return root_id;
+    }
+
+    /*!
+     * \brief Block until all scheduled trees are measured.
+     */
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        d_cv.wait(lock, [this]() { return d_outstanding == 0; });
+    }
+
+    RestartCleaner::TreeSize getSize(std::size_t root_id) const
+    {
+        RestartCleaner::TreeSize size;
+        size.bytes = d_roots[root_id]->bytes.load();
+        size.files = d_roots[root_id]->files.load();
+        return size;
+    }
+
+    std::string getError(std::size_t root_id) const
+    {
+        std::lock_guard<std::mutex> lock(d_roots[root_id]->mutex);
+        return d_roots[root_id]->error;
+    }
+
+private:
+    struct InodeKey
+    {
+        std::uint64_t dev;
+        std::uint64_t ino;
+
+        bool operator==(const InodeKey& other) const
+        {
+            return dev == other.dev && ino == other.ino;
+        }
+    };
+
+    struct InodeKeyHash
+    {
+        std::size_t operator()(const InodeKey& key) const
+        {
+            return std::hash<std::uint64_t>()(key.ino ^ (key.dev * 0x9e3779b97f4a7c15ULL));
+        }
+    };
+
+    struct Root
+    {
+        std::atomic<std::uintmax_t> bytes{ 0 };
+        std::atomic<std::uintmax_t> files{ 0 };
+        mutable std::mutex mutex;
+        std::unordered_set<InodeKey, InodeKeyHash> linked_inodes;
+        std::string error;
+    };
+
+    void submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(d_mutex);
+            ++d_outstanding;
+        }
+        d_pool.submit([this, task]() {
+            task();
+            std::lock_guard<std::mutex> lock(d_mutex);
+            if (--d_outstanding == 0) d_cv.notify_all();
+        });
+    }
+
+    void recordError(Root& root, const std::string& what, int err)
+    {
+        std::lock_guard<std::mutex> lock(root.mutex);
+        if (root.error.empty()) root.error = what + ": " + errnoString(err);
+    }
+
+    void addFile(Root& root, const struct statx& stx)
+    {
+        if (stx.stx_nlink > 1 && !S_ISDIR(stx.stx_mode))
+        {
+            const InodeKey key = { (static_cast<std::uint64_t>(stx.stx_dev_major) << 32) | stx.stx_dev_minor,
+                                   stx.stx_ino };
+            std::lock_guard<std::mutex> lock(root.mutex);
+            if (!root.linked_inodes.insert(key).second) return;
+        }
+        root.bytes += static_cast<std::uintmax_t>(stx.stx_blocks) * 512;
+        root.files += 1;
+    }
+
+    void scanDir(Root& root, std::shared_ptr<SharedFd> parent, const std::string& name)
+    {
+        const int parent_fd = parent ? parent->fd : d_base_fd;
+        const int fd = ::openat(parent_fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+        {
+            // A symbolic link to a directory does not own the target's data
+            if (errno != ELOOP && errno != ENOTDIR) recordError(root, "cannot open " + name, errno);
+            return;
+        }
+        auto dir = std::make_shared<SharedFd>(fd);
+
+        struct statx stx;
+        if (::statx(fd, "", AT_EMPTY_PATH | AT_STATX_DONT_SYNC, SIZE_STATX_MASK, &stx) == 0)
+        {
+            root.bytes += static_cast<std::uintmax_t>(stx.stx_blocks) * 512;
+        }
+
+        auto batch = std::make_shared<std::vector<std::string>>();
+        const auto flush = [&]() {
+            submit([this, &root, dir, batch]() { statBatch(root, dir->fd, *batch); });
+            batch = std::make_shared<std::vector<std::string>>();
+        };
+        const int err = forEachDirEntry(fd, [&](const LinuxDirent64& entry) {
+            bool is_dir = entry.d_type == DT_DIR;
+            if (entry.d_type == DT_UNKNOWN)
+            {
+                struct stat st;
+                is_dir = ::fstatat(fd, entry.d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+            }
+            if (is_dir)
+            {
+                const std::string child = entry.d_name;
+                submit([this, &root, dir, child]() { scanDir(root, dir, child); });
+                return;
+            }
+            batch->emplace_back(entry.d_name);
+            if (batch->size() == STATX_BATCH_SIZE) flush();
+        });
+        if (err != 0) recordError(root, "cannot read " + name, err);
+        if (!batch->empty()) flush();
+    }
+
+    void statBatch(Root& root, int dir_fd, const std::vector<std::string>& names)
+    {
+        for (const auto& name : names)
+        {
+            struct statx stx;
+            if (::statx(dir_fd, name.c_str(), AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, SIZE_STATX_MASK, &stx) != 0)
+            {
+                if (errno != ENOENT) recordError(root, "cannot stat " + name, errno);
+                continue;
+            }
+            addFile(root, stx);
+        }
+    }
+
+    RestartWorkerPool& d_pool;
+    const int d_base_fd;
+    std::vector<std::unique_ptr<Root>> d_roots;
+    std::mutex d_mutex;
+    std::condition_variable d_cv;
+    std::size_t d_outstanding = 0;
+};
+
+/*!
+ * \brief Computes CRC32C checksums of files on a worker pool.
+ *
+ * Every file is read sequentially by one task in blocks of
+ * CHECKSUM_BLOCK_SIZE bytes, so many files (typically one per rank) are
+ * checksummed concurrently.
+ */
+class ParallelChecksummer
+{
+public:
+    explicit ParallelChecksummer(RestartWorkerPool& pool) : d_pool(pool)
+    {
+    }
+
+    /*!
+     * \brief Schedule the checksum of dir/name.  Returns an id for getChecksum().
+     */
+    std::size_t checksum(std::shared_ptr<SharedFd> dir, const std::string& name)
+    {
+        const std::size_t file_id = d_files.size();
+        d_files.push_back(std::make_unique<File>());
+        File* file = d_files.back().get();
+        {
+            std::lock_guard<std::mutex> lock(d_mutex);
+            ++d_outstanding;
+        }
+        d_pool.submit([this, file, dir, name]() {
+            readFile(*file, dir->fd, name);
+            std::lock_guard<std::mutex> lock(d_mutex);
+            if (--d_outstanding == 0) d_cv.notify_all();
+        });
+        return file_id;
+    }
+
+    /*!
+     * \brief Block until all scheduled checksums are computed.
+     */
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        d_cv.wait(lock, [this]() { return d_outstanding == 0; });
+    }
+
+    std::uint32_t getChecksum(std::size_t file_id) const
+    {
+        return d_files[file_id]->crc;
+    }
+
+    std::string getError(std::size_t file_id) const
+    {
+        return d_files[file_id]->error;
+    }
+
+private:
+    struct File
+    {
+        std::uint32_t crc = 0;
+        std::string error;
+    };
+
+    static void readFile(File& file, int dir_fd, const std::string& name)
+    {
+        const int fd = ::openat(dir_fd, name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+        {
+            file.error = "cannot open " + name + ": " + errnoString(errno);
+            return;
+        }
+        ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        
+        const int err = checksumFile(fd, file.crc);
+        if (err != 0) file.error = "cannot read " + name + ": " + errnoString(err);
+        ::close(fd);
+    }
+
+    RestartWorkerPool& d_pool;
+    std::vector<std::unique_ptr<File>> d_files;
+    std::mutex d_mutex;
+    std::condition_variable d_cv;
+    std::size_t d_outstanding = 0;
+};
+
+/*!
+ * \brief Copies directory trees to another file system on a worker pool.
+ *
+ * Every directory is read by its own task and every regular file is copied
+ * by its own task.  File data is moved with copy_file_range(), falling back
+ * to sendfile() and then to read()/write(), so that it does not pass through
+ * user space where the kernel allows it.  Each copy is checked by comparing
+ * the CRC32C checksums of source and destination.  Permissions and file
+ * modification times are preserved, ownership is not.  When the last task of
+ * a tree is done, the completion callback runs on that worker.
+ */
+class ParallelTreeCopier
+{
+public:
+    using DoneCallback = std::function<void(std::size_t root_id)>;
+
+    ParallelTreeCopier(RestartWorkerPool& pool, std::shared_ptr<std::atomic<bool>> cancel, DoneCallback on_done)
+        : d_pool(pool), d_cancel(std::move(cancel)), d_on_done(std::move(on_done))
+    {
+    }
+
+    /*!
+     * \brief Schedule copying the tree src_parent/name to dst_parent/dst_name.
+     *
+     * Ids are handed out in call order, starting at zero.
+     */
+    std::size_t copy(std::shared_ptr<SharedFd> src_parent,
+                     const std::string& name,
+                     std::shared_ptr<SharedFd> dst_parent,
+                     const std::string& dst_name)
+    {
+        std::size_t root_id;
+        {
+            std::lock_guard<std::mutex> lock(d_mutex);
+            root_id = d_roots.size();
+            d_roots.emplace_back();
+            d_roots.back().pending = 1;
+            d_roots.back().start = std::chrono::steady_clock::now();
+            ++d_outstanding_roots;
+        }
+        d_pool.submit([this, root_id, src_parent, name, dst_parent, dst_name]() {
+            copyDir(root_id, src_parent, name, dst_parent, dst_name);
+        });
+        return root_id;
+    }
+
+    /*!
+     * \brief Block until all scheduled trees are copied and their callbacks returned.
+     */
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        d_cv.wait(lock, [this]() { return d_outstanding_roots == 0; });
+    }
+
+    /*!
+     * \brief First error recorded for a tree, or an empty string on success.
+     */
+    std::string getError(std::size_t root_id) const
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        return d_roots[root_id].error;
+    }
+
+    std::uintmax_t getFiles(std::size_t root_id) const
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        return d_roots[root_id].files;
+    }
+
+    std::uintmax_t getBytes(std::size_t root_id) const
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        return d_roots[root_id].bytes;
+    }
+
+    double getSeconds(std::size_t root_id) const
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        return d_roots[root_id].seconds;
+    }
+
+private:
+    struct Root
+    {
+        std::string error;
+        std::uintmax_t files = 0;
+        std::uintmax_t bytes = 0;
+        std::size_t pending = 0;
+        std::chrono::steady_clock::time_point start;
+        double seconds = 0.0;
+    };
+
+    void fail(std::size_t root_id, const std::string& message)
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        if (d_roots[root_id].error.empty()) d_roots[root_id].error = message;
+    }
+
+    bool shouldStop(std::size_t root_id)
+    {
+        if (d_cancel && d_cancel->load()) fail(root_id, "cancelled");
+        std::lock_guard<std::mutex> lock(d_mutex);
+        return !d_roots[root_id].error.empty();
+    }
+
+    void spawn(std::size_t root_id, std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(d_mutex);
+            ++d_roots[root_id].pending;
+        }
+        d_pool.submit(std::move(task));
+    }
+
+    void finishTask(std::size_t root_id)
+    {
+        {
+            std::lock_guard<std::mutex> lock(d_mutex);
+            Root& root = d_roots[root_id];
+            if (--root.pending > 0) return;
+            root.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - root.start).count();
+        }
+        d_on_done(root_id);
+        std::lock_guard<std::mutex> lock(d_mutex);
+        if (--d_outstanding_roots == 0) d_cv.notify_all();
+    }
+
+    void copyDir(std::size_t root_id,
+                 const std::shared_ptr<SharedFd>& src_parent,
+                 const std::string& name,
+                 const std::shared_ptr<SharedFd>& dst_parent,
+                 const std::string& dst_name)
+    {
+        if (shouldStop(root_id))
+        {
+            finishTask(root_id);
+            return;
+        }
+
+        struct stat st;
+        const int src_fd = ::openat(src_parent->fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (src_fd < 0 || ::fstat(src_fd, &st) != 0)
+        {
+            fail(root_id, "cannot open " + name + ": " + errnoString(errno));
+            if (src_fd >= 0) ::close(src_fd);
+            finishTask(root_id);
+            return;
+        }
+        const auto src_dir = std::make_shared<SharedFd>(src_fd);
+
+        // The owner must be able to add the entries
+        if (::mkdirat(dst_parent->fd, dst_name.c_str(), (st.st_mode & 07777) | S_IRWXU) != 0)
+        {
+            fail(root_id, "cannot create " + dst_name + ": " + errnoString(errno));
+            finishTask(root_id);
+            return;
+        }
+        const int dst_fd = ::openat(dst_parent->fd, dst_name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dst_fd < 0)
+        {
+            fail(root_id, "cannot open " + dst_name + ": " + errnoString(errno));
+            finishTask(root_id);
+            return;
+        }
+        const auto dst_dir = std::make_shared<SharedFd>(dst_fd);
+
+        const int err = forEachDirEntry(src_fd, [&](const LinuxDirent64& entry) {
+            const std::string entry_name(entry.d_name);
+            unsigned char type = entry.d_type;
+            if (type == DT_UNKNOWN)
+            {
+                struct stat entry_st;
+                if (::fstatat(src_fd, entry.d_name, &entry_st, AT_SYMLINK_NOFOLLOW) != 0)
+                {
+                    fail(root_id, "cannot stat " + entry_name + ": " + errnoString(errno));
+                    return;
+                }
+                type = S_ISDIR(entry_st.st_mode) ? DT_DIR : S_ISREG(entry_st.st_mode) ? DT_REG
+                                                          : S_ISLNK(entry_st.st_mode) ? DT_LNK : DT_UNKNOWN;
+            }
+
+            if (type == DT_DIR)
+            {
+                spawn(root_id, [this, root_id, src_dir, entry_name, dst_dir]() {
+                    copyDir(root_id, src_dir, entry_name, dst_dir, entry_name);
+                });
+            }
+            else if (type == DT_REG)
+            {
+                spawn(root_id, [this, root_id, src_dir, entry_name, dst_dir]() {
+                    copyFile(root_id, src_dir, dst_dir, entry_name);
+                });
+            }
+            else if (type == DT_LNK)
+            {
+                std::vector<char> target(PATH_MAX + 1);
+                const ssize_t length = ::readlinkat(src_fd, entry.d_name, target.data(), target.size() - 1);
+                if (length < 0)
+                {
+                    fail(root_id, "cannot read link " + entry_name + ": " + errnoString(errno));
+                    return;
+                }
+                target[length] = '\0';
+                if (::symlinkat(target.data(), dst_fd, entry.d_name) != 0)
+                {
+                    fail(root_id, "cannot create link " + entry_name + ": " + errnoString(errno));
+                }
+            }
+            else
+            {
+                fail(root_id, entry_name + " is not a file, directory or symbolic link");
+            }
+        });
+        if (err != 0) fail(root_id, "cannot read " + name + ": " + errnoString(err));
+        finishTask(root_id);
+    }
+
+    void copyFile(std::size_t root_id,
+                  const std::shared_ptr<SharedFd>& src_dir,
+                  const std::shared_ptr<SharedFd>& dst_dir,
+                  const std::string& name)
+    {
+        if (shouldStop(root_id))
+        {
+            finishTask(root_id);
+            return;
+        }
+
+        struct stat st;
+        const int src_fd = ::openat(src_dir->fd, name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (src_fd < 0 || ::fstat(src_fd, &st) != 0)
+        {
+            fail(root_id, "cannot open " + name + ": " + errnoString(errno));
+            if (src_fd >= 0) ::close(src_fd);
+            finishTask(root_id);
+            return;
+        }
+        const int dst_fd =
+            ::openat(dst_dir->fd, name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if (dst_fd < 0)
+        {
+            fail(root_id, "cannot create " + name + ": " + errnoString(errno));
+            ::close(src_fd);
+            finishTask(root_id);
+            return;
+        }
+        ::posix_fadvise(src_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        std::uintmax_t copied = 0;
+        std::string error = copyData(src_fd, dst_fd, copied);
+        if (!error.empty()) error = "cannot copy " + name + ": " + error;
+        if (error.empty() && copied != static_cast<std::uintmax_t>(st.st_size))
+        {
+            error = name + " changed size while it was copied";
+        }
+        if (error.empty())
+        {
+            std::uint32_t src_crc = 0;
+            std::uint32_t dst_crc = 0;
+            int err = checksumFile(src_fd, src_crc);
+            if (err == 0) err = checksumFile(dst_fd, dst_crc);
+            if (err != 0)
+            {
+                error = "cannot verify " + name + ": " + errnoString(err);
+            }
+            else if (src_crc != dst_crc)
+            {
+                error = "checksum mismatch for the copy of " + name;
+            }
+        }
+        if (error.empty())
+        {
+            const struct timespec times[2] = { st.st_atim, st.st_mtim };
+            if (::fchmod(dst_fd, st.st_mode & 07777) != 0 || ::futimens(dst_fd, times) != 0)
+            {
+                error = "cannot set attributes of " + name + ": " + errnoString(errno);
+            }
+        }
+        ::close(src_fd);
+        ::close(dst_fd);
+
+        if (!error.empty())
+        {
+            fail(root_id, error);
+        }
+        else
+        {
+            std::lock_guard<std::mutex> lock(d_mutex);
+            ++d_roots[root_id].files;
+            d_roots[root_id].bytes += copied;
+        }
+        finishTask(root_id);
+    }
+
+    /*!
+     * \brief Copy all data of src_fd to dst_fd, using the fastest mechanism that works.
+     *
+     * \return An empty string on success, or a description of the error
+     */
+    static std::string copyData(int src_fd, int dst_fd, std::uintmax_t& copied)
+    {
+        enum class Method { COPY_FILE_RANGE, SENDFILE, READ_WRITE };
+        Method method = Method::COPY_FILE_RANGE;
+        std::vector<char> buffer;
+        for (;;)
+        {
+            ssize_t n = 0;
+            if (method == Method::COPY_FILE_RANGE)
+            {
+                n = ::copy_file_range(src_fd, nullptr, dst_fd, nullptr, COPY_CHUNK_SIZE, 0);
+                if (n < 0 && copied == 0 &&
+                    (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+                {
+                    method = Method::SENDFILE;
+                    continue;
+                }
+            }
+            else if (method == Method::SENDFILE)
+            {
+                n = ::sendfile(dst_fd, src_fd, nullptr, COPY_CHUNK_SIZE);
+                if (n < 0 && copied == 0 && (errno == EINVAL || errno == ENOSYS))
+                {
+                    method = Method::READ_WRITE;
+                    continue;
+                }
+            }
+            else
+            {
+                buffer.resize(CHECKSUM_BLOCK_SIZE);
+                n = ::read(src_fd, buffer.data(), buffer.size());
+                for (ssize_t written = 0; n > 0 && written < n;)
+                {
+                    const ssize_t w = ::write(dst_fd, buffer.data() + written, n - written);
+                    if (w < 0 && errno == EINTR) continue;
+                    if (w < 0) return errnoString(errno);
+                    written += w;
+                }
+            }
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return errnoString(errno);
+            if (n == 0) return std::string();
+            copied += static_cast<std::uintmax_t>(n);
+        }
+    }
+
+    RestartWorkerPool& d_pool;
+    const std::shared_ptr<std::atomic<bool>> d_cancel;
+    const DoneCallback d_on_done;
+    mutable std::mutex d_mutex;
+    std::condition_variable d_cv;
+    std::deque<Root> d_roots;
+    std::size_t d_outstanding_roots = 0;
+};
+
+/*!
+ * \brief Check that the per-rank files of a restart directory are complete.
+ *
+ * Every rank r of 0, ..., N-1 must have a "samrai.<r>" file, and every
+ * "hier_data.<r>.samrai.<r>" file must belong to one of these ranks.
+ *
+ * \return A description of the first problem, or an empty string
+ */
+std::string
+checkRankFiles(const std::vector<std::string>& names)
+{
+    const auto parse_rank = [](std::string_view text) {
+        if (text.empty() || text.find_first_not_of("0123456789") != std::string_view::npos) return -1L;
+        return std::strtol(std::string(text).c_str(), nullptr, 10);
+    };
+    
+    std::vector<long> ranks;
+    std::vector<long> hier_ranks;
+    for (const auto& name : names)
+    {
+        const std::string_view view(name);
+        if (view.compare(0, 7, "samrai.") == 0)
+        {
+            const long rank = parse_rank(view.substr(7));
+            if (rank >= 0) ranks.push_back(rank);
+        }
+        else if (view.compare(0, 10, "hier_data.") == 0)
+        {
+            const std::size_t dot = view.find('.', 10);
+            if (dot == std::string_view::npos) continue;
+            const long rank = parse_rank(view.substr(10, dot - 10));
+            if (rank >= 0 && view.substr(dot) == ".samrai." + std::string(view.substr(10, dot - 10)))
+            {
+                hier_ranks.push_back(rank);
+            }
+        }
+    }
+    
+    if (ranks.empty()) return "no samrai.* files";
+    std::sort(ranks.begin(), ranks.end());
+    for (std::size_t i = 0; i < ranks.size(); ++i)
+    {
+        if (ranks[i] != static_cast<long>(i)) return "samrai file of rank " + std::to_string(i) + " is missing";
+    }
+    for (long rank : hier_ranks)
+    {
+        if (rank >= static_cast<long>(ranks.size()))
+        {
+            return "hier_data file of rank " + std::to_string(rank) + " has no samrai file";
+        }
+    }
+    return std::string();
+}
+/*!
+ * \brief Pack the tree base_fd/name into base_fd/<name>.pack and verify it.
+ *
+ * File contents are read, checksummed and compressed by tasks on \p pool,
+ * at most PACK_INFLIGHT_BYTES ahead of the writer, and appended in the
+ * order they complete.  The index records where each one ended up.
+ *
+ * \return An empty string on success, or a description of the error
+ */
+std::string
+writePack(RestartWorkerPool& pool,
+          const std::string& base_path,
+          int base_fd,
+          const std::string& name,
+          RestartPack::Codec codec,
+          const std::shared_ptr<std::atomic<bool>>& cancel,
+          std::uintmax_t& pack_bytes,
+          std::uintmax_t& num_files)
+{
+    // Collect the tree first; symbolic link targets are kept as entry data
+    std::vector<RestartPack::Entry> entries;
+    std::vector<std::string> link_targets;
+    std::string walk_error;
+    std::function<void(int, const std::string&)> walk = [&](int dir_fd, const std::string& prefix) {
+        const int err = forEachDirEntry(dir_fd, [&](const LinuxDirent64& dirent) {
+            if (!walk_error.empty()) return;
+            struct stat st;
+            const std::string path = prefix + dirent.d_name;
+            if (::fstatat(dir_fd, dirent.d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+            {
+                walk_error = "cannot stat " + path + ": " + errnoString(errno);
+                return;
+            }
+            RestartPack::Entry entry;
+            entry.path = path;
+            entry.mode = st.st_mode & 07777;
+            entry.mtime_sec = st.st_mtim.tv_sec;
+            entry.mtime_nsec = static_cast<std::uint32_t>(st.st_mtim.tv_nsec);
+            if (S_ISDIR(st.st_mode))
+            {
+                entry.type = RestartPack::EntryType::DIRECTORY;
+                entries.push_back(entry);
+                link_targets.emplace_back();
+                const int child_fd = ::openat(dir_fd, dirent.d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (child_fd < 0)
+                {
+                    walk_error = "cannot open " + path + ": " + errnoString(errno);
+                    return;
+                }
+                walk(child_fd, path + "/");
+                ::close(child_fd);
+            }
+            else if (S_ISREG(st.st_mode))
+            {
+                entry.size = static_cast<std::uint64_t>(st.st_size);
+                entries.push_back(entry);
+                link_targets.emplace_back();
+            }
+            else if (S_ISLNK(st.st_mode))
+            {
+                std::vector<char> target(PATH_MAX + 1);
+                const ssize_t length = ::readlinkat(dir_fd, dirent.d_name, target.data(), target.size() - 1);
+                if (length < 0)
+                {
+                    walk_error = "cannot read link " + path + ": " + errnoString(errno);
+                    return;
+                }
+                entry.type = RestartPack::EntryType::SYMLINK;
+                entry.size = static_cast<std::uint64_t>(length);
+                entries.push_back(entry);
+                link_targets.emplace_back(target.data(), static_cast<std::size_t>(length));
+            }
+            else
+            {
+                walk_error = path + " is not a file, directory or symbolic link";
+            }
+        });
+        if (err != 0 && walk_error.empty()) walk_error = "cannot read " + prefix + ": " + errnoString(err);
+    };
+    const int root_fd = ::openat(base_fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (root_fd < 0) return "cannot open: " + errnoString(errno);
+    walk(root_fd, "");
+    if (!walk_error.empty())
+    {
+        ::close(root_fd);
+        return walk_error;
+    }
+    const auto root = std::make_shared<SharedFd>(root_fd);
+    
+    const std::string pack_name = name + std::string(PACK_SUFFIX);
+    const std::string tmp_name = pack_name + ".tmp";
+    ::unlinkat(base_fd, tmp_name.c_str(), 0);
+    const int pack_fd = ::openat(base_fd, tmp_name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (pack_fd < 0) return "cannot create " + tmp_name + ": " + errnoString(errno);
+    const auto discard = [&](const std::string& error) {
+        ::close(pack_fd);
+        ::unlinkat(base_fd, tmp_name.c_str(), 0);
+        return error;
+    };
+    
+    std::uint64_t offset = sizeof(PACK_MAGIC);
+    int err = writeAll(pack_fd, PACK_MAGIC, sizeof(PACK_MAGIC));
+    for (std::size_t i = 0; i < entries.size() && err == 0; ++i)
+    {
+        if (entries[i].type != RestartPack::EntryType::SYMLINK) continue;
+        const std::string& target = link_targets[i];
+        entries[i].crc = ~updateCrc32c(0xFFFFFFFFu, target.data(), target.size());
+        entries[i].offset = offset;
+        entries[i].stored_size = target.size();
+        err = writeAll(pack_fd, target.data(), target.size());
+        offset += target.size();
+    }
+    if (err != 0) return discard("cannot write " + tmp_name + ": " + errnoString(err));
+    
+    struct Blob
+    {
+        std::size_t index;
+        std::string data;
+        RestartPack::Codec codec;
+        std::uint32_t crc;
+        std::string error;
+    };
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<Blob> done;
+    std::size_t outstanding = 0;
+    std::size_t inflight_bytes = 0;
+    std::string error;
+    
+    const auto read_file = [&, root](std::size_t index) {
+        Blob blob{ index, std::string(), RestartPack::Codec::NONE, 0, std::string() };
+        try
+        {
+            const RestartPack::Entry& entry = entries[index];
+            const int fd = ::openat(root->fd, entry.path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0)
+            {
+                blob.error = "cannot open " + entry.path + ": " + errnoString(errno);
+            }
+            else
+            {
+                std::string data(entry.size, '\0');
+                std::size_t filled = 0;
+                while (filled < data.size())
+                {
+                    const ssize_t nread = ::pread(fd, &data[filled], data.size() - filled, filled);
+                    if (nread < 0 && errno == EINTR) continue;
+                    if (nread <= 0)
+                    {
+                        blob.error = nread < 0 ? "cannot read " + entry.path + ": " + errnoString(errno)
+                                               : entry.path + " changed size while it was packed";
+                        break;
+                    }
+                    filled += static_cast<std::size_t>(nread);
+                }
+                ::close(fd);
+                blob.crc = ~updateCrc32c(0xFFFFFFFFu, data.data(), data.size());
+                if (codec != RestartPack::Codec::NONE && compressBlob(codec, data, blob.data))
+                {
+                    blob.codec = codec;
+                }
+                else
+                {
+                    blob.data = std::move(data);
+                }
+            }
+        }
+        catch (const std::exception& e)
+        {
+            blob.error = e.what();
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        done.push_back(std::move(blob));
+        cv.notify_all();
+    };
+    
+    std::size_t next = 0;
+    for (;;)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (error.empty() && next < entries.size())
+        {
+            if (entries[next].type != RestartPack::EntryType::FILE)
+            {
+                ++next;
+                continue;
+            }
+            if (outstanding > 0 && inflight_bytes + entries[next].size > PACK_INFLIGHT_BYTES) break;
+            if (cancel && cancel->load())
+            {
+                error = "cancelled";
+                break;
+            }
+            ++outstanding;
+            inflight_bytes += entries[next].size;
+            const std::size_t index = next++;
+            pool.submit([&read_file, index]() { read_file(index); });
+        }
+        if (outstanding == 0) break;
+        
+        cv.wait(lock, [&]() { return !done.empty(); });
+        Blob blob = std::move(done.front());
+        done.pop_front();
+        --outstanding;
+        inflight_bytes -= entries[blob.index].size;
+        lock.unlock();
+        
+        // Keep draining after an error: the tasks refer to this frame
+        if (!error.empty()) continue;
+        if (!blob.error.empty())
+        {
+            error = blob.error;
+            continue;
+        }
+        RestartPack::Entry& entry = entries[blob.index];
+        entry.codec = blob.codec;
+        entry.crc = blob.crc;
+        entry.offset = offset;
+        entry.stored_size = blob.data.size();
+        err = writeAll(pack_fd, blob.data.data(), blob.data.size());
+        if (err != 0) error = "cannot write " + tmp_name + ": " + errnoString(err);
+        offset += blob.data.size();
+        ++num_files;
+    }
+    if (!error.empty()) return discard(error);
+    
+    std::sort(entries.begin(), entries.end(), [](const RestartPack::Entry& a, const RestartPack::Entry& b) {
+        return a.path < b.path;
+    });
+    std::string index;
+    for (const auto& entry : entries)
+    {
+        appendLittleEndian(index, static_cast<std::uint8_t>(entry.type));
+        appendLittleEndian(index, static_cast<std::uint8_t>(entry.codec));
+        appendLittleEndian(index, static_cast<std::uint16_t>(0));
+        appendLittleEndian(index, entry.mode);
+        appendLittleEndian(index, entry.mtime_sec);
+        appendLittleEndian(index, entry.mtime_nsec);
+        appendLittleEndian(index, entry.crc);
+        appendLittleEndian(index, entry.offset);
+        appendLittleEndian(index, entry.stored_size);
+        appendLittleEndian(index, entry.size);
+        appendLittleEndian(index, static_cast<std::uint32_t>(entry.path.size()));
+        index.append(entry.path);
+    }
+    std::string footer;
+    appendLittleEndian(footer, offset);
+    appendLittleEndian(footer, static_cast<std::uint64_t>(index.size()));
+    appendLittleEndian(footer, static_cast<std::uint64_t>(entries.size()));
+    appendLittleEndian(footer, ~updateCrc32c(0xFFFFFFFFu, index.data(), index.size()));
+    appendLittleEndian(footer, static_cast<std::uint32_t>(0));
+    footer.append(PACK_FOOTER_MAGIC, sizeof(PACK_FOOTER_MAGIC));
+    
+    err = writeAll(pack_fd, index.data(), index.size());
+    if (err == 0) err = writeAll(pack_fd, footer.data(), footer.size());
+    if (err == 0 && ::fsync(pack_fd) != 0) err = errno;
+    if (err != 0) return discard("cannot write " + tmp_name + ": " + errnoString(err));
+    ::close(pack_fd);
+    
+    if (::renameat2(base_fd, tmp_name.c_str(), base_fd, pack_name.c_str(), RENAME_NOREPLACE) != 0)
+    {
+        const std::string rename_error = errnoString(errno);
+        ::unlinkat(base_fd, tmp_name.c_str(), 0);
+        return "cannot create " + pack_name + ": " + rename_error;
+    }
+    ::fsync(base_fd);
+    pack_bytes = offset + index.size() + footer.size();
+    
+    // Read everything back before the directory may go
+    try
+    {
+        const RestartPack pack((fs::path(base_path) / pack_name).string());
+        for (const auto& entry : pack.getEntries())
+        {
+            pack.readEntry(entry);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        ::unlinkat(base_fd, pack_name.c_str(), 0);
+        return std::string("verification failed: ") + e.what();
+    }
+    return std::string();
+}
+
+/*!
+ * \brief Lists and shares identical files of restart directories on a worker pool.
+ *
+ * Every restart directory is listed by its own task.  Every share() call is
+ * one task that compares both files byte by byte and then makes the
+ * destination share the data of the source: with FICLONE if the file system
+ * supports it, otherwise, if allowed, by renaming a new hard link to the
+ * source over the destination.
+ */
+class ParallelFileSharer
+{
+public:
+    struct File
+    {
+        std::size_t dir;
+        std::string path;
+        struct statx stx;
+    };
+
+    struct Result
+    {
+        bool shared = false;
+        bool reflinked = false;
+        std::uintmax_t bytes = 0;
+        struct statx stx = {};
+        std::string error;
+    };
+
+    ParallelFileSharer(RestartWorkerPool& pool, bool allow_hard_links)
+        : d_pool(pool), d_allow_hard_links(allow_hard_links)
+    {
+    }
+
+    /*!
+     * \brief Schedule listing the regular files below \p root, for restart directory \p dir.
+     */
+    void list(std::size_t dir, std::shared_ptr<SharedFd> root)
+    {
+        submit([this, dir, root]() {
+            std::vector<File> files;
+            std::string error;
+            listDir(dir, root->fd, "", files, error);
+            std::lock_guard<std::mutex> lock(d_mutex);
+            d_files.insert(d_files.end(), std::make_move_iterator(files.begin()), std::make_move_iterator(files.end()));
+            if (!error.empty()) d_list_errors.push_back(error);
+        });
+    }
+
+    /*!
+     * \brief Schedule making \p dst share the data of \p src.  Returns an id for getResult().
+     */
+    std::size_t share(std::shared_ptr<SharedFd> src_root,
+                      const File& src,
+                      std::shared_ptr<SharedFd> dst_root,
+                      const File& dst)
+    {
+        const std::size_t id = d_results.size();
+        d_results.push_back(std::make_unique<Result>());
+        Result* result = d_results.back().get();
+        submit([this, result, src_root, src, dst_root, dst]() {
+            shareFile(*result, src_root->fd, src, dst_root->fd, dst);
+        });
+        return id;
+    }
+
+    /*!
+     * \brief Block until all scheduled tasks are done.
+     */
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(d_mutex);
+        d_cv.wait(lock, [this]() { return d_outstanding == 0; });
+    }
+
+    std::vector<File>& getFiles()
+    {
+        return d_files;
+    }
+
+    const std::vector<std::string>& getListErrors() const
+    {
+        return d_list_errors;
+    }
+
+    const Result& getResult(std::size_t id) const
+    {
+        return *d_results[id];
+    }
+
+private:
+    void submit(std::function<void()> task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(d_mutex);
+            ++d_outstanding;
+        }
+        d_pool.submit([this, task]() {
+            task();
+            std::lock_guard<std::mutex> lock(d_mutex);
+            if (--d_outstanding == 0) d_cv.notify_all();
+        });
+    }
+
+    static void listDir(std::size_t dir, int fd, const std::string& prefix, std::vector<File>& files, std::string& error)
+    {
+        const int err = forEachDirEntry(fd, [&](const LinuxDirent64& entry) {
+            if (entry.d_type != DT_DIR && entry.d_type != DT_REG && entry.d_type != DT_UNKNOWN) return;
+            File file{ dir, prefix + entry.d_name, {} };
+            if (::statx(fd, entry.d_name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                        STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID | STATX_NLINK | STATX_INO | STATX_SIZE |
+                            STATX_MTIME | STATX_BLOCKS,
+                        &file.stx) != 0)
+            {
+                if (errno != ENOENT && error.empty()) error = "cannot stat " + file.path + ": " + errnoString(errno);
+                return;
+            }
+            if (S_ISREG(file.stx.stx_mode))
+            {
+                if (!endsWith(entry.d_name, DEDUP_LINK_SUFFIX)) files.push_back(std::move(file));
+                return;
+            }
+            if (!S_ISDIR(file.stx.stx_mode)) return;
+            const int child_fd = ::openat(fd, entry.d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child_fd < 0)
+            {
+                if (error.empty()) error = "cannot open " + file.path + ": " + errnoString(errno);
+                return;
+            }
+            listDir(dir, child_fd, file.path + "/", files, error);
+            ::close(child_fd);
+        });
+        if (err != 0 && error.empty()) error = "cannot read " + (prefix.empty() ? "." : prefix) + ": " + errnoString(err);
+    }
+
+    static bool endsWith(const char* name, const char* suffix)
+    {
+        const std::size_t length = std::strlen(name);
+        const std::size_t suffix_length = std::strlen(suffix);
+        return length >= suffix_length && std::strcmp(name + length - suffix_length, suffix) == 0;
+    }
+
+    /*!
+     * \brief Compare the contents of two open files.
+     *
+     * \return 0 on success or an errno value
+     */
+    static int compareFiles(int fd_a, int fd_b, bool& equal)
+    {
+        std::vector<char> buffer_a(CHECKSUM_BLOCK_SIZE);
+        std::vector<char> buffer_b(CHECKSUM_BLOCK_SIZE);
+        off_t offset = 0;
+        equal = false;
+        for (;;)
+        {
+            const ssize_t read_a = ::pread(fd_a, buffer_a.data(), buffer_a.size(), offset);
+            if (read_a < 0 && errno == EINTR) continue;
+            if (read_a < 0) return errno;
+            std::size_t read_b = 0;
+            while (read_b < static_cast<std::size_t>(read_a))
+            {
+                const ssize_t n = ::pread(fd_b, buffer_b.data() + read_b, read_a - read_b, offset + read_b);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) return errno;
+                if (n == 0) return 0;
+                read_b += static_cast<std::size_t>(n);
+            }
+            if (std::memcmp(buffer_a.data(), buffer_b.data(), read_b) != 0) return 0;
+            if (read_a == 0)
+            {
+                // Both files end here unless the second one is longer
+                char byte;
+                const ssize_t n = ::pread(fd_b, &byte, 1, offset);
+                if (n < 0) return errno;
+                equal = n == 0;
+                return 0;
+            }
+            offset += read_a;
+        }
+    }
+
+    void shareFile(Result& result, int src_root_fd, const File& src, int dst_root_fd, const File& dst)
+    {
+        const int src_fd = ::openat(src_root_fd, src.path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (src_fd < 0)
+        {
+            result.error = "cannot open " + src.path + ": " + errnoString(errno);
+            return;
+        }
+        const bool try_reflink = !d_reflink_unsupported.load();
+        const int dst_fd =
+            ::openat(dst_root_fd, dst.path.c_str(), (try_reflink ? O_RDWR : O_RDONLY) | O_NOFOLLOW | O_CLOEXEC);
+        if (dst_fd < 0)
+        {
+            result.error = "cannot open " + dst.path + ": " + errnoString(errno);
+            ::close(src_fd);
+            return;
+        }
+        
+        // Both files must still be the ones listed and must be identical
+        struct statx src_stx;
+        struct statx dst_stx;
+        bool equal = false;
+        int err = 0;
+        if (::statx(src_fd, "", AT_EMPTY_PATH, STATX_INO | STATX_SIZE | STATX_MTIME, &src_stx) != 0 ||
+            ::statx(dst_fd, "", AT_EMPTY_PATH, STATX_INO | STATX_SIZE | STATX_MTIME | STATX_NLINK | STATX_BLOCKS,
+                    &dst_stx) != 0)
+        {
+            err = errno;
+        }
+        else if (src_stx.stx_ino == src.stx.stx_ino && dst_stx.stx_ino == dst.stx.stx_ino &&
+                 src_stx.stx_size == src.stx.stx_size && dst_stx.stx_size == dst.stx.stx_size &&
+                 src_stx.stx_mtime.tv_sec == src.stx.stx_mtime.tv_sec &&
+                 src_stx.stx_mtime.tv_nsec == src.stx.stx_mtime.tv_nsec &&
+                 dst_stx.stx_mtime.tv_sec == dst.stx.stx_mtime.tv_sec &&
+                 dst_stx.stx_mtime.tv_nsec == dst.stx.stx_mtime.tv_nsec)
+        {
+            err = compareFiles(src_fd, dst_fd, equal);
+        }
+        if (err != 0 || !equal)
+        {
+            if (err != 0) result.error = "cannot compare " + dst.path + ": " + errnoString(err);
+            ::close(src_fd);
+            ::close(dst_fd);
+            return;
+        }
+        const std::uintmax_t bytes = static_cast<std::uintmax_t>(dst_stx.stx_blocks) * 512;
+        
+        if (try_reflink)
+        {
+            if (::ioctl(dst_fd, FICLONE, src_fd) == 0)
+            {
+                // Restore the modification time, so that the copy looks untouched
+                const struct timespec times[2] = { { 0, UTIME_OMIT },
+                                                   { dst_stx.stx_mtime.tv_sec, dst_stx.stx_mtime.tv_nsec } };
+                ::futimens(dst_fd, times);
+                ::statx(dst_fd, "", AT_EMPTY_PATH, STATX_INO | STATX_SIZE | STATX_MTIME, &result.stx);
+                result.shared = true;
+                result.reflinked = true;
+                result.bytes = bytes;
+                ::close(src_fd);
+                ::close(dst_fd);
+                return;
+            }
+            if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EXDEV || errno == EINVAL)
+            {
+                d_reflink_unsupported = true;
+            }
+            else
+            {
+                result.error = "cannot reflink " + dst.path + ": " + errnoString(errno);
+            }
+        }
+        ::close(src_fd);
+        ::close(dst_fd);
+        if (!result.error.empty() || !d_allow_hard_links) return;
+        
+        // A hard link shares mode and owner as well
+        if (src.stx.stx_mode != dst.stx.stx_mode || src.stx.stx_uid != dst.stx.stx_uid ||
+            src.stx.stx_gid != dst.stx.stx_gid)
+        {
+            return;
+        }
+        const std::string tmp_path = dst.path + DEDUP_LINK_SUFFIX;
+        ::unlinkat(dst_root_fd, tmp_path.c_str(), 0);
+        if (::linkat(src_root_fd, src.path.c_str(), dst_root_fd, tmp_path.c_str(), 0) != 0)
+        {
+            // A file system without hard links, or an inode with too many, keeps its copies
+            if (errno != EMLINK && errno != EPERM && errno != EOPNOTSUPP)
+            {
+                result.error = "cannot link " + dst.path + ": " + errnoString(errno);
+            }
+            return;
+        }
+        if (::renameat(dst_root_fd, tmp_path.c_str(), dst_root_fd, dst.path.c_str()) != 0)
+        {
+            result.error = "cannot replace " + dst.path + ": " + errnoString(errno);
+            ::unlinkat(dst_root_fd, tmp_path.c_str(), 0);
+            return;
+        }
+        result.shared = true;
+        result.bytes = dst_stx.stx_nlink <= 1 ? bytes : 0;
+        result.stx = src_stx;
+    }
+
+    RestartWorkerPool& d_pool;
+    const bool d_allow_hard_links;
+    std::atomic<bool> d_reflink_unsupported{ false };
+    std::vector<File> d_files;
+    std::vector<std::string> d_list_errors;
+    std::vector<std::unique_ptr<Result>> d_results;
+    std::mutex d_mutex;
+    std::condition_variable d_cv;
+    std::size_t d_outstanding = 0;
+};
+
+/*!
+ * \brief Rank of a file named with a numeric suffix ("samrai.00003", "patch.00003"), or -1.
+ */
+int
+fileRank(std::string_view name)
+{
+    const std::size_t dot = name.rfind('.');
+    if (dot == std::string_view::npos || dot + 1 == name.size() || name.size() - dot - 1 > 9) return -1;
+    int rank = 0;
+    for (char c : name.substr(dot + 1))
+    {
+        if (c < '0' || c > '9') return -1;
+        rank = rank * 10 + (c - '0');
+    }
+    return rank;
+}
+
+/*!
+ * \brief Append "<prefix><path>\n" of every file below \p dir_fd that has a
+ * rank suffix to parts[rank % parts.size()].
+ *
+ * \return 0 on success or the first errno value; unlisted files are left alone
+ */
+int
+collectRankFiles(int dir_fd, const std::string& prefix, std::vector<std::string>& parts)
+{
+    int first_error = 0;
+    const int err = forEachDirEntry(dir_fd, [&](const LinuxDirent64& entry) {
+        bool is_dir = entry.d_type == DT_DIR;
+        if (entry.d_type == DT_UNKNOWN)
+        {
+            struct stat st;
+            is_dir = ::fstatat(dir_fd, entry.d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (is_dir)
+        {
+            const int child_fd = ::openat(dir_fd, entry.d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child_fd < 0)
+            {
+                if (first_error == 0) first_error = errno;
+                return;
+            }
+            const int child_error = collectRankFiles(child_fd, prefix + entry.d_name + "/", parts);
+            ::close(child_fd);
+            if (first_error == 0) first_error = child_error;
+            return;
+        }
+        const int rank = fileRank(entry.d_name);
+        if (rank < 0 || std::strchr(entry.d_name, '\n')) return;
+        std::string& part = parts[static_cast<std::size_t>(rank) % parts.size()];
+        part += prefix;
+        part += entry.d_name;
+        part += '\n';
+    });
+    return err != 0 ? err : first_error;
+}
+
+/*!
+ * \brief Restarts of a base directory as recorded in its binary catalog
+ * (CATALOG_FILENAME).
+ *
+ * The file holds a header, one fixed-size record per restart and the names
+ * the records refer to.  The header has the magic number, the number of
+ * records, the size of the names, the length of the name pattern (stored
+ * first among the names), the inode, modification time and link count of
+ * the base directory the listing was read from, the time the catalog was
+ * written and a CRC32C of everything else.  A record has the iteration,
+ * state, checksum status, flags, the offset and length of the name, and
+ * the inode, modification time, number of files and bytes of the
+ * directory.  Times are in nanoseconds.
+ *
+ * The file is rewritten in place and never shrinks: rewriting does not
+ * change the base directory, and a reader that maps it cannot fault.  A
+ * reader that catches a write half done fails the checksum and falls back
+ * to the file system.
+ */
+struct RestartCatalog
+{
+    enum class State : std::uint8_t
+    {
+        LIVE,
+        TOMBSTONED,
+        DELETED,
+        PACKED
+    };
+
+    enum class Checksum : std::uint8_t
+    {
+        UNKNOWN,
+        VERIFIED,
+        FAILED
+    };
+
+    /*
+     * size_known is set once files and bytes were measured at mtime_ns;
+     * completed once mtime_ns was read while a newer restart existed, so
+     * that it is the completion time of the restart.
+     */
+    struct Entry
+    {
+        std::string name;
+        int iteration = 0;
+        State state = State::LIVE;
+        Checksum checksum = Checksum::UNKNOWN;
+        bool size_known = false;
+        bool completed = false;
+        std::uint64_t inode = 0;
+        std::int64_t mtime_ns = -1;
+        std::uint64_t files = 0;
+        std::uint64_t bytes = 0;
+    };
+
+    std::string pattern;
+    std::uint64_t base_inode = 0;
+    std::int64_t base_mtime_ns = -1;
+    std::uint64_t base_nlink = 0;
+    std::int64_t written_ns = 0;
+    std::vector<Entry> entries;
+
+    /*!
+     * \brief Map and read the catalog of the base directory \p base_fd.
+     *
+     * \return Whether a valid catalog was read
+     */
+    bool load(int base_fd)
+    {
+        const int fd = ::openat(base_fd, CATALOG_FILENAME, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return false;
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < CATALOG_HEADER_SIZE)
+        {
+            ::close(fd);
+            return false;
+        }
+        const std::size_t size = static_cast<std::size_t>(st.st_size);
+        void* data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) return false;
+        const bool valid = parse(static_cast<const char*>(data), size);
+        ::munmap(data, size);
+        if (!valid) entries.clear();
+        return valid;
+    }
+
+    /*!
+     * \brief Write the catalog into the base directory \p base_fd.
+     *
+     * \return 0 on success or an errno value
+     */
+    int store(int base_fd) const
+    {
+        std::string records;
+        std::string names = pattern;
+        records.reserve(entries.size() * CATALOG_RECORD_SIZE);
+        for (const Entry& entry : entries)
+        {
+            appendLittleEndian<std::int32_t>(records, entry.iteration);
+            appendLittleEndian<std::uint8_t>(records, static_cast<std::uint8_t>(entry.state));
+            appendLittleEndian<std::uint8_t>(records, static_cast<std::uint8_t>(entry.checksum));
+            appendLittleEndian<std::uint8_t>(records, (entry.size_known ? 1 : 0) | (entry.completed ? 2 : 0));
+            appendLittleEndian<std::uint8_t>(records, 0);
+            appendLittleEndian<std::uint32_t>(records, static_cast<std::uint32_t>(names.size()));
+            appendLittleEndian<std::uint32_t>(records, static_cast<std::uint32_t>(entry.name.size()));
+            appendLittleEndian<std::uint64_t>(records, entry.inode);
+            appendLittleEndian<std::int64_t>(records, entry.mtime_ns);
+            appendLittleEndian<std::uint64_t>(records, entry.files);
+            appendLittleEndian<std::uint64_t>(records, entry.bytes);
+            names += entry.name;
+        }
+        
+        std::string data(CATALOG_MAGIC, sizeof(CATALOG_MAGIC));
+        appendLittleEndian<std::uint32_t>(data, static_cast<std::uint32_t>(entries.size()));
+        appendLittleEndian<std::uint32_t>(data, static_cast<std::uint32_t>(names.size()));
+        appendLittleEndian<std::uint64_t>(data, base_inode);
+        appendLittleEndian<std::int64_t>(data, base_mtime_ns);
+        appendLittleEndian<std::uint64_t>(data, base_nlink);
+        appendLittleEndian<std::int64_t>(data, written_ns);
+        appendLittleEndian<std::uint32_t>(data, static_cast<std::uint32_t>(pattern.size()));
+        appendLittleEndian<std::uint32_t>(data, 0);
+        appendLittleEndian<std::uint32_t>(data, 0);
+        std::uint32_t crc = updateCrc32c(0xFFFFFFFFu, data.data(), data.size());
+        crc = updateCrc32c(crc, records.data(), records.size());
+        crc = updateCrc32c(crc, names.data(), names.size());
+        appendLittleEndian<std::uint32_t>(data, ~crc);
+        data += records;
+        data += names;
+        
+        const int fd = ::openat(base_fd, CATALOG_FILENAME, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) return errno;
+        const int err = writeAll(fd, data.data(), data.size());
+        ::close(fd);
+        return err;
+    }
+
+    /*!
+     * \brief Record \p st as the base directory the listing was read from,
+     * starting at \p read_ns, which must be taken before \p st.
+     */
+    void setBase(const struct stat& st, std::int64_t read_ns)
+    {
+        base_inode = st.st_ino;
+        base_mtime_ns = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        base_nlink = st.st_nlink;
+        written_ns = read_ns;
+    }
+
+    /*!
+     * \brief Whether the listing is that of the base directory \p st, read
+     * long enough after its last change to rule out a change it missed.
+     */
+    bool describes(const struct stat& st) const
+    {
+        const std::int64_t mtime_ns = static_cast<std::int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+        return base_inode == st.st_ino && base_mtime_ns == mtime_ns && base_nlink == st.st_nlink &&
+               written_ns - mtime_ns >= CATALOG_SETTLE_NS;
+    }
+
+    /*!
+     * \brief Positions of the live entries by name; invalidated by changes to \p entries.
+     */
+    std::unordered_map<std::string_view, std::size_t> getLiveEntries() const
+    {
+        std::unordered_map<std::string_view, std::size_t> live;
+        for (std::size_t i = 0; i < entries.size(); ++i)
+        {
+            if (entries[i].state == State::LIVE) live.emplace(entries[i].name, i);
+        }
+        return live;
+    }
+
+    /*!
+     * \brief Live entry for the directory \p name with inode \p inode, or nullptr.
+     */
+    Entry* findLive(const std::unordered_map<std::string_view, std::size_t>& live,
+                    std::string_view name,
+                    std::uint64_t inode)
+    {
+        const auto it = live.find(name);
+        if (it == live.end() || inode == 0 || entries[it->second].inode != inode) return nullptr;
+        return &entries[it->second];
+    }
+
+private:
+    bool parse(const char* data, std::size_t size)
+    {
+        std::uint32_t num_records, names_size, pattern_size, crc;
+        num_records = loadLittleEndian<std::uint32_t>(data + 8);
+        names_size = loadLittleEndian<std::uint32_t>(data + 12);
+        base_inode = loadLittleEndian<std::uint64_t>(data + 16);
+        base_mtime_ns = loadLittleEndian<std::int64_t>(data + 24);
+        base_nlink = loadLittleEndian<std::uint64_t>(data + 32);
+        written_ns = loadLittleEndian<std::int64_t>(data + 40);
+        pattern_size = loadLittleEndian<std::uint32_t>(data + 48);
+        crc = loadLittleEndian<std::uint32_t>(data + 60);
+        if (std::memcmp(data, CATALOG_MAGIC, sizeof(CATALOG_MAGIC)) != 0) return false;
+        const std::uint64_t body_size = std::uint64_t(num_records) * CATALOG_RECORD_SIZE + names_size;
+        if (body_size > size - CATALOG_HEADER_SIZE || pattern_size > names_size) return false;
+        std::uint32_t check = updateCrc32c(0xFFFFFFFFu, data, 60);
+        check = updateCrc32c(check, data + CATALOG_HEADER_SIZE, body_size);
+        if (~check != crc) return false;
+        
+        const char* names = data + CATALOG_HEADER_SIZE + std::uint64_t(num_records) * CATALOG_RECORD_SIZE;
+        pattern.assign(names, pattern_size);
+        entries.resize(num_records);
+        for (std::uint32_t i = 0; i < num_records; ++i)
+        {
+            const char* record = data + CATALOG_HEADER_SIZE + std::uint64_t(i) * CATALOG_RECORD_SIZE;
+            Entry& entry = entries[i];
+            std::int32_t iteration;
+            std::uint32_t name_offset, name_length;
+            iteration = loadLittleEndian<std::int32_t>(record);
+            name_offset = loadLittleEndian<std::uint32_t>(record + 8);
+            name_length = loadLittleEndian<std::uint32_t>(record + 12);
+            entry.inode = loadLittleEndian<std::uint64_t>(record + 16);
+            entry.mtime_ns = loadLittleEndian<std::int64_t>(record + 24);
+            entry.files = loadLittleEndian<std::uint64_t>(record + 32);
+            entry.bytes = loadLittleEndian<std::uint64_t>(record + 40);
+            const auto state = static_cast<std::uint8_t>(record[4]);
+            const auto checksum = static_cast<std::uint8_t>(record[5]);
+            const auto flags = static_cast<std::uint8_t>(record[6]);
+            if (state > 3 || checksum > 2 || name_offset > names_size || name_length > names_size - name_offset)
+            {
+                return false;
+            }
+            entry.iteration = iteration;
+            entry.state = static_cast<State>(state);
+            entry.checksum = static_cast<Checksum>(checksum);
+            entry.size_known = (flags & 1) != 0;
+            entry.completed = (flags & 2) != 0;
+            entry.name.assign(names + name_offset, name_length);
+        }
+        return true;
+    }
+};
+
+/*!
+ * \brief Apply \p update to the catalog of the base directory \p base_fd and
+ * write it back if \p update returns true.
+ *
+ * The listing and its base directory identity are written back unchanged,
+ * so a stale listing stays stale.
+ */
+template <class Update>
+void
+updateCatalog(int base_fd, Update&& update)
+{
+    RestartCatalog catalog;
+    if (catalog.load(base_fd) && update(catalog)) catalog.store(base_fd);
+}
+
+} // namespace
+
+/////////////////////////////// RestartCleaner::RunStats /////////////////////
+
+struct RestartCleaner::RunStats
+{
+    IoCounters counters;
+    CleanupReport report;
+    
+    void addDirectory(const DirectoryReport& directory)
+    {
+        report.directories.push_back(directory);
+        if (!directory.error.empty()) report.errors.push_back(directory.name + ": " + directory.error);
+    }
+    
+    void copySyscalls()
+    {
+        report.syscalls.open = counters.open;
+        report.syscalls.getdents = counters.getdents;
+        report.syscalls.stat = counters.stat;
+        report.syscalls.unlink = counters.unlink;
+        report.syscalls.rmdir = counters.rmdir;
+        report.syscalls.rename = counters.rename;
+    }
+};
+
+/////////////////////////////// RestartCleaner::BaseLock /////////////////////
+
+struct RestartCleaner::BaseLock
+{
+    ~BaseLock()
+    {
+        // Closing the last descriptor of the open file description releases the lock
+        if (fd >= 0) ::close(fd);
+    }
+
+    int fd = -1;
+    bool held = false;
+};
+
+/////////////////////////////// RestartCleaner::PendingRemoval ///////////////
+
+struct RestartCleaner::PendingRemoval
+{
+    PendingRemoval(RestartWorkerPool& pool, int fd, std::shared_ptr<std::atomic<bool>> cancel,
+                   std::shared_ptr<RunStats> run_stats, std::unique_ptr<DeletionThrottle> deletion_throttle)
+        : base_fd(fd),
+          stats(std::move(run_stats)),
+          throttle(std::move(deletion_throttle)),
+          remover(pool, fd, std::move(cancel), stats ? &stats->counters : nullptr, throttle.get())
+    {
+    }
+
+    ~PendingRemoval()
+    {
+        // The workers use base_fd until the removal is complete
+        remover.wait();
+        ::close(base_fd);
+    }
+
+    void add(const fs::path& dir_path)
+    {
+        dirs.push_back(dir_path);
+        ids.push_back(remover.remove(dir_path.filename().string()));
+    }
+
+    const int base_fd;
+    const std::shared_ptr<RunStats> stats;
+    const std::unique_ptr<DeletionThrottle> throttle;
+    ParallelTreeRemover remover;
+    std::vector<fs::path> dirs;
+    std::vector<std::size_t> ids;
+};
+
+/////////////////////////////// RestartIndex /////////////////////////////////
+
+void RestartIndex::addEntry(int iteration, std::string_view name, std::uint64_t inode)
+{
+    d_entries.push_back(
+        { iteration, static_cast<std::uint32_t>(d_names.size()), static_cast<std::uint32_t>(name.size()), inode });
+    d_names.append(name);
+}
+
+void RestartIndex::sortByIteration()
+{
+    std::sort(d_entries.begin(), d_entries.end(), [](const Entry& a, const Entry& b) {
+        return a.iteration < b.iteration;
+    });
+    std::sort(d_packed.begin(), d_packed.end());
+}
+
+void RestartIndex::removeNames(const std::vector<std::string>& names)
+{
+    if (names.empty()) return;
+
+    const std::unordered_set<std::string_view> removed(names.begin(), names.end());
+    RestartIndex kept;
+    kept.d_entries.reserve(d_entries.size());
+    kept.d_names.reserve(d_names.size());
+    for (std::size_t i = 0; i < d_entries.size(); ++i)
+    {
+        if (removed.count(getName(i)) == 0) kept.addEntry(getIteration(i), getName(i), getInode(i));
+    }
+    kept.d_packed = std::move(d_packed);
+    *this = std::move(kept);
+}
+
+std::vector<int> RestartIndex::getIterations() const
+{
+    std::vector<int> iterations;
+    iterations.reserve(d_entries.size());
+    for (const auto& entry : d_entries)
+    {
+        iterations.push_back(entry.iteration);
+    }
+    return iterations;
+}
+
+void RestartIndex::addPack(int iteration)
+{
+    d_packed.push_back(iteration);
+}
+
+/////////////////////////////// RestartPack //////////////////////////////////
+
+RestartPack::RestartPack(const std::string& path) : d_path(path)
+{
+    const auto corrupt = [&path](const std::string& reason) {
+        return std::runtime_error("RestartCleaner: Invalid pack " + path + ": " + reason);
+    };
+    
+    const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || ::fstat(fd, &st) != 0)
+    {
+        const int err = errno;
+        if (fd >= 0) ::close(fd);
+        throw std::runtime_error("RestartCleaner: Cannot open pack " + path + ": " + errnoString(err));
+    }
+    d_size = static_cast<std::size_t>(st.st_size);
+    if (d_size < sizeof(PACK_MAGIC) + PACK_FOOTER_SIZE)
+    {
+        ::close(fd);
+        throw corrupt("too short");
+    }
+    void* data = ::mmap(nullptr, d_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) throw std::runtime_error("RestartCleaner: Cannot map pack " + path + ": " + errnoString(errno));
+    d_data = static_cast<const char*>(data);
+    
+    try
+    {
+        const char* footer = d_data + d_size - PACK_FOOTER_SIZE;
+        std::uint64_t index_offset, index_size, num_entries;
+        std::uint32_t index_crc;
+        index_offset = loadLittleEndian<std::uint64_t>(footer);
+        index_size = loadLittleEndian<std::uint64_t>(footer + 8);
+        num_entries = loadLittleEndian<std::uint64_t>(footer + 16);
+        index_crc = loadLittleEndian<std::uint32_t>(footer + 24);
+        if (std::memcmp(d_data, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0 ||
+            std::memcmp(footer + 32, PACK_FOOTER_MAGIC, sizeof(PACK_FOOTER_MAGIC)) != 0)
+        {
+            throw corrupt("bad magic");
+        }
+        if (index_offset < sizeof(PACK_MAGIC) || index_offset + index_size != d_size - PACK_FOOTER_SIZE)
+        {
+            throw corrupt("bad index location");
+        }
+        const char* index = d_data + index_offset;
+        if (~updateCrc32c(0xFFFFFFFFu, index, index_size) != index_crc) throw corrupt("index checksum mismatch");
+        d_data_end = index_offset;
+        
+        std::size_t pos = 0;
+        const auto read = [&](auto& value) {
+            if (pos + sizeof(value) > index_size) throw corrupt("truncated index");
+            value = loadLittleEndian<std::remove_reference_t<decltype(value)>>(index + pos);
+            pos += sizeof(value);
+        };
+        d_entries.reserve(std::min<std::uint64_t>(num_entries, index_size / 56));
+        std::unordered_set<std::string> directories;
+        for (std::uint64_t i = 0; i < num_entries; ++i)
+        {
+            Entry entry;
+            std::uint8_t type, codec;
+            std::uint16_t reserved;
+            std::uint32_t path_length;
+            read(type);
+            read(codec);
+            read(reserved);
+            read(entry.mode);
+            read(entry.mtime_sec);
+            read(entry.mtime_nsec);
+            read(entry.crc);
+            read(entry.offset);
+            read(entry.stored_size);
+            read(entry.size);
+            read(path_length);
+            if (pos + path_length > index_size) throw corrupt("truncated index");
+            entry.path.assign(index + pos, path_length);
+            pos += path_length;
+            
+            entry.type = static_cast<EntryType>(type);
+            entry.codec = static_cast<Codec>(codec);
+            if (type > 2 || codec > 2) throw corrupt("unknown entry type or codec");
+            if (entry.offset > d_data_end || entry.stored_size > d_data_end - entry.offset)
+            {
+                throw corrupt("entry " + entry.path + " lies outside the data");
+            }
+            
+            // Paths must stay inside the directory the pack is unpacked into
+            const fs::path entry_path(entry.path);
+            if (entry.path.empty() || entry_path.is_absolute() ||
+                std::any_of(entry_path.begin(), entry_path.end(), [](const fs::path& part) {
+                    return part == ".." || part == "." || part.empty();
+                }))
+            {
+                throw corrupt("bad path " + entry.path);
+            }
+            
+            // Parents must be directory entries, never symbolic links, so
+            // that unpacking cannot follow a link out of the destination
+            const std::string parent = entry_path.parent_path().string();
+            if (!parent.empty() && directories.count(parent) == 0)
+            {
+                throw corrupt("parent of " + entry.path + " is not a directory");
+            }
+            if (entry.type == EntryType::DIRECTORY) directories.insert(entry.path);
+            if (!d_entries.empty() && !(d_entries.back().path < entry.path)) throw corrupt("index is not sorted");
+            d_entries.push_back(std::move(entry));
+        }
+    }
+    catch (...)
+    {
+        ::munmap(const_cast<char*>(d_data), d_size);
+        throw;
+    }
+}
+
+RestartPack::~RestartPack()
+{
+    ::munmap(const_cast<char*>(d_data), d_size);
+}
+
+const RestartPack::Entry* RestartPack::findEntry(std::string_view path) const
+{
+    const auto it = std::lower_bound(d_entries.begin(), d_entries.end(), path, [](const Entry& entry, std::string_view p) {
+        return entry.path < p;
+    });
+    return it != d_entries.end() && it->path == path ? &*it : nullptr;
+}
+
+std::string RestartPack::readEntry(const Entry& entry) const
+{
+    std::string data;
+    if (entry.type == EntryType::DIRECTORY) return data;
+    
+    data.resize(entry.size);
+    const std::string error = decompressBlob(entry.codec, d_data + entry.offset, entry.stored_size, data);
+    if (!error.empty())
+    {
+        throw std::runtime_error("RestartCleaner: Cannot read " + entry.path + " from " + d_path + ": " + error);
+    }
+    if (data.size() != entry.size || ~updateCrc32c(0xFFFFFFFFu, data.data(), data.size()) != entry.crc)
+    {
+        throw std::runtime_error("RestartCleaner: Checksum mismatch for " + entry.path + " in " + d_path);
+    }
+    return data;
+}
+
+std::string RestartPack::readFile(std::string_view path) const
+{
+    const Entry* entry = findEntry(path);
+    if (!entry || entry->type != EntryType::FILE)
+    {
+        throw std::runtime_error("RestartCleaner: No file " + std::string(path) + " in " + d_path);
+    }
+    return readEntry(*entry);
+}
+
+void RestartPack::unpack(const std::string& dest_dir) const
+{
+    const auto fail = [&](const std::string& what, int err) {
+        return std::runtime_error("RestartCleaner: Cannot unpack " + d_path + ": " + what + ": " + errnoString(err));
+    };
+    if (::mkdir(dest_dir.c_str(), 0755) != 0) throw fail(dest_dir, errno);
+    const int dest_fd = ::open(dest_dir.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dest_fd < 0) throw fail(dest_dir, errno);
+    const SharedFd dest(dest_fd);
+    
+    // Every entry is created relative to its parent, which is opened one
+    // component at a time without following symbolic links, so that nothing
+    // is written outside dest_dir even if the tree changes meanwhile
+    const auto open_dir = [&](const fs::path& path) {
+        int fd = ::openat(dest.fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        for (const auto& part : path)
+        {
+            if (fd < 0) break;
+            const int next = ::openat(fd, part.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            const int err = errno;
+            ::close(fd);
+            errno = err;
+            fd = next;
+        }
+        if (fd < 0) throw fail((fs::path(dest_dir) / path).string(), errno);
+        return std::make_shared<SharedFd>(fd);
+    };
+    fs::path parent_path;
+    std::shared_ptr<SharedFd> parent = open_dir(parent_path);
+    
+    // Parents sort before their children; directories are finished last so
+    // that creating their entries does not change their times
+    for (const auto& entry : d_entries)
+    {
+        const fs::path path(entry.path);
+        if (path.parent_path() != parent_path)
+        {
+            parent_path = path.parent_path();
+            parent = open_dir(parent_path);
+        }
+        const std::string name = path.filename().string();
+        const std::string what = (fs::path(dest_dir) / path).string();
+        if (entry.type == EntryType::DIRECTORY)
+        {
+            if (::mkdirat(parent->fd, name.c_str(), entry.mode | S_IRWXU) != 0) throw fail(what, errno);
+            continue;
+        }
+        const std::string data = readEntry(entry);
+        if (entry.type == EntryType::SYMLINK)
+        {
+            if (::symlinkat(data.c_str(), parent->fd, name.c_str()) != 0) throw fail(what, errno);
+            continue;
+        }
+        const int fd = ::openat(parent->fd, name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+                                S_IRUSR | S_IWUSR);
+        if (fd < 0) throw fail(what, errno);
+        const struct timespec times[2] = { { 0, UTIME_OMIT }, { entry.mtime_sec, entry.mtime_nsec } };
+        int err = writeAll(fd, data.data(), data.size());
+        if (err == 0 && (::fchmod(fd, entry.mode) != 0 || ::futimens(fd, times) != 0)) err = errno;
+        ::close(fd);
+        if (err != 0) throw fail(what, err);
+    }
+    for (auto it = d_entries.rbegin(); it != d_entries.rend(); ++it)
+    {
+        if (it->type != EntryType::DIRECTORY) continue;
+        const std::shared_ptr<SharedFd> dir = open_dir(it->path);
+        const struct timespec times[2] = { { 0, UTIME_OMIT }, { it->mtime_sec, it->mtime_nsec } };
+        if (::fchmod(dir->fd, it->mode) != 0 || ::futimens(dir->fd, times) != 0)
+        {
+            throw fail((fs::path(dest_dir) / it->path).string(), errno);
+        }
+    }
+}
+
+bool RestartPack::isCodecSupported(Codec codec)
+{
+    switch (codec)
+    {
+    case Codec::NONE:
+        return true;
+    case Codec::ZSTD:
+#if defined(RESTART_CLEANER_WITH_ZSTD)
+        return true;
+#else
+        return false;
+#endif
+    case Codec::LZ4:
+#if defined(RESTART_CLEANER_WITH_LZ4)
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+/////////////////////////////// RestartThreadCommunicator ////////////////////
+
+struct RestartThreadCommunicator::Group
+{
+    explicit Group(int num_ranks) : size(num_ranks), slots(num_ranks)
+    {
+    }
+
+    const int size;
+    std::mutex mutex;
+    std::condition_variable cv;
+    int arrived = 0;
+    std::uint64_t generation = 0;
+    std::string data;
+    std::vector<std::string> slots;
+};
+
+std::vector<std::unique_ptr<RestartThreadCommunicator>> RestartThreadCommunicator::create(int size)
+{
+    if (size < 1) throw std::invalid_argument("RestartCleaner: A communicator needs at least one rank");
+    auto group = std::make_shared<Group>(size);
+    std::vector<std::unique_ptr<RestartThreadCommunicator>> comms;
+    for (int rank = 0; rank < size; ++rank)
+    {
+        comms.emplace_back(new RestartThreadCommunicator(group, rank));
+    }
+    return comms;
+}
+
+RestartThreadCommunicator::RestartThreadCommunicator(std::shared_ptr<Group> group, int rank)
+    : d_group(std::move(group)), d_rank(rank)
+{
+}
+
+int RestartThreadCommunicator::getSize() const
+{
+    return d_group->size;
+}
+
+void RestartThreadCommunicator::barrier()
+{
+    std::unique_lock<std::mutex> lock(d_group->mutex);
+    const std::uint64_t generation = d_group->generation;
+    if (++d_group->arrived == d_group->size)
+    {
+        d_group->arrived = 0;
+        ++d_group->generation;
+        d_group->cv.notify_all();
+        return;
+    }
+    d_group->cv.wait(lock, [&]() { return d_group->generation != generation; });
+}
+
+// Each collective writes the shared state, meets at a barrier, reads, and
+// meets again, so that the next collective cannot overwrite what is still read
+
+void RestartThreadCommunicator::broadcast(std::string& data, int root)
+{
+    if (d_rank == root)
+    {
+        std::lock_guard<std::mutex> lock(d_group->mutex);
+        d_group->data = data;
+    }
+    barrier();
+    if (d_rank != root)
+    {
+        std::lock_guard<std::mutex> lock(d_group->mutex);
+        data = d_group->data;
+    }
+    barrier();
+}
+
+std::string RestartThreadCommunicator::scatter(const std::vector<std::string>& parts, int root)
+{
+    if (d_rank == root)
+    {
+        std::lock_guard<std::mutex> lock(d_group->mutex);
+        for (int rank = 0; rank < d_group->size; ++rank)
+        {
+            d_group->slots[rank] = rank < static_cast<int>(parts.size()) ? parts[rank] : std::string();
+        }
+    }
+    barrier();
+    std::string part;
+    {
+        std::lock_guard<std::mutex> lock(d_group->mutex);
+        part = std::move(d_group->slots[d_rank]);
+    }
+    barrier();
+    return part;
+}
+
+std::vector<std::string> RestartThreadCommunicator::gather(const std::string& part, int root)
+{
+    {
+        std::lock_guard<std::mutex> lock(d_group->mutex);
+        d_group->slots[d_rank] = part;
+    }
+    barrier();
+    std::vector<std::string> parts;
+    if (d_rank == root)
+    {
+        std::lock_guard<std::mutex> lock(d_group->mutex);
+        parts = d_group->slots;
+    }
+    barrier();
+    return parts;
+}
+
+#if defined(RESTART_CLEANER_WITH_MPI)
+
+/////////////////////////////// RestartMPICommunicator ///////////////////////
+
+RestartMPICommunicator::RestartMPICommunicator(MPI_Comm comm) : d_comm(comm)
+{
+}
+
+int RestartMPICommunicator::getRank() const
+{
+    int rank = 0;
+    MPI_Comm_rank(d_comm, &rank);
+    return rank;
+}
+
+int RestartMPICommunicator::getSize() const
+{
+    int size = 1;
+    MPI_Comm_size(d_comm, &size);
+    return size;
+}
+
+void RestartMPICommunicator::barrier()
+{
+    MPI_Barrier(d_comm);
+}
+
+void RestartMPICommunicator::broadcast(std::string& data, int root)
+{
+    unsigned long long length = data.size();
+    MPI_Bcast(&length, 1, MPI_UNSIGNED_LONG_LONG, root, d_comm);
+    data.resize(length);
+    MPI_Bcast(&data[0], static_cast<int>(length), MPI_CHAR, root, d_comm);
+}
+
+std::string RestartMPICommunicator::scatter(const std::vector<std::string>& parts, int root)
+{
+    const bool is_root = getRank() == root;
+    std::vector<int> counts;
+    std::vector<int> displacements;
+    std::string buffer;
+    if (is_root)
+    {
+        for (int rank = 0; rank < getSize(); ++rank)
+        {
+            displacements.push_back(static_cast<int>(buffer.size()));
+            counts.push_back(static_cast<int>(parts[rank].size()));
+            buffer += parts[rank];
+        }
+    }
+    int count = 0;
+    MPI_Scatter(counts.data(), 1, MPI_INT, &count, 1, MPI_INT, root, d_comm);
+    std::string part(count, '\0');
+    MPI_Scatterv(buffer.data(), counts.data(), displacements.data(), MPI_CHAR, &part[0], count, MPI_CHAR, root,
+                 d_comm);
+    return part;
+}
+
+std::vector<std::string> RestartMPICommunicator::gather(const std::string& part, int root)
+{
+    const bool is_root = getRank() == root;
+    const int size = getSize();
+    int count = static_cast<int>(part.size());
+    std::vector<int> counts(is_root ? size : 0);
+    MPI_Gather(&count, 1, MPI_INT, counts.data(), 1, MPI_INT, root, d_comm);
+    std::vector<int> displacements(counts.size());
+    int total = 0;
+    for (std::size_t rank = 0; rank < counts.size(); ++rank)
+    {
+        displacements[rank] = total;
+        total += counts[rank];
+    }
+    std::string buffer(total, '\0');
+    MPI_Gatherv(part.data(), count, MPI_CHAR, &buffer[0], counts.data(), displacements.data(), MPI_CHAR, root,
+                d_comm);
+    std::vector<std::string> parts;
+    for (std::size_t rank = 0; rank < counts.size(); ++rank)
+    {
+        parts.push_back(buffer.substr(displacements[rank], counts[rank]));
+    }
+    return parts;
+}
+
+#endif
+
+/////////////////////////////// RestartNamePattern ///////////////////////////
+
+static_assert(matchIterationName<RestoreDirNames>("restore.000042") == 42);
+static_assert(matchIterationName<RestoreDirNames>("restore.1000000") == -1);
+static_assert(matchIterationName("restore.1000000", "restore.", 6, 0, "", false) == 1000000);
+static_assert(matchIterationName("restore.0000001", "restore.", 6, 0, "", false) == -1);
+static_assert(matchIterationName("restore.000042", "restore.", 6, 6, ".tar", true) == 42);
+static_assert(matchIterationName("restore.99999999999", "restore.", 1, 0, "", false) == -1);
+
+RestartNamePattern::RestartNamePattern() : RestartNamePattern("restore.{6}")
+{
+}
+
+RestartNamePattern::RestartNamePattern(const std::string& spec) : d_spec(spec)
+{
+    const auto invalid = [&spec](const std::string& reason) {
+        return std::invalid_argument("RestartCleaner: Invalid name pattern \"" + spec + "\": " + reason);
+    };
+    const auto is_plain = [](std::string_view text) {
+        return text.find_first_of("{}[]/") == std::string_view::npos;
+    };
+
+    const std::size_t open = spec.find('{');
+    const std::size_t close = spec.find('}', open);
+    if (open == std::string::npos || close == std::string::npos)
+    {
+        throw invalid("expected a digit field such as {6}, {6+} or {}");
+    }
+    d_prefix = spec.substr(0, open);
+    if (!is_plain(d_prefix)) throw invalid("unexpected character in prefix");
+
+    std::string field = spec.substr(open + 1, close - open - 1);
+    const bool open_ended = !field.empty() && field.back() == '+';
+    if (open_ended) field.pop_back();
+    if (field.empty())
+    {
+        if (open_ended) throw invalid("expected a digit count before +");
+        d_min_digits = 1;
+        d_max_digits = 0;
+    }
+    else
+    {
+        if (field.size() > 2 || field.find_first_not_of("0123456789") != std::string::npos || std::stoi(field) < 1 ||
+            std::stoi(field) > 10)
+        {
+            throw invalid("the digit count must be between 1 and 10");
+        }
+        d_min_digits = std::stoi(field);
+        d_max_digits = open_ended ? 0 : d_min_digits;
+    }
+
+    std::string rest = spec.substr(close + 1);
+    if (rest.size() >= 2 && rest.front() == '[' && rest.back() == ']')
+    {
+        rest = rest.substr(1, rest.size() - 2);
+        d_optional_suffix = true;
+    }
+    if (!is_plain(rest)) throw invalid("unexpected character in suffix");
+    d_suffix = rest;
+
+    // Patterns with a compile-time matcher use it
+    const auto is = [this](auto names) {
+        using Names = decltype(names);
+        return d_prefix == Names::prefix && d_min_digits == Names::min_digits && d_max_digits == Names::max_digits &&
+               d_suffix == Names::suffix && d_optional_suffix == Names::optional_suffix;
+    };
+    if (is(RestoreDirNames()))
+    {
+        d_kind = Kind::RESTORE;
+    }
+    else if (is(VisItDumpNames()))
+    {
+        d_kind = Kind::VISIT_DUMP;
+    }
+    else if (is(LagDataNames()))
+    {
+        d_kind = Kind::LAG_DATA;
+    }
+}
+
+/////////////////////////////// RestartCleanupHandle /////////////////////////
+
+void RestartCleanupHandle::wait() const
+{
+    if (d_future.valid()) d_future.get();
+}
+
+void RestartCleanupHandle::cancel() const
+{
+    if (d_cancel) d_cancel->store(true);
+}
+
+bool RestartCleanupHandle::isDone() const
+{
+    return !d_future.valid() || d_future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+/////////////////////////////// RestartWorkerPool ////////////////////////////
+
+RestartWorkerPool::RestartWorkerPool(int num_threads)
+{
+    if (num_threads <= 0)
+    {
+        throw std::invalid_argument("RestartWorkerPool: num_threads must be positive");
+    }
+
+    // One queue per worker plus the shared queue for outside submitters
+    for (int i = 0; i <= num_threads; ++i)
+    {
+        d_queues.push_back(std::make_unique<TaskQueue>());
+    }
+    d_workers.reserve(num_threads);
+    for (int i = 0; i < num_threads; ++i)
+    {
+        d_workers.emplace_back(&RestartWorkerPool::workerLoop, this, static_cast<std::size_t>(i));
+    }
+}
+
+RestartWorkerPool::~RestartWorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(d_mutex);
+        d_shutdown = true;
+    }
+    d_cv.notify_all();
+    for (auto& worker : d_workers)
+    {
+        worker.join();
+    }
+}
+
+void RestartWorkerPool::submit(std::function<void()> task)
+{
+    const std::size_t queue_index = t_current_pool == this ? t_worker_index : d_workers.size();
+    {
+        TaskQueue& queue = *d_queues[queue_index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        queue.tasks.push_back(std::move(task));
+    }
+    {
+        // Counted under d_mutex so that a worker going to sleep cannot miss it
+        std::lock_guard<std::mutex> lock(d_mutex);
+        ++d_num_queued;
+    }
+    d_cv.notify_one();
+}
+
+int RestartWorkerPool::getNumThreads() const
+{
+    return static_cast<int>(d_workers.size());
+}
+
+void RestartWorkerPool::workerLoop(std::size_t worker_index)
+{
+    t_current_pool = this;
+    t_worker_index = worker_index;
+    for (;;)
+    {
+        std::function<void()> task;
+        if (takeTask(worker_index, task))
+        {
+            task();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(d_mutex);
+        d_cv.wait(lock, [this]() { return d_shutdown || d_num_queued > 0; });
+        if (d_shutdown && d_num_queued == 0) return;
+    }
+}
+
+bool RestartWorkerPool::takeTask(std::size_t worker_index, std::function<void()>& task)
+{
+    const std::size_t num_queues = d_queues.size();
+    for (std::size_t k = 0; k < num_queues; ++k)
+    {
+        // Own queue first (newest task), then the shared queue, then steal
+        // the oldest task of the other workers, starting with the neighbour.
+        const std::size_t queue_index = k == 0 ? worker_index : k == 1 ? num_queues - 1 : (worker_index + k - 1) % (num_queues - 1);
+
+        TaskQueue& queue = *d_queues[queue_index];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) continue;
+        if (k == 0)
+        {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        else
+        {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+
+        std::lock_guard<std::mutex> count_lock(d_mutex);
+        --d_num_queued;
+        return true;
+    }
+    return false;
+}
+
+/////////////////////////////// PUBLIC ///////////////////////////////////////
+
+RestartCleaner::RestartCleaner(const std::string& restart_base_path,
+                               int keep_restart_count,
+                               const std::string& strategy,
+                               bool dry_run)
+    : d_restart_base_path(restart_base_path),
+      d_strategy(parseStrategy(strategy)),
+      d_keep_restart_count(keep_restart_count),
+      d_dry_run(dry_run),
+      d_num_jobs(std::max(1, static_cast<int>(std::thread::hardware_concurrency()))),
+      d_retention_tiers({ { 10, keep_restart_count }, { 100, 0 } })
+{
+    if (keep_restart_count <= 0)
+    {
+        throw std::invalid_argument("RestartCleaner: keep_restart_count must be positive");
+    }
+    
+    if (!fs::exists(restart_base_path))
+    {
+        throw std::invalid_argument("RestartCleaner: restart_base_path does not exist: " + restart_base_path);
+    }
+}
+
+RestartCleaner::~RestartCleaner()
+{
+    if (d_async_thread.joinable()) d_async_thread.join();
+    waitForReaper();
+}
+
+RestartCleaner::CleanupReport RestartCleaner::cleanup()
+{
+    std::cout << "RestartCleaner: Starting cleanup of " << d_restart_base_path << std::endl;
+    std::cout << "Keeping " << d_keep_restart_count << " most recent restart directories" << std::endl;
+    
+    RunControl control;
+    control.stats = std::make_shared<RunStats>();
+    CleanupReport& report = control.stats->report;
+    initReport(report);
+    
+    const auto start = std::chrono::steady_clock::now();
+    executeStrategy(control);
+    report.total_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    control.stats->copySyscalls();
+    return report;
+}
+
+RestartCleaner::CleanupPlan RestartCleaner::plan() const
+{
+    std::cout << "RestartCleaner: Planning cleanup of " << d_restart_base_path << std::endl;
+    
+    RunControl control;
+    control.stats = std::make_shared<RunStats>();
+    CleanupReport& report = control.stats->report;
+    initReport(report);
+    const CleanupSelection selection = selectVictims(control);
+    
+    CleanupPlan plan;
+    plan.base_path = d_restart_base_path;
+    plan.strategy = report.strategy;
+    plan.action = report.action;
+    plan.keep_restart_count = d_keep_restart_count;
+    plan.created = static_cast<std::int64_t>(std::time(nullptr));
+    plan.num_found = selection.num_managed;
+    if (selection.victims.empty()) return plan;
+    
+    // Measure the victims only, unless the strategy already measured everything
+    const int base_fd = ::open(d_restart_base_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (base_fd < 0)
+    {
+        throw std::runtime_error("RestartCleaner: Error opening " + d_restart_base_path + ": " + errnoString(errno));
+    }
+    std::vector<TreeSize> sizes(selection.victims.size());
+    if (!selection.sizes.empty())
+    {
+        for (std::size_t k = 0; k < selection.victims.size(); ++k)
+        {
+            sizes[k] = selection.sizes[selection.victims[k]];
+        }
+    }
+    else
+    {
+        const std::shared_ptr<RestartWorkerPool> pool = getWorkerPool();
+        ParallelTreeSizer sizer(*pool, base_fd);
+        for (std::size_t victim : selection.victims)
+        {
+            sizer.measure(std::string(selection.index.getName(victim)));
+        }
+        sizer.wait();
+        for (std::size_t k = 0; k < selection.victims.size(); ++k)
+        {
+            sizes[k] = sizer.getSize(k);
+            const std::string error = sizer.getError(k);
+            if (!error.empty())
+            {
+                std::cerr << "  Error measuring " << selection.index.getName(selection.victims[k]) << ": " << error
+                          << std::endl;
+            }
+        }
+    }
+    
+    for (std::size_t k = 0; k < selection.victims.size(); ++k)
+    {
+        const std::size_t victim = selection.victims[k];
+        PlannedDirectory directory;
+        directory.name = std::string(selection.index.getName(victim));
+        directory.iteration = selection.index.getIteration(victim);
+        directory.mtime_ns = getDirIdentity(base_fd, directory.name, directory.inode);
+        directory.entries = sizes[k].files;
+        directory.bytes = sizes[k].bytes;
+        plan.total_entries += directory.entries;
+        plan.total_bytes += directory.bytes;
+        plan.directories.push_back(std::move(directory));
+    }
+    ::close(base_fd);
+    
+    plan.seconds_per_entry = getUnlinkCost(plan.cost_source);
+    plan.predicted_seconds = static_cast<double>(plan.total_entries) * plan.seconds_per_entry;
+    if (d_rate_limits.unlinks_per_second > 0.0)
+    {
+        plan.predicted_seconds =
+            std::max(plan.predicted_seconds, static_cast<double>(plan.total_entries) / d_rate_limits.unlinks_per_second);
+    }
+    if (d_rate_limits.bytes_per_second > 0.0)
+    {
+        plan.predicted_seconds =
+            std::max(plan.predicted_seconds, static_cast<double>(plan.total_bytes) / d_rate_limits.bytes_per_second);
+    }
+    
+    std::cout << "Plan: " << plan.directories.size() << " restart directories, " << plan.total_entries
+              << " entries, " << formatBytes(plan.total_bytes) << " to free, about " << plan.predicted_seconds
+              << " s to delete (" << (plan.cost_source == "MEASURED" ? "measured" : "default") << " "
+              << plan.seconds_per_entry * 1e6 << " us per entry)" << std::endl;
+    return plan;
+}
+
+RestartCleaner::CleanupReport RestartCleaner::execute(const CleanupPlan& plan)
+{
+    std::error_code ec;
+    if (!fs::equivalent(plan.base_path, d_restart_base_path, ec))
+    {
+        throw std::invalid_argument("RestartCleaner: The plan is for " + plan.base_path + ", not " +
+                                    d_restart_base_path);
+    }
+    std::cout << "RestartCleaner: Executing the plan for " << d_restart_base_path << " made "
+              << formatDuration(std::max<std::int64_t>(0, std::time(nullptr) - plan.created)) << " ago" << std::endl;
+    
+    RunControl control;
+    control.stats = std::make_shared<RunStats>();
+    CleanupReport& report = control.stats->report;
+    initReport(report);
+    const auto start = std::chrono::steady_clock::now();
+    
+    const std::unique_ptr<BaseLock> lock = lockBasePath();
+    if (lock && !lock->held)
+    {
+        std::cout << "RestartCleaner: Another process is cleaning up " << d_restart_base_path << ", skipping"
+                  << std::endl;
+        report.skipped = true;
+        return report;
+    }
+    
+    // Match the planned directories against a fresh scan
+    CleanupSelection selection;
+    selection.index = scanRestartIndex(control.stats.get());
+    const RestartIndex& index = selection.index;
+    selection.num_managed = index.size();
+    std::unordered_map<std::string_view, std::size_t> positions;
+    for (std::size_t i = 0; i < index.size(); ++i)
+    {
+        positions[index.getName(i)] = i;
+    }
+    selection.sizes.resize(index.size());
+    const std::unordered_set<int> pins = loadPins();
+    const int base_fd = ::open(d_restart_base_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (base_fd < 0)
+    {
+        throw std::runtime_error("RestartCleaner: Error opening " + d_restart_base_path + ": " + errnoString(errno));
+    }
+    
+    // Pinned restarts do not count towards keep_restart_count, as in
+    // selectVictimsFromIndex()
+    std::size_t num_pinned = 0;
+    for (std::size_t i = 0; i < index.size(); ++i)
+    {
+        if (pins.count(index.getIteration(i)) > 0 ||
+            (d_pin_markers && hasPinMarker(base_fd, index.getName(i))))
+        {
+            ++num_pinned;
+        }
+    }
+    for (const auto& directory : plan.directories)
+    {
+        const auto it = positions.find(directory.name);
+        if (it == positions.end())
+        {
+            std::cout << "  Skipping " << directory.name << ": no longer exists" << std::endl;
+            continue;
+        }
+        
+        if (pins.count(directory.iteration) > 0 ||
+            (d_pin_markers && hasPinMarker(base_fd, directory.name)))
+        {
+            std::cout << "  Skipping " << directory.name << ": pinned since planned" << std::endl;
+            continue;
+        }
+        
+        // Inode numbers of deleted directories are reused quickly, so the
+        // modification time has to match as well
+        std::uint64_t inode = 0;
+        const std::int64_t mtime_ns = getDirIdentity(base_fd, directory.name, inode);
+        if (inode != directory.inode || mtime_ns != directory.mtime_ns)
+        {
+            std::cout << "  Skipping " << directory.name << ": replaced since planned" << std::endl;
+            continue;
+        }
+        selection.victims.push_back(it->second);
+        selection.sizes[it->second].bytes = directory.bytes;
+        selection.sizes[it->second].files = directory.entries;
+    }
+    ::close(base_fd);
+    std::sort(selection.victims.begin(), selection.victims.end());
+    while (!selection.victims.empty() &&
+           static_cast<int>(index.size() - num_pinned - selection.victims.size()) < d_keep_restart_count)
+    {
+        std::cout << "  Keeping " << index.getName(selection.victims.back()) << " to keep " << d_keep_restart_count
+                  << " restart directories" << std::endl;
+        selection.victims.pop_back();
+    }
+    
+    report.num_found = plan.num_found;
+    report.num_pinned = num_pinned;
+    report.num_selected = selection.victims.size();
+    std::cout << "Deleting " << selection.victims.size() << " of " << plan.directories.size()
+              << " planned restart directories" << std::endl;
+    deleteRestartDirs(selection, control);
+    report.total_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    
+    control.stats->copySyscalls();
+    return report;
+}
+
+void RestartCleaner::initReport(CleanupReport& report) const
+{
+    report.base_path = d_restart_base_path;
+    report.dry_run = d_dry_run;
+    report.tombstones = d_use_tombstones;
+    report.partition_index = d_partition_index;
+    report.partition_count = d_partition_count;
+    switch (d_action)
+    {
+    case VictimAction::DELETE:
+        report.action = "DELETE";
+        break;
+    case VictimAction::MIGRATE:
+        report.action = "MIGRATE";
+        break;
+    case VictimAction::PACK:
+        report.action = "PACK";
+        break;
+    }
+    report.archive_path = d_archive_path;
+    switch (d_strategy)
+    {
+    case CleanupStrategy::KEEP_RECENT_N:
+        report.strategy = "KEEP_RECENT_N";
+        break;
+    case CleanupStrategy::SMART_RETENTION:
+        report.strategy = "SMART_RETENTION";
+        break;
+    case CleanupStrategy::MAX_BYTES:
+        report.strategy = "MAX_BYTES";
+        break;
+    case CleanupStrategy::TIME_BASED:
+        report.strategy = "TIME_BASED";
+        break;
+    }
+    report.engine = getEngineName();
+}
+
+RestartCleaner::CleanupReport RestartCleaner::cleanupDistributed(RestartCommunicator& comm)
+{
+    const int rank = comm.getRank();
+    RunControl control;
+    control.stats = std::make_shared<RunStats>();
+    CleanupReport& report = control.stats->report;
+    initReport(report);
+    report.engine = "DISTRIBUTED";
+    const auto start = std::chrono::steady_clock::now();
+    
+    // Rank 0 plans and tells the other ranks how to go on:
+    // "UNLINK|LOCAL <found> <selected>", "SKIP" or "ERROR <message>"
+    std::unique_ptr<BaseLock> lock;
+    CleanupSelection selection;
+    std::vector<std::string> parts(comm.getSize());
+    std::string outcome;
+    if (rank == 0)
+    {
+        std::cout << "RestartCleaner: Starting distributed cleanup of " << d_restart_base_path << " on "
+                  << comm.getSize() << " ranks" << std::endl;
+        try
+        {
+            lock = lockBasePath();
+            if (lock && !lock->held)
+            {
+                std::cout << "RestartCleaner: Another process is cleaning up " << d_restart_base_path << ", skipping"
+                          << std::endl;
+                outcome = "SKIP";
+            }
+            else
+            {
+                selection = selectVictims(control);
+                const bool local = d_dry_run || d_use_tombstones || d_action != VictimAction::DELETE ||
+                                   selection.victims.empty() || comm.getSize() == 1;
+                if (!local)
+                {
+                    const int base_fd = ::open(d_restart_base_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                    if (base_fd < 0) throw std::runtime_error("RestartCleaner: Error opening " + d_restart_base_path);
+                    SharedFd base(base_fd);
+                    for (std::size_t victim : selection.victims)
+                    {
+                        const std::string name(selection.index.getName(victim));
+                        const int dir_fd = ::openat(base.fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                        const int err = dir_fd < 0 ? errno : collectRankFiles(dir_fd, name + "/", parts);
+                        if (dir_fd >= 0) ::close(dir_fd);
+                        
+                        // Whatever is not listed is removed by rank 0 afterwards
+                        if (err != 0) std::cerr << "  Warning: cannot list " << name << ": " << errnoString(err) << std::endl;
+                    }
+                }
+                outcome = std::string(local ? "LOCAL " : "UNLINK ") + std::to_string(report.num_found) + " " +
+                          std::to_string(report.num_selected);
+            }
+        }
+        catch (const std::exception& e)
+        {
+            outcome = std::string("ERROR ") + e.what();
+        }
+    }
+    comm.broadcast(outcome, 0);
+    
+    if (outcome == "SKIP")
+    {
+        report.skipped = true;
+        return report;
+    }
+    if (outcome.compare(0, 6, "ERROR ") == 0)
+    {
+        if (rank == 0) throw std::runtime_error(outcome.substr(6));
+        throw std::runtime_error("RestartCleaner: Rank 0 could not plan the distributed cleanup: " + outcome.substr(6));
+    }
+    std::istringstream fields(outcome);
+    std::string mode;
+    fields >> mode >> report.num_found >> report.num_selected;
+    
+    if (mode == "UNLINK")
+    {
+        const std::string mine = comm.scatter(parts, 0);
+        std::uintmax_t num_unlinked = 0;
+        std::string error;
+        const int base_fd = ::open(d_restart_base_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (base_fd < 0)
+        {
+            error = "cannot open " + d_restart_base_path + ": " + errnoString(errno);
+        }
+        else
+        {
+            std::istringstream paths(mine);
+            std::string path;
+            while (std::getline(paths, path))
+            {
+                ++control.stats->counters.unlink;
+                if (::unlinkat(base_fd, path.c_str(), 0) == 0)
+                {
+                    ++num_unlinked;
+                }
+                else if (errno != ENOENT && error.empty())
+                {
+                    error = "cannot unlink " + path + ": " + errnoString(errno);
+                }
+            }
+            ::close(base_fd);
+        }
+        report.entries_unlinked = num_unlinked;
+        if (!error.empty()) report.errors.push_back("rank " + std::to_string(rank) + ": " + error);
+        
+        // Gathering the counts is also the barrier before rank 0 removes the directories
+        const std::vector<std::string> results = comm.gather(std::to_string(num_unlinked) + " " + error, 0);
+        for (std::size_t other = 1; other < results.size(); ++other)
+        {
+            std::istringstream result(results[other]);
+            std::uintmax_t count = 0;
+            result >> count;
+            std::string other_error;
+            std::getline(result >> std::ws, other_error);
+            report.entries_unlinked += count;
+            if (!other_error.empty()) report.errors.push_back("rank " + std::to_string(other) + ": " + other_error);
+        }
+        if (rank == 0)
+        {
+            std::cout << "  " << report.entries_unlinked << " per-rank files unlinked by " << comm.getSize()
+                      << " ranks" << std::endl;
+        }
+    }
+    
+    // No rank returns before the old directories are gone
+    std::exception_ptr failure;
+    if (rank == 0)
+    {
+        try
+        {
+            deleteRestartDirs(selection, control);
+            if (d_dedup_mode != DedupMode::OFF && d_partition_index == 0) deduplicateRestartDirs(control);
+        }
+        catch (...)
+        {
+            failure = std::current_exception();
+        }
+    }
+    comm.barrier();
+    if (failure) std::rethrow_exception(failure);
+    
+    report.total_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    control.stats->copySyscalls();
+    return report;
+}
+
+RestartCleanupHandle RestartCleaner::cleanupAsync(int protected_iteration)
+{
+    if (d_async_thread.joinable()) d_async_thread.join();
+
+    RunControl control;
+    control.iteration_limit = protected_iteration;
+    control.cancel = std::make_shared<std::atomic<bool>>(false);
+
+    auto promise = std::make_shared<std::promise<void>>();
+    RestartCleanupHandle handle;
+    handle.d_future = promise->get_future().share();
+    handle.d_cancel = control.cancel;
+
+    d_async_thread = std::thread([this, control, promise]() {
+        try
+        {
+            setIdleIoPriority();
+            std::cout << "RestartCleaner: Starting background cleanup of " << d_restart_base_path << std::endl;
+            executeStrategy(control);
+            promise->set_value();
+        }
+        catch (...)
+        {
+            promise->set_exception(std::current_exception());
+        }
+    });
+    return handle;
+}
+
+RestartCleaner::BatchSummary RestartCleaner::cleanupBatch(const std::vector<RestartCleaner*>& cleaners)
+{
+    struct Run
+    {
+        RestartCleaner* cleaner;
+        CleanupSelection selection;
+        std::vector<fs::path> dirs;
+        std::shared_ptr<RestartWorkerPool> pool;
+        std::unique_ptr<PendingRemoval> removal;
+        std::unique_ptr<BaseLock> lock;
+        bool started = false;
+    };
+    
+    BatchSummary summary;
+    const RunControl control;
+    
+    // Scan and plan every run first; this only touches metadata of the base directories
+    std::vector<Run> runs;
+    runs.reserve(cleaners.size());
+    for (RestartCleaner* cleaner : cleaners)
+    {
+        std::cout << "RestartCleaner: Planning cleanup of " << cleaner->d_restart_base_path << std::endl;
+        Run run;
+        run.cleaner = cleaner;
+        try
+        {
+            // The lock is held until the end of the batch
+            run.lock = cleaner->lockBasePath();
+            if (run.lock && !run.lock->held)
+            {
+                std::cout << "  Another process is cleaning up " << cleaner->d_restart_base_path << ", skipping"
+                          << std::endl;
+                ++summary.num_skipped;
+                continue;
+            }
+            run.selection = cleaner->selectVictims(control);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "  Error: " << e.what() << std::endl;
+            ++summary.num_failed;
+            continue;
+        }
+        
+        for (std::size_t victim : run.selection.victims)
+        {
+            run.dirs.push_back(fs::path(cleaner->d_restart_base_path) / run.selection.index.getName(victim));
+        }
+        ++summary.num_runs;
+        summary.num_found += run.selection.num_managed;
+        summary.num_selected += run.dirs.size();
+        runs.push_back(std::move(run));
+    }
+    
+    // Submit the deletions of all parallel runs at once, so that the workers
+    // balance small and large runs against each other
+    for (auto& run : runs)
+    {
+        const RestartCleaner& cleaner = *run.cleaner;
+        if (run.dirs.empty() || cleaner.d_dry_run || cleaner.d_use_tombstones ||
+            cleaner.d_engine == DeletionEngine::SERIAL || cleaner.d_action != VictimAction::DELETE)
+        {
+            continue;
+        }
+        run.pool = cleaner.getWorkerPool();
+        run.removal = cleaner.startParallelRemoval(run.dirs, control, *run.pool);
+        run.started = true;
+        if (!run.removal) summary.num_failed += run.dirs.size();
+    }
+    
+    // Dry runs, serial runs, tombstone renames and migrations are handled
+    // while the parallel deletions proceed
+    for (auto& run : runs)
+    {
+        if (run.dirs.empty() || run.started) continue;
+        std::cout << "RestartCleaner: Results for " << run.cleaner->d_restart_base_path << std::endl;
+        if (run.cleaner->d_dry_run)
+        {
+            for (const auto& dir_path : run.dirs)
+            {
+                if (run.cleaner->d_action == VictimAction::MIGRATE)
+                {
+                    std::cout << "  DRY RUN: Would migrate " << dir_path << " to "
+                              << fs::path(run.cleaner->d_archive_path) << std::endl;
+                }
+                else if (run.cleaner->d_action == VictimAction::PACK)
+                {
+                    std::cout << "  DRY RUN: Would pack " << dir_path << std::endl;
+                }
+                else
+                {
+                    std::cout << "  DRY RUN: Would delete " << dir_path << std::endl;
+                }
+            }
+            continue;
+        }
+        const std::vector<std::string> removed = run.cleaner->removeRestartDirs(run.dirs, control);
+        run.cleaner->updateCachedIndex(removed);
+        summary.num_deleted += removed.size();
+        summary.num_failed += run.dirs.size() - removed.size();
+    }
+    
+    for (auto& run : runs)
+    {
+        if (!run.removal) continue;
+        std::cout << "RestartCleaner: Results for " << run.cleaner->d_restart_base_path << std::endl;
+        const std::vector<std::string> removed = run.cleaner->finishParallelRemoval(*run.removal);
+        run.cleaner->updateCachedIndex(removed);
+        summary.num_deleted += removed.size();
+        summary.num_failed += run.dirs.size() - removed.size();
+    }
+    
+    for (const auto& run : runs)
+    {
+        if (run.cleaner->d_dedup_mode == DedupMode::OFF || run.cleaner->d_partition_index != 0) continue;
+        try
+        {
+            run.cleaner->deduplicateRestartDirs(control);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "  Error: " << e.what() << std::endl;
+        }
+    }
+    
+    return summary;
+}
+
+std::vector<std::string> RestartCleaner::findRestartRoots(const std::string& root, const RestartNamePattern& pattern)
+{
+    std::error_code ec;
+    fs::recursive_directory_iterator it(root, fs::directory_options::skip_permission_denied, ec);
+    if (ec)
+    {
+        throw std::invalid_argument("RestartCleaner: Cannot read " + root + ": " + ec.message());
+    }
+    
+    std::unordered_set<std::string> roots;
+    for (const fs::recursive_directory_iterator end; it != end; it.increment(ec))
+    {
+        if (ec)
+        {
+            std::cerr << "RestartCleaner: Error scanning " << root << ": " << ec.message() << std::endl;
+            break;
+        }
+        
+        // Symbolic links are not descended into, but are listed as entries
+        if (it->is_symlink(ec) || !it->is_directory(ec)) continue;
+        if (pattern.match(it->path().filename().string()) >= 0)
+        {
+            roots.insert(it->path().parent_path().string());
+            it.disable_recursion_pending();
+        }
+    }
+    
+    std::vector<std::string> sorted_roots(roots.begin(), roots.end());
+    std::sort(sorted_roots.begin(), sorted_roots.end());
+    return sorted_roots;
+}
+
+std::vector<int> RestartCleaner::getAvailableIterations() const
+{
+    std::vector<int> iterations;
+    
+    try
+    {
+        const RestartIndex index = getRestartIndex();
+        iterations = index.getIterations();
+        
+        // A restart may be packed while a directory of the same iteration exists
+        const std::vector<int>& packed = index.getPackedIterations();
+        if (!packed.empty())
+        {
+            std::vector<int> merged;
+            std::set_union(iterations.begin(), iterations.end(), packed.begin(), packed.end(),
+                           std::back_inserter(merged));
+            merged.erase(std::unique(merged.begin(), merged.end()), merged.end());
+            iterations = std::move(merged);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "RestartCleaner: Error scanning directories: " << e.what() << std::endl;
+    }
+    
+    return iterations;
+}
+
+RestartIndex RestartCleaner::getRestartIndex() const
+{
+    // An index read within CATALOG_SETTLE_NS of the last change may have
+    // missed a change that left the modification time as it was, unless the
+    // last change was our own deletion
+    struct stat dir_stat;
+    if (::stat(d_restart_base_path.c_str(), &dir_stat) == 0)
+    {
+        const std::int64_t mtime_ns =
+            static_cast<std::int64_t>(dir_stat.st_mtim.tv_sec) * 1000000000 + dir_stat.st_mtim.tv_nsec;
+        std::lock_guard<std::mutex> lock(d_index_mutex);
+        if (d_cached_index_valid && dir_stat.st_mtim.tv_sec == d_cached_index_mtime.tv_sec &&
+            dir_stat.st_mtim.tv_nsec == d_cached_index_mtime.tv_nsec &&
+            (d_cached_index_after_delete || d_cached_index_read_ns - mtime_ns >= CATALOG_SETTLE_NS))
+        {
+            return d_cached_index;
+        }
+    }
+    return scanRestartIndex();
+}
+
+void RestartCleaner::setDeletionEngine(const std::string& engine)
+{
+    if (engine == "PARALLEL")
+    {
+        d_engine = DeletionEngine::PARALLEL;
+    }
+    else if (engine == "URING")
+    {
+        d_engine = DeletionEngine::URING;
+    }
+    else if (engine == "SERIAL")
+    {
+        if (d_rate_limits.unlinks_per_second > 0.0 || d_rate_limits.bytes_per_second > 0.0)
+        {
+            throw std::invalid_argument("RestartCleaner: Rate limits require the PARALLEL deletion engine");
+        }
+        d_engine = DeletionEngine::SERIAL;
+    }
+    else
+    {
+        throw std::invalid_argument("RestartCleaner: Unknown deletion engine: " + engine);
+    }
+}
+
+std::unordered_set<int> RestartCleaner::loadPins() const
+{
+    std::unordered_set<int> pins = d_pinned_iterations;
+    const fs::path pin_path = fs::path(d_restart_base_path) / PIN_LIST_FILENAME;
+    std::ifstream pin_file(pin_path);
+    std::string line;
+    while (std::getline(pin_file, line))
+    {
+        line = line.substr(0, line.find('#'));
+        const std::size_t begin = line.find_first_not_of(" \t");
+        if (begin == std::string::npos) continue;
+        line = line.substr(begin, line.find_last_not_of(" \t\r") + 1 - begin);
+        
+        // An iteration number, or a directory name
+        int iteration = -1;
+        if (line.find_first_not_of("0123456789") == std::string::npos && line.size() <= 9)
+        {
+            iteration = std::stoi(line);
+        }
+        else
+        {
+            iteration = d_name_pattern.match(line);
+        }
+        if (iteration < 0)
+        {
+            std::cerr << "  Warning: ignoring '" << line << "' in " << pin_path << std::endl;
+            continue;
+        }
+        pins.insert(iteration);
+    }
+    return pins;
+}
+
+std::string RestartCleaner::getEngineName() const
+{
+    switch (d_engine)
+    {
+    case DeletionEngine::SERIAL:
+        return "SERIAL";
+    case DeletionEngine::PARALLEL:
+        return "PARALLEL";
+    case DeletionEngine::URING:
+        return UringBatch::isSupported() ? "URING" : "PARALLEL";
+    }
+    return "PARALLEL";
+}
+
+void RestartCleaner::setUnlinkOrder(const std::string& order)
+{
+    if (order == "READDIR")
+    {
+        d_unlink_order = UnlinkOrder::READDIR;
+    }
+    else if (order == "INODE")
+    {
+        d_unlink_order = UnlinkOrder::INODE;
+    }
+    else if (order == "REVERSE")
+    {
+        d_unlink_order = UnlinkOrder::REVERSE;
+    }
+    else
+    {
+        throw std::invalid_argument("RestartCleaner: Unknown unlink order: " + order);
+    }
+}
+
+void RestartCleaner::setRateLimits(const RateLimits& limits)
+{
+    if (limits.unlinks_per_second < 0.0 || limits.bytes_per_second < 0.0)
+    {
+        throw std::invalid_argument("RestartCleaner: Rate limits must not be negative");
+    }
+    if (limits.adaptive && limits.unlinks_per_second == 0.0)
+    {
+        throw std::invalid_argument("RestartCleaner: Adaptive throttling needs an unlink rate to start from");
+    }
+    if (d_engine == DeletionEngine::SERIAL && (limits.unlinks_per_second > 0.0 || limits.bytes_per_second > 0.0))
+    {
+        throw std::invalid_argument("RestartCleaner: Rate limits require the PARALLEL deletion engine");
+    }
+    d_rate_limits = limits;
+}
+
+void RestartCleaner::setNumJobs(int num_jobs)
+{
+    if (num_jobs <= 0)
+    {
+        throw std::invalid_argument("RestartCleaner: num_jobs must be positive");
+    }
+    d_num_jobs = num_jobs;
+}
+
+void RestartCleaner::setWorkerPool(std::shared_ptr<RestartWorkerPool> pool)
+{
+    d_worker_pool = std::move(pool);
+}
+
+void RestartCleaner::setTombstoneDeletion(bool use_tombstones)
+{
+    if (use_tombstones && d_partition_count > 1)
+    {
+        throw std::invalid_argument("RestartCleaner: Tombstones cannot be combined with partitions");
+    }
+    d_use_tombstones = use_tombstones;
+}
+
+void RestartCleaner::setLocking(const std::string& mode)
+{
+    if (mode == "OFF")
+    {
+        d_lock_mode = LockMode::OFF;
+    }
+    else if (mode == "SKIP")
+    {
+        d_lock_mode = LockMode::SKIP;
+    }
+    else if (mode == "WAIT")
+    {
+        d_lock_mode = LockMode::WAIT;
+    }
+    else
+    {
+        throw std::invalid_argument("RestartCleaner: Unknown locking mode: " + mode);
+    }
+}
+
+void RestartCleaner::setPartition(int index, int count)
+{
+    if (count < 1 || index < 0 || index >= count)
+    {
+        throw std::invalid_argument("RestartCleaner: Partition index must be in [0, count) and count positive");
+    }
+    if (count > 1 && d_use_tombstones)
+    {
+        throw std::invalid_argument("RestartCleaner: Tombstones cannot be combined with partitions");
+    }
+    d_partition_index = index;
+    d_partition_count = count;
+}
+
+void RestartCleaner::waitForReaper() const
+{
+    std::unique_lock<std::mutex> lock(d_reaper_mutex);
+    d_reaper_cv.wait(lock, [this]() { return !d_reaper_running; });
+    if (d_reaper_thread.joinable()) d_reaper_thread.join();
+}
+
+void RestartCleaner::setVerification(const std::string& mode)
+{
+    if (mode == "OFF")
+    {
+        d_verify_mode = VerifyMode::OFF;
+    }
+    else if (mode == "INCREMENTAL")
+    {
+        d_verify_mode = VerifyMode::INCREMENTAL;
+    }
+    else if (mode == "FULL")
+    {
+        d_verify_mode = VerifyMode::FULL;
+    }
+    else
+    {
+        throw std::invalid_argument("RestartCleaner: Unknown verification mode: " + mode);
+    }
+}
+
+void RestartCleaner::setAction(const std::string& action, const std::string& archive_path)
+{
+    if (action == "DELETE")
+    {
+        d_action = VictimAction::DELETE;
+        d_archive_path.clear();
+    }
+    else if (action == "MIGRATE")
+    {
+        if (archive_path.empty())
+        {
+            throw std::invalid_argument("RestartCleaner: MIGRATE needs an archive path");
+        }
+        std::error_code ec;
+        if (fs::weakly_canonical(archive_path, ec) == fs::weakly_canonical(d_restart_base_path, ec))
+        {
+            throw std::invalid_argument("RestartCleaner: The archive path must differ from the restart base path");
+        }
+        d_action = VictimAction::MIGRATE;
+        d_archive_path = archive_path;
+    }
+    else if (action == "PACK")
+    {
+        if (!archive_path.empty())
+        {
+            throw std::invalid_argument("RestartCleaner: PACK writes the packs into the restart base path");
+        }
+        d_action = VictimAction::PACK;
+        d_archive_path.clear();
+    }
+    else
+    {
+        throw std::invalid_argument("RestartCleaner: Unknown action: " + action);
+    }
+}
+
+void RestartCleaner::setPackCompression(const std::string& codec)
+{
+    RestartPack::Codec pack_codec;
+    if (codec == "NONE")
+    {
+        pack_codec = RestartPack::Codec::NONE;
+    }
+    else if (codec == "ZSTD")
+    {
+        pack_codec = RestartPack::Codec::ZSTD;
+    }
+    else if (codec == "LZ4")
+    {
+        pack_codec = RestartPack::Codec::LZ4;
+    }
+    else
+    {
+        throw std::invalid_argument("RestartCleaner: Unknown pack compression: " + codec);
+    }
+    if (!RestartPack::isCodecSupported(pack_codec))
+    {
+        throw std::invalid_argument("RestartCleaner: Pack compression " + codec + " is not available in this build");
+    }
+    d_pack_codec = pack_codec;
+}
+
+void RestartCleaner::setDeduplication(const std::string& mode)
+{
+    if (mode == "OFF")
+    {
+        d_dedup_mode = DedupMode::OFF;
+    }
+    else if (mode == "AUTO")
+    {
+        d_dedup_mode = DedupMode::AUTO;
+    }
+    else if (mode == "REFLINK")
+    {
+        d_dedup_mode = DedupMode::REFLINK;
+    }
+    else
+    {
+        throw std::invalid_argument("RestartCleaner: Unknown deduplication mode: " + mode);
+    }
+}
+
+void RestartCleaner::setPinnedIterations(const std::vector<int>& iterations)
+{
+    for (int iteration : iterations)
+    {
+        if (iteration < 0)
+        {
+            throw std::invalid_argument("RestartCleaner: Pinned iterations must not be negative");
+        }
+    }
+    d_pinned_iterations = std::unordered_set<int>(iterations.begin(), iterations.end());
+}
+
+void RestartCleaner::setPinMarkers(bool use_markers)
+{
+    d_pin_markers = use_markers;
+}
+
+void RestartCleaner::setCatalog(const std::string& mode)
+{
+    if (mode == "ON")
+    {
+        d_catalog_mode = CatalogMode::ON;
+    }
+    else if (mode == "OFF")
+    {
+        d_catalog_mode = CatalogMode::OFF;
+    }
+    else if (mode == "REBUILD")
+    {
+        d_catalog_mode = CatalogMode::REBUILD;
+    }
+    else
+    {
+        throw std::invalid_argument("RestartCleaner: Unknown catalog mode: " + mode);
+    }
+    
+    // The cached index may have come from the catalog
+    std::lock_guard<std::mutex> lock(d_index_mutex);
+    d_cached_index_valid = false;
+}
+
+void RestartCleaner::setNamePattern(const RestartNamePattern& pattern)
+{
+    d_name_pattern = pattern;
+    std::lock_guard<std::mutex> lock(d_index_mutex);
+    d_cached_index_valid = false;
+}
+
+void RestartCleaner::setRetentionTiers(const std::vector<RetentionTier>& tiers)
+{
+    for (const auto& tier : tiers)
+    {
+        if (tier.stride <= 0 || tier.count < 0)
+        {
+            throw std::invalid_argument("RestartCleaner: retention tiers need a positive stride and a non-negative count");
+        }
+    }
+    d_retention_tiers = tiers;
+}
+
+void RestartCleaner::setMaxBytes(std::uintmax_t max_bytes)
+{
+    if (max_bytes == 0)
+    {
+        throw std::invalid_argument("RestartCleaner: max_bytes must be positive");
+    }
+    d_max_bytes = max_bytes;
+}
+
+void RestartCleaner::setTimeRetention(const TimeRetention& retention)
+{
+    if (retention.keep_all_seconds < 0 || retention.interval_seconds <= 0 || retention.max_age_seconds < 0)
+    {
+        throw std::invalid_argument("RestartCleaner: time retention needs a positive interval and non-negative windows");
+    }
+    if (retention.max_age_seconds != 0 && retention.max_age_seconds < retention.keep_all_seconds)
+    {
+        throw std::invalid_argument("RestartCleaner: the maximum age must not be shorter than the keep-all window");
+    }
+    d_time_retention = retention;
+}
+
+/////////////////////////////// PRIVATE //////////////////////////////////////
+
+RestartCleaner::CleanupStrategy RestartCleaner::parseStrategy(const std::string& strategy_str) const
+{
+    if (strategy_str == "KEEP_RECENT_N")
+    {
+        return CleanupStrategy::KEEP_RECENT_N;
+    }
+    if (strategy_str == "SMART_RETENTION")
+    {
+        return CleanupStrategy::SMART_RETENTION;
+    }
+    if (strategy_str == "MAX_BYTES")
+    {
+        return CleanupStrategy::MAX_BYTES;
+    }
+    if (strategy_str == "TIME_BASED")
+    {
+        return CleanupStrategy::TIME_BASED;
+    }
+    
+    throw std::invalid_argument("RestartCleaner: Unknown strategy: " + strategy_str);
+}
+
+void RestartCleaner::executeStrategy(const RunControl& control) const
+{
+    const std::unique_ptr<BaseLock> lock = lockBasePath();
+    if (lock && !lock->held)
+    {
+        std::cout << "RestartCleaner: Another process is cleaning up " << d_restart_base_path << ", skipping"
+                  << std::endl;
+        if (control.stats) control.stats->report.skipped = true;
+        return;
+    }
+    
+    // A current catalog lists the base directory without reading it, which
+    // beats streaming the scan
+    if (canStreamSelection() && !isCatalogCurrent())
+    {
+        streamKeepRecentN(control);
+    }
+    else
+    {
+        const CleanupSelection selection = selectVictims(control);
+        deleteRestartDirs(selection, control);
+    }
+    if (d_dedup_mode != DedupMode::OFF && d_partition_index == 0 && !control.isCancelled())
+    {
+        deduplicateRestartDirs(control);
+    }
+}
+
+bool RestartCleaner::canStreamSelection() const
+{
+    // Dry runs list, tombstones journal and migrations copy the complete
+    // victim set, and verification has to see every kept restart before
+    // anything is deleted
+    return d_strategy == CleanupStrategy::KEEP_RECENT_N && d_engine != DeletionEngine::SERIAL && !d_dry_run &&
+           !d_use_tombstones && d_verify_mode == VerifyMode::OFF && d_action == VictimAction::DELETE &&
+           d_partition_count == 1;
+}
+
+void RestartCleaner::streamKeepRecentN(const RunControl& control) const
+{
+    resumeTombstones();
+    
+    RunStats* stats = control.stats.get();
+    IoCounters* counters = stats ? &stats->counters : nullptr;
+    const auto scan_start = std::chrono::steady_clock::now();
+    
+    if (counters) ++counters->open;
+    const int dir_fd = ::open(d_restart_base_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0)
+    {
+        if (errno == ENOENT)
+        {
+            std::cout << "No restart directories found" << std::endl;
+            return;
+        }
+        throw std::runtime_error("RestartCleaner: Error scanning directory: " + d_restart_base_path + ": " +
+                                 errnoString(errno));
+    }
+    
+    const std::shared_ptr<RestartWorkerPool> pool = getWorkerPool();
+    std::unique_ptr<PendingRemoval> removal = startParallelRemoval({}, control, *pool);
+    if (!removal)
+    {
+        ::close(dir_fd);
+        return;
+    }
+    
+    // The newest managed directories seen so far. Every directory that has
+    // more than d_keep_restart_count newer ones is a victim, no matter what
+    // the rest of the scan finds, so it goes to the workers right away.
+    // Entries the file system fails to return can only make us keep more.
+    // Optional pattern suffixes let two directories share an iteration, so
+    // the kept ones are ordered by iteration and then name, like the index.
+    const fs::path base_path(d_restart_base_path);
+    const std::size_t keep_count = d_keep_restart_count;
+    std::map<std::pair<int, std::string>, std::uint64_t> kept;
+    std::vector<std::pair<int, std::pair<std::string, std::uint64_t>>> protected_dirs;
+    std::unordered_set<std::string> seen;
+    std::vector<int> packed;
+    std::size_t num_managed = 0;
+    std::size_t num_pinned = 0;
+    std::uintmax_t num_entries = 0;
+    const std::unordered_set<int> pins = loadPins();
+    
+    // The modification time before reading, for the catalog
+    const std::int64_t read_ns = getRealTimeNs();
+    struct stat dir_stat;
+    const bool have_stat = ::fstat(dir_fd, &dir_stat) == 0;
+    
+    const int err = forEachDirEntry(dir_fd, [&](const LinuxDirent64& entry) {
+        ++num_entries;
+        const std::string_view name(entry.d_name);
+        const int iter = d_name_pattern.match(name);
+        if (iter < 0)
+        {
+            const int pack_iter = packIteration(d_name_pattern, name);
+            if (pack_iter >= 0) packed.push_back(pack_iter);
+            return;
+        }
+        
+        bool is_dir = entry.d_type == DT_DIR;
+        if (entry.d_type == DT_UNKNOWN || entry.d_type == DT_LNK)
+        {
+            struct stat st;
+            if (counters) ++counters->stat;
+            is_dir = ::fstatat(dir_fd, entry.d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (!is_dir) return;
+        
+        // An entry returned twice by the file system must neither take a
+        // second slot nor be removed twice
+        if (!seen.emplace(name).second) return;
+        
+        if (!control.isManaged(iter))
+        {
+            protected_dirs.emplace_back(iter, std::make_pair(std::string(name), entry.d_ino));
+            return;
+        }
+        
+        // Pinned directories are kept like protected ones, outside the count
+        if (counters && d_pin_markers && pins.count(iter) == 0) ++counters->stat;
+        if (pins.count(iter) > 0 || (d_pin_markers && hasPinMarker(dir_fd, name)))
+        {
+            ++num_pinned;
+            protected_dirs.emplace_back(iter, std::make_pair(std::string(name), entry.d_ino));
+            return;
+        }
+        
+        ++num_managed;
+        std::pair<int, std::string> key(iter, name);
+        if (kept.size() < keep_count)
+        {
+            kept.emplace(std::move(key), entry.d_ino);
+        }
+        else if (key > kept.begin()->first)
+        {
+            removal->add(base_path / kept.begin()->first.second);
+            kept.erase(kept.begin());
+            kept.emplace(std::move(key), entry.d_ino);
+        }
+        else
+        {
+            removal->add(base_path / std::string(name));
+        }
+    }, counters);
+    const auto scan_end = std::chrono::steady_clock::now();
+    const std::size_t num_victims = removal->dirs.size();
+    
+    // What will be left is exactly the kept, protected and undeletable directories
+    RestartIndex index;
+    for (const auto& entry : kept)
+    {
+        index.addEntry(entry.first.first, entry.first.second, entry.second);
+    }
+    for (const auto& entry : protected_dirs)
+    {
+        index.addEntry(entry.first, entry.second.first, entry.second.second);
+    }
+    for (int iteration : packed)
+    {
+        index.addPack(iteration);
+    }
+    
+    // Without victims the scan saw the whole base directory as it stays, so
+    // it refreshes the catalog like any other scan
+    if (err == 0 && num_victims == 0 && have_stat && d_catalog_mode != CatalogMode::OFF)
+    {
+        storeCatalog(dir_fd, dir_stat, read_ns, index);
+    }
+    ::close(dir_fd);
+    
+    if (err == 0)
+    {
+        if (num_pinned > 0)
+        {
+            std::cout << "Keeping " << num_pinned << " pinned restart directories" << std::endl;
+        }
+        if (num_managed == 0)
+        {
+            std::cout << "No restart directories found" << std::endl;
+        }
+        else if (num_victims == 0)
+        {
+            std::cout << "Found " << num_managed << " restart directories" << std::endl;
+            std::cout << "No cleanup needed, keeping all " << num_managed << " directories" << std::endl;
+        }
+        else
+        {
+            std::cout << "Found " << num_managed << " restart directories" << std::endl;
+            std::cout << "Deleting " << num_victims << " old restart directories (keeping " << d_keep_restart_count
+                      << " most recent)" << std::endl;
+        }
+    }
+    
+    std::vector<std::string> removed = finishParallelRemoval(*removal);
+    if (stats)
+    {
+        CleanupReport& report = stats->report;
+        report.entries_scanned = num_entries;
+        report.num_found = num_managed;
+        report.num_selected = num_victims;
+        report.num_pinned = num_pinned;
+        report.num_deleted = removed.size();
+        report.scan_seconds = std::chrono::duration<double>(scan_end - scan_start).count();
+        report.delete_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - scan_end).count();
+        for (const auto& directory : report.directories)
+        {
+            report.entries_unlinked += directory.entries;
+        }
+        recordUnlinkCost(report);
+    }
+    
+    if (err != 0)
+    {
+        std::lock_guard<std::mutex> lock(d_index_mutex);
+        d_cached_index_valid = false;
+        throw std::runtime_error("RestartCleaner: Error scanning directory: " + d_restart_base_path + ": " +
+                                 errnoString(err));
+    }
+    
+    std::sort(removed.begin(), removed.end());
+    for (const auto& dir_path : removal->dirs)
+    {
+        const std::string name = dir_path.filename().string();
+        if (!std::binary_search(removed.begin(), removed.end(), name)) index.addEntry(d_name_pattern.match(name), name);
+    }
+    index.sortByIteration();
+    markCatalogRemoved(removed);
+    
+    const std::int64_t new_read_ns = getRealTimeNs();
+    const bool have_new_stat = ::stat(d_restart_base_path.c_str(), &dir_stat) == 0;
+    std::lock_guard<std::mutex> lock(d_index_mutex);
+    d_cached_index = std::move(index);
+    d_cached_index_valid = have_new_stat;
+    d_cached_index_read_ns = new_read_ns;
+    d_cached_index_after_delete = num_victims > 0;
+    if (have_new_stat) d_cached_index_mtime = dir_stat.st_mtim;
+}
+
+RestartCleaner::CleanupSelection RestartCleaner::selectVictims(const RunControl& control) const
+{
+    return selectVictimsFromIndex(scanRestartIndex(control.stats.get()), control);
+}
+
+RestartCleaner::CleanupSelection RestartCleaner::selectVictimsFromIndex(RestartIndex index_in,
+                                                                        const RunControl& control) const
+{
+    CleanupSelection selection;
+    
+    // Tombstones left behind by an interrupted process are reaped in the
+    // background while this cleanup proceeds
+    if (d_partition_index == 0) resumeTombstones();
+    
+    // The index is already parsed and sorted by iteration
+    selection.index = std::move(index_in);
+    const RestartIndex& index = selection.index;
+    const auto plan_start = std::chrono::steady_clock::now();
+    
+    // Protected iterations form a suffix of the sorted index
+    std::size_t num_managed = index.size();
+    while (num_managed > 0 && !control.isManaged(index.getIteration(num_managed - 1)))
+    {
+        --num_managed;
+    }
+    selection.num_managed = num_managed;
+    
+    if (control.stats) control.stats->report.num_found = num_managed;
+    if (num_managed == 0)
+    {
+        std::cout << "No restart directories found" << std::endl;
+        return selection;
+    }
+    
+    std::cout << "Found " << num_managed << " restart directories" << std::endl;
+    
+    // Pinned restarts are taken out of the index the strategies see, so that
+    // they are neither selected nor counted.  positions maps the entries of
+    // that index back to the full one.
+    const std::unordered_set<int> pins = loadPins();
+    RestartIndex unpinned_index;
+    std::vector<std::size_t> positions;
+    std::size_t num_pinned = 0;
+    const int base_fd = d_pin_markers ? ::open(d_restart_base_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC) : -1;
+    for (std::size_t i = 0; i < index.size(); ++i)
+    {
+        const bool pinned = i < num_managed && (pins.count(index.getIteration(i)) > 0 ||
+                                                (base_fd >= 0 && hasPinMarker(base_fd, index.getName(i))));
+        if (pinned)
+        {
+            if (num_pinned++ == 0) std::cout << "Keeping pinned restart directories:";
+            std::cout << ' ' << index.getName(i);
+            continue;
+        }
+        unpinned_index.addEntry(index.getIteration(i), index.getName(i), index.getInode(i));
+        positions.push_back(i);
+    }
+    if (base_fd >= 0) ::close(base_fd);
+    if (num_pinned > 0) std::cout << std::endl;
+    const RestartIndex& candidates = num_pinned > 0 ? unpinned_index : index;
+    const std::size_t num_candidates = num_managed - num_pinned;
+    
+    std::vector<TreeSize> sizes;
+    switch (d_strategy)
+    {
+    case CleanupStrategy::KEEP_RECENT_N:
+        selection.victims = keepRecentN(candidates, num_candidates);
+        break;
+    case CleanupStrategy::SMART_RETENTION:
+        selection.victims = smartRetention(candidates, num_candidates);
+        break;
+    case CleanupStrategy::MAX_BYTES:
+        selection.victims = maxBytes(candidates, num_candidates, sizes);
+        break;
+    case CleanupStrategy::TIME_BASED:
+        selection.victims = timeBased(candidates, num_candidates);
+        break;
+    }
+    
+    if (d_verify_mode != VerifyMode::OFF && !selection.victims.empty())
+    {
+        protectUnverifiedRestarts(candidates, num_candidates, selection.victims);
+    }
+    
+    if (d_partition_count > 1) keepPartitionVictims(candidates, selection.victims);
+    
+    if (num_pinned > 0)
+    {
+        for (std::size_t& victim : selection.victims)
+        {
+            victim = positions[victim];
+        }
+        if (!sizes.empty())
+        {
+            selection.sizes.resize(index.size());
+            for (std::size_t k = 0; k < positions.size(); ++k)
+            {
+                selection.sizes[positions[k]] = sizes[k];
+            }
+        }
+    }
+    else
+    {
+        selection.sizes = std::move(sizes);
+    }
+    
+    if (control.stats)
+    {
+        CleanupReport& report = control.stats->report;
+        report.num_pinned = num_pinned;
+        report.num_selected = selection.victims.size();
+        report.plan_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - plan_start).count();
+    }
+    return selection;
+}
+
+void RestartCleaner::protectUnverifiedRestarts(const RestartIndex& index,
+                                               std::size_t num_managed,
+                                               std::vector<std::size_t>& victims) const
+{
+    std::vector<bool> is_victim(num_managed, false);
+    for (std::size_t i : victims)
+    {
+        is_victim[i] = true;
+    }
+    
+    // Only kept restarts newer than some victim can protect anything
+    std::vector<std::size_t> kept;
+    for (std::size_t i = victims.front() + 1; i < num_managed; ++i)
+    {
+        if (!is_victim[i]) kept.push_back(i);
+    }
+    std::cout << "Verifying " << kept.size() << " kept restart directories" << std::endl;
+    const std::vector<std::string> problems = verifyRestartDirs(index, kept);
+    
+    std::vector<bool> failed(num_managed, false);
+    for (std::size_t k = 0; k < kept.size(); ++k)
+    {
+        failed[kept[k]] = !problems[k].empty();
+    }
+    
+    // A failed restart protects the next-older one, which is then verified in
+    // turn, so a run of damaged restarts is followed back to an intact one.
+    bool protected_any = false;
+    for (std::size_t i = num_managed - 1; i > 0; --i)
+    {
+        if (!failed[i] || !is_victim[i - 1]) continue;
+        
+        is_victim[i - 1] = false;
+        protected_any = true;
+        std::cout << "  Keeping " << index.getName(i - 1) << " because " << index.getName(i)
+                  << " failed verification" << std::endl;
+        failed[i - 1] = !verifyRestartDirs(index, { i - 1 }).front().empty();
+    }
+    
+    if (!protected_any) return;
+    victims.erase(std::remove_if(victims.begin(), victims.end(), [&](std::size_t i) { return !is_victim[i]; }),
+                  victims.end());
+    std::cout << "Deleting " << victims.size() << " restart directories after verification" << std::endl;
+}
+
+std::vector<std::string> RestartCleaner::verifyRestartDirs(const RestartIndex& index,
+                                                           const std::vector<std::size_t>& positions) const
+{
+    struct ManifestEntry
+    {
+        std::uintmax_t size;
+        struct statx_timestamp mtime;
+        std::uint32_t crc;
+    };
+    
+    struct FileCheck
+    {
+        std::string name;
+        struct statx stx;
+        std::size_t checksum_id;
+        bool checksummed;
+    };
+    
+    struct DirManifest
+    {
+        std::uint64_t inode = 0;
+        std::int64_t mtime_ns = -1;
+        std::unordered_map<std::string, ManifestEntry> files;
+    };
+    
+    struct DirCheck
+    {
+        std::shared_ptr<SharedFd> dir;
+        std::uint64_t inode = 0;
+        std::int64_t mtime_ns = -1;
+        std::unordered_map<std::string, ManifestEntry> manifest;
+        std::vector<FileCheck> files;
+        std::string problem;
+    };
+    
+    std::vector<std::string> problems(positions.size());
+    const int base_fd = ::open(d_restart_base_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (base_fd < 0)
+    {
+        throw std::runtime_error("RestartCleaner: Error opening " + d_restart_base_path + ": " + errnoString(errno));
+    }
+    SharedFd base(base_fd);
+    
+    // Load the manifest, kept in the base directory so that verifying does
+    // not change the restart directories: "<dir name> <dir inode> <dir mtime
+    // ns> <file name> <size> <mtime sec> <mtime nsec> <crc32c>" per line
+    const fs::path manifest_path = fs::path(d_restart_base_path) / CHECKSUM_MANIFEST_FILENAME;
+    std::unordered_map<std::string, DirManifest> manifest;
+    {
+        std::ifstream manifest_file(manifest_path);
+        std::string dir_name;
+        std::string name;
+        std::uint64_t inode = 0;
+        std::int64_t mtime_ns = 0;
+        ManifestEntry entry;
+        while (manifest_file >> dir_name >> inode >> mtime_ns >> name >> entry.size >> entry.mtime.tv_sec >>
+               entry.mtime.tv_nsec >> std::hex >> entry.crc >> std::dec)
+        {
+            DirManifest& dir = manifest[dir_name];
+            dir.inode = inode;
+            dir.mtime_ns = mtime_ns;
+            dir.files[name] = entry;
+        }
+    }
+    
+    const std::shared_ptr<RestartWorkerPool> pool = getWorkerPool();
+    ParallelChecksummer checksummer(*pool);
+    std::vector<DirCheck> checks(positions.size());
+    for (std::size_t k = 0; k < positions.size(); ++k)
+    {
+        DirCheck& check = checks[k];
+        const std::string dir_name(index.getName(positions[k]));
+        const int dir_fd = ::openat(base.fd, dir_name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd < 0)
+        {
+            check.problem = "cannot open directory: " + errnoString(errno);
+            continue;
+        }
+        check.dir = std::make_shared<SharedFd>(dir_fd);
+        
+        // Records of a replaced directory (another inode) are dropped.  A
+        // changed directory modification time means files were added, removed
+        // or renamed since the last verification, so none of the records is
+        // trusted, but recorded files must still exist.
+        check.mtime_ns = getDirIdentity(base.fd, dir_name, check.inode);
+        const auto recorded = manifest.find(dir_name);
+        const bool recorded_here = recorded != manifest.end() && recorded->second.inode == check.inode;
+        if (recorded_here) check.manifest = recorded->second.files;
+        const bool dir_unchanged = recorded_here && recorded->second.mtime_ns == check.mtime_ns;
+        
+        std::vector<std::string> names;
+        const int err = forEachDirEntry(dir_fd, [&](const LinuxDirent64& entry) {
+            if (entry.d_type != DT_REG && entry.d_type != DT_UNKNOWN) return;
+            names.emplace_back(entry.d_name);
+        });
+        if (err != 0)
+        {
+            check.problem = "cannot read directory: " + errnoString(err);
+            continue;
+        }
+        std::sort(names.begin(), names.end());
+        check.problem = checkRankFiles(names);
+        
+        // Restart files are written once: a file whose size and modification
+        // time match the manifest is trusted unless a full verification was
+        // requested, everything else is read and checksummed.
+        for (const auto& name : names)
+        {
+            FileCheck file{ name, {}, 0, false };
+            if (::statx(dir_fd, name.c_str(), AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_SIZE | STATX_MTIME,
+                        &file.stx) != 0 ||
+                !S_ISREG(file.stx.stx_mode))
+            {
+                continue;
+            }
+            const auto it = check.manifest.find(name);
+            const bool unchanged = dir_unchanged && it != check.manifest.end() &&
+                                   it->second.size == file.stx.stx_size &&
+                                   it->second.mtime.tv_sec == file.stx.stx_mtime.tv_sec &&
+                                   it->second.mtime.tv_nsec == file.stx.stx_mtime.tv_nsec;
+            if (!unchanged || d_verify_mode == VerifyMode::FULL)
+            {
+                file.checksum_id = checksummer.checksum(check.dir, name);
+                file.checksummed = true;
+            }
+            check.files.push_back(file);
+        }
+        for (const auto& entry : check.manifest)
+        {
+            if (!std::binary_search(names.begin(), names.end(), entry.first) && check.problem.empty())
+            {
+                check.problem = entry.first + " is missing";
+            }
+        }
+    }
+    checksummer.wait();
+    
+    bool manifest_changed = false;
+    for (std::size_t k = 0; k < positions.size(); ++k)
+    {
+        DirCheck& check = checks[k];
+        const std::string dir_name(index.getName(positions[k]));
+        if (!check.dir)
+        {
+            std::cerr << "  Verification failed for " << dir_name << ": " << check.problem << std::endl;
+            problems[k] = check.problem;
+            continue;
+        }
+        
+        DirManifest& record = manifest[dir_name];
+        if (record.inode != check.inode || record.mtime_ns != check.mtime_ns) manifest_changed = true;
+        record.inode = check.inode;
+        record.mtime_ns = check.mtime_ns;
+        std::size_t num_checksummed = 0;
+        for (const auto& file : check.files)
+        {
+            if (!file.checksummed) continue;
+            ++num_checksummed;
+            
+            const std::string error = checksummer.getError(file.checksum_id);
+            const std::uint32_t crc = checksummer.getChecksum(file.checksum_id);
+            const auto it = check.manifest.find(file.name);
+            if (!error.empty() || (it != check.manifest.end() && it->second.crc != crc))
+            {
+                // Keep the recorded checksum, so that the damage stays visible
+                if (check.problem.empty()) check.problem = error.empty() ? file.name + " has changed" : error;
+                continue;
+            }
+            if (it == check.manifest.end() || it->second.size != file.stx.stx_size ||
+                it->second.mtime.tv_sec != file.stx.stx_mtime.tv_sec ||
+                it->second.mtime.tv_nsec != file.stx.stx_mtime.tv_nsec)
+            {
+                check.manifest[file.name] = { file.stx.stx_size, file.stx.stx_mtime, crc };
+                manifest_changed = true;
+            }
+        }
+        
+        if (!check.problem.empty())
+        {
+            std::cerr << "  Verification failed for " << dir_name << ": " << check.problem << std::endl;
+            problems[k] = check.problem;
+        }
+        else
+        {
+            std::cout << "  Verified " << dir_name << " (" << check.files.size() << " files, " << num_checksummed
+                      << " checksummed)" << std::endl;
+        }
+        
+        record.files = check.manifest;
+    }
+    
+    // Rewrite the manifest atomically, and only when it changed, dropping
+    // the records of restart directories that no longer exist
+    if (manifest_changed && !d_dry_run)
+    {
+        std::unordered_set<std::string_view> managed;
+        for (std::size_t i = 0; i < index.size(); ++i)
+        {
+            managed.insert(index.getName(i));
+        }
+        std::vector<std::string> dir_names;
+        for (const auto& dir : manifest)
+        {
+            if (managed.count(dir.first) > 0) dir_names.push_back(dir.first);
+        }
+        std::sort(dir_names.begin(), dir_names.end());
+        
+        const fs::path tmp_path = manifest_path.string() + ".tmp";
+        {
+            std::ofstream manifest_file(tmp_path, std::ios::trunc);
+            for (const auto& dir_name : dir_names)
+            {
+                const DirManifest& dir = manifest[dir_name];
+                std::vector<std::string> names;
+                for (const auto& entry : dir.files)
+                {
+                    names.push_back(entry.first);
+                }
+                std::sort(names.begin(), names.end());
+                for (const auto& name : names)
+                {
+                    const ManifestEntry& entry = dir.files.at(name);
+                    char crc_text[16];
+                    std::snprintf(crc_text, sizeof(crc_text), "%08x", static_cast<unsigned int>(entry.crc));
+                    manifest_file << dir_name << ' ' << dir.inode << ' ' << dir.mtime_ns << ' ' << name << ' '
+                                  << entry.size << ' ' << entry.mtime.tv_sec << ' ' << entry.mtime.tv_nsec << ' '
+                                  << crc_text << '\n';
+                }
+            }
+        }
+        std::error_code ec;
+        fs::rename(tmp_path, manifest_path, ec);
+        if (ec) std::cerr << "  Error writing " << manifest_path << ": " << ec.message() << std::endl;
+    }
+    
+    if (d_catalog_mode != CatalogMode::OFF && !d_dry_run)
+    {
+        updateCatalog(base.fd, [&](RestartCatalog& catalog) {
+            const std::unordered_map<std::string_view, std::size_t> live = catalog.getLiveEntries();
+            bool changed = false;
+            for (std::size_t k = 0; k < positions.size(); ++k)
+            {
+                RestartCatalog::Entry* record =
+                    catalog.findLive(live, index.getName(positions[k]), index.getInode(positions[k]));
+                const auto status =
+                    problems[k].empty() ? RestartCatalog::Checksum::VERIFIED : RestartCatalog::Checksum::FAILED;
+                if (!record || record->checksum == status) continue;
+                record->checksum = status;
+                changed = true;
+            }
+            return changed;
+        });
+    }
+    return problems;
+}
+
+std::shared_ptr<RestartWorkerPool> RestartCleaner::getWorkerPool() const
+{
+    if (d_worker_pool) return d_worker_pool;
+    return std::make_shared<RestartWorkerPool>(d_num_jobs);
+}
+
+RestartIndex RestartCleaner::scanRestartIndex(RunStats* stats) const
+{
+    RestartIndex index;
+    IoCounters* counters = stats ? &stats->counters : nullptr;
+    std::uintmax_t num_entries = 0;
+    const auto scan_start = std::chrono::steady_clock::now();
+
+    if (counters) ++counters->open;
+    const int dir_fd = ::open(d_restart_base_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0)
+    {
+        if (errno == ENOENT) return index;
+        throw std::runtime_error("RestartCleaner: Error scanning directory: " + d_restart_base_path + ": " +
+                                 errnoString(errno));
+    }
+
+    // Take the modification time before reading, so that entries created
+    // during the scan invalidate the cached index.
+    const std::int64_t read_ns = getRealTimeNs();
+    struct stat dir_stat;
+    const bool have_stat = ::fstat(dir_fd, &dir_stat) == 0;
+
+    if (have_stat && d_catalog_mode == CatalogMode::ON && readCatalogIndex(dir_fd, dir_stat, index))
+    {
+        ::close(dir_fd);
+        index.sortByIteration();
+        if (stats)
+        {
+            stats->report.catalog_used = true;
+            stats->report.scan_seconds =
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - scan_start).count();
+        }
+        std::lock_guard<std::mutex> lock(d_index_mutex);
+        d_cached_index = index;
+        d_cached_index_valid = true;
+        d_cached_index_read_ns = read_ns;
+        d_cached_index_after_delete = false;
+        d_cached_index_mtime = dir_stat.st_mtim;
+        return index;
+    }
+
+    const int err = forEachDirEntry(dir_fd, [&](const LinuxDirent64& entry) {
+        ++num_entries;
+        const std::string_view name(entry.d_name);
+        const int iter = d_name_pattern.match(name);
+        if (iter < 0)
+        {
+            // Packed restarts are listed, but never managed
+            const int pack_iter = packIteration(d_name_pattern, name);
+            if (pack_iter >= 0) index.addPack(pack_iter);
+            return;
+        }
+
+        bool is_dir = entry.d_type == DT_DIR;
+        if (entry.d_type == DT_UNKNOWN || entry.d_type == DT_LNK)
+        {
+            // Follow links, like std::filesystem::directory_entry::is_directory()
+            struct stat st;
+            if (counters) ++counters->stat;
+            is_dir = ::fstatat(dir_fd, entry.d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (is_dir) index.addEntry(iter, name, entry.d_ino);
+    }, counters);
+
+    if (err != 0)
+    {
+        ::close(dir_fd);
+        throw std::runtime_error("RestartCleaner: Error scanning directory: " + d_restart_base_path + ": " +
+                                 errnoString(err));
+    }
+
+    const auto sort_start = std::chrono::steady_clock::now();
+    index.sortByIteration();
+    const auto sort_end = std::chrono::steady_clock::now();
+    if (have_stat && d_catalog_mode != CatalogMode::OFF) storeCatalog(dir_fd, dir_stat, read_ns, index);
+    ::close(dir_fd);
+    if (stats)
+    {
+        stats->report.entries_scanned = num_entries;
+        stats->report.scan_seconds = std::chrono::duration<double>(sort_start - scan_start).count();
+        stats->report.sort_seconds = std::chrono::duration<double>(sort_end - sort_start).count();
+    }
+
+    std::lock_guard<std::mutex> lock(d_index_mutex);
+    d_cached_index = index;
+    d_cached_index_valid = have_stat;
+    d_cached_index_read_ns = read_ns;
+    d_cached_index_after_delete = false;
+    if (have_stat) d_cached_index_mtime = dir_stat.st_mtim;
+    return index;
+}
+
+bool RestartCleaner::readCatalogIndex(int dir_fd, const struct stat& dir_stat, RestartIndex& index) const
+{
+    RestartCatalog catalog;
+    if (!catalog.load(dir_fd) || catalog.pattern != d_name_pattern.getSpec() || !catalog.describes(dir_stat))
+    {
+        return false;
+    }
+    for (const RestartCatalog::Entry& entry : catalog.entries)
+    {
+        if (entry.state == RestartCatalog::State::LIVE)
+        {
+            index.addEntry(entry.iteration, entry.name, entry.inode);
+        }
+        else if (entry.state == RestartCatalog::State::PACKED && entry.name.empty())
+        {
+            index.addPack(entry.iteration);
+        }
+    }
+    return true;
+}
+
+void RestartCleaner::storeCatalog(int dir_fd,
+                                  const struct stat& dir_stat,
+                                  std::int64_t read_ns,
+                                  const RestartIndex& index) const
+{
+    using Entry = RestartCatalog::Entry;
+    using State = RestartCatalog::State;
+    
+    // Dry runs leave the base directory as it is
+    if (d_dry_run) return;
+    
+    RestartCatalog old;
+    if (d_catalog_mode == CatalogMode::REBUILD || !old.load(dir_fd) || old.pattern != d_name_pattern.getSpec())
+    {
+        old.entries.clear();
+    }
+    const std::unordered_map<std::string_view, std::size_t> old_live = old.getLiveEntries();
+    std::unordered_map<int, std::size_t> old_packs;
+    for (std::size_t i = 0; i < old.entries.size(); ++i)
+    {
+        if (old.entries[i].state == State::PACKED) old_packs[old.entries[i].iteration] = i;
+    }
+    std::vector<bool> carried(old.entries.size(), false);
+    
+    RestartCatalog catalog;
+    catalog.pattern = d_name_pattern.getSpec();
+    catalog.setBase(dir_stat, read_ns);
+    catalog.entries.reserve(index.size() + index.getPackedIterations().size());
+    for (std::size_t i = 0; i < index.size(); ++i)
+    {
+        Entry entry;
+        const auto it = old_live.find(index.getName(i));
+        if (it != old_live.end() && old.entries[it->second].inode == index.getInode(i))
+        {
+            entry = old.entries[it->second];
+            carried[it->second] = true;
+        }
+        entry.name = std::string(index.getName(i));
+        entry.iteration = index.getIteration(i);
+        entry.inode = index.getInode(i);
+        catalog.entries.push_back(std::move(entry));
+    }
+    
+    // A pack keeps the record of the directory it replaced, under an empty
+    // name, so that its size and checksum status stay known
+    for (int iteration : index.getPackedIterations())
+    {
+        Entry entry;
+        const auto it = old_packs.find(iteration);
+        if (it != old_packs.end() && !carried[it->second])
+        {
+            entry = old.entries[it->second];
+            carried[it->second] = true;
+        }
+        entry.name.clear();
+        entry.iteration = iteration;
+        entry.state = State::PACKED;
+        catalog.entries.push_back(std::move(entry));
+    }
+    
+    // Everything else is gone from the base directory.  Tombstones count as
+    // deleted once the trash journal is gone, i.e. the reaper is done.
+    struct stat journal_stat;
+    const std::string journal_path = std::string(TRASH_DIRNAME) + "/" + JOURNAL_FILENAME;
+    const bool reaping = ::fstatat(dir_fd, journal_path.c_str(), &journal_stat, 0) == 0;
+    std::vector<Entry> removed;
+    for (std::size_t i = 0; i < old.entries.size(); ++i)
+    {
+        if (carried[i]) continue;
+        Entry& entry = old.entries[i];
+        if (entry.state != State::TOMBSTONED || !reaping) entry.state = State::DELETED;
+        removed.push_back(std::move(entry));
+    }
+    if (removed.size() > CATALOG_MAX_REMOVED)
+    {
+        std::nth_element(removed.begin(), removed.begin() + CATALOG_MAX_REMOVED, removed.end(),
+                         [](const Entry& a, const Entry& b) { return a.iteration > b.iteration; });
+        removed.resize(CATALOG_MAX_REMOVED);
+    }
+    std::move(removed.begin(), removed.end(), std::back_inserter(catalog.entries));
+    
+    // A read-only restart directory is listed without a catalog, silently
+    const int err = catalog.store(dir_fd);
+    if (err != 0 && err != EROFS && err != EACCES)
+    {
+        std::cerr << "  Warning: cannot update restart catalog " << fs::path(d_restart_base_path) / CATALOG_FILENAME
+                  << ": " << errnoString(err) << std::endl;
+    }
+}
+
+bool RestartCleaner::isCatalogCurrent() const
+{
+    if (d_catalog_mode != CatalogMode::ON) return false;
+    const int dir_fd = ::open(d_restart_base_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return false;
+    struct stat dir_stat;
+    RestartCatalog catalog;
+    const bool current = ::fstat(dir_fd, &dir_stat) == 0 && catalog.load(dir_fd) &&
+                         catalog.pattern == d_name_pattern.getSpec() && catalog.describes(dir_stat);
+    ::close(dir_fd);
+    return current;
+}
+
+void RestartCleaner::updateCachedIndex(const std::vector<std::string>& removed_names) const
+{
+    markCatalogRemoved(removed_names);
+    
+    // Changes made by other processes while we were deleting are not
+    // detected here; they only show up once the base directory changes again.
+    const std::int64_t read_ns = getRealTimeNs();
+    struct stat dir_stat;
+    const bool have_stat = ::stat(d_restart_base_path.c_str(), &dir_stat) == 0;
+
+    std::lock_guard<std::mutex> lock(d_index_mutex);
+    if (!d_cached_index_valid) return;
+    d_cached_index.removeNames(removed_names);
+    d_cached_index_valid = have_stat;
+    d_cached_index_read_ns = read_ns;
+    d_cached_index_after_delete = true;
+    if (have_stat) d_cached_index_mtime = dir_stat.st_mtim;
+}
+
+void RestartCleaner::markCatalogRemoved(const std::vector<std::string>& removed_names) const
+{
+    if (d_catalog_mode == CatalogMode::OFF || d_dry_run || removed_names.empty()) return;
+    const int dir_fd = ::open(d_restart_base_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) return;
+    
+    // Migrated restarts are gone from the base directory as much as deleted ones
+    RestartCatalog::State state = RestartCatalog::State::DELETED;
+    if (d_action == VictimAction::PACK)
+    {
+        state = RestartCatalog::State::PACKED;
+    }
+    else if (d_use_tombstones && d_action == VictimAction::DELETE)
+    {
+        state = RestartCatalog::State::TOMBSTONED;
+    }
+    const std::unordered_set<std::string_view> removed(removed_names.begin(), removed_names.end());
+    updateCatalog(dir_fd, [&](RestartCatalog& catalog) {
+        bool changed = false;
+        for (RestartCatalog::Entry& entry : catalog.entries)
+        {
+            if (entry.state != RestartCatalog::State::LIVE || removed.count(entry.name) == 0) continue;
+            entry.state = state;
+            changed = true;
+        }
+        return changed;
+    });
+    ::close(dir_fd);
+}
+
+std::vector<std::size_t> RestartCleaner::keepRecentN(const RestartIndex& /*index*/, std::size_t num_managed) const
+{
+    std::vector<std::size_t> victims;
+    
+    // Determine which directories to delete
+    if (static_cast<int>(num_managed) <= d_keep_restart_count)
+    {
+        std::cout << "No cleanup needed, keeping all " << num_managed << " directories" << std::endl;
+        return victims;
+    }
+    
+    // Delete old directories
+    int num_to_delete = num_managed - d_keep_restart_count;
+    std::cout << "Deleting " << num_to_delete << " old restart directories (keeping " 
+              << d_keep_restart_count << " most recent)" << std::endl;
+    
+    victims.reserve(num_to_delete);
+    for (int i = 0; i < num_to_delete; ++i)
+    {
+        victims.push_back(i);
+    }
+    return victims;
+}
+
+std::vector<std::size_t> RestartCleaner::smartRetention(const RestartIndex& index, std::size_t num_managed) const
+{
+    std::vector<std::size_t> victims;
+    
+    if (static_cast<int>(num_managed) <= d_keep_restart_count)
+    {
+        std::cout << "No cleanup needed, keeping all " << num_managed << " directories" << std::endl;
+        return victims;
+    }
+    
+    // Estimate the restart interval from the dense tier (including the gap to
+    // the next older restart), which is never thinned and therefore stable
+    // between invocations.
+    const std::size_t first_dense = num_managed - d_keep_restart_count;
+    long long interval = 0;
+    for (std::size_t i = first_dense; i < num_managed; ++i)
+    {
+        const long long gap = static_cast<long long>(index.getIteration(i)) - index.getIteration(i - 1);
+        if (gap > 0 && (interval == 0 || gap < interval)) interval = gap;
+    }
+    if (interval == 0) interval = 1;
+    
+    // Walk from newest to oldest.  Within a tier, an entry is kept if it is the
+    // oldest one in its bucket, i.e. if the next older entry falls into a
+    // different bucket.
+    std::size_t tier = 0;
+    int kept_in_tier = 0;
+    for (std::size_t i = first_dense; i-- > 0;)
+    {
+        bool keep = false;
+        if (tier < d_retention_tiers.size())
+        {
+            const long long width = interval * d_retention_tiers[tier].stride;
+            keep = i == 0 || index.getIteration(i) / width != index.getIteration(i - 1) / width;
+        }
+        
+        if (!keep)
+        {
+            victims.push_back(i);
+            continue;
+        }
+        
+        if (++kept_in_tier == d_retention_tiers[tier].count)
+        {
+            ++tier;
+            kept_in_tier = 0;
+        }
+    }
+    std::reverse(victims.begin(), victims.end());
+    
+    if (victims.empty())
+    {
+        std::cout << "No cleanup needed, keeping all " << num_managed << " directories" << std::endl;
+        return victims;
+    }
+    
+    std::cout << "Deleting " << victims.size() << " old restart directories (keeping " << d_keep_restart_count
+              << " most recent and " << num_managed - d_keep_restart_count - victims.size()
+              << " older ones in " << d_retention_tiers.size() << " retention tiers)" << std::endl;
+    return victims;
+}
+
+std::vector<std::size_t> RestartCleaner::maxBytes(const RestartIndex& index,
+                                                  std::size_t num_managed,
+                                                  std::vector<TreeSize>& sizes) const
+{
+    if (d_max_bytes == 0)
+    {
+        throw std::logic_error("RestartCleaner: MAX_BYTES strategy requires a budget, see setMaxBytes()");
+    }
+    
+    // Protected restarts are never deleted but still count against the budget
+    sizes = getRestartDirSizes(index);
+    std::uintmax_t total_bytes = 0;
+    for (const auto& size : sizes)
+    {
+        total_bytes += size.bytes;
+    }
+    std::cout << "Restart directories use " << formatBytes(total_bytes) << " (budget " << formatBytes(d_max_bytes)
+              << ")" << std::endl;
+    
+    std::vector<std::size_t> victims;
+    std::uintmax_t freed_bytes = 0;
+    for (std::size_t i = 0; total_bytes - freed_bytes > d_max_bytes &&
+                            static_cast<int>(num_managed - i) > d_keep_restart_count;
+         ++i)
+    {
+        victims.push_back(i);
+        freed_bytes += sizes[i].bytes;
+    }
+    
+    if (total_bytes - freed_bytes > d_max_bytes)
+    {
+        std::cout << "Warning: budget cannot be met without deleting the " << d_keep_restart_count
+                  << " most recent restart directories" << std::endl;
+    }
+    
+    if (victims.empty())
+    {
+        std::cout << "No cleanup needed, keeping all " << num_managed << " directories" << std::endl;
+        return victims;
+    }
+    
+    std::cout << "Deleting " << victims.size() << " old restart directories (freeing " << formatBytes(freed_bytes)
+              << ", keeping " << num_managed - victims.size() << " most recent)" << std::endl;
+    return victims;
+}
+
+std::vector<RestartCleaner::TreeSize> RestartCleaner::getRestartDirSizes(const RestartIndex& index) const
+{
+    struct CachedSize
+    {
+        struct statx_timestamp mtime;
+        TreeSize size;
+    };
+    
+    std::vector<TreeSize> sizes(index.size());
+    const int base_fd = ::open(d_restart_base_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (base_fd < 0)
+    {
+        throw std::runtime_error("RestartCleaner: Error opening " + d_restart_base_path + ": " + errnoString(errno));
+    }
+    
+    // Load the cache: "<name> <mtime sec> <mtime nsec> <bytes> <files>" per line
+    const fs::path cache_path = fs::path(d_restart_base_path) / SIZE_CACHE_FILENAME;
+    std::unordered_map<std::string, CachedSize> cache;
+    {
+        std::ifstream cache_file(cache_path);
+        std::string name;
+        CachedSize entry;
+        while (cache_file >> name >> entry.mtime.tv_sec >> entry.mtime.tv_nsec >> entry.size.bytes >> entry.size.files)
+        {
+            cache[name] = entry;
+        }
+    }
+    
+    // Restart directories are written once, so an unchanged directory
+    // modification time means the cached size is still valid.  The catalog
+    // is asked first, the size cache second.
+    RestartCatalog catalog;
+    if (d_catalog_mode != CatalogMode::OFF) catalog.load(base_fd);
+    const std::unordered_map<std::string_view, std::size_t> live = catalog.getLiveEntries();
+    std::vector<RestartCatalog::Entry*> records(index.size(), nullptr);
+    bool catalog_changed = false;
+    std::vector<struct statx_timestamp> mtimes(index.size());
+    std::vector<std::size_t> to_measure;
+    for (std::size_t i = 0; i < index.size(); ++i)
+    {
+        const std::string name(index.getName(i));
+        struct statx stx;
+        if (::statx(base_fd, name.c_str(), 0, STATX_MTIME | STATX_INO, &stx) != 0)
+        {
+            continue;
+        }
+        mtimes[i] = stx.stx_mtime;
+        const std::int64_t mtime_ns =
+            static_cast<std::int64_t>(stx.stx_mtime.tv_sec) * 1000000000 + stx.stx_mtime.tv_nsec;
+        
+        records[i] = catalog.findLive(live, name, stx.stx_ino);
+        if (records[i] && records[i]->size_known && records[i]->mtime_ns == mtime_ns)
+        {
+            sizes[i] = { records[i]->bytes, records[i]->files };
+            records[i] = nullptr;
+            continue;
+        }
+        if (records[i] && records[i]->mtime_ns != mtime_ns)
+        {
+            records[i]->mtime_ns = mtime_ns;
+            records[i]->completed = i + 1 < index.size();
+            records[i]->size_known = false;
+            catalog_changed = true;
+        }
+        
+        const auto it = cache.find(name);
+        if (it != cache.end() && it->second.mtime.tv_sec == stx.stx_mtime.tv_sec &&
+            it->second.mtime.tv_nsec == stx.stx_mtime.tv_nsec)
+        {
+            sizes[i] = it->second.size;
+        }
+        else
+        {
+            to_measure.push_back(i);
+        }
+    }
+    
+    if (!to_measure.empty())
+    {
+        std::cout << "Measuring " << to_measure.size() << " of " << index.size() << " restart directories"
+                  << std::endl;
+        
+        const std::shared_ptr<RestartWorkerPool> pool = getWorkerPool();
+        ParallelTreeSizer sizer(*pool, base_fd);
+        std::vector<std::size_t> ids;
+        ids.reserve(to_measure.size());
+        for (std::size_t i : to_measure)
+        {
+            ids.push_back(sizer.measure(std::string(index.getName(i))));
+        }
+        sizer.wait();
+        
+        for (std::size_t k = 0; k < to_measure.size(); ++k)
+        {
+            const std::size_t i = to_measure[k];
+            sizes[i] = sizer.getSize(ids[k]);
+            
+            const std::string error = sizer.getError(ids[k]);
+            if (!error.empty())
+            {
+                // Do not cache incomplete sizes
+                std::cerr << "  Error measuring " << index.getName(i) << ": " << error << std::endl;
+                mtimes[i] = {};
+                records[i] = nullptr;
+            }
+        }
+        
+        // Rewrite the cache with the current entries only, atomically
+        const fs::path tmp_path = cache_path.string() + ".tmp";
+        {
+            std::ofstream cache_file(tmp_path, std::ios::trunc);
+            for (std::size_t i = 0; i < index.size(); ++i)
+            {
+                if (mtimes[i].tv_sec == 0 && mtimes[i].tv_nsec == 0) continue;
+                cache_file << index.getName(i) << ' ' << mtimes[i].tv_sec << ' ' << mtimes[i].tv_nsec << ' '
+                           << sizes[i].bytes << ' ' << sizes[i].files << '\n';
+            }
+        }
+        std::error_code ec;
+        fs::rename(tmp_path, cache_path, ec);
+        if (ec)
+        {
+            std::cerr << "  Warning: cannot update size cache " << cache_path << ": " << ec.message() << std::endl;
+        }
+    }
+    
+    // Sizes read from the size cache or measured go into the catalog
+    for (std::size_t i = 0; i < index.size(); ++i)
+    {
+        if (!records[i]) continue;
+        records[i]->size_known = true;
+        records[i]->files = sizes[i].files;
+        records[i]->bytes = sizes[i].bytes;
+        catalog_changed = true;
+    }
+    if (catalog_changed && !d_dry_run) catalog.store(base_fd);
+    
+    ::close(base_fd);
+    return sizes;
+}
+
+std::vector<std::size_t> RestartCleaner::timeBased(const RestartIndex& index, std::size_t num_managed) const
+{
+    std::vector<std::size_t> victims;
+    
+    if (static_cast<int>(num_managed) <= d_keep_restart_count)
+    {
+        std::cout << "No cleanup needed, keeping all " << num_managed << " directories" << std::endl;
+        return victims;
+    }
+    
+    const std::vector<std::int64_t> times = getCompletionTimes(index, num_managed);
+    const std::int64_t now = static_cast<std::int64_t>(std::time(nullptr));
+    const TimeRetention& retention = d_time_retention;
+    const auto expired = [&](std::int64_t time) {
+        return retention.max_age_seconds != 0 && now - time > retention.max_age_seconds;
+    };
+    const auto bucket = [&](std::int64_t time) {
+        return time >= 0 ? time / retention.interval_seconds : time;
+    };
+    
+    // Walk from newest to oldest.  Past the keep-all window, an entry is kept
+    // if it is the oldest surviving one in its interval, so a restart kept by
+    // one invocation stays kept by later ones.  Entries whose completion time
+    // is unknown are never deleted.
+    std::size_t num_recent = 0;
+    for (std::size_t i = num_managed - d_keep_restart_count; i-- > 0;)
+    {
+        const std::int64_t time = times[i];
+        bool keep = time < 0 || now - time <= retention.keep_all_seconds;
+        if (keep)
+        {
+            if (time >= 0) ++num_recent;
+        }
+        else if (!expired(time))
+        {
+            keep = i == 0 || times[i - 1] < 0 || expired(times[i - 1]) || bucket(times[i - 1]) != bucket(time);
+        }
+        if (!keep) victims.push_back(i);
+    }
+    std::reverse(victims.begin(), victims.end());
+    
+    if (victims.empty())
+    {
+        std::cout << "No cleanup needed, keeping all " << num_managed << " directories" << std::endl;
+        return victims;
+    }
+    
+    std::cout << "Deleting " << victims.size() << " old restart directories (keeping " << d_keep_restart_count
+              << " most recent, " << num_recent << " more from the last "
+              << formatDuration(retention.keep_all_seconds) << " and "
+              << num_managed - d_keep_restart_count - num_recent - victims.size() << " older ones, one per "
+              << formatDuration(retention.interval_seconds) << ")" << std::endl;
+    return victims;
+}
+
+std::vector<std::int64_t> RestartCleaner::getCompletionTimes(const RestartIndex& index, std::size_t num_managed) const
+{
+    struct CachedTime
+    {
+        std::uint64_t inode;
+        std::int64_t time;
+    };
+    
+    // Load the cache: "<name> <inode> <completion time>" per line.  Names are
+    // reused when a run restarts from an older checkpoint, inode numbers of
+    // live directories are not.
+    const fs::path cache_path = fs::path(d_restart_base_path) / TIME_CACHE_FILENAME;
+    std::unordered_map<std::string, CachedTime> cache;
+    {
+        std::ifstream cache_file(cache_path);
+        std::string name;
+        CachedTime entry;
+        while (cache_file >> name >> entry.inode >> entry.time)
+        {
+            cache[name] = entry;
+        }
+    }
+    
+    std::vector<std::int64_t> times(num_managed, -1);
+    std::vector<std::uint64_t> inodes(num_managed, 0);
+    const auto open_base = [this]() {
+        const int fd = ::open(d_restart_base_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw std::runtime_error("RestartCleaner: Error opening " + d_restart_base_path + ": " + errnoString(errno));
+        }
+        return fd;
+    };
+    
+    // The catalog is asked first, for every entry but the newest, which may
+    // still be written
+    RestartCatalog catalog;
+    int base_fd = -1;
+    if (d_catalog_mode != CatalogMode::OFF)
+    {
+        base_fd = open_base();
+        catalog.load(base_fd);
+    }
+    const std::unordered_map<std::string_view, std::size_t> live = catalog.getLiveEntries();
+    bool catalog_changed = false;
+    std::size_t num_hits = 0;
+    bool read_older = false;
+    for (std::size_t i = 0; i < num_managed; ++i)
+    {
+        const std::string name(index.getName(i));
+        RestartCatalog::Entry* record = catalog.findLive(live, name, index.getInode(i));
+        const auto it = cache.find(name);
+        const bool cached = index.getInode(i) != 0 && it != cache.end() && it->second.inode == index.getInode(i);
+        if (record && record->completed && i + 1 < num_managed)
+        {
+            times[i] = record->mtime_ns / 1000000000;
+            inodes[i] = record->inode;
+            if (cached) ++num_hits;
+            read_older |= !cached;
+            continue;
+        }
+        if (cached)
+        {
+            times[i] = it->second.time;
+            inodes[i] = it->second.inode;
+            ++num_hits;
+            continue;
+        }
+        
+        if (base_fd < 0) base_fd = open_base();
+        struct statx stx;
+        if (::statx(base_fd, name.c_str(), AT_STATX_DONT_SYNC, STATX_MTIME | STATX_INO, &stx) != 0)
+        {
+            std::cerr << "  Warning: cannot read the completion time of " << name << ": " << errnoString(errno)
+                      << std::endl;
+            continue;
+        }
+        times[i] = stx.stx_mtime.tv_sec;
+        inodes[i] = stx.stx_ino;
+        read_older |= i + 1 < num_managed;
+        
+        const std::int64_t mtime_ns =
+            static_cast<std::int64_t>(stx.stx_mtime.tv_sec) * 1000000000 + stx.stx_mtime.tv_nsec;
+        if (record && i + 1 < num_managed)
+        {
+            if (record->mtime_ns != mtime_ns) record->size_known = false;
+            record->mtime_ns = mtime_ns;
+            record->completed = true;
+            catalog_changed = true;
+        }
+    }
+    if (catalog_changed && !d_dry_run) catalog.store(base_fd);
+    if (base_fd >= 0) ::close(base_fd);
+    
+    // Rewrite the cache with the current entries only, atomically, if it
+    // missed an entry other than the newest or holds deleted ones
+    if (read_older || num_hits != cache.size())
+    {
+        const fs::path tmp_path = cache_path.string() + ".tmp";
+        {
+            std::ofstream cache_file(tmp_path, std::ios::trunc);
+            for (std::size_t i = 0; i + 1 < num_managed; ++i)
+            {
+                if (times[i] < 0) continue;
+                cache_file << index.getName(i) << ' ' << inodes[i] << ' ' << times[i] << '\n';
+            }
+        }
+        std::error_code ec;
+        fs::rename(tmp_path, cache_path, ec);
+        if (ec)
+        {
+            std::cerr << "  Warning: cannot update time cache " << cache_path << ": " << ec.message() << std::endl;
+        }
+    }
+    return times;
+}
+
+double RestartCleaner::getUnlinkCost(std::string& source) const
+{
+    // The cost file holds "<engine> <jobs> <seconds per entry>" per line
+    const std::string engine = getEngineName();
+    {
+        std::ifstream cost_file(fs::path(d_restart_base_path) / COST_FILENAME);
+        std::string line_engine;
+        int jobs = 0;
+        double cost = 0.0;
+        while (cost_file >> line_engine >> jobs >> cost)
+        {
+            if (line_engine == engine && jobs == d_num_jobs && cost > 0.0)
+            {
+                source = "MEASURED";
+                return cost;
+            }
+        }
+    }
+    
+    // Without a measurement, fall back to the documented default
+    source = "DEFAULT";
+    return DEFAULT_UNLINK_COST;
+}
+
+void RestartCleaner::recordUnlinkCost(const CleanupReport& report) const
+{
+    // Only plain deletions of enough entries say something about the cost
+    if (d_dry_run || d_use_tombstones || d_action != VictimAction::DELETE || report.entries_unlinked < COST_MIN_ENTRIES ||
+        d_rate_limits.unlinks_per_second > 0.0 || d_rate_limits.bytes_per_second > 0.0 || report.delete_seconds <= 0.0)
+    {
+        return;
+    }
+    const std::string engine = getEngineName();
+    double cost = report.delete_seconds / static_cast<double>(report.entries_unlinked);
+    
+    // Keep the other lines, and smooth this one over successive deletions
+    const fs::path cost_path = fs::path(d_restart_base_path) / COST_FILENAME;
+    std::ostringstream others;
+    {
+        std::ifstream cost_file(cost_path);
+        std::string line_engine;
+        int jobs = 0;
+        double line_cost = 0.0;
+        while (cost_file >> line_engine >> jobs >> line_cost)
+        {
+            if (line_engine == engine && jobs == d_num_jobs)
+            {
+                if (line_cost > 0.0) cost = 0.5 * (cost + line_cost);
+                continue;
+            }
+            others << line_engine << ' ' << jobs << ' ' << line_cost << '\n';
+        }
+    }
+    const fs::path tmp_path = cost_path.string() + ".tmp";
+    {
+        std::ofstream cost_file(tmp_path, std::ios::trunc);
+        cost_file << others.str() << engine << ' ' << d_num_jobs << ' ' << cost << '\n';
+    }
+    std::error_code ec;
+    fs::rename(tmp_path, cost_path, ec);
+    if (ec)
+    {
+        std::cerr << "  Warning: cannot update cost file " << cost_path << ": " << ec.message() << std::endl;
+    }
+}
+
+void RestartCleaner::deleteRestartDirs(const CleanupSelection& selection, const RunControl& control) const
+{
+    const std::vector<std::size_t>& victims = selection.victims;
+    if (victims.empty()) return;
+
+    std::vector<fs::path> dirs_to_delete;
+    dirs_to_delete.reserve(victims.size());
+    for (std::size_t victim : victims)
+    {
+        dirs_to_delete.push_back(fs::path(d_restart_base_path) / selection.index.getName(victim));
+    }
+
+    if (d_dry_run)
+    {
+        for (const auto& dir_path : dirs_to_delete)
+        {
+            if (d_action == VictimAction::MIGRATE)
+            {
+                std::cout << "  DRY RUN: Would migrate " << dir_path << " to " << fs::path(d_archive_path) << std::endl;
+            }
+            else if (d_action == VictimAction::PACK)
+            {
+                std::cout << "  DRY RUN: Would pack " << dir_path << std::endl;
+            }
+            else
+            {
+                std::cout << "  DRY RUN: Would delete " << dir_path << std::endl;
+            }
+        }
+        return;
+    }
+
+    const auto delete_start = std::chrono::steady_clock::now();
+    const std::vector<std::string> removed = removeRestartDirs(dirs_to_delete, control);
+    updateCachedIndex(removed);
+    if (!control.stats) return;
+
+    // The directory reports are in victim order; sizes are known only if the
+    // strategy measured them
+    CleanupReport& report = control.stats->report;
+    report.delete_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - delete_start).count();
+    report.num_deleted = removed.size();
+    report.bytes_known = !selection.sizes.empty();
+    std::unordered_map<std::string_view, std::uintmax_t> victim_bytes;
+    for (std::size_t victim : victims)
+    {
+        if (report.bytes_known) victim_bytes[selection.index.getName(victim)] = selection.sizes[victim].bytes;
+    }
+    for (auto& directory : report.directories)
+    {
+        const auto it = victim_bytes.find(directory.name);
+        if (it != victim_bytes.end()) directory.bytes = it->second;
+        report.entries_unlinked += directory.entries;
+        if (directory.removed) report.bytes_unlinked += directory.bytes;
+    }
+    recordUnlinkCost(report);
+}
+
+std::vector<std::string> RestartCleaner::removeRestartDirs(const std::vector<fs::path>& dirs,
+                                                           const RunControl& control) const
+{
+    if (d_action == VictimAction::MIGRATE)
+    {
+        return migrateRestartDirs(dirs, control);
+    }
+    if (d_action == VictimAction::PACK)
+    {
+        return packRestartDirs(dirs, control);
+    }
+    if (d_use_tombstones)
+    {
+        return tombstoneRestartDirs(dirs, control);
+    }
+    return removeTrees(dirs, control);
+}
+
+std::vector<std::string> RestartCleaner::removeTrees(const std::vector<fs::path>& dirs,
+                                                     const RunControl& control) const
+{
+    switch (d_engine)
+    {
+    case DeletionEngine::SERIAL:
+        return removeRestartDirsSerial(dirs, control);
+    case DeletionEngine::PARALLEL:
+    case DeletionEngine::URING:
+        return removeRestartDirsParallel(dirs, control);
+    }
+    return {};
+}
+
+std::vector<std::string> RestartCleaner::tombstoneRestartDirs(const std::vector<fs::path>& dirs,
+                                                              const RunControl& control) const
+{
+    const fs::path trash_path = fs::path(d_restart_base_path) / TRASH_DIRNAME;
+    if (::mkdir(trash_path.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        std::cerr << "  Error creating " << trash_path << ": " << errnoString(errno)
+                  << "; deleting directly" << std::endl;
+        return removeTrees(dirs, control);
+    }
+    
+    std::lock_guard<std::mutex> lock(d_reaper_mutex);
+    
+    // Journal the tombstones (durably) before renaming anything, so that a
+    // tombstone can never exist without a journal entry.
+    std::vector<std::string> tombstones;
+    std::string journal_text;
+    for (const auto& dir_path : dirs)
+    {
+        tombstones.push_back(dir_path.filename().string() + "." + std::to_string(::getpid()) + "." +
+                             std::to_string(++d_tombstone_counter));
+        journal_text += "T " + tombstones.back() + "\n";
+    }
+    const fs::path journal_path = trash_path / JOURNAL_FILENAME;
+    const int journal_fd = openLockedJournal(trash_path, true);
+    if (journal_fd < 0 ||
+        ::write(journal_fd, journal_text.data(), journal_text.size()) != static_cast<ssize_t>(journal_text.size()) ||
+        ::fsync(journal_fd) != 0)
+    {
+        std::cerr << "  Error writing " << journal_path << ": " << errnoString(errno) << "; deleting directly"
+                  << std::endl;
+        if (journal_fd >= 0) ::close(journal_fd);
+        return removeTrees(dirs, control);
+    }
+    ::close(journal_fd);
+    
+    std::vector<std::string> renamed;
+    std::vector<std::string> queued;
+    for (std::size_t i = 0; i < dirs.size(); ++i)
+    {
+        if (control.isCancelled())
+        {
+            std::cout << "  Cancelled before " << dirs[i] << std::endl;
+            break;
+        }
+        
+        const fs::path tombstone_path = trash_path / tombstones[i];
+        DirectoryReport directory;
+        directory.name = dirs[i].filename().string();
+        const auto start = std::chrono::steady_clock::now();
+        if (control.stats) ++control.stats->counters.rename;
+        if (::rename(dirs[i].c_str(), tombstone_path.c_str()) != 0)
+        {
+            directory.error = "cannot move to " + tombstone_path.string() + ": " + errnoString(errno);
+            std::cerr << "  Error moving " << dirs[i] << " to " << tombstone_path << ": " << errnoString(errno)
+                      << std::endl;
+        }
+        else
+        {
+            directory.removed = true;
+            renamed.push_back(directory.name);
+            queued.push_back(tombstones[i]);
+            std::cout << "  Moved " << dirs[i] << " to " << tombstone_path << std::endl;
+        }
+        directory.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (control.stats) control.stats->addDirectory(directory);
+    }
+    
+    queueTombstones(queued);
+    return renamed;
+}
+
+void RestartCleaner::resumeTombstones() const
+{
+    std::lock_guard<std::mutex> lock(d_reaper_mutex);
+    if (d_journal_resumed || d_dry_run) return;
+    d_journal_resumed = true;
+    
+    // "T <name>" marks a tombstone, "D <name>" its removal
+    std::ifstream journal(fs::path(d_restart_base_path) / TRASH_DIRNAME / JOURNAL_FILENAME);
+    const std::vector<std::string> pending = getPendingTombstones(journal);
+    if (pending.empty()) return;
+    
+    std::cout << "RestartCleaner: Resuming removal of " << pending.size() << " tombstones in "
+              << fs::path(d_restart_base_path) / TRASH_DIRNAME << std::endl;
+    queueTombstones(pending);
+}
+
+void RestartCleaner::queueTombstones(const std::vector<std::string>& tombstones) const
+{
+    if (tombstones.empty()) return;
+    
+    d_reaper_queue.insert(d_reaper_queue.end(), tombstones.begin(), tombstones.end());
+    if (d_reaper_running) return;
+    
+    // The previous reaper has left its loop; reap it before starting a new one
+    if (d_reaper_thread.joinable()) d_reaper_thread.join();
+    d_reaper_running = true;
+    d_reaper_thread = std::thread(&RestartCleaner::reapTombstones, this);
+}
+
+void RestartCleaner::reapTombstones() const
+{
+    setIdleIoPriority();
+    
+    const fs::path trash_path = fs::path(d_restart_base_path) / TRASH_DIRNAME;
+    const fs::path journal_path = trash_path / JOURNAL_FILENAME;
+    for (;;)
+    {
+        std::vector<fs::path> batch;
+        {
+            std::lock_guard<std::mutex> lock(d_reaper_mutex);
+            if (d_reaper_queue.empty())
+            {
+                // The journal is shared with other processes, so it can go
+                // only once every tombstone in it is gone, not just ours
+                const int journal_fd = openLockedJournal(trash_path, false);
+                if (journal_fd >= 0)
+                {
+                    std::string journal_text;
+                    char buffer[4096];
+                    ssize_t count;
+                    while ((count = ::read(journal_fd, buffer, sizeof(buffer))) > 0)
+                    {
+                        journal_text.append(buffer, count);
+                    }
+                    std::istringstream journal(journal_text);
+                    if (count == 0 && getPendingTombstones(journal).empty())
+                    {
+                        ::unlink(journal_path.c_str());
+                        ::rmdir(trash_path.c_str());
+                    }
+                    ::close(journal_fd);
+                }
+                d_reaper_running = false;
+                d_reaper_cv.notify_all();
+                return;
+            }
+            for (const auto& tombstone : d_reaper_queue)
+            {
+                batch.push_back(trash_path / tombstone);
+            }
+            d_reaper_queue.clear();
+        }
+        
+        const std::vector<std::string> removed = removeTrees(batch, RunControl());
+        
+        std::string journal_text;
+        for (const auto& name : removed)
+        {
+            journal_text += "D " + name + "\n";
+        }
+        std::lock_guard<std::mutex> lock(d_reaper_mutex);
+        const int journal_fd = openLockedJournal(trash_path, false);
+        if (journal_fd >= 0)
+        {
+            // Losing these records is harmless: removing a tombstone twice is
+            // a no-op, and the journal is then kept until it is resumed
+            if (::write(journal_fd, journal_text.data(), journal_text.size()) < 0)
+            {
+                std::cerr << "  Warning: cannot write " << journal_path << ": " << errnoString(errno) << std::endl;
+            }
+            ::close(journal_fd);
+        }
+    }
+}
+
+std::vector<std::string> RestartCleaner::removeRestartDirsSerial(const std::vector<fs::path>& dirs,
+                                                                 const RunControl& control) const
+{
+    std::vector<std::string> removed;
+    for (const auto& dir_path : dirs)
+    {
+        if (control.isCancelled())
+        {
+            std::cout << "  Cancelled before " << dir_path << std::endl;
+            break;
+        }
+
+        DirectoryReport directory;
+        directory.name = dir_path.filename().string();
+        const auto start = std::chrono::steady_clock::now();
+        try
+        {
+            directory.entries = fs::remove_all(dir_path);
+            directory.removed = true;
+            removed.push_back(directory.name);
+            std::cout << "  Deleted " << dir_path << std::endl;
+        }
+        catch (const std::exception& e)
+        {
+            directory.error = e.what();
+            std::cerr << "  Error deleting " << dir_path << ": " << e.what() << std::endl;
+        }
+        directory.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (control.stats) control.stats->addDirectory(directory);
+    }
+    return removed;
+}
+
+std::vector<std::string> RestartCleaner::removeRestartDirsParallel(const std::vector<fs::path>& dirs,
+                                                                   const RunControl& control) const
+{
+    const std::shared_ptr<RestartWorkerPool> pool = getWorkerPool();
+    std::unique_ptr<PendingRemoval> removal = startParallelRemoval(dirs, control, *pool);
+    if (!removal) return {};
+    return finishParallelRemoval(*removal);
+}
+
+std::unique_ptr<RestartCleaner::PendingRemoval> RestartCleaner::startParallelRemoval(const std::vector<fs::path>& dirs,
+                                                                                     const RunControl& control,
+                                                                                     RestartWorkerPool& pool) const
+{
+    // All trees are entries of one parent directory (the base directory or
+    // the trash directory), so the worker tasks only need names relative to it.
+    const fs::path parent = dirs.empty() ? fs::path(d_restart_base_path) : dirs.front().parent_path();
+    const int base_fd = ::open(parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (base_fd < 0)
+    {
+        std::cerr << "  Error opening " << parent << ": " << errnoString(errno) << std::endl;
+        return nullptr;
+    }
+
+    if (control.stats) ++control.stats->counters.open;
+    std::unique_ptr<DeletionThrottle> throttle;
+    if (d_rate_limits.unlinks_per_second > 0.0 || d_rate_limits.bytes_per_second > 0.0)
+    {
+        throttle = std::make_unique<DeletionThrottle>(d_rate_limits);
+    }
+    auto removal =
+        std::make_unique<PendingRemoval>(pool, base_fd, control.cancel, control.stats, std::move(throttle));
+    switch (d_unlink_order)
+    {
+    case UnlinkOrder::READDIR:
+        removal->remover.setOrder(ParallelTreeRemover::Order::READDIR);
+        break;
+    case UnlinkOrder::INODE:
+        removal->remover.setOrder(ParallelTreeRemover::Order::INODE);
+        break;
+    case UnlinkOrder::REVERSE:
+        removal->remover.setOrder(ParallelTreeRemover::Order::REVERSE);
+        break;
+    }
+    if (d_engine == DeletionEngine::URING)
+    {
+        if (UringBatch::isSupported())
+        {
+            removal->remover.setUring(true);
+        }
+        else
+        {
+            std::cout << "  io_uring is not available, unlinking with worker threads" << std::endl;
+        }
+    }
+    removal->dirs.reserve(dirs.size());
+    removal->ids.reserve(dirs.size());
+    for (const auto& dir_path : dirs)
+    {
+        removal->add(dir_path);
+    }
+    return removal;
+}
+
+std::vector<std::string> RestartCleaner::finishParallelRemoval(PendingRemoval& removal) const
+{
+    std::vector<std::string> removed;
+    removal.remover.wait();
+    if (removal.stats && removal.throttle)
+    {
+        removal.stats->report.throttle_seconds += removal.throttle->getWaitSeconds();
+    }
+
+    const std::vector<fs::path>& dirs = removal.dirs;
+    for (std::size_t i = 0; i < dirs.size(); ++i)
+    {
+        const std::string error = removal.remover.getError(removal.ids[i]);
+        if (removal.remover.wasSkipped(removal.ids[i]))
+        {
+            std::cout << "  Cancelled before " << dirs[i] << std::endl;
+            continue;
+        }
+        
+        if (error.empty())
+        {
+            removed.push_back(dirs[i].filename().string());
+            std::cout << "  Deleted " << dirs[i] << std::endl;
+        }
+        else
+        {
+            std::cerr << "  Error deleting " << dirs[i] << ": " << error << std::endl;
+        }
+        
+        if (removal.stats)
+        {
+            DirectoryReport directory;
+            directory.name = dirs[i].filename().string();
+            directory.removed = error.empty();
+            directory.seconds = removal.remover.getSeconds(removal.ids[i]);
+            directory.entries = removal.remover.getEntries(removal.ids[i]);
+            directory.error = error;
+            removal.stats->addDirectory(directory);
+        }
+    }
+    return removed;
+}
+
+std::vector<std::string> RestartCleaner::migrateRestartDirs(const std::vector<fs::path>& dirs,
+                                                            const RunControl& control) const
+{
+    std::vector<std::string> migrated;
+    if (dirs.empty()) return migrated;
+    
+    std::error_code ec;
+    fs::create_directories(d_archive_path, ec);
+    const auto archive = std::make_shared<SharedFd>(::open(d_archive_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (archive->fd < 0)
+    {
+        std::cerr << "  Error opening archive " << fs::path(d_archive_path) << ": "
+                  << (ec ? ec.message() : errnoString(errno)) << std::endl;
+        return migrated;
+    }
+    const fs::path parent = dirs.front().parent_path();
+    const auto base = std::make_shared<SharedFd>(::open(parent.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (base->fd < 0)
+    {
+        std::cerr << "  Error opening " << parent << ": " << errnoString(errno) << std::endl;
+        return migrated;
+    }
+    
+    // Sources are removed through a parallel removal of the base directory
+    const std::shared_ptr<RestartWorkerPool> pool = getWorkerPool();
+    std::unique_ptr<PendingRemoval> removal = startParallelRemoval({}, control, *pool);
+    if (!removal) return migrated;
+    
+    struct Migration
+    {
+        std::string name;
+        bool skipped = false;
+        bool renamed = false;
+        bool copied = false;
+        bool published = false;
+        std::size_t copy_id = 0;
+        std::size_t removal_id = 0;
+        std::string error;
+    };
+    std::vector<Migration> migrations(dirs.size());
+    std::vector<std::size_t> copy_targets;
+    std::mutex mutex;
+    
+    // Publish a finished copy and start removing its source, while the
+    // other copies proceed
+    ParallelTreeCopier copier(*pool, control.cancel, [&](std::size_t copy_id) {
+        const std::string error = copier.getError(copy_id);
+        std::lock_guard<std::mutex> lock(mutex);
+        Migration& migration = migrations[copy_targets[copy_id]];
+        const std::string staging = migration.name + MIGRATING_SUFFIX;
+        migration.error = error;
+        if (migration.error.empty() && ::syncfs(archive->fd) != 0)
+        {
+            migration.error = "cannot sync the archive: " + errnoString(errno);
+        }
+        if (migration.error.empty() &&
+            ::renameat2(archive->fd, staging.c_str(), archive->fd, migration.name.c_str(), RENAME_NOREPLACE) != 0)
+        {
+            migration.error = "cannot publish the copy: " + errnoString(errno);
+        }
+        if (!migration.error.empty())
+        {
+            std::error_code remove_ec;
+            fs::remove_all(fs::path(d_archive_path) / staging, remove_ec);
+            return;
+        }
+        ::fsync(archive->fd);
+        migration.published = true;
+        migration.removal_id = removal->remover.remove(migration.name);
+    });
+    
+    for (std::size_t i = 0; i < dirs.size(); ++i)
+    {
+        Migration& migration = migrations[i];
+        migration.name = dirs[i].filename().string();
+        if (control.isCancelled())
+        {
+            migration.skipped = true;
+            continue;
+        }
+        
+        // Within one file system a rename moves the whole tree at once
+        if (control.stats) ++control.stats->counters.rename;
+        if (::renameat2(base->fd, migration.name.c_str(), archive->fd, migration.name.c_str(), RENAME_NOREPLACE) == 0)
+        {
+            migration.renamed = true;
+            continue;
+        }
+        if (errno != EXDEV)
+        {
+            migration.error = errno == EEXIST ? "already in the archive" : errnoString(errno);
+            continue;
+        }
+        if (::faccessat(archive->fd, migration.name.c_str(), F_OK, AT_SYMLINK_NOFOLLOW) == 0)
+        {
+            migration.error = "already in the archive";
+            continue;
+        }
+        
+        // Staging directories of an interrupted migration are incomplete
+        const std::string staging = migration.name + MIGRATING_SUFFIX;
+        fs::remove_all(fs::path(d_archive_path) / staging, ec);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            copy_targets.push_back(i);
+        }
+        migration.copied = true;
+        migration.copy_id = copier.copy(base, migration.name, archive, staging);
+    }
+    copier.wait();
+    removal->remover.wait();
+    if (control.stats && removal->throttle)
+    {
+        control.stats->report.throttle_seconds += removal->throttle->getWaitSeconds();
+    }
+    
+    for (const Migration& migration : migrations)
+    {
+        const fs::path dir_path = parent / migration.name;
+        if (migration.skipped)
+        {
+            std::cout << "  Cancelled before " << dir_path << std::endl;
+            continue;
+        }
+        
+        DirectoryReport directory;
+        directory.name = migration.name;
+        directory.error = migration.error;
+        if (migration.copied)
+        {
+            directory.seconds = copier.getSeconds(migration.copy_id);
+            if (migration.published)
+            {
+                const std::string error = removal->remover.getError(migration.removal_id);
+                directory.entries = removal->remover.getEntries(migration.removal_id);
+                directory.seconds += removal->remover.getSeconds(migration.removal_id);
+                if (!error.empty()) directory.error = "copied, but cannot remove the source: " + error;
+            }
+        }
+        directory.removed = directory.error.empty();
+        
+        if (!directory.removed)
+        {
+            std::cerr << "  Error migrating " << dir_path << ": " << directory.error << std::endl;
+        }
+        else if (migration.renamed)
+        {
+            std::cout << "  Migrated " << dir_path << " to " << fs::path(d_archive_path) << std::endl;
+        }
+        else
+        {
+            std::cout << "  Migrated " << dir_path << " to " << fs::path(d_archive_path) << " ("
+                      << copier.getFiles(migration.copy_id) << " files copied)" << std::endl;
+        }
+        if (directory.removed) migrated.push_back(migration.name);
+        
+        if (control.stats)
+        {
+            if (migration.published) control.stats->report.bytes_copied += copier.getBytes(migration.copy_id);
+            control.stats->addDirectory(directory);
+        }
     }
+    return migrated;
 }
 
-void RestartCleaner::cleanup()
+std::vector<std::string> RestartCleaner::packRestartDirs(const std::vector<fs::path>& dirs,
+                                                         const RunControl& control) const
 {
-    std::cout << "RestartCleaner: Starting cleanup of " << d_restart_base_path << std::endl;
-    std::cout << "Keeping " << d_keep_restart_count << " most recent restart directories" << std::endl;
+    std::vector<std::string> packed;
+    if (dirs.empty()) return packed;
     
-    executeStrategy();
-}
-
-std::vector<int> RestartCleaner::getAvailableIterations() const
-{
-    std::vector<int> iterations;
+    const std::shared_ptr<RestartWorkerPool> pool = getWorkerPool();
+    std::unique_ptr<PendingRemoval> removal = startParallelRemoval({}, control, *pool);
+    if (!removal) return packed;
     
-    try
+    struct Packing
     {
-        std::vector<fs::path> all_dirs = getAllRestartDirs(d_restart_base_path);
-        
-        for (const auto& dir : all_dirs)
+        std::uintmax_t pack_bytes = 0;
+        std::uintmax_t num_files = 0;
+        double seconds = 0.0;
+        std::string error;
+        std::size_t removal_id = 0;
+        bool written = false;
+        bool skipped = false;
+    };
+    std::vector<Packing> packings(dirs.size());
+    
+    // Removing a packed directory overlaps with packing the next one
+    for (std::size_t i = 0; i < dirs.size(); ++i)
+    {
+        Packing& packing = packings[i];
+        if (control.isCancelled())
         {
-            int iter = parseIterationNum(dir.filename().string());
-            if (iter >= 0)
-            {
-                iterations.push_back(iter);
-            }
+            packing.skipped = true;
+            continue;
         }
-        
-        std::sort(iterations.begin(), iterations.end());
+        const std::string name = dirs[i].filename().string();
+        const auto start = std::chrono::steady_clock::now();
+        packing.error = writePack(*pool, dirs[i].parent_path().string(), removal->base_fd, name, d_pack_codec,
+                                  control.cancel, packing.pack_bytes, packing.num_files);
+        packing.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (!packing.error.empty()) continue;
+        packing.written = true;
+        packing.removal_id = removal->remover.remove(name);
     }
-    catch (const std::exception& e)
+    removal->remover.wait();
+    if (control.stats && removal->throttle)
     {
-        std::cerr << "RestartCleaner: Error scanning directories: " << e.what() << std::endl;
+        control.stats->report.throttle_seconds += removal->throttle->getWaitSeconds();
     }
     
-    return iterations;
+    for (std::size_t i = 0; i < dirs.size(); ++i)
+    {
+        const Packing& packing = packings[i];
+        if (packing.skipped)
+        {
+            std::cout << "  Cancelled before " << dirs[i] << std::endl;
+            continue;
+        }
+        
+        DirectoryReport directory;
+        directory.name = dirs[i].filename().string();
+        directory.error = packing.error;
+        directory.seconds = packing.seconds;
+        if (packing.written)
+        {
+            const std::string error = removal->remover.getError(packing.removal_id);
+            directory.entries = removal->remover.getEntries(packing.removal_id);
+            directory.seconds += removal->remover.getSeconds(packing.removal_id);
+            if (!error.empty()) directory.error = "packed, but cannot remove the directory: " + error;
+        }
+        directory.removed = directory.error.empty();
+        
+        if (directory.removed)
+        {
+            packed.push_back(directory.name);
+            std::cout << "  Packed " << dirs[i] << " (" << packing.num_files << " files, " << packing.pack_bytes
+                      << " bytes)" << std::endl;
+        }
+        else
+        {
+            std::cerr << "  Error packing " << dirs[i] << ": " << directory.error << std::endl;
+        }
+        if (control.stats)
+        {
+            if (packing.written) control.stats->report.bytes_copied += packing.pack_bytes;
+            control.stats->addDirectory(directory);
+        }
+    }
+    
+    // The cached index does not know about the new packs
+    std::lock_guard<std::mutex> lock(d_index_mutex);
+    d_cached_index_valid = false;
+    return packed;
 }
 
-/////////////////////////////// PRIVATE //////////////////////////////////////
-
-RestartCleaner::CleanupStrategy RestartCleaner::parseStrategy(const std::string& strategy_str) const
+std::unique_ptr<RestartCleaner::BaseLock> RestartCleaner::lockBasePath() const
 {
-    if (strategy_str == "KEEP_RECENT_N")
+    if (d_lock_mode == LockMode::OFF || d_dry_run) return nullptr;
+    
+    const fs::path lock_path = fs::path(d_restart_base_path) / LOCK_FILENAME;
+    auto lock = std::make_unique<BaseLock>();
+    lock->fd = ::open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock->fd < 0)
     {
-        return CleanupStrategy::KEEP_RECENT_N;
+        throw std::runtime_error("RestartCleaner: Cannot open lock file " + lock_path.string() + ": " +
+                                 errnoString(errno));
     }
     
-    throw std::invalid_argument("RestartCleaner: Unknown strategy: " + strategy_str);
+    // OFD locks belong to the open file description, so that two cleaners in
+    // one process exclude each other as well.  A partition locks one byte;
+    // an unpartitioned cleanup locks the whole file.
+    struct flock range = {};
+    range.l_type = F_WRLCK;
+    range.l_whence = SEEK_SET;
+    range.l_start = d_partition_count > 1 ? d_partition_index : 0;
+    range.l_len = d_partition_count > 1 ? 1 : 0;
+    const int command = d_lock_mode == LockMode::WAIT ? F_OFD_SETLKW : F_OFD_SETLK;
+    int result;
+    while ((result = ::fcntl(lock->fd, command, &range)) != 0 && errno == EINTR)
+    {
+    }
+    if (result == 0)
+    {
+        lock->held = true;
+    }
+    else if (errno != EAGAIN && errno != EACCES)
+    {
+        throw std::runtime_error("RestartCleaner: Cannot lock " + lock_path.string() + ": " + errnoString(errno));
+    }
+    return lock;
 }
 
-void RestartCleaner::executeStrategy() const
+void RestartCleaner::keepPartitionVictims(const RestartIndex& index, std::vector<std::size_t>& victims) const
 {
-    // Currently only one strategy - direct call to avoid unnecessary complexity
-    // Future: expand to switch statement when more strategies are added
-    keepRecentN();
+    const std::size_t num_selected = victims.size();
+    victims.erase(std::remove_if(victims.begin(), victims.end(),
+                                 [&](std::size_t i) {
+                                     // FNV-1a, which is the same in every build
+                                     std::uint64_t hash = 0xcbf29ce484222325ULL;
+                                     for (char c : index.getName(i))
+                                     {
+                                         hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ULL;
+                                     }
+                                     return static_cast<int>(hash % d_partition_count) != d_partition_index;
+                                 }),
+                  victims.end());
+    std::cout << "Partition " << d_partition_index << " of " << d_partition_count << ": taking " << victims.size()
+              << " of the " << num_selected << " selected restart directories" << std::endl;
 }
 
-int RestartCleaner::parseIterationNum(const std::string& dirname) const
+void RestartCleaner::deduplicateRestartDirs(const RunControl& control) const
 {
-    // Expect format: "restore.XXXXXX" where XXXXXX is exactly 6 digits
-    if (dirname.length() != 14 || dirname.substr(0, 8) != "restore.")
+    struct HashEntry
     {
-        return -1;
+        std::uintmax_t size;
+        struct statx_timestamp mtime;
+        std::uint64_t ino;
+        std::uint32_t crc;
+    };
+    
+    const RestartIndex index = getRestartIndex();
+    std::vector<std::size_t> positions;
+    for (std::size_t i = 0; i < index.size(); ++i)
+    {
+        if (control.isManaged(index.getIteration(i))) positions.push_back(i);
     }
+    if (positions.size() < 2) return;
     
-    // Check that the remaining 6 characters are all digits
-    std::string number_part = dirname.substr(8);
-    if (number_part.length() != 6)
+    const int base_fd = ::open(d_restart_base_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (base_fd < 0)
     {
-        return -1;
+        throw std::runtime_error("RestartCleaner: Error opening " + d_restart_base_path + ": " + errnoString(errno));
     }
+    SharedFd base(base_fd);
     
-    for (char c : number_part)
+    const std::shared_ptr<RestartWorkerPool> pool = getWorkerPool();
+    ParallelFileSharer sharer(*pool, d_dedup_mode == DedupMode::AUTO);
+    std::vector<std::shared_ptr<SharedFd>> roots(positions.size());
+    for (std::size_t k = 0; k < positions.size(); ++k)
     {
-        if (!std::isdigit(c))
+        const std::string dir_name(index.getName(positions[k]));
+        const int dir_fd = ::openat(base.fd, dir_name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dir_fd < 0)
         {
-            return -1;
+            std::cerr << "  Error deduplicating " << dir_name << ": cannot open: " << errnoString(errno) << std::endl;
+            continue;
+        }
+        roots[k] = std::make_shared<SharedFd>(dir_fd);
+        sharer.list(k, roots[k]);
+    }
+    sharer.wait();
+    for (const auto& error : sharer.getListErrors())
+    {
+        std::cerr << "  Error deduplicating: " << error << std::endl;
+    }
+    
+    // Only files that share their size with a file of another inode can have duplicates
+    std::vector<ParallelFileSharer::File>& files = sharer.getFiles();
+    std::sort(files.begin(), files.end(), [](const ParallelFileSharer::File& a, const ParallelFileSharer::File& b) {
+        if (a.stx.stx_size != b.stx.stx_size) return a.stx.stx_size < b.stx.stx_size;
+        return a.stx.stx_ino < b.stx.stx_ino;
+    });
+    std::vector<std::size_t> candidates;
+    for (std::size_t begin = 0, end = 0; begin < files.size(); begin = end)
+    {
+        while (end < files.size() && files[end].stx.stx_size == files[begin].stx.stx_size) ++end;
+        if (files[begin].stx.stx_size < DEDUP_MIN_FILE_SIZE) continue;
+        if (files[begin].stx.stx_ino == files[end - 1].stx.stx_ino) continue;
+        for (std::size_t i = begin; i < end; ++i)
+        {
+            candidates.push_back(i);
         }
     }
     
-    try
+    // Load the manifest: "<dir>/<path> <size> <mtime sec> <mtime nsec> <inode> <crc32c>" per line
+    const fs::path manifest_path = fs::path(d_restart_base_path) / DEDUP_MANIFEST_FILENAME;
+    std::unordered_map<std::string, HashEntry> manifest;
     {
-        return std::stoi(number_part);
+        std::ifstream manifest_file(manifest_path);
+        std::string path;
+        HashEntry entry;
+        while (manifest_file >> path >> entry.size >> entry.mtime.tv_sec >> entry.mtime.tv_nsec >> entry.ino >>
+               std::hex >> entry.crc >> std::dec)
+        {
+            manifest[path] = entry;
+        }
     }
-    catch (...)
+    const auto manifest_key = [&](const ParallelFileSharer::File& file) {
+        return std::string(index.getName(positions[file.dir])) + "/" + file.path;
+    };
+    
+    ParallelChecksummer checksummer(*pool);
+    std::vector<std::uint32_t> crcs(files.size());
+    std::vector<std::pair<std::size_t, std::size_t>> checksum_ids;
+    std::size_t num_cached = 0;
+    for (std::size_t i : candidates)
     {
-        return -1;
+        const ParallelFileSharer::File& file = files[i];
+        const auto it = manifest.find(manifest_key(file));
+        if (it != manifest.end() && it->second.size == file.stx.stx_size && it->second.ino == file.stx.stx_ino &&
+            it->second.mtime.tv_sec == file.stx.stx_mtime.tv_sec &&
+            it->second.mtime.tv_nsec == file.stx.stx_mtime.tv_nsec)
+        {
+            crcs[i] = it->second.crc;
+            ++num_cached;
+        }
+        else
+        {
+            checksum_ids.emplace_back(i, checksummer.checksum(roots[file.dir], file.path));
+        }
     }
-}
-
-std::vector<fs::path> RestartCleaner::getAllRestartDirs(const std::string& restart_dir) const
-{
-    std::vector<fs::path> restart_dirs;
+    checksummer.wait();
     
-    try
+    std::vector<bool> unreadable(files.size(), false);
+    for (const auto& id : checksum_ids)
+    {
+        const std::string error = checksummer.getError(id.second);
+        if (error.empty())
+        {
+            crcs[id.first] = checksummer.getChecksum(id.second);
+            continue;
+        }
+        std::cerr << "  Error deduplicating " << manifest_key(files[id.first]) << ": " << error << std::endl;
+        unreadable[id.first] = true;
+    }
+    std::vector<std::size_t> hashed;
+    for (std::size_t i : candidates)
     {
-        if (fs::exists(restart_dir))
+        if (!unreadable[i]) hashed.push_back(i);
+    }
+    
+    // Within each group of equal size and checksum, share the data of the newest copy
+    std::sort(hashed.begin(), hashed.end(), [&](std::size_t a, std::size_t b) {
+        if (files[a].stx.stx_size != files[b].stx.stx_size) return files[a].stx.stx_size < files[b].stx.stx_size;
+        if (crcs[a] != crcs[b]) return crcs[a] < crcs[b];
+        return files[a].dir > files[b].dir;
+    });
+    std::vector<std::pair<std::size_t, std::size_t>> share_ids;
+    std::uintmax_t num_files = 0;
+    std::uintmax_t num_bytes = 0;
+    for (std::size_t begin = 0, end = 0; begin < hashed.size(); begin = end)
+    {
+        const ParallelFileSharer::File& source = files[hashed[begin]];
+        const std::uint32_t crc = crcs[hashed[begin]];
+        while (end < hashed.size() && files[hashed[end]].stx.stx_size == source.stx.stx_size &&
+               crcs[hashed[end]] == crc)
+        {
+            ++end;
+        }
+        for (std::size_t k = begin + 1; k < end; ++k)
         {
-            for (const auto& entry : fs::directory_iterator(restart_dir))
+            const ParallelFileSharer::File& copy = files[hashed[k]];
+            if (copy.stx.stx_ino == source.stx.stx_ino || control.isCancelled()) continue;
+            if (d_dry_run)
             {
-                if (entry.is_directory())
-                {
-                    std::string dirname = entry.path().filename().string();
-                    if (parseIterationNum(dirname) >= 0)
-                    {
-                        restart_dirs.push_back(entry.path());
-                    }
-                }
+                ++num_files;
+                if (copy.stx.stx_nlink <= 1) num_bytes += static_cast<std::uintmax_t>(copy.stx.stx_blocks) * 512;
+                continue;
             }
+            share_ids.emplace_back(hashed[k], sharer.share(roots[source.dir], source, roots[copy.dir], copy));
         }
     }
-    catch (const std::exception& e)
+    sharer.wait();
+    
+    std::size_t num_reflinked = 0;
+    std::vector<std::string> errors;
+    for (const auto& id : share_ids)
+    {
+        ParallelFileSharer::File& copy = files[id.first];
+        const ParallelFileSharer::Result& result = sharer.getResult(id.second);
+        if (!result.error.empty())
+        {
+            std::cerr << "  Error deduplicating " << manifest_key(copy) << ": " << result.error << std::endl;
+            errors.push_back(manifest_key(copy) + ": " + result.error);
+            continue;
+        }
+        if (!result.shared) continue;
+        ++num_files;
+        num_bytes += result.bytes;
+        if (result.reflinked) ++num_reflinked;
+        copy.stx.stx_ino = result.stx.stx_ino;
+        copy.stx.stx_mtime = result.stx.stx_mtime;
+    }
+    
+    if (d_dry_run)
     {
-        throw std::runtime_error("RestartCleaner: Error scanning directory: " + std::string(e.what()));
+        std::cout << "  DRY RUN: Would deduplicate " << num_files << " files, reclaiming " << num_bytes << " bytes"
+                  << std::endl;
     }
+    else
+    {
+        std::cout << "Deduplicated " << num_files << " files in " << positions.size() << " restart directories ("
+                  << num_reflinked << " reflinked, " << num_files - num_reflinked << " hard linked), reclaimed "
+                  << num_bytes << " bytes; " << checksum_ids.size() << " files checksummed, " << num_cached
+                  << " from the manifest" << std::endl;
+    }
+    if (control.stats)
+    {
+        control.stats->report.files_deduplicated += num_files;
+        control.stats->report.bytes_deduplicated += num_bytes;
+        control.stats->report.errors.insert(control.stats->report.errors.end(), errors.begin(), errors.end());
+    }
+    if (d_dry_run || (checksum_ids.empty() && share_ids.empty() && manifest.size() == hashed.size())) return;
     
-    return restart_dirs;
+    // Rewrite the manifest with the current files only, atomically
+    const fs::path tmp_path = manifest_path.string() + ".tmp";
+    {
+        std::ofstream manifest_file(tmp_path, std::ios::trunc);
+        for (std::size_t i : hashed)
+        {
+            const ParallelFileSharer::File& file = files[i];
+            char crc_text[16];
+            std::snprintf(crc_text, sizeof(crc_text), "%08x", static_cast<unsigned int>(crcs[i]));
+            manifest_file << manifest_key(file) << ' ' << file.stx.stx_size << ' ' << file.stx.stx_mtime.tv_sec << ' '
+                          << file.stx.stx_mtime.tv_nsec << ' ' << file.stx.stx_ino << ' ' << crc_text << '\n';
+        }
+    }
+    std::error_code ec;
+    fs::rename(tmp_path, manifest_path, ec);
+    if (ec)
+    {
+        std::cerr << "  Warning: cannot update deduplication manifest " << manifest_path << ": " << ec.message()
+                  << std::endl;
+    }
 }
 
-void RestartCleaner::keepRecentN() const
+/////////////////////////////// RestartWatcher ///////////////////////////////
+
+struct RestartWatcher::WatchState
 {
-    std::vector<fs::path> all_dirs = getAllRestartDirs(d_restart_base_path);
+    using Clock = std::chrono::steady_clock;
     
-    if (all_dirs.empty())
+    /*!
+     * \brief A restart directory that is still being written.
+     */
+    struct PendingDir
     {
-        std::cout << "No restart directories found" << std::endl;
-        return;
+        int iteration = -1;
+        Clock::time_point last_activity;
+        std::vector<int> watches;
+    };
+    
+    /*!
+     * \brief What an inotify watch descriptor refers to.
+     */
+    struct Watch
+    {
+        std::string owner;
+        std::string path;
+    };
+    
+    int base_watch = -1;
+    std::map<int, std::string> finalized;
+    std::map<std::string, PendingDir> pending;
+    std::unordered_map<int, Watch> watches;
+    bool finalized_changed = false;
+    bool base_gone = false;
+};
+
+RestartWatcher::RestartWatcher(RestartCleaner& cleaner, double quiescence_seconds, const std::string& marker_name)
+    : d_cleaner(cleaner), d_quiescence_seconds(quiescence_seconds), d_marker_name(marker_name)
+{
+    d_inotify_fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    d_stop_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (d_inotify_fd < 0 || d_stop_fd < 0)
+    {
+        const int err = errno;
+        if (d_inotify_fd >= 0) ::close(d_inotify_fd);
+        if (d_stop_fd >= 0) ::close(d_stop_fd);
+        throw std::runtime_error("RestartWatcher: Cannot set up inotify: " + errnoString(err));
     }
+}
+
+RestartWatcher::~RestartWatcher()
+{
+    ::close(d_inotify_fd);
+    ::close(d_stop_fd);
+}
+
+void RestartWatcher::stop()
+{
+    const std::uint64_t one = 1;
+    ssize_t ignored = ::write(d_stop_fd, &one, sizeof(one));
+    (void)ignored;
+}
+
+std::size_t RestartWatcher::getNumCleanups() const
+{
+    return d_num_cleanups.load();
+}
+
+void RestartWatcher::run()
+{
+    using Clock = WatchState::Clock;
+    const std::string& base_path = d_cleaner.d_restart_base_path;
+    const auto quiescence = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(d_quiescence_seconds));
+    WatchState state;
+    
+    const auto has_marker = [&](const std::string& name) {
+        const std::string marker_path = base_path + "/" + name + "/" + d_marker_name;
+        return ::access(marker_path.c_str(), F_OK) == 0;
+    };
     
-    std::cout << "Found " << all_dirs.size() << " restart directories" << std::endl;
+    const auto stop_watching = [&](const std::string& name) {
+        const auto it = state.pending.find(name);
+        if (it == state.pending.end()) return;
+        for (int wd : it->second.watches)
+        {
+            ::inotify_rm_watch(d_inotify_fd, wd);
+            state.watches.erase(wd);
+        }
+        state.pending.erase(it);
+    };
     
-    // Parse iteration numbers and sort
-    std::vector<std::pair<int, fs::path>> dirs_with_iter;
+    const auto finalize = [&](const std::string& name, int iteration, const char* reason) {
+        stop_watching(name);
+        state.finalized[iteration] = name;
+        state.finalized_changed = true;
+        std::cout << "RestartWatcher: " << name << " finalized (" << reason << ")" << std::endl;
+    };
     
-    for (const auto& dir : all_dirs)
-    {
-        int iter = parseIterationNum(dir.filename().string());
-        if (iter >= 0)
+    const auto watch_dir = [&](const std::string& owner, const std::string& path) {
+        const int wd = ::inotify_add_watch(d_inotify_fd, (base_path + "/" + path).c_str(), WATCH_PENDING_MASK);
+        if (wd < 0) return;
+        state.watches[wd] = { owner, path };
+        state.pending[owner].watches.push_back(wd);
+    };
+    
+    // A new restart directory is watched before it is checked for the
+    // marker, so that a marker created in between is not missed
+    const auto add_pending = [&](const std::string& name, int iteration) {
+        if (state.pending.count(name) != 0 || state.finalized.count(iteration) != 0) return;
+        WatchState::PendingDir& dir = state.pending[name];
+        dir.iteration = iteration;
+        dir.last_activity = Clock::now();
+        watch_dir(name, name);
+        if (!d_marker_name.empty() && has_marker(name)) finalize(name, iteration, "marker");
+    };
+    
+    // Initial (and, after an event queue overflow, repeated) full scan.  Old
+    // restart directories count as finalized; recently modified ones, or
+    // ones without the marker, are watched until they are finalized.
+    const auto resync = [&]() {
+        for (auto& entry : state.watches)
         {
-            dirs_with_iter.push_back({iter, dir});
+            ::inotify_rm_watch(d_inotify_fd, entry.first);
         }
-    }
+        state.watches.clear();
+        state.pending.clear();
+        state.finalized.clear();
+        state.finalized_changed = true;
+        
+        const RestartIndex index = d_cleaner.scanRestartIndex();
+        const auto now = std::chrono::system_clock::now();
+        for (std::size_t i = 0; i < index.size(); ++i)
+        {
+            const std::string name(index.getName(i));
+            struct stat st;
+            bool recent = false;
+            if (::stat((base_path + "/" + name).c_str(), &st) == 0)
+            {
+                const auto mtime = std::chrono::seconds(st.st_mtim.tv_sec) + std::chrono::nanoseconds(st.st_mtim.tv_nsec);
+                recent = now.time_since_epoch() - mtime < quiescence;
+            }
+            const bool unmarked = !d_marker_name.empty() && !has_marker(name);
+            if (recent && (d_marker_name.empty() || unmarked))
+            {
+                add_pending(name, index.getIteration(i));
+            }
+            else
+            {
+                state.finalized[index.getIteration(i)] = name;
+            }
+        }
+    };
     
-    std::sort(dirs_with_iter.begin(), dirs_with_iter.end());
+    const auto handle_event = [&](const struct inotify_event& event) {
+        const std::string name = event.len > 0 ? event.name : "";
+        if (event.mask & IN_Q_OVERFLOW)
+        {
+            std::cout << "RestartWatcher: Event queue overflow, rescanning " << base_path << std::endl;
+            resync();
+            return;
+        }
+        
+        if (event.wd == state.base_watch)
+        {
+            if (event.mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+            {
+                state.base_gone = true;
+                return;
+            }
+            const int iteration = d_cleaner.d_name_pattern.match(name);
+            if (iteration < 0 || !(event.mask & IN_ISDIR)) return;
+            
+            if (event.mask & IN_CREATE)
+            {
+                add_pending(name, iteration);
+            }
+            else if (event.mask & IN_MOVED_TO)
+            {
+                // A directory renamed into place has been written completely
+                if (state.finalized.count(iteration) == 0) finalize(name, iteration, "renamed into place");
+            }
+            else if (event.mask & (IN_DELETE | IN_MOVED_FROM))
+            {
+                // Removals, including our own, never call for another cleanup
+                stop_watching(name);
+                state.finalized.erase(iteration);
+            }
+            return;
+        }
+        
+        const auto watch = state.watches.find(event.wd);
+        if (watch == state.watches.end()) return;
+        if (event.mask & IN_IGNORED)
+        {
+            state.watches.erase(watch);
+            return;
+        }
+        const std::string owner = watch->second.owner;
+        const std::string path = watch->second.path;
+        const auto dir = state.pending.find(owner);
+        if (dir == state.pending.end()) return;
+        
+        dir->second.last_activity = Clock::now();
+        if ((event.mask & IN_ISDIR) && (event.mask & (IN_CREATE | IN_MOVED_TO)))
+        {
+            watch_dir(owner, path + "/" + name);
+        }
+        else if (!d_marker_name.empty() && path == owner && name == d_marker_name &&
+                 (event.mask & (IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE)))
+        {
+            finalize(owner, dir->second.iteration, "marker");
+        }
+    };
     
-    // Determine which directories to delete
-    if (static_cast<int>(dirs_with_iter.size()) <= d_keep_restart_count)
+    state.base_watch = ::inotify_add_watch(d_inotify_fd, base_path.c_str(), WATCH_BASE_MASK);
+    if (state.base_watch < 0)
     {
-        std::cout << "No cleanup needed, keeping all " << dirs_with_iter.size() << " directories" << std::endl;
-        return;
+        throw std::runtime_error("RestartWatcher: Cannot watch " + base_path + ": " + errnoString(errno));
     }
+    resync();
+    std::cout << "RestartWatcher: Watching " << base_path << " (" << state.finalized.size() << " restart directories, "
+              << state.pending.size() << " being written)" << std::endl;
     
-    // Delete old directories
-    int num_to_delete = dirs_with_iter.size() - d_keep_restart_count;
-    std::cout << "Deleting " << num_to_delete << " old restart directories (keeping " 
-              << d_keep_restart_count << " most recent)" << std::endl;
-    
-    for (int i = 0; i < num_to_delete; ++i)
+    std::vector<char> buffer(GETDENTS_BUFFER_SIZE);
+    while (!state.base_gone)
     {
-        const fs::path& dir_path = dirs_with_iter[i].second;
+        // Run the strategy once per batch of finalized restart directories,
+        // under the lock on the base path like any other cleanup.  A batch
+        // skipped because another process holds the lock is retried.
+        bool skipped = false;
+        if (state.finalized_changed && !state.finalized.empty())
+        {
+            const std::unique_ptr<RestartCleaner::BaseLock> lock = d_cleaner.lockBasePath();
+            if (lock && !lock->held)
+            {
+                std::cout << "RestartWatcher: Another process is cleaning up " << base_path << ", retrying"
+                          << std::endl;
+                skipped = true;
+            }
+            else
+            {
+                RestartIndex index;
+                for (const auto& entry : state.finalized)
+                {
+                    index.addEntry(entry.first, entry.second);
+                }
+                RestartCleaner::RunControl control;
+                d_cleaner.deleteRestartDirs(d_cleaner.selectVictimsFromIndex(index, control), control);
+                ++d_num_cleanups;
+            }
+        }
+        state.finalized_changed = skipped;
         
-        if (d_dry_run)
+        // Sleep until an event arrives, stop() is called, the quiescence
+        // window of the oldest pending restart directory ends or a skipped
+        // cleanup is due again
+        int timeout_ms = -1;
+        if (d_marker_name.empty())
+        {
+            for (const auto& entry : state.pending)
+            {
+                const auto remaining = entry.second.last_activity + quiescence - Clock::now();
+                const long ms = std::max<long>(
+                    0, std::chrono::duration_cast<std::chrono::milliseconds>(remaining).count() + 1);
+                timeout_ms = timeout_ms < 0 ? static_cast<int>(ms) : std::min(timeout_ms, static_cast<int>(ms));
+            }
+        }
+        if (skipped) timeout_ms = timeout_ms < 0 ? WATCH_LOCK_RETRY_MS : std::min(timeout_ms, WATCH_LOCK_RETRY_MS);
+        struct pollfd fds[2] = { { d_inotify_fd, POLLIN, 0 }, { d_stop_fd, POLLIN, 0 } };
+        if (::poll(fds, 2, timeout_ms) < 0 && errno != EINTR)
         {
-            std::cout << "  DRY RUN: Would delete " << dir_path << std::endl;
+            throw std::runtime_error("RestartWatcher: poll failed: " + errnoString(errno));
         }
-        else
+        if (fds[1].revents & POLLIN)
         {
-            try
+            std::uint64_t value;
+            ssize_t ignored = ::read(d_stop_fd, &value, sizeof(value));
+            (void)ignored;
+            break;
+        }
+        
+        for (;;)
+        {
+            const ssize_t nread = ::read(d_inotify_fd, buffer.data(), buffer.size());
+            if (nread <= 0) break;
+            for (ssize_t pos = 0; pos < nread;)
+            {
+                const auto* event = reinterpret_cast<const struct inotify_event*>(buffer.data() + pos);
+                pos += sizeof(struct inotify_event) + event->len;
+                handle_event(*event);
+            }
+        }
+        
+        if (d_marker_name.empty())
+        {
+            std::vector<std::pair<std::string, int>> quiet;
+            for (const auto& entry : state.pending)
             {
-                fs::remove_all(dir_path);
-                std::cout << "  Deleted " << dir_path << std::endl;
+                if (Clock::now() - entry.second.last_activity >= quiescence)
+                {
+                    quiet.emplace_back(entry.first, entry.second.iteration);
+                }
+            }
+            for (const auto& entry : quiet)
+            {
+                finalize(entry.first, entry.second, "quiescent");
             }
-            catch (const std::exception& e)
+        }
+    }
+    
+    for (auto& entry : state.watches)
+    {
+        ::inotify_rm_watch(d_inotify_fd, entry.first);
+    }
+    ::inotify_rm_watch(d_inotify_fd, state.base_watch);
+    if (state.base_gone) std::cout << "RestartWatcher: " << base_path << " is gone, stopping" << std::endl;
+}
+
+/////////////////////////////// RestartCleaner::CleanupReport ///////////////
+
+std::string RestartCleaner::CleanupReport::toJson() const
+{
+    std::ostringstream json;
+    json << "{\"base_path\": " << jsonString(base_path) << ", \"strategy\": " << jsonString(strategy)
+         << ", \"engine\": " << jsonString(engine) << ", \"dry_run\": " << (dry_run ? "true" : "false")
+         << ", \"tombstones\": " << (tombstones ? "true" : "false") << ", \"skipped\": " << (skipped ? "true" : "false")
+         << ", \"partition\": {\"index\": " << partition_index << ", \"count\": " << partition_count << "}"
+         << ", \"action\": " << jsonString(action)
+         << ", \"archive_path\": " << (archive_path.empty() ? "null" : jsonString(archive_path));
+    json << ", \"phases\": {\"scan_seconds\": " << scan_seconds << ", \"sort_seconds\": " << sort_seconds
+         << ", \"plan_seconds\": " << plan_seconds << ", \"delete_seconds\": " << delete_seconds
+         << ", \"total_seconds\": " << total_seconds << "}";
+    json << ", \"entries_scanned\": " << entries_scanned
+         << ", \"catalog_used\": " << (catalog_used ? "true" : "false") << ", \"num_found\": " << num_found
+         << ", \"num_selected\": " << num_selected << ", \"num_pinned\": " << num_pinned
+         << ", \"num_deleted\": " << num_deleted
+         << ", \"throttle_seconds\": " << throttle_seconds << ", \"bytes_copied\": " << bytes_copied
+         << ", \"files_deduplicated\": " << files_deduplicated << ", \"bytes_deduplicated\": " << bytes_deduplicated
+         << ", \"entries_unlinked\": " << entries_unlinked
+         << ", \"bytes_unlinked\": ";
+    if (bytes_known)
+    {
+        json << bytes_unlinked;
+    }
+    else
+    {
+        json << "null";
+    }
+    json << ", \"syscalls\": {\"open\": " << syscalls.open << ", \"getdents\": " << syscalls.getdents
+         << ", \"stat\": " << syscalls.stat << ", \"unlink\": " << syscalls.unlink << ", \"rmdir\": " << syscalls.rmdir
+         << ", \"rename\": " << syscalls.rename << "}";
+    
+    json << ", \"directories\": [";
+    for (std::size_t i = 0; i < directories.size(); ++i)
+    {
+        const DirectoryReport& directory = directories[i];
+        json << (i == 0 ? "" : ", ") << "{\"name\": " << jsonString(directory.name)
+             << ", \"removed\": " << (directory.removed ? "true" : "false") << ", \"seconds\": " << directory.seconds
+             << ", \"entries\": " << directory.entries << ", \"bytes\": ";
+        if (bytes_known)
+        {
+            json << directory.bytes;
+        }
+        else
+        {
+            json << "null";
+        }
+        json << ", \"error\": " << (directory.error.empty() ? "null" : jsonString(directory.error)) << "}";
+    }
+    json << "], \"errors\": [";
+    for (std::size_t i = 0; i < errors.size(); ++i)
+    {
+        json << (i == 0 ? "" : ", ") << jsonString(errors[i]);
+    }
+    json << "]}";
+    return json.str();
+}
+
+/////////////////////////////// RestartCleaner::CleanupPlan /////////////////
+
+void RestartCleaner::CleanupPlan::save(const std::string& path) const
+{
+    // One "<key> <value>" per line; names and paths take the rest of the line
+    std::ostringstream text;
+    text.precision(17);
+    text << PLAN_HEADER << '\n'
+         << "base_path " << base_path << '\n'
+         << "strategy " << strategy << '\n'
+         << "action " << action << '\n'
+         << "keep " << keep_restart_count << '\n'
+         << "created " << created << '\n'
+         << "found " << num_found << '\n'
+         << "cost " << seconds_per_entry << ' ' << cost_source << '\n'
+         << "predicted " << predicted_seconds << '\n';
+    for (const auto& directory : directories)
+    {
+        text << "dir " << directory.iteration << ' ' << directory.inode << ' ' << directory.mtime_ns << ' '
+             << directory.entries << ' ' << directory.bytes << ' ' << directory.name << '\n';
+    }
+    
+    const std::string tmp_path = path + ".tmp";
+    {
+        std::ofstream file(tmp_path, std::ios::trunc);
+        file << text.str();
+        if (!file.flush())
+        {
+            throw std::runtime_error("RestartCleaner: Error writing plan " + tmp_path);
+        }
+    }
+    std::error_code ec;
+    fs::rename(tmp_path, path, ec);
+    if (ec)
+    {
+        throw std::runtime_error("RestartCleaner: Error writing plan " + path + ": " + ec.message());
+    }
+}
+
+RestartCleaner::CleanupPlan RestartCleaner::CleanupPlan::load(const std::string& path)
+{
+    std::ifstream file(path);
+    std::string line;
+    if (!std::getline(file, line) || line != PLAN_HEADER)
+    {
+        throw std::runtime_error("RestartCleaner: Not a cleanup plan: " + path);
+    }
+    
+    CleanupPlan plan;
+    while (std::getline(file, line))
+    {
+        std::istringstream fields(line);
+        std::string key;
+        fields >> key;
+        fields >> std::ws;
+        if (key == "base_path") std::getline(fields, plan.base_path);
+        else if (key == "strategy") fields >> plan.strategy;
+        else if (key == "action") fields >> plan.action;
+        else if (key == "keep") fields >> plan.keep_restart_count;
+        else if (key == "created") fields >> plan.created;
+        else if (key == "found") fields >> plan.num_found;
+        else if (key == "cost") fields >> plan.seconds_per_entry >> plan.cost_source;
+        else if (key == "predicted") fields >> plan.predicted_seconds;
+        else if (key == "dir")
+        {
+            PlannedDirectory directory;
+            fields >> directory.iteration >> directory.inode >> directory.mtime_ns >> directory.entries >>
+                directory.bytes;
+            if (fields.fail())
             {
-                std::cerr << "  Error deleting " << dir_path << ": " << e.what() << std::endl;
+                throw std::runtime_error("RestartCleaner: Invalid line in cleanup plan " + path + ": " + line);
             }
+            std::getline(fields >> std::ws, directory.name);
+            plan.total_entries += directory.entries;
+            plan.total_bytes += directory.bytes;
+            plan.directories.push_back(std::move(directory));
+            continue;
+        }
+        if (fields.fail())
+        {
+            throw std::runtime_error("RestartCleaner: Invalid line in cleanup plan " + path + ": " + line);
+        }
+    }
+    if (plan.base_path.empty() || plan.keep_restart_count <= 0)
+    {
+        throw std::runtime_error("RestartCleaner: Incomplete cleanup plan: " + path);
+    }
+    for (const auto& directory : plan.directories)
+    {
+        if (directory.name.empty() || directory.name.find('/') != std::string::npos || directory.name[0] == '.')
+        {
+            throw std::runtime_error("RestartCleaner: Invalid directory in cleanup plan " + path + ": " +
+                                     directory.name);
         }
     }
+    return plan;
 }
 
 // } // Future IBAMR integration namespace
@@ -18,9 +18,26 @@
 
 /////////////////////////////// INCLUDES /////////////////////////////////////
 
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
 #include <vector>
-#include <filesystem>
+
+#if defined(RESTART_CLEANER_WITH_MPI)
+#include <mpi.h>
+#endif
 
 namespace fs = std::filesystem;
 
@@ -30,136 +47,1852 @@ namespace fs = std::filesystem;
 /////////////////////////////// CLASS DEFINITION /////////////////////////////
 
 /*!
- * \brief Class RestartCleaner provides functionality to manage restart directories.
+ * \brief Class RestartWorkerPool is a fixed-size, work-stealing pool of threads.
  *
- * This class provides methods to automatically clean up old restart directories while
- * keeping the most recent ones. Supports extensible cleanup strategies.
- * It is designed to work with IBAMR's standard restart directory naming convention.
+ * The pool is used by the parallel engines of RestartCleaner to spread
+ * directory scans and unlink operations over several workers, and can be
+ * shared by several RestartCleaner objects (see RestartCleaner::cleanupBatch()).
+ * Each worker has its own task queue: tasks submitted by a worker go to its
+ * own queue and are run newest first, which keeps a directory walk depth
+ * first and cache friendly, while idle workers steal the oldest tasks of
+ * other workers.  Tasks submitted by other threads are distributed through a
+ * shared queue.  Tasks must not throw; completion tracking is left to the
+ * submitter.
+ */
+class RestartWorkerPool
+{
+public:
+    /*!
+     * \brief Constructor.
+     *
+     * \param num_threads Number of worker threads (must be positive)
+     */
+    explicit RestartWorkerPool(int num_threads);
+
+    /*!
+     * \brief Destructor.  Finishes all queued tasks and joins the workers.
+     */
+    ~RestartWorkerPool();
+
+    /*!
+     * \brief Queue a task for execution on one of the workers.
+     */
+    void submit(std::function<void()> task);
+
+    /*!
+     * \brief Get the number of worker threads.
+     */
+    int getNumThreads() const;
+
+private:
+    RestartWorkerPool() = delete;
+    RestartWorkerPool(const RestartWorkerPool& from) = delete;
+    RestartWorkerPool& operator=(const RestartWorkerPool& that) = delete;
+
+    /*!
+     * \brief Task queue owned by one worker (or, the last one, shared by all
+     * submitters that are not workers of this pool).
+     */
+    struct TaskQueue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    /*!
+     * \brief Main loop of each worker thread.
+     */
+    void workerLoop(std::size_t worker_index);
+
+    /*!
+     * \brief Take a task from the worker's own queue, the shared queue or
+     * another worker's queue, in that order.
+     */
+    bool takeTask(std::size_t worker_index, std::function<void()>& task);
+
+    std::vector<std::thread> d_workers;
+    std::vector<std::unique_ptr<TaskQueue>> d_queues;
+    std::mutex d_mutex;
+    std::condition_variable d_cv;
+    std::size_t d_num_queued = 0;
+    bool d_shutdown = false;
+};
+
+/*!
+ * \brief Extract the iteration number from a name of the form
+ * <prefix><digits><suffix>.
  *
- * The main functionalities include:
- * -# Scan a specified directory for subdirectories matching the pattern "restore.XXXXXX"
- * -# Parse iteration numbers from these directory names
- * -# Sort directories based on iteration numbers  
- * -# Keep the N most recent directories and delete the rest
+ * The digit field has between \p min_digits and \p max_digits digits (no
+ * upper bound if \p max_digits is zero).  Digits beyond \p min_digits must not
+ * be leading zeros, which is what printf("%06d") produces past 999999.  If
+ * \p optional_suffix is set, the name may also end right after the digits.
  *
- * \note This class assumes restart directories follow the naming pattern "restore.XXXXXX"
- * where XXXXXX is a zero-padded iteration number.
+ * \return The iteration number, or -1 if the name does not match or the
+ *         number does not fit in an int
+ */
+constexpr int matchIterationName(std::string_view name,
+                                 std::string_view prefix,
+                                 std::size_t min_digits,
+                                 std::size_t max_digits,
+                                 std::string_view suffix,
+                                 bool optional_suffix) noexcept
+{
+    if (name.size() < prefix.size() + min_digits || name.substr(0, prefix.size()) != prefix) return -1;
+
+    std::size_t pos = prefix.size();
+    long long iteration = 0;
+    while (pos < name.size() && name[pos] >= '0' && name[pos] <= '9')
+    {
+        iteration = 10 * iteration + (name[pos] - '0');
+        if (iteration > 2147483647LL) return -1;
+        ++pos;
+    }
+    const std::size_t num_digits = pos - prefix.size();
+    if (num_digits < min_digits || (max_digits > 0 && num_digits > max_digits)) return -1;
+    if (num_digits > min_digits && name[prefix.size()] == '0') return -1;
+
+    const std::string_view rest = name.substr(pos);
+    if (rest != suffix && !(optional_suffix && rest.empty())) return -1;
+    return static_cast<int>(iteration);
+}
+
+/*!
+ * \brief Match \p name against a pattern fixed at compile time.
  *
- * Supported cleanup strategies:
- * - "KEEP_RECENT_N": Keep the N most recent restart directories (default)
- * - Future extensions: "SMART_RETENTION", "TIME_BASED", etc.
+ * \p Names provides static constexpr members prefix, min_digits, max_digits,
+ * suffix and optional_suffix, so that the matcher is specialized for them.
+ */
+template <class Names>
+constexpr int matchIterationName(std::string_view name) noexcept
+{
+    return matchIterationName(
+        name, Names::prefix, Names::min_digits, Names::max_digits, Names::suffix, Names::optional_suffix);
+}
+
+/*!
+ * \brief Restart directories written by SAMRAI's RestartManager: "restore.{6}".
+ */
+struct RestoreDirNames
+{
+    static constexpr std::string_view prefix = "restore.";
+    static constexpr std::size_t min_digits = 6;
+    static constexpr std::size_t max_digits = 6;
+    static constexpr std::string_view suffix = "";
+    static constexpr bool optional_suffix = false;
+};
+
+/*!
+ * \brief VisIt dump directories written by VisItDataWriter: "visit_dump.{5+}".
+ */
+struct VisItDumpNames
+{
+    static constexpr std::string_view prefix = "visit_dump.";
+    static constexpr std::size_t min_digits = 5;
+    static constexpr std::size_t max_digits = 0;
+    static constexpr std::string_view suffix = "";
+    static constexpr bool optional_suffix = false;
+};
+
+/*!
+ * \brief Lagrangian data directories written by LSiloDataWriter: "lag_data.cycle_{6+}".
+ */
+struct LagDataNames
+{
+    static constexpr std::string_view prefix = "lag_data.cycle_";
+    static constexpr std::size_t min_digits = 6;
+    static constexpr std::size_t max_digits = 0;
+    static constexpr std::string_view suffix = "";
+    static constexpr bool optional_suffix = false;
+};
+
+/*!
+ * \brief Class RestartNamePattern selects the directories a RestartCleaner
+ * manages and extracts their iteration numbers.
  *
- * Sample usage:
- * \code
- * // Basic usage
- * RestartCleaner cleaner("/path/to/restores", 5);
- * cleaner.cleanup();
- * // With dry run
- * RestartCleaner cleaner("/path/to/restores", 3, "KEEP_RECENT_N", true);
- * // Future strategy example:
- * // RestartCleaner cleaner("/path/to/restores", 5, "SMART_RETENTION");
- * // Verify results
- * auto iterations = cleaner.getAvailableIterations();
- * \endcode
+ * A pattern is written as a prefix, a digit field in braces and a suffix:
+ * - "{6}": exactly six digits
+ * - "{6+}": at least six digits
+ * - "{}": any number of digits
+ *
+ * A suffix in brackets is optional, e.g. "restore.{6}[.tar]".  The patterns of
+ * RestoreDirNames, VisItDumpNames and LagDataNames use their compile-time
+ * matchers; all other patterns are matched at run time.
  */
-class RestartCleaner
+class RestartNamePattern
 {
 public:
     /*!
-     * \brief Constructor.
+     * \brief The default pattern "restore.{6}".
+     */
+    RestartNamePattern();
+
+    /*!
+     * \brief Parse a pattern.
      *
-     * \param restart_base_path  Base directory containing restore folders
-     * \param keep_restart_count Number of recent restore directories to keep
-     * \param strategy          Cleanup strategy ("KEEP_RECENT_N", future: "SMART_RETENTION")  
-     * \param dry_run           If true, only report what would be deleted without actually deleting
+     * \throws std::invalid_argument if \p spec is malformed
      */
-    RestartCleaner(const std::string& restart_base_path,
-                   int keep_restart_count,
-                   const std::string& strategy = "KEEP_RECENT_N",
-                   bool dry_run = false);
+    explicit RestartNamePattern(const std::string& spec);
 
-    // Future IBAMR integration constructor:
-    // RestartCleaner(const std::string& object_name,
-    //                SAMRAI::tbox::Pointer<SAMRAI::tbox::Database> input_db);
+    /*!
+     * \brief Get the iteration number of \p name, or -1 if it does not match.
+     */
+    int match(std::string_view name) const
+    {
+        switch (d_kind)
+        {
+        case Kind::RESTORE:
+            return matchIterationName<RestoreDirNames>(name);
+        case Kind::VISIT_DUMP:
+            return matchIterationName<VisItDumpNames>(name);
+        case Kind::LAG_DATA:
+            return matchIterationName<LagDataNames>(name);
+        case Kind::CUSTOM:
+            break;
+        }
+        return matchIterationName(name, d_prefix, d_min_digits, d_max_digits, d_suffix, d_optional_suffix);
+    }
 
     /*!
-     * \brief Destructor.
+     * \brief Get the pattern as written.
      */
-    ~RestartCleaner() = default;
+    const std::string& getSpec() const
+    {
+        return d_spec;
+    }
+
+private:
+    enum class Kind
+    {
+        RESTORE,
+        VISIT_DUMP,
+        LAG_DATA,
+        CUSTOM
+    };
+
+    std::string d_spec;
+    Kind d_kind = Kind::CUSTOM;
+    std::string d_prefix;
+    std::string d_suffix;
+    std::size_t d_min_digits = 1;
+    std::size_t d_max_digits = 0;
+    bool d_optional_suffix = false;
+};
 
+/*!
+ * \brief Class RestartIndex holds the restart entries found by a single scan of
+ * a restart base directory.
+ *
+ * Entries are stored contiguously as (iteration, name, inode) triples; all names share
+ * one character buffer so that building the index does not allocate per
+ * entry.  The index is built once per scan and then reused for planning the
+ * cleanup, for getAvailableIterations() and for reporting.
+ */
+class RestartIndex
+{
+public:
     /*!
-     * \brief Scan and cleanup old restart directories.
-     *
-     * This method performs the complete cleanup process:
-     * 1. Scans the base directory for restart folders
-     * 2. Parses iteration numbers from directory names
-     * 3. Sorts directories by iteration number
-     * 4. Keeps the N most recent directories and deletes the rest
+     * \brief Append an entry; \p inode is 0 if unknown.
      */
-    void cleanup();
+    void addEntry(int iteration, std::string_view name, std::uint64_t inode = 0);
 
     /*!
-     * \brief Get available iteration numbers.
+     * \brief Sort the entries by ascending iteration number.
+     */
+    void sortByIteration();
+
+    /*!
+     * \brief Remove all entries whose names are contained in \p names.
+     */
+    void removeNames(const std::vector<std::string>& names);
+
+    /*!
+     * \brief Number of entries.
+     */
+    std::size_t size() const
+    {
+        return d_entries.size();
+    }
+
+    /*!
+     * \brief Whether the index has no entries.
+     */
+    bool empty() const
+    {
+        return d_entries.empty();
+    }
+
+    /*!
+     * \brief Iteration number of entry \p i.
+     */
+    int getIteration(std::size_t i) const
+    {
+        return d_entries[i].iteration;
+    }
+
+    /*!
+     * \brief Directory name of entry \p i.  The view is valid until the index is modified.
+     */
+    std::string_view getName(std::size_t i) const
+    {
+        return std::string_view(d_names.data() + d_entries[i].name_offset, d_entries[i].name_length);
+    }
+
+    /*!
+     * \brief Inode number of the directory of entry \p i as read from the base directory, or 0.
+     */
+    std::uint64_t getInode(std::size_t i) const
+    {
+        return d_entries[i].inode;
+    }
+
+    /*!
+     * \brief Iteration numbers of all entries, in index order.
+     */
+    std::vector<int> getIterations() const;
+
+    /*!
+     * \brief Record a restart that is kept as a pack file.
      *
-     * \return Vector of iteration numbers for available restore directories,
-     *         sorted in ascending order
+     * Packs are not entries: strategies neither count nor select them.
      */
-    std::vector<int> getAvailableIterations() const;
+    void addPack(int iteration);
+
+    /*!
+     * \brief Iteration numbers of the packed restarts, sorted by sortByIteration().
+     */
+    const std::vector<int>& getPackedIterations() const
+    {
+        return d_packed;
+    }
 
 private:
-    RestartCleaner() = delete;
-    RestartCleaner(const RestartCleaner& from) = delete;
-    RestartCleaner& operator=(const RestartCleaner& that) = delete;
+    struct Entry
+    {
+        int iteration;
+        std::uint32_t name_offset;
+        std::uint32_t name_length;
+        std::uint64_t inode;
+    };
+
+    std::vector<Entry> d_entries;
+    std::string d_names;
+    std::vector<int> d_packed;
+};
+
+/*!
+ * \brief Class RestartPack reads the pack files written by the PACK action of
+ * RestartCleaner.
+ *
+ * A pack holds a whole restart directory in one file: an 8 byte magic, the
+ * data of every file and symbolic link target, each optionally compressed on
+ * its own, an index of all entries sorted by path and a fixed-size footer
+ * that locates the index.  All integers are little endian.  The file is
+ * mapped into memory, so that a single file can be extracted without reading
+ * or decompressing the rest.  Every entry carries the CRC32C checksum of its
+ * uncompressed data, which is checked whenever it is read.
+ */
+class RestartPack
+{
+public:
+    enum class EntryType : std::uint8_t {
+        FILE = 0,
+        DIRECTORY = 1,
+        SYMLINK = 2
+    };
+
+    enum class Codec : std::uint8_t {
+        NONE = 0,
+        ZSTD = 1,
+        LZ4 = 2
+    };
 
     /*!
-     * \brief Internal strategy enumeration.
+     * \brief An entry of the pack index.  Paths are relative to the packed directory.
      */
-    enum class CleanupStrategy { 
-        KEEP_RECENT_N
-        // Future strategies: SMART_RETENTION, TIME_BASED
+    struct Entry
+    {
+        std::string path;
+        EntryType type = EntryType::FILE;
+        Codec codec = Codec::NONE;
+        std::uint32_t mode = 0;
+        std::int64_t mtime_sec = 0;
+        std::uint32_t mtime_nsec = 0;
+        std::uint32_t crc = 0;
+        std::uint64_t offset = 0;
+        std::uint64_t stored_size = 0;
+        std::uint64_t size = 0;
     };
-    
+
     /*!
-     * \brief Parse strategy string to enum.
+     * \brief Map a pack file and read its index.
+     *
+     * \throws std::runtime_error if the file cannot be read or is not a valid pack
      */
-    CleanupStrategy parseStrategy(const std::string& strategy_str) const;
-    
+    explicit RestartPack(const std::string& path);
+
+    ~RestartPack();
+
     /*!
-     * \brief Execute cleanup based on current strategy.
+     * \brief All entries, sorted by path.
+     */
+    const std::vector<Entry>& getEntries() const
+    {
+        return d_entries;
+    }
+
+    /*!
+     * \brief Find the entry with the given path, or return nullptr.
+     */
+    const Entry* findEntry(std::string_view path) const;
+
+    /*!
+     * \brief Return the contents of a file, or the target of a symbolic link.
+     *
+     * \throws std::runtime_error if the entry is damaged or uses a codec this
+     *         build does not support
+     */
+    std::string readEntry(const Entry& entry) const;
+
+    /*!
+     * \brief Return the contents of the file with the given path.
+     *
+     * \throws std::runtime_error if there is no such file
      */
-    void executeStrategy() const;
+    std::string readFile(std::string_view path) const;
 
     /*!
-     * \brief Parse iteration number from directory name.
+     * \brief Restore the packed directory tree as \p dest_dir, which must not exist.
      *
-     * Extracts the iteration number from directory names following the pattern
-     * "restore.XXXXXX" where XXXXXX is a zero-padded number.
+     * Permissions and modification times are restored as well.
+     */
+    void unpack(const std::string& dest_dir) const;
+
+    /*!
+     * \brief Whether this build can compress and decompress with \p codec.
+     */
+    static bool isCodecSupported(Codec codec);
+
+private:
+    RestartPack(const RestartPack& from) = delete;
+    RestartPack& operator=(const RestartPack& that) = delete;
+
+    std::string d_path;
+    const char* d_data = nullptr;
+    std::size_t d_size = 0;
+    std::uint64_t d_data_end = 0;
+    std::vector<Entry> d_entries;
+};
+
+/*!
+ * \brief Class RestartCommunicator is the collective communication needed by
+ * RestartCleaner::cleanupDistributed().
+ *
+ * Every operation is collective: all ranks of the group must call it in the
+ * same order.  RestartMPICommunicator (built with RESTART_CLEANER_WITH_MPI)
+ * wraps an MPI communicator; RestartThreadCommunicator lets threads of one
+ * process stand in for ranks.
+ */
+class RestartCommunicator
+{
+public:
+    virtual ~RestartCommunicator() = default;
+
+    virtual int getRank() const = 0;
+
+    virtual int getSize() const = 0;
+
+    /*!
+     * \brief Block until every rank has called barrier().
+     */
+    virtual void barrier() = 0;
+
+    /*!
+     * \brief Replace \p data on every rank by \p data of rank \p root.
+     */
+    virtual void broadcast(std::string& data, int root) = 0;
+
+    /*!
+     * \brief Send \p parts[r] of rank \p root to rank r and return it.
      *
-     * \param dirname Directory name to parse
-     * \return Iteration number, or -1 if parsing fails
+     * \p parts must have getSize() elements on the root and is ignored elsewhere.
      */
-    int parseIterationNum(const std::string& dirname) const;
+    virtual std::string scatter(const std::vector<std::string>& parts, int root) = 0;
 
     /*!
-     * \brief Get all restart directories from the base path.
+     * \brief Collect \p part of every rank on rank \p root, indexed by rank.
      *
-     * Scans the restart base directory and returns all subdirectories that
-     * match the restart naming pattern.
+     * \return The parts on the root, an empty vector elsewhere
+     */
+    virtual std::vector<std::string> gather(const std::string& part, int root) = 0;
+};
+
+/*!
+ * \brief Class RestartThreadCommunicator connects threads of one process as
+ * the ranks of a RestartCommunicator.
+ *
+ * create() returns one communicator per rank; each must be used by its own
+ * thread.  Meant for tests and for running cleanupDistributed() without MPI.
+ */
+class RestartThreadCommunicator : public RestartCommunicator
+{
+public:
+    /*!
+     * \brief Create the communicators of a group of \p size ranks.
+     */
+    static std::vector<std::unique_ptr<RestartThreadCommunicator>> create(int size);
+
+    int getRank() const override
+    {
+        return d_rank;
+    }
+
+    int getSize() const override;
+
+    void barrier() override;
+
+    void broadcast(std::string& data, int root) override;
+
+    std::string scatter(const std::vector<std::string>& parts, int root) override;
+
+    std::vector<std::string> gather(const std::string& part, int root) override;
+
+private:
+    struct Group;
+
+    RestartThreadCommunicator(std::shared_ptr<Group> group, int rank);
+
+    std::shared_ptr<Group> d_group;
+    int d_rank;
+};
+
+#if defined(RESTART_CLEANER_WITH_MPI)
+/*!
+ * \brief Class RestartMPICommunicator implements RestartCommunicator on an MPI
+ * communicator, which must outlive it.
+ */
+class RestartMPICommunicator : public RestartCommunicator
+{
+public:
+    explicit RestartMPICommunicator(MPI_Comm comm);
+
+    int getRank() const override;
+
+    int getSize() const override;
+
+    void barrier() override;
+
+    void broadcast(std::string& data, int root) override;
+
+    std::string scatter(const std::vector<std::string>& parts, int root) override;
+
+    std::vector<std::string> gather(const std::string& part, int root) override;
+
+private:
+    MPI_Comm d_comm;
+};
+#endif
+
+/*!
+ * \brief Class RestartCleanupHandle refers to a cleanup running in the background.
+ *
+ * Handles are returned by RestartCleaner::cleanupAsync() and may be copied
+ * freely.  A default-constructed handle refers to no cleanup.
+ */
+class RestartCleanupHandle
+{
+public:
+    RestartCleanupHandle() = default;
+
+    /*!
+     * \brief Block until the cleanup has finished.
      *
-     * \param restart_dir Base directory to scan
-     * \return Vector of filesystem paths to valid restart directories
+     * Rethrows any exception raised by the background cleanup.
      */
-    std::vector<fs::path> getAllRestartDirs(const std::string& restart_dir) const;
+    void wait() const;
 
     /*!
-     * \brief KEEP_RECENT_N strategy implementation.
+     * \brief Request cancellation.
+     *
+     * Directories whose removal has already started are removed completely;
+     * no further directories are touched.  Use wait() to block until the
+     * background thread has stopped.
      */
-    void keepRecentN() const;
+    void cancel() const;
 
-    const std::string d_restart_base_path;
-    const CleanupStrategy d_strategy;
-    const int d_keep_restart_count;
-    const bool d_dry_run;
+    /*!
+     * \brief Whether the cleanup has finished (or the handle is empty).
+     */
+    bool isDone() const;
+
+private:
+    friend class RestartCleaner;
+
+    std::shared_future<void> d_future;
+    std::shared_ptr<std::atomic<bool>> d_cancel;
+};
+
+/*!
+ * \brief Class RestartCleaner provides functionality to manage restart directories.
+ *
+ * This class provides methods to automatically clean up old restart directories while
+ * keeping the most recent ones. Supports extensible cleanup strategies.
+ * It is designed to work with IBAMR's standard restart directory naming convention.
+ *
+ * The main functionalities include:
+ * -# Scan a specified directory for subdirectories matching the pattern "restore.XXXXXX"
+ *    (or another RestartNamePattern, see setNamePattern())
+ * -# Parse iteration numbers from these directory names
+ * -# Sort directories based on iteration numbers  
+ * -# Keep the N most recent directories and delete the rest
+ *
+ * Old directories are removed by one of three deletion engines:
+ * - "PARALLEL": walks each tree with openat()/getdents64()/unlinkat() relative
+ *   to directory file descriptors and spreads the unlinks over a worker pool
+ *   (default)
+ * - "URING": like "PARALLEL", but submits each batch of unlinks through
+ *   io_uring (falls back to "PARALLEL" where io_uring is not available)
+ * - "SERIAL": removes each tree with std::filesystem::remove_all()
+ *
+ * With setTombstoneDeletion(), old directories are first renamed into a
+ * ".trash" subdirectory of the base path, which is atomic and instant, and
+ * are then removed by a background reaper.  A journal in ".trash" records the
+ * tombstones so that an interrupted reaper is resumed by the next cleanup.
+ *
+ * With setVerification(), the kept restart directories are checked for
+ * complete per-rank files and CRC32C checksums before anything older is
+ * deleted; a damaged restart keeps its predecessor alive.
+ *
+ * With setAction("MIGRATE", archive_path), old directories are moved to an
+ * archive directory instead of being deleted; with setAction("PACK") they
+ * are replaced by single pack files (see RestartPack).
+ *
+ * With setDeduplication(), identical files in the kept restart directories
+ * are made to share their data through reflinks or hard links.
+ *
+ * Restarts can be pinned, e.g. the checkpoints a parameter study branched
+ * from: by setPinnedIterations(), by a line in ".restart_cleaner_pins" in the
+ * base directory, or, with setPinMarkers(), by a ".pinned" file in the
+ * restart directory.  Pinned restarts are never selected by any strategy and
+ * do not count towards the number of restarts kept.
+ *
+ * With setLocking(), concurrent cleanups of the same base path by several
+ * processes are serialized through an advisory lock file; setPartition()
+ * lets cooperating processes split the victims between them instead.
+ *
+ * \note By default this class assumes restart directories follow the naming pattern
+ * "restore.XXXXXX" where XXXXXX is a zero-padded iteration number.
+ *
+ * Supported cleanup strategies:
+ * - "KEEP_RECENT_N": Keep the N most recent restart directories (default)
+ * - "SMART_RETENTION": Keep the N most recent restart directories, then thin
+ *   out older ones in tiers of increasing spacing (see setRetentionTiers())
+ * - "MAX_BYTES": Delete the oldest restart directories until their total size
+ *   is within a byte budget (see setMaxBytes()), always keeping the N most
+ *   recent ones
+ * - "TIME_BASED": Keep every restart directory completed within a window,
+ *   then one per interval (see setTimeRetention()), always keeping the N
+ *   most recent ones
+ *
+ * Sample usage:
+ * \code
+ * // Basic usage
+ * RestartCleaner cleaner("/path/to/restores", 5);
+ * cleaner.cleanup();
+ * // With dry run
+ * RestartCleaner cleaner("/path/to/restores", 3, "KEEP_RECENT_N", true);
+ * // Delete with 16 workers
+ * cleaner.setNumJobs(16);
+ * // Overlap cleanup with the next timesteps; never touch restore.<iter> and newer
+ * RestartCleanupHandle handle = cleaner.cleanupAsync(iter);
+ * // ... advance the solution ...
+ * handle.wait();
+ * // Tiered retention: 5 dense, then every 10th, then every 100th restart
+ * RestartCleaner cleaner("/path/to/restores", 5, "SMART_RETENTION");
+ * // Stay within 2 TiB, but never below the 2 most recent restarts
+ * RestartCleaner cleaner("/path/to/restores", 2, "MAX_BYTES");
+ * cleaner.setMaxBytes(std::uintmax_t(2) << 40);
+ * // Everything from the last 6 hours, then one restart per day
+ * RestartCleaner cleaner("/path/to/restores", 2, "TIME_BASED");
+ * cleaner.setTimeRetention({ 6 * 3600, 24 * 3600, 0 });
+ * // Plan during a compute-heavy phase, delete when the file system is idle
+ * RestartCleaner::CleanupPlan plan = cleaner.plan();
+ * // ... advance the solution ...
+ * cleaner.execute(plan);
+ * // Verify results
+ * auto iterations = cleaner.getAvailableIterations();
+ * \endcode
+ */
+class RestartCleaner
+{
+public:
+    /*!
+     * \brief One tier of the SMART_RETENTION strategy.
+     *
+     * A tier keeps one restart per \p stride restart intervals, up to \p count
+     * restarts (0 means no limit).  The restart interval is estimated from the
+     * most recent restarts, which are always kept.
+     */
+    struct RetentionTier
+    {
+        int stride;
+        int count;
+    };
+
+    /*!
+     * \brief Disk usage of one restart directory tree.
+     */
+    struct TreeSize
+    {
+        std::uintmax_t bytes = 0;
+        std::uintmax_t files = 0;
+    };
+
+    /*!
+     * \brief Windows of the TIME_BASED strategy, in seconds.
+     *
+     * Restarts completed within the last \p keep_all_seconds are all kept.
+     * Older ones are thinned to one per \p interval_seconds, with intervals
+     * aligned to the epoch (UTC midnight for a day).  Restarts older than
+     * \p max_age_seconds are deleted, unless it is 0.
+     */
+    struct TimeRetention
+    {
+        std::int64_t keep_all_seconds = 6 * 3600;
+        std::int64_t interval_seconds = 24 * 3600;
+        std::int64_t max_age_seconds = 0;
+    };
+
+    /*!
+     * \brief Totals over the runs cleaned up by cleanupBatch().
+     */
+    struct BatchSummary
+    {
+        std::size_t num_runs = 0;
+        std::size_t num_found = 0;
+        std::size_t num_selected = 0;
+        std::size_t num_deleted = 0;
+        std::size_t num_failed = 0;
+        std::size_t num_skipped = 0;
+    };
+
+    /*!
+     * \brief Limits on the rate at which old restart directories are deleted.
+     *
+     * A rate of 0 means no limit.  With \p adaptive, the unlink rate starts at
+     * \p unlinks_per_second and is lowered while the observed unlinkat()
+     * latency is well above the lowest latency seen so far, then raised again
+     * once the latency recovers.
+     */
+    struct RateLimits
+    {
+        double unlinks_per_second = 0.0;
+        double bytes_per_second = 0.0;
+        bool adaptive = false;
+    };
+
+    /*!
+     * \brief Outcome of one restart directory selected for deletion.
+     *
+     * \p seconds is the wall time to delete the tree (with tombstones: to
+     * rename it), \p entries the number of files and directories unlinked,
+     * and \p bytes the allocated size, if the strategy measured it.
+     */
+    struct DirectoryReport
+    {
+        std::string name;
+        bool removed = false;
+        double seconds = 0.0;
+        std::uintmax_t entries = 0;
+        std::uintmax_t bytes = 0;
+        std::string error;
+    };
+
+    /*!
+     * \brief File system calls issued by the descriptor-based code paths.
+     *
+     * Calls made through std::filesystem (the SERIAL engine, the size cache)
+     * are not counted.
+     */
+    struct SyscallCounts
+    {
+        std::uint64_t open = 0;
+        std::uint64_t getdents = 0;
+        std::uint64_t stat = 0;
+        std::uint64_t unlink = 0;
+        std::uint64_t rmdir = 0;
+        std::uint64_t rename = 0;
+    };
+
+    /*!
+     * \brief Timings, counts and errors of one cleanup().
+     *
+     * The phases are consecutive: reading and parsing the base directory
+     * (scan), sorting the index (sort), selecting and verifying victims
+     * (plan) and removing them (delete).  When the scan was answered by the
+     * restart catalog, catalog_used is set and no entries were scanned.
+     */
+    struct CleanupReport
+    {
+        std::string base_path;
+        std::string strategy;
+        std::string engine;
+        bool dry_run = false;
+        bool tombstones = false;
+        bool skipped = false;
+        int partition_index = 0;
+        int partition_count = 1;
+        std::string action;
+        std::string archive_path;
+
+        double scan_seconds = 0.0;
+        double sort_seconds = 0.0;
+        double plan_seconds = 0.0;
+        double delete_seconds = 0.0;
+        double total_seconds = 0.0;
+
+        std::uintmax_t entries_scanned = 0;
+        bool catalog_used = false;
+        std::size_t num_found = 0;
+        std::size_t num_selected = 0;
+        std::size_t num_deleted = 0;
+        std::size_t num_pinned = 0;
+        std::uintmax_t entries_unlinked = 0;
+        std::uintmax_t bytes_unlinked = 0;
+        bool bytes_known = false;
+        std::uintmax_t bytes_copied = 0;
+        std::uintmax_t files_deduplicated = 0;
+        std::uintmax_t bytes_deduplicated = 0;
+        double throttle_seconds = 0.0;
+
+        SyscallCounts syscalls;
+        std::vector<DirectoryReport> directories;
+        std::vector<std::string> errors;
+
+        /*!
+         * \brief Serialize the report as a single JSON object.
+         */
+        std::string toJson() const;
+    };
+
+    /*!
+     * \brief One restart directory of a CleanupPlan.
+     *
+     * \p inode and \p mtime_ns (modification time in nanoseconds) identify
+     * the directory, so that a directory of the same name created after
+     * planning is not deleted; \p entries counts its files and subdirectories
+     * and \p bytes their allocated size.
+     */
+    struct PlannedDirectory
+    {
+        std::string name;
+        int iteration = 0;
+        std::uint64_t inode = 0;
+        std::int64_t mtime_ns = 0;
+        std::uintmax_t entries = 0;
+        std::uintmax_t bytes = 0;
+    };
+
+    /*!
+     * \brief Victims selected by plan() for a later execute().
+     *
+     * The predicted time is \p total_entries times \p seconds_per_entry,
+     * bounded below by the rate limits.  The cost per entry is "MEASURED" by
+     * earlier deletions of this base path with the same engine and number of
+     * jobs, or else the "DEFAULT" of 50 us, a serial unlink on a local file
+     * system.  plan() writes nothing to the base path.  It covers deleting
+     * only; MIGRATE and PACK copy the data first.
+     */
+    struct CleanupPlan
+    {
+        std::string base_path;
+        std::string strategy;
+        std::string action;
+        int keep_restart_count = 0;
+        std::int64_t created = 0;
+        std::size_t num_found = 0;
+        std::vector<PlannedDirectory> directories;
+        std::uintmax_t total_entries = 0;
+        std::uintmax_t total_bytes = 0;
+        double seconds_per_entry = 0.0;
+        std::string cost_source;
+        double predicted_seconds = 0.0;
+
+        /*!
+         * \brief Write the plan to \p path, replacing it atomically.
+         */
+        void save(const std::string& path) const;
+
+        /*!
+         * \brief Read a plan written by save().
+         */
+        static CleanupPlan load(const std::string& path);
+    };
+
+    /*!
+     * \brief Constructor.
+     *
+     * \param restart_base_path  Base directory containing restore folders
+     * \param keep_restart_count Number of recent restore directories to keep
+     * \param strategy          Cleanup strategy ("KEEP_RECENT_N", "SMART_RETENTION", "MAX_BYTES" or "TIME_BASED")
+     * \param dry_run           If true, only report what would be deleted without actually deleting
+     */
+    RestartCleaner(const std::string& restart_base_path,
+                   int keep_restart_count,
+                   const std::string& strategy = "KEEP_RECENT_N",
+                   bool dry_run = false);
+
+    // Future IBAMR integration constructor (the solver would then call
+    // cleanupDistributed() with a RestartMPICommunicator on its communicator):
+    // RestartCleaner(const std::string& object_name,
+    //                SAMRAI::tbox::Pointer<SAMRAI::tbox::Database> input_db);
+
+    /*!
+     * \brief Destructor.  Waits for a background cleanup started by cleanupAsync()
+     * and for the tombstone reaper.
+     */
+    ~RestartCleaner();
+
+    /*!
+     * \brief Scan and cleanup old restart directories.
+     *
+     * This method performs the complete cleanup process:
+     * 1. Scans the base directory for restart folders
+     * 2. Parses iteration numbers from directory names
+     * 3. Sorts directories by iteration number
+     * 4. Keeps the N most recent directories and deletes the rest
+     *
+     * \return Per-phase timings, counts and errors of this cleanup
+     */
+    CleanupReport cleanup();
+
+    /*!
+     * \brief Select the restart directories cleanup() would remove, without removing them.
+     *
+     * Measures the victims and predicts the time to delete them.  Nothing is
+     * locked, so the plan may be computed while another process cleans up.
+     */
+    CleanupPlan plan() const;
+
+    /*!
+     * \brief Remove the restart directories of a plan made by plan().
+     *
+     * Planned directories that no longer exist or were replaced by another
+     * directory of the same name are skipped, and so are the newest ones if
+     * fewer than keep_restart_count restarts would remain.  Honors the lock,
+     * the action and the dry run setting of this object.
+     *
+     * \return Per-phase timings, counts and errors of this cleanup
+     */
+    CleanupReport execute(const CleanupPlan& plan);
+
+    /*!
+     * \brief Clean up with the help of every rank of \p comm (collective).
+     *
+     * Rank 0 takes the lock (see setLocking()), scans and selects the victims
+     * and assigns every file named with a rank suffix (samrai.<rank>,
+     * hier_data.<n>.samrai.<rank>, patch.<rank>, ...) to that rank modulo the
+     * group size.  Each rank unlinks its own files, and after all ranks are
+     * done rank 0 removes the remaining files and the directories.  Dry runs,
+     * tombstones, MIGRATE and PACK are handled by rank 0 alone.  The objects
+     * on all ranks must be configured alike; only rank 0 uses its settings
+     * beyond the base path.
+     *
+     * \return The report on rank 0; on other ranks only the selection counts,
+     *         entries_unlinked and errors of that rank
+     * \throws std::runtime_error on every rank if rank 0 fails to plan
+     */
+    CleanupReport cleanupDistributed(RestartCommunicator& comm);
+
+    /*!
+     * \brief Run cleanup() on a background thread at idle I/O priority.
+     *
+     * The scan, plan and delete phases all run on the background thread, so
+     * the caller can continue time stepping immediately.  Directories whose
+     * iteration number is greater than or equal to \p protected_iteration are
+     * ignored altogether: pass the iteration of the restart that is currently
+     * being written (or will be written next) to guarantee it is never
+     * touched.  At most one background cleanup runs at a time; starting a new
+     * one first waits for the previous one.
+     *
+     * \param protected_iteration First iteration to ignore, or -1 to consider all
+     * \return Handle to wait for or cancel the background cleanup
+     */
+    RestartCleanupHandle cleanupAsync(int protected_iteration = -1);
+
+    /*!
+     * \brief Clean up several restart directories at once.
+     *
+     * Each cleaner scans and plans its own restart directory in turn; then the
+     * deletions of all cleaners that use the parallel engine are submitted
+     * together, so that a few huge runs and many small ones balance across
+     * the workers.  Give all cleaners the same pool with setWorkerPool() to
+     * run everything through a single pool.
+     *
+     * \return Totals over all runs
+     */
+    static BatchSummary cleanupBatch(const std::vector<RestartCleaner*>& cleaners);
+
+    /*!
+     * \brief Find all restart directories below a root directory.
+     *
+     * A directory is a restart directory if it directly contains at least one
+     * restore directory, i.e. a directory matching \p pattern.  Restore
+     * directories themselves are not descended into and symbolic links are
+     * not followed.
+     *
+     * \return Paths of the restart directories found, sorted
+     */
+    static std::vector<std::string> findRestartRoots(const std::string& root,
+                                                     const RestartNamePattern& pattern = RestartNamePattern());
+
+    /*!
+     * \brief Get available iteration numbers.
+     *
+     * \return Vector of iteration numbers for available restore directories,
+     *         sorted in ascending order
+     */
+    std::vector<int> getAvailableIterations() const;
+
+    /*!
+     * \brief Get the index of restart directories, sorted by iteration.
+     *
+     * The index built by the most recent scan (including the one done by
+     * cleanup()) is reused as long as the modification time of the base
+     * directory is unchanged, so this normally costs a single stat().
+     */
+    RestartIndex getRestartIndex() const;
+
+    /*!
+     * \brief Select the deletion engine.
+     *
+     * "URING" works like "PARALLEL", but every worker submits its batches of
+     * unlinks (and, with a byte rate limit, the statx calls before them) as
+     * one io_uring submission each.  Without kernel support for
+     * IORING_OP_UNLINKAT (Linux 5.11), or where io_uring is disabled, it
+     * falls back to "PARALLEL" at run time, and always when built against
+     * older kernel headers; reports name the engine used.
+     *
+     * \param engine Engine name ("PARALLEL", "URING" or "SERIAL")
+     */
+    void setDeletionEngine(const std::string& engine);
+
+    /*!
+     * \brief Set the number of worker threads used by the parallel deletion engine.
+     *
+     * \param num_jobs Number of workers (must be positive)
+     */
+    void setNumJobs(int num_jobs);
+
+    /*!
+     * \brief Use an existing worker pool instead of creating one per cleanup.
+     *
+     * The pool overrides setNumJobs() and may be shared with other cleaners.
+     */
+    void setWorkerPool(std::shared_ptr<RestartWorkerPool> pool);
+
+    /*!
+     * \brief Enable or disable two-phase deletion through tombstones.
+     *
+     * When enabled, each victim is first renamed to base_path/.trash/ and
+     * recorded in base_path/.trash/journal; cleanup() returns as soon as all
+     * victims are renamed, and a background reaper removes the tombstones
+     * with the selected engine.  A restart directory is therefore either
+     * complete or gone, even if the process is killed during the cleanup.
+     */
+    void setTombstoneDeletion(bool use_tombstones);
+
+    /*!
+     * \brief Select what happens to the restart directories a strategy selects.
+     *
+     * \param action One of:
+     * - "DELETE": remove them (default)
+     * - "MIGRATE": move them into \p archive_path, which is created if needed.
+     *   A directory on the same file system is renamed.  Otherwise its files
+     *   are copied in parallel with copy_file_range() into a staging directory
+     *   "<name>.migrating", each copy is checked against the CRC32C checksum of
+     *   its source, and only once the archive file system is synced and the
+     *   staging directory renamed to "<name>" is the source removed.  Existing
+     *   archive entries are never replaced.  Tombstones do not apply.
+     * - "PACK": replace each of them by a pack file "<name>.pack" in the base
+     *   directory (see RestartPack).  Files are read and compressed in
+     *   parallel and written to "<name>.pack.tmp", which is synced, renamed and
+     *   then read back and verified before the directory is removed.  Packed
+     *   restarts are listed by getAvailableIterations() but are otherwise left
+     *   alone by the strategies.
+     * \param archive_path The archive directory for MIGRATE
+     */
+    void setAction(const std::string& action, const std::string& archive_path = "");
+
+    /*!
+     * \brief Set the compression of the files in packs: "NONE" (default),
+     * "ZSTD" or "LZ4".
+     *
+     * ZSTD and LZ4 are available if the library is built with
+     * RESTART_CLEANER_WITH_ZSTD or RESTART_CLEANER_WITH_LZ4 defined.  Files
+     * that do not shrink are stored uncompressed.
+     */
+    void setPackCompression(const std::string& codec);
+
+    /*!
+     * \brief Block until the tombstone reaper has removed all tombstones.
+     */
+    void waitForReaper() const;
+
+    /*!
+     * \brief Set the tiers used by the SMART_RETENTION strategy.
+     *
+     * The keep_restart_count most recent restarts are always kept.  Going back
+     * in time from there, each tier keeps the oldest restart of every bucket of
+     * stride restart intervals until it has kept count restarts, after which
+     * the next tier takes over.  Restarts beyond the last tier are deleted.
+     * The default is {{10, keep_restart_count}, {100, 0}}: keep every 10th
+     * restart for a while and every 100th restart after that.
+     *
+     * Since buckets are aligned to iteration numbers, a restart kept by one
+     * invocation is kept by later invocations until it moves to a coarser tier.
+     */
+    void setRetentionTiers(const std::vector<RetentionTier>& tiers);
+
+    /*!
+     * \brief Set the byte budget used by the MAX_BYTES strategy.
+     *
+     * Sizes are allocated bytes (as charged by quotas), summed over each
+     * restart directory tree with files that have several hard links counted
+     * once.  The sizes are cached in a file in the base directory, keyed on
+     * the modification time of each restart directory, so unchanged restart
+     * directories are not walked again by later invocations.
+     */
+    void setMaxBytes(std::uintmax_t max_bytes);
+
+    /*!
+     * \brief Set the windows used by the TIME_BASED strategy.
+     *
+     * The completion time of a restart is the modification time of its
+     * directory, which changes for the last time when its last file is
+     * created.  It is read with one statx() per directory and cached in a
+     * file in the base directory, keyed on the directory inode, so later
+     * invocations only read the base directory.  The keep_restart_count most
+     * recent restarts are always kept; the default keeps everything from the
+     * last 6 hours and one restart per day before that.
+     */
+    void setTimeRetention(const TimeRetention& retention);
+
+    /*!
+     * \brief Set the order in which the PARALLEL engine unlinks the files of a directory.
+     *
+     * \param order One of:
+     * - "READDIR": unlink in directory order while the directory is still
+     *   being read (default)
+     * - "INODE": read the whole directory, then unlink in batches of
+     *   ascending inode numbers, which keeps inode table and journal updates
+     *   of each batch close together on ext4 and XFS
+     * - "REVERSE": read the whole directory, then unlink in reverse directory
+     *   order (mainly for comparison, see bench_restart_cleaner --unlink-orders)
+     */
+    void setUnlinkOrder(const std::string& order);
+
+    /*!
+     * \brief Throttle deletion to bound its impact on the file system.
+     *
+     * Every unlinkat() call, for files and directories alike, takes a token
+     * from a bucket refilled at limits.unlinks_per_second.  With a byte rate,
+     * each file is stat'ed before it is unlinked and takes its allocated size
+     * from a second bucket.  The limits apply to each cleanup (and to the
+     * tombstone reaper) separately and require the PARALLEL engine.
+     */
+    void setRateLimits(const RateLimits& limits);
+
+    /*!
+     * \brief Verify kept restart directories before older ones are deleted.
+     *
+     * \param mode One of:
+     * - "OFF": no verification (default)
+     * - "INCREMENTAL": check that every rank has its samrai.* file and that
+     *   hier_data.* files match the ranks, then compute CRC32C checksums of the
+     *   files not yet recorded in the ".restart_cleaner_checksums" manifest
+     *   of the base path (or whose size or modification time changed since,
+     *   or all of them if files were added to or removed from the directory)
+     * - "FULL": as INCREMENTAL, but re-read and compare every file
+     *
+     * Every kept restart newer than the oldest victim is verified.  A kept
+     * restart that fails protects the next-older restart from deletion, and
+     * that restart is verified in turn.
+     */
+    void setVerification(const std::string& mode);
+
+    /*!
+     * \brief Manage the directories matching \p pattern instead of "restore.{6}".
+     *
+     * This also covers runs past iteration 999999 ("restore.{6+}") and output
+     * directories such as "visit_dump.{5+}" or "lag_data.cycle_{6+}".
+     */
+    void setNamePattern(const RestartNamePattern& pattern);
+
+    /*!
+     * \brief Serialize cleanups of the base path across processes.
+     *
+     * A cleanup takes an open file description (OFD) write lock on the file
+     * ".restart_cleaner.lock" in the base path for its plan and delete phases
+     * (and deduplication).  A RestartWatcher takes it for every cleanup and
+     * retries a skipped one a second later.  Dry runs do not lock.
+     *
+     * \param mode One of:
+     * - "OFF": no locking (default)
+     * - "SKIP": if another process holds the lock, print a message and return
+     *   without doing anything (CleanupReport::skipped is set)
+     * - "WAIT": wait for the lock
+     */
+    void setLocking(const std::string& mode);
+
+    /*!
+     * \brief Delete only the share \p index of \p count of the selected victims.
+     *
+     * Cooperating processes that run the same cleanup with the same \p count
+     * and different \p index values delete disjoint victims in parallel.
+     * Victims are assigned by a hash of their name, so the assignment does
+     * not depend on what the other processes have already deleted.  With
+     * locking, each partition locks its own byte of the lock file, so
+     * partitions run together but exclude an unpartitioned cleanup and a
+     * second process with the same index.  Only partition 0 deduplicates and
+     * resumes tombstones; new tombstones cannot be combined with partitions.
+     */
+    void setPartition(int index, int count);
+
+    /*!
+     * \brief Share the data of identical files in the kept restart directories.
+     *
+     * After each cleanup, files of the managed restart directories that remain
+     * are bucketed by size, files in buckets of two or more are checksummed in
+     * parallel (CRC32C), and files with equal checksums are compared byte by
+     * byte before older copies are made to share the data of the newest one.
+     * Checksums are cached in a manifest in the base directory, keyed on size,
+     * modification time and inode, so later runs only read new files.
+     *
+     * \param mode One of:
+     * - "OFF": no deduplication (default)
+     * - "AUTO": reflink (FICLONE) where the file system supports it, otherwise
+     *   replace the older copy by a hard link if mode and owner match
+     * - "REFLINK": reflinks only
+     *
+     * A reflinked copy keeps its inode and modification time; a hard-linked
+     * copy takes both from the newest copy, so restart files must not be
+     * modified in place afterwards.  Sizes used by MAX_BYTES charge shared
+     * data to every restart directory holding it, which keeps the budget an
+     * upper bound on the space used.
+     */
+    void setDeduplication(const std::string& mode);
+
+    /*!
+     * \brief Pin restarts by iteration number, replacing earlier pins set here.
+     *
+     * These pins add to the ones listed in ".restart_cleaner_pins" in the
+     * base directory (one iteration number or directory name per line, "#"
+     * starts a comment), which is read once per cleanup, and to the marker
+     * files enabled by setPinMarkers().  Pinned restarts are taken out of the
+     * index before any strategy runs, so they are never selected, do not
+     * count towards keep_restart_count, and are not charged to the MAX_BYTES
+     * budget.  Looking up a pin costs a hash lookup per restart directory.
+     */
+    void setPinnedIterations(const std::vector<int>& iterations);
+
+    /*!
+     * \brief Also pin restart directories that contain a ".pinned" file.
+     *
+     * Off by default, since looking for the marker costs one stat() per
+     * managed restart directory in every cleanup.
+     */
+    void setPinMarkers(bool use_markers);
+
+    /*!
+     * \brief Keep a binary catalog of the restarts in the base directory.
+     *
+     * The catalog ".restart_cleaner_catalog" records the listing of the base
+     * directory together with the inode, modification time and link count
+     * the base directory had when it was read, and per restart directory its
+     * iteration, inode, modification time, size, checksum status and state
+     * (live, tombstoned, deleted or packed).  A scan answers from the catalog
+     * without reading the base directory when the base directory is
+     * unchanged and its last change was at least a second older than the
+     * catalog; sizes (MAX_BYTES) and completion times (TIME_BASED) are taken
+     * from the catalog while the inode and modification time of a directory
+     * match, before the text caches are tried.
+     *
+     * \param mode One of:
+     * - "ON": use and update the catalog (default)
+     * - "OFF": neither read nor write it
+     * - "REBUILD": never answer a scan from the catalog, and rebuild it from
+     *   the file system on every scan instead of carrying records over
+     */
+    void setCatalog(const std::string& mode);
+
+private:
+    friend class RestartWatcher;
+
+    RestartCleaner() = delete;
+    RestartCleaner(const RestartCleaner& from) = delete;
+    RestartCleaner& operator=(const RestartCleaner& that) = delete;
+
+    /*!
+     * \brief Internal strategy enumeration.
+     */
+    enum class CleanupStrategy { 
+        KEEP_RECENT_N,
+        SMART_RETENTION,
+        MAX_BYTES,
+        TIME_BASED
+    };
+
+    /*!
+     * \brief Internal deletion engine enumeration.
+     */
+    enum class DeletionEngine {
+        SERIAL,
+        PARALLEL,
+        URING
+    };
+
+    /*!
+     * \brief Internal enumeration of what happens to selected directories.
+     */
+    enum class VictimAction {
+        DELETE,
+        MIGRATE,
+        PACK
+    };
+
+    /*!
+     * \brief Internal verification mode enumeration.
+     */
+    enum class VerifyMode {
+        OFF,
+        INCREMENTAL,
+        FULL
+    };
+
+    /*!
+     * \brief Internal locking mode enumeration.
+     */
+    enum class LockMode {
+        OFF,
+        SKIP,
+        WAIT
+    };
+
+    /*!
+     * \brief Lock on the base path held by a cleanup.
+     */
+    struct BaseLock;
+
+    /*!
+     * \brief Internal unlink order enumeration.
+     */
+    enum class UnlinkOrder {
+        READDIR,
+        INODE,
+        REVERSE
+    };
+
+    /*!
+     * \brief Internal deduplication mode enumeration.
+     */
+    enum class DedupMode {
+        OFF,
+        AUTO,
+        REFLINK
+    };
+
+    /*!
+     * \brief Internal catalog mode enumeration.
+     */
+    enum class CatalogMode {
+        OFF,
+        ON,
+        REBUILD
+    };
+
+    /*!
+     * \brief Report under construction and the counters it is built from.
+     */
+    struct RunStats;
+
+    /*!
+     * \brief Per-run settings shared by the scan, plan and delete phases.
+     */
+    struct RunControl
+    {
+        int iteration_limit = -1;
+        std::shared_ptr<std::atomic<bool>> cancel;
+        std::shared_ptr<RunStats> stats;
+
+        bool isCancelled() const
+        {
+            return cancel && cancel->load();
+        }
+
+        bool isManaged(int iteration) const
+        {
+            return iteration_limit < 0 || iteration < iteration_limit;
+        }
+    };
+
+    /*!
+     * \brief Parse strategy string to enum.
+     */
+    CleanupStrategy parseStrategy(const std::string& strategy_str) const;
+
+    /*!
+     * \brief Iterations pinned by setPinnedIterations() and by the pin list in the base directory.
+     */
+    std::unordered_set<int> loadPins() const;
+
+    /*!
+     * \brief Name of the deletion engine that actually runs, after a fallback from URING.
+     */
+    std::string getEngineName() const;
+
+    /*!
+     * \brief Restart directories found by a scan and the ones selected for deletion.
+     */
+    struct CleanupSelection
+    {
+        RestartIndex index;
+        std::size_t num_managed = 0;
+        std::vector<std::size_t> victims;
+        std::vector<TreeSize> sizes;
+    };
+
+    /*!
+     * \brief Parallel removal that has been started but not waited for.
+     */
+    struct PendingRemoval;
+
+    /*!
+     * \brief Execute cleanup based on current strategy.
+     */
+    void executeStrategy(const RunControl& control) const;
+
+    /*!
+     * \brief Whether executeStrategy() can select and delete in a single pass with streamKeepRecentN().
+     */
+    bool canStreamSelection() const;
+
+    /*!
+     * \brief Run KEEP_RECENT_N cleanup while scanning the base directory.
+     *
+     * Only the newest d_keep_restart_count managed directories are held in
+     * memory; every older one is handed to the delete workers as soon as it is
+     * known to be a victim, so deletion overlaps the scan.
+     */
+    void streamKeepRecentN(const RunControl& control) const;
+
+    /*!
+     * \brief Scan the base directory and select victims with the current strategy.
+     */
+    CleanupSelection selectVictims(const RunControl& control) const;
+
+    /*!
+     * \brief Select victims among the entries of an index that is already up to date.
+     */
+    CleanupSelection selectVictimsFromIndex(RestartIndex index, const RunControl& control) const;
+
+    /*!
+     * \brief Get the worker pool set by setWorkerPool(), or a new one with d_num_jobs workers.
+     */
+    std::shared_ptr<RestartWorkerPool> getWorkerPool() const;
+
+    /*!
+     * \brief Scan the base path for restart directories.
+     *
+     * Reads the base directory with getdents64() in a single pass.  The entry
+     * type reported by the file system is used to recognize directories, so
+     * only entries of unknown type (or symbolic links) need a stat() call.
+     * The resulting index is sorted by iteration and cached.  A current
+     * restart catalog stands in for the base directory, and a scan rewrites
+     * the catalog otherwise.
+     *
+     * \param stats Receives the scan and sort timings and counts, if not null
+     * \return Index of all valid restart directories
+     */
+    RestartIndex scanRestartIndex(RunStats* stats = nullptr) const;
+
+    /*!
+     * \brief Fill \p index from the restart catalog of \p dir_fd if it describes \p dir_stat.
+     *
+     * \return Whether the catalog was used
+     */
+    bool readCatalogIndex(int dir_fd, const struct stat& dir_stat, RestartIndex& index) const;
+
+    /*!
+     * \brief Rewrite the restart catalog of \p dir_fd with the listing \p index read from \p dir_stat.
+     *
+     * Records of directories with unchanged inodes carry over, directories
+     * that are gone are kept as removed.  \p read_ns is the time taken before
+     * \p dir_stat, i.e. before the scan started, which the settle check needs.
+     */
+    void storeCatalog(int dir_fd, const struct stat& dir_stat, std::int64_t read_ns, const RestartIndex& index) const;
+
+    /*!
+     * \brief Whether the restart catalog describes the base directory as it is now.
+     */
+    bool isCatalogCurrent() const;
+
+    /*!
+     * \brief Update the cached index after directories were removed by this object.
+     *
+     * The removed directories are also marked in the restart catalog.
+     */
+    void updateCachedIndex(const std::vector<std::string>& removed_names) const;
+
+    /*!
+     * \brief Mark the directories \p removed_names as removed by this object in the restart catalog.
+     */
+    void markCatalogRemoved(const std::vector<std::string>& removed_names) const;
+
+    /*!
+     * \brief KEEP_RECENT_N strategy implementation.
+     *
+     * \param index       Restart index sorted by iteration
+     * \param num_managed Number of leading index entries the strategy may delete
+     * \return Positions of the index entries to delete, in ascending order
+     */
+    std::vector<std::size_t> keepRecentN(const RestartIndex& index, std::size_t num_managed) const;
+
+    /*!
+     * \brief SMART_RETENTION strategy implementation.
+     *
+     * Selects the victims in a single pass over the sorted index, from the
+     * newest to the oldest entry.
+     *
+     * \param index       Restart index sorted by iteration
+     * \param num_managed Number of leading index entries the strategy may delete
+     * \return Positions of the index entries to delete, in ascending order
+     */
+    std::vector<std::size_t> smartRetention(const RestartIndex& index, std::size_t num_managed) const;
+
+    /*!
+     * \brief MAX_BYTES strategy implementation.
+     *
+     * \param index       Restart index sorted by iteration
+     * \param num_managed Number of leading index entries the strategy may delete
+     * \param sizes       Set to the disk usage of every index entry
+     * \return Positions of the index entries to delete, in ascending order
+     */
+    std::vector<std::size_t> maxBytes(const RestartIndex& index,
+                                      std::size_t num_managed,
+                                      std::vector<TreeSize>& sizes) const;
+
+    /*!
+     * \brief Get the disk usage of every entry of the index.
+     *
+     * Entries whose modification time matches the size cache are taken from
+     * the cache; all others are measured in parallel and the cache is updated.
+     */
+    std::vector<TreeSize> getRestartDirSizes(const RestartIndex& index) const;
+
+    /*!
+     * \brief Get the cost of deleting one entry, in seconds.
+     *
+     * \param source Set to "MEASURED" or "DEFAULT", see CleanupPlan
+     */
+    double getUnlinkCost(std::string& source) const;
+
+    /*!
+     * \brief Record the cost per entry observed by a deletion in the cost file.
+     */
+    void recordUnlinkCost(const CleanupReport& report) const;
+
+    /*!
+     * \brief TIME_BASED strategy implementation.
+     *
+     * \param index       Restart index sorted by iteration
+     * \param num_managed Number of leading index entries the strategy may delete
+     * \return Positions of the index entries to delete, in ascending order
+     */
+    std::vector<std::size_t> timeBased(const RestartIndex& index, std::size_t num_managed) const;
+
+    /*!
+     * \brief Get the completion time (seconds since the epoch) of the first
+     * \p num_managed entries of the index, or -1 where it cannot be read.
+     *
+     * Entries whose inode matches the time cache are taken from the cache.
+     * The newest entry may still be written to and is never cached.
+     */
+    std::vector<std::int64_t> getCompletionTimes(const RestartIndex& index, std::size_t num_managed) const;
+
+    /*!
+     * \brief Remove victims that are needed because a newer kept restart failed verification.
+     *
+     * \param index       Restart index sorted by iteration
+     * \param num_managed Number of leading index entries the strategy may delete
+     * \param victims     Positions selected by the strategy, updated in place
+     */
+    void protectUnverifiedRestarts(const RestartIndex& index,
+                                   std::size_t num_managed,
+                                   std::vector<std::size_t>& victims) const;
+
+    /*!
+     * \brief Verify the given index entries, checksumming their files in parallel.
+     *
+     * \return For each entry, a description of the problem found, or an empty string
+     */
+    std::vector<std::string> verifyRestartDirs(const RestartIndex& index,
+                                               const std::vector<std::size_t>& positions) const;
+
+    /*!
+     * \brief Delete (or, in dry-run mode, list) the selected index entries.
+     */
+    void deleteRestartDirs(const CleanupSelection& selection, const RunControl& control) const;
+
+    /*!
+     * \brief Remove the given restart directories with the selected engine.
+     *
+     * Errors are reported per directory and do not abort the removal of the
+     * remaining directories.  Cancellation is checked before each directory.
+     *
+     * \return Names of the directories that were removed
+     */
+    std::vector<std::string> removeRestartDirs(const std::vector<fs::path>& dirs, const RunControl& control) const;
+
+    /*!
+     * \brief Move the given restart directories into the archive directory.
+     *
+     * Copies across file systems run on the worker pool; each source is
+     * removed as soon as its copy has been published, while other copies
+     * proceed.
+     *
+     * \return Names of the directories that were migrated
+     */
+    std::vector<std::string> migrateRestartDirs(const std::vector<fs::path>& dirs, const RunControl& control) const;
+
+    /*!
+     * \brief Replace the given restart directories by verified pack files.
+     *
+     * Directories are packed one after the other with parallel readers; each
+     * is removed in the background while the next one is packed.
+     *
+     * \return Names of the directories that were packed
+     */
+    std::vector<std::string> packRestartDirs(const std::vector<fs::path>& dirs, const RunControl& control) const;
+
+    /*!
+     * \brief Fill in the settings of a new report.
+     */
+    void initReport(CleanupReport& report) const;
+
+    /*!
+     * \brief Take the lock on the base path selected by setLocking().
+     *
+     * \return nullptr if no locking is needed, otherwise the lock, which may
+     *         not be held if another process holds it and the mode is SKIP
+     */
+    std::unique_ptr<BaseLock> lockBasePath() const;
+
+    /*!
+     * \brief Drop the victims that belong to other partitions (see setPartition()).
+     */
+    void keepPartitionVictims(const RestartIndex& index, std::vector<std::size_t>& victims) const;
+
+    /*!
+     * \brief Share the data of identical files in the managed restart directories (see setDeduplication()).
+     */
+    void deduplicateRestartDirs(const RunControl& control) const;
+
+    /*!
+     * \brief Remove the given directory trees right away with the selected engine.
+     *
+     * All trees must be entries of the same parent directory.
+     *
+     * \return Names of the trees that were removed
+     */
+    std::vector<std::string> removeTrees(const std::vector<fs::path>& dirs, const RunControl& control) const;
+
+    /*!
+     * \brief Rename the given directories into the trash directory and queue them for the reaper.
+     *
+     * \return Names of the directories that were renamed
+     */
+    std::vector<std::string> tombstoneRestartDirs(const std::vector<fs::path>& dirs, const RunControl& control) const;
+
+    /*!
+     * \brief Queue the tombstones left in the journal by an earlier, interrupted process.
+     */
+    void resumeTombstones() const;
+
+    /*!
+     * \brief Add tombstones to the reaper queue, starting the reaper thread if needed.
+     *
+     * Must be called with d_reaper_mutex held.
+     */
+    void queueTombstones(const std::vector<std::string>& tombstones) const;
+
+    /*!
+     * \brief Main loop of the reaper thread.
+     */
+    void reapTombstones() const;
+
+    /*!
+     * \brief Remove the given directories with std::filesystem::remove_all().
+     */
+    std::vector<std::string> removeRestartDirsSerial(const std::vector<fs::path>& dirs,
+                                                     const RunControl& control) const;
+
+    /*!
+     * \brief Remove the given directories with the descriptor-relative parallel engine.
+     */
+    std::vector<std::string> removeRestartDirsParallel(const std::vector<fs::path>& dirs,
+                                                       const RunControl& control) const;
+
+    /*!
+     * \brief Submit the parallel removal of the given directories to \p pool without waiting.
+     */
+    std::unique_ptr<PendingRemoval> startParallelRemoval(const std::vector<fs::path>& dirs,
+                                                         const RunControl& control,
+                                                         RestartWorkerPool& pool) const;
+
+    /*!
+     * \brief Wait for a removal started by startParallelRemoval() and report the results.
+     *
+     * \return Names of the directories that were removed
+     */
+    std::vector<std::string> finishParallelRemoval(PendingRemoval& removal) const;
+
+    const std::string d_restart_base_path;
+    const CleanupStrategy d_strategy;
+    const int d_keep_restart_count;
+    const bool d_dry_run;
+
+    DeletionEngine d_engine = DeletionEngine::PARALLEL;
+    UnlinkOrder d_unlink_order = UnlinkOrder::READDIR;
+    int d_num_jobs;
+    std::shared_ptr<RestartWorkerPool> d_worker_pool;
+    std::vector<RetentionTier> d_retention_tiers;
+    std::uintmax_t d_max_bytes = 0;
+    TimeRetention d_time_retention;
+    VerifyMode d_verify_mode = VerifyMode::OFF;
+    RateLimits d_rate_limits;
+    RestartNamePattern d_name_pattern;
+    VictimAction d_action = VictimAction::DELETE;
+    std::string d_archive_path;
+    RestartPack::Codec d_pack_codec = RestartPack::Codec::NONE;
+    DedupMode d_dedup_mode = DedupMode::OFF;
+    LockMode d_lock_mode = LockMode::OFF;
+    int d_partition_index = 0;
+    int d_partition_count = 1;
+    std::unordered_set<int> d_pinned_iterations;
+    bool d_pin_markers = false;
+    CatalogMode d_catalog_mode = CatalogMode::ON;
+
+    std::thread d_async_thread;
+
+    /*
+     * Tombstone reaper state.  The reaper thread runs while d_reaper_queue is
+     * non-empty; the journal is only modified with d_reaper_mutex and its
+     * file lock held, since other processes share it.
+     */
+    bool d_use_tombstones = false;
+    mutable std::mutex d_reaper_mutex;
+    mutable std::condition_variable d_reaper_cv;
+    mutable std::thread d_reaper_thread;
+    mutable std::deque<std::string> d_reaper_queue;
+    mutable bool d_reaper_running = false;
+    mutable bool d_journal_resumed = false;
+    mutable unsigned long d_tombstone_counter = 0;
+
+    /*
+     * Index of the last scan, keyed on the modification time of the base
+     * directory and reused only once that time is older than the scan by a
+     * settle interval, or right after our own deletions, which set the time
+     * (changes by others while deleting are missed either way).  Guarded by
+     * d_index_mutex since a background cleanup may update it while the owner
+     * queries it.
+     */
+    mutable std::mutex d_index_mutex;
+    mutable RestartIndex d_cached_index;
+    mutable bool d_cached_index_valid = false;
+    mutable struct timespec d_cached_index_mtime = {};
+    mutable std::int64_t d_cached_index_read_ns = 0;
+    mutable bool d_cached_index_after_delete = false;
+};
+
+/*!
+ * \brief Class RestartWatcher runs a RestartCleaner whenever a new restart directory is finalized.
+ *
+ * The watcher scans the base directory once at startup and from then on
+ * follows it with inotify: restore.XXXXXX directories that are created,
+ * renamed in, deleted or renamed away update an in-memory set of iterations,
+ * so the base directory is never rescanned in steady state (only after an
+ * inotify queue overflow).
+ *
+ * A new restart directory only counts once it is finalized:
+ * - a directory renamed into the base directory is finalized immediately;
+ * - with a marker name, a directory is finalized when a file of that name
+ *   appears in it;
+ * - otherwise, a directory is finalized once nothing in it has been
+ *   created, written or renamed for the quiescence window.
+ * Directories being written are watched (with their subdirectories) until
+ * they are finalized.  The cleaner's strategy runs on the finalized
+ * directories, once at startup and after every batch of finalizations, so
+ * a restart that is still being written is neither counted nor deleted.
+ *
+ * Sample usage:
+ * \code
+ * RestartCleaner cleaner("/path/to/restores", 5);
+ * RestartWatcher watcher(cleaner, 30.0);
+ * std::thread thread([&]() { watcher.run(); });
+ * // ...
+ * watcher.stop();
+ * thread.join();
+ * \endcode
+ */
+class RestartWatcher
+{
+public:
+    /*!
+     * \brief Constructor.
+     *
+     * \param cleaner            Cleaner whose base path and strategy are used
+     * \param quiescence_seconds Idle time after which a new restart directory is finalized
+     * \param marker_name        File whose appearance finalizes a restart directory
+     *                           (empty to use the quiescence window)
+     * \throws std::runtime_error if inotify is not available
+     */
+    RestartWatcher(RestartCleaner& cleaner, double quiescence_seconds = 30.0, const std::string& marker_name = "");
+
+    /*!
+     * \brief Destructor.
+     */
+    ~RestartWatcher();
+
+    /*!
+     * \brief Watch the base directory until stop() is called or the directory disappears.
+     */
+    void run();
+
+    /*!
+     * \brief Make run() return.  Async-signal-safe.
+     */
+    void stop();
+
+    /*!
+     * \brief Number of times the strategy has run so far.
+     */
+    std::size_t getNumCleanups() const;
+
+private:
+    RestartWatcher(const RestartWatcher& from) = delete;
+    RestartWatcher& operator=(const RestartWatcher& that) = delete;
+
+    /*!
+     * \brief Inotify descriptors and per-directory state, defined in the source file.
+     */
+    struct WatchState;
+
+    RestartCleaner& d_cleaner;
+    const double d_quiescence_seconds;
+    const std::string d_marker_name;
+    int d_inotify_fd = -1;
+    int d_stop_fd = -1;
+    std::atomic<std::size_t> d_num_cleanups{ 0 };
 };
 
 // } // Future IBAMR integration namespace
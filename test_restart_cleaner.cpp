@@ -3,8 +3,20 @@
 #include <iostream>
 #include <filesystem>
 #include <fstream>
+#include <iterator>
 #include <algorithm>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+#include <ctime>
+#include <cstdio>
 #include <stdexcept>
+#include <thread>
+#include <tuple>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace fs = std::filesystem;
 
@@ -88,7 +100,7 @@ private:
 /**
  * Test iteration number parsing through getAvailableIterations
  * Tests extraction of iteration numbers from directory names via public interface
- * This indirectly tests the private parseIterationNum function
+ * This indirectly tests the default RestartNamePattern
  */
 bool test_iteration_parsing_via_public_interface(TestEnvironment& env) {
     std::cout << "Testing iteration number parsing... ";
@@ -97,7 +109,7 @@ bool test_iteration_parsing_via_public_interface(TestEnvironment& env) {
         RestartCleaner cleaner(env.get_test_dir(), 10, "KEEP_RECENT_N", true); // Keep all, dry run
         auto iterations = cleaner.getAvailableIterations();
 
-        // Expected valid iterations in sorted order (tests parseIterationNum indirectly)
+        // Expected valid iterations in sorted order (tests the name pattern indirectly)
         std::vector<int> expected_iterations = {
             1, 100, 200, 300, 1000, 2500, 3000, 5000, 999999
         };
@@ -139,7 +151,7 @@ bool test_iteration_parsing_via_public_interface(TestEnvironment& env) {
 /**
  * Test directory filtering logic
  * Tests that invalid directory names are properly ignored
- * This indirectly tests both getAllRestartDirs and parseIterationNum functions
+ * This indirectly tests both getAllRestartDirs and the default name pattern
  */
 bool test_directory_filtering(TestEnvironment& env) {
     std::cout << "Testing directory filtering... ";
@@ -323,6 +335,1984 @@ bool test_error_handling() {
     }
 }
 
+/**
+ * Create a scratch restart directory with the given iterations
+ * Each restore directory holds per-rank files and a nested subdirectory
+ */
+void create_restart_tree(const std::string& dir, const std::vector<int>& iterations, int files_per_dir) {
+    if (fs::exists(dir)) {
+        fs::remove_all(dir);
+    }
+    for (int iter : iterations) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "restore.%06d", iter);
+        std::string full_path = dir + "/" + name;
+        fs::create_directories(full_path + "/nodes/level_0");
+        for (int rank = 0; rank < files_per_dir; ++rank) {
+            char rank_suffix[16];
+            std::snprintf(rank_suffix, sizeof(rank_suffix), "%05d", rank);
+            std::ofstream(full_path + "/samrai." + rank_suffix) << "SAMRAI restart data";
+            std::ofstream(full_path + "/hier_data." + rank_suffix + ".samrai." + rank_suffix) << "Hierarchy data";
+            std::ofstream(full_path + "/nodes/level_0/patch." + rank_suffix) << "Patch data";
+        }
+        fs::create_symlink("samrai.00000", full_path + "/latest");
+    }
+}
+
+/**
+ * Test actual deletion with the serial and the parallel engine
+ * Both engines must remove exactly the old trees and leave the recent ones intact
+ */
+bool test_deletion_engines() {
+    std::cout << "Testing deletion engines... ";
+
+    const std::string dir = "engine_test_dir";
+    try {
+        // URING falls back to PARALLEL without kernel support; the second URING
+        // run reads the file sizes for a byte rate limit through io_uring too
+        bool throttled = false;
+        for (const std::string engine : {"SERIAL", "PARALLEL", "URING", "URING"}) {
+            create_restart_tree(dir, {10, 20, 30, 40, 50, 60}, 300);
+
+            RestartCleaner cleaner(dir, 2, "KEEP_RECENT_N", false);
+            cleaner.setDeletionEngine(engine);
+            cleaner.setNumJobs(4);
+            if (engine == "URING" && throttled) {
+                RestartCleaner::RateLimits limits;
+                limits.bytes_per_second = 1e12;
+                cleaner.setRateLimits(limits);
+            }
+            throttled = engine == "URING";
+            std::cout.setstate(std::ios::failbit); // silence per-directory output
+            RestartCleaner::CleanupReport report = cleaner.cleanup();
+            std::cout.clear();
+
+            // 900 files, 2 subdirectories, a link and the directory itself per restart
+            if (engine != "SERIAL" && (report.entries_unlinked != 4 * 904 || !report.errors.empty() ||
+                                       (report.engine != engine && report.engine != "PARALLEL"))) {
+                std::cout << "FAILED (" << engine << " engine unlinked " << report.entries_unlinked << " entries)"
+                          << std::endl;
+                fs::remove_all(dir);
+                return false;
+            }
+
+            auto remaining = cleaner.getAvailableIterations();
+            if (remaining != std::vector<int>({50, 60})) {
+                std::cout << "FAILED (" << engine << " engine left " << remaining.size() << " directories)" << std::endl;
+                fs::remove_all(dir);
+                return false;
+            }
+            if (!fs::exists(dir + "/restore.000060/nodes/level_0/patch.00299")) {
+                std::cout << "FAILED (" << engine << " engine touched a kept directory)" << std::endl;
+                fs::remove_all(dir);
+                return false;
+            }
+        }
+
+        try {
+            RestartCleaner cleaner(dir, 2, "KEEP_RECENT_N", false);
+            cleaner.setDeletionEngine("BOGUS");
+            std::cout << "FAILED (Should throw exception for unknown engine)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        } catch (const std::invalid_argument&) {
+            // Expected exception
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
+/**
+ * Test background cleanup
+ * The protected iteration and everything newer must never be touched, and a
+ * cancelled cleanup must not leave any directory half deleted
+ */
+bool test_async_cleanup() {
+    std::cout << "Testing asynchronous cleanup... ";
+
+    const std::string dir = "async_test_dir";
+    try {
+        create_restart_tree(dir, {10, 20, 30, 40, 50, 60}, 50);
+        {
+            RestartCleaner cleaner(dir, 2, "KEEP_RECENT_N", false);
+            std::cout.setstate(std::ios::failbit);
+            RestartCleanupHandle handle = cleaner.cleanupAsync(50); // restore.000050 is "being written"
+            handle.wait();
+            std::cout.clear();
+
+            if (!handle.isDone() || cleaner.getAvailableIterations() != std::vector<int>({30, 40, 50, 60})) {
+                std::cout << "FAILED (Protected iterations were not respected)" << std::endl;
+                fs::remove_all(dir);
+                return false;
+            }
+        }
+
+        create_restart_tree(dir, {10, 20, 30, 40, 50, 60}, 50);
+        {
+            RestartCleaner cleaner(dir, 1, "KEEP_RECENT_N", false);
+            std::cout.setstate(std::ios::failbit);
+            RestartCleanupHandle handle = cleaner.cleanupAsync();
+            handle.cancel();
+            handle.wait();
+            std::cout.clear();
+
+            for (int iter : cleaner.getAvailableIterations()) {
+                char name[32];
+                std::snprintf(name, sizeof(name), "/restore.%06d", iter);
+                if (!fs::exists(dir + name + "/nodes/level_0/patch.00049")) {
+                    std::cout << "FAILED (Cancelled cleanup left " << name << " half deleted)" << std::endl;
+                    fs::remove_all(dir);
+                    return false;
+                }
+            }
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
+/**
+ * Test reuse of the restart index
+ * The index built by cleanup() must reflect the deletions, and any later
+ * change to the base directory must invalidate it
+ */
+bool test_restart_index() {
+    std::cout << "Testing restart index reuse... ";
+
+    const std::string dir = "index_test_dir";
+    try {
+        create_restart_tree(dir, {5, 15, 25, 35}, 2);
+        RestartCleaner cleaner(dir, 2, "KEEP_RECENT_N", false);
+        std::cout.setstate(std::ios::failbit);
+        cleaner.cleanup();
+        std::cout.clear();
+
+        RestartIndex index = cleaner.getRestartIndex();
+        if (index.size() != 2 || index.getName(0) != "restore.000025" || index.getIteration(1) != 35) {
+            std::cout << "FAILED (Index does not reflect the cleanup)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // The index left by the cleanup is reused without a rescan: a
+        // directory added behind its back (keeping the time) is not seen
+        const auto base_mtime = fs::last_write_time(dir);
+        fs::create_directories(dir + "/restore.000050");
+        fs::last_write_time(dir, base_mtime);
+        if (cleaner.getRestartIndex().size() != 2) {
+            std::cout << "FAILED (Index was rescanned after the cleanup)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+        fs::remove(dir + "/restore.000050");
+
+        // Make sure the new entry gets a distinct directory timestamp
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        fs::create_directories(dir + "/restore.000045");
+        if (cleaner.getAvailableIterations() != std::vector<int>({25, 35, 45})) {
+            std::cout << "FAILED (Stale index after the directory changed)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
+/**
+ * Test the SMART_RETENTION strategy
+ * Checks the tiered selection and that kept restarts stay kept when new
+ * restarts arrive
+ */
+bool test_smart_retention() {
+    std::cout << "Testing smart retention... ";
+
+    const std::string dir = "smart_test_dir";
+    try {
+        std::vector<int> iterations;
+        for (int iter = 100; iter <= 10000; iter += 100) {
+            iterations.push_back(iter);
+        }
+        create_restart_tree(dir, iterations, 1);
+
+        // Dense: 9800-10000, every 10th restart (3 kept): 7000-9000, then every 100th: 100
+        RestartCleaner cleaner(dir, 3, "SMART_RETENTION", false);
+        std::cout.setstate(std::ios::failbit);
+        cleaner.cleanup();
+        std::cout.clear();
+        std::vector<int> expected = {100, 7000, 8000, 9000, 9800, 9900, 10000};
+        if (cleaner.getAvailableIterations() != expected) {
+            std::cout << "FAILED (Unexpected tiered selection)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // A new restart only pushes the oldest dense one out
+        fs::create_directories(dir + "/restore.010100");
+        std::cout.setstate(std::ios::failbit);
+        cleaner.cleanup();
+        std::cout.clear();
+        expected = {100, 7000, 8000, 9000, 9900, 10000, 10100};
+        if (cleaner.getAvailableIterations() != expected) {
+            std::cout << "FAILED (Tiered selection is not stable)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
+/**
+ * Test the MAX_BYTES strategy
+ * Each restore directory holds 1 MiB of data plus a hard link to it, which
+ * must only be counted once
+ */
+bool test_max_bytes() {
+    std::cout << "Testing byte budget retention... ";
+
+    const std::string dir = "max_bytes_test_dir";
+    try {
+        create_restart_tree(dir, {10, 20, 30, 40, 50, 60}, 1);
+        const std::string block(1 << 20, 'x');
+        for (const auto& entry : fs::directory_iterator(dir)) {
+            std::ofstream(entry.path() / "hier_data.big") << block;
+            fs::create_hard_link(entry.path() / "hier_data.big", entry.path() / "hier_data.link");
+        }
+
+        RestartCleaner cleaner(dir, 1, "MAX_BYTES", false);
+        cleaner.setMaxBytes(5 << 19); // 2.5 MiB
+        std::cout.setstate(std::ios::failbit);
+        cleaner.cleanup();
+        std::cout.clear();
+        if (cleaner.getAvailableIterations() != std::vector<int>({50, 60})) {
+            std::cout << "FAILED (Expected the 2 most recent directories to fit the budget)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+        if (!fs::exists(dir + "/.restart_cleaner_sizes")) {
+            std::cout << "FAILED (Size cache was not written)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // The minimum keep count wins over the budget
+        cleaner.setMaxBytes(1);
+        std::cout.setstate(std::ios::failbit);
+        cleaner.cleanup();
+        std::cout.clear();
+        if (cleaner.getAvailableIterations() != std::vector<int>({60})) {
+            std::cout << "FAILED (Most recent directory must always be kept)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
+/**
+ * Test batch cleanup of several runs through one shared worker pool
+ */
+bool test_batch_cleanup() {
+    std::cout << "Testing batch cleanup... ";
+
+    const std::string root = "batch_test_dir";
+    try {
+        fs::remove_all(root);
+        create_restart_tree(root + "/run_a/restart_IB2d", {1, 2, 3, 4, 5}, 20);
+        create_restart_tree(root + "/run_b/restart_IB2d", {10, 20}, 1);
+        create_restart_tree(root + "/sweep/run_c/restart_IB2d", {7, 8, 9}, 200);
+        fs::create_directories(root + "/run_a/viz_IB2d");
+
+        std::vector<std::string> roots = RestartCleaner::findRestartRoots(root);
+        if (roots.size() != 3 || roots[0] != root + "/run_a/restart_IB2d") {
+            std::cout << "FAILED (Expected 3 restart directories, found " << roots.size() << ")" << std::endl;
+            fs::remove_all(root);
+            return false;
+        }
+
+        auto pool = std::make_shared<RestartWorkerPool>(3);
+        std::vector<std::unique_ptr<RestartCleaner>> cleaners;
+        std::vector<RestartCleaner*> cleaner_ptrs;
+        for (const auto& dir : roots) {
+            cleaners.push_back(std::make_unique<RestartCleaner>(dir, 2, "KEEP_RECENT_N", false));
+            cleaners.back()->setWorkerPool(pool);
+            cleaner_ptrs.push_back(cleaners.back().get());
+        }
+        std::cout.setstate(std::ios::failbit);
+        RestartCleaner::BatchSummary summary = RestartCleaner::cleanupBatch(cleaner_ptrs);
+        std::cout.clear();
+
+        if (summary.num_runs != 3 || summary.num_found != 10 || summary.num_deleted != 4 || summary.num_failed != 0) {
+            std::cout << "FAILED (Unexpected batch summary: " << summary.num_deleted << " deleted)" << std::endl;
+            fs::remove_all(root);
+            return false;
+        }
+        for (const auto& cleaner : cleaners) {
+            if (cleaner->getAvailableIterations().size() != 2) {
+                std::cout << "FAILED (Every run should keep 2 restart directories)" << std::endl;
+                fs::remove_all(root);
+                return false;
+            }
+        }
+
+        fs::remove_all(root);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(root);
+        return false;
+    }
+}
+
+/**
+ * Test two-phase deletion through tombstones
+ * Victims must vanish from the restart directory immediately, the reaper must
+ * clean up the trash, and tombstones of an interrupted run must be resumed
+ */
+bool test_tombstone_deletion() {
+    std::cout << "Testing tombstone deletion... ";
+
+    const std::string dir = "tombstone_test_dir";
+    try {
+        create_restart_tree(dir, {10, 20, 30, 40, 50}, 100);
+        {
+            RestartCleaner cleaner(dir, 2, "KEEP_RECENT_N", false);
+            cleaner.setTombstoneDeletion(true);
+            std::cout.setstate(std::ios::failbit);
+            cleaner.cleanup();
+            bool moved = cleaner.getAvailableIterations() == std::vector<int>({40, 50});
+            cleaner.waitForReaper();
+            std::cout.clear();
+
+            if (!moved) {
+                std::cout << "FAILED (Old restart directories were not moved away)" << std::endl;
+                fs::remove_all(dir);
+                return false;
+            }
+        }
+        if (fs::exists(dir + "/.trash") || !fs::exists(dir + "/restore.000050/nodes/level_0/patch.00099")) {
+            std::cout << "FAILED (Reaper left the trash directory or touched a kept directory)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // Simulate a process that died after journaling and renaming a tombstone
+        create_restart_tree(dir + "/.trash", {1}, 10);
+        fs::rename(dir + "/.trash/restore.000001", dir + "/.trash/restore.000001.123.1");
+        std::ofstream(dir + "/.trash/journal") << "T restore.000001.123.1\nT restore.000002.123.2\nD restore.000002.123.2\n";
+        {
+            RestartCleaner cleaner(dir, 2, "KEEP_RECENT_N", false);
+            std::cout.setstate(std::ios::failbit);
+            cleaner.cleanup();
+            cleaner.waitForReaper();
+            std::cout.clear();
+        }
+        if (fs::exists(dir + "/.trash")) {
+            std::cout << "FAILED (Interrupted tombstones were not resumed)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
+/**
+ * Test verification of kept restarts
+ * Checksums must be recorded in the manifest, and a kept restart with missing
+ * or damaged files must protect the next older restart from deletion
+ */
+bool test_verification() {
+    std::cout << "Testing restart verification... ";
+
+    const std::string dir = "verify_test_dir";
+    try {
+        // Intact restarts: the manifest records the CRC32C of every file
+        create_restart_tree(dir, {10, 20, 30, 40, 50}, 4);
+        std::ofstream(dir + "/restore.000050/check.dat") << "123456789";
+        {
+            RestartCleaner cleaner(dir, 2, "KEEP_RECENT_N", false);
+            cleaner.setVerification("INCREMENTAL");
+            std::cout.setstate(std::ios::failbit);
+            cleaner.cleanup();
+            std::cout.clear();
+            if (cleaner.getAvailableIterations() != std::vector<int>({40, 50})) {
+                std::cout << "FAILED (Intact restarts should not protect older ones)" << std::endl;
+                fs::remove_all(dir);
+                return false;
+            }
+        }
+        std::ifstream manifest(dir + "/.restart_cleaner_checksums");
+        std::string manifest_text((std::istreambuf_iterator<char>(manifest)), std::istreambuf_iterator<char>());
+        // One line per file: "<dir name> <dir inode> <dir mtime> <file name> <size> <mtime> <crc32c>"
+        const std::size_t check_record = manifest_text.find(" check.dat 9 ");
+        const std::size_t line_start = check_record == std::string::npos ? 0 : manifest_text.rfind('\n', check_record) + 1;
+        const std::string line = manifest_text.substr(line_start, manifest_text.find('\n', line_start) - line_start);
+        if (check_record == std::string::npos || line.compare(0, 15, "restore.000050 ") != 0 ||
+            line.size() < 9 || line.compare(line.size() - 9, 9, " e3069283") != 0) {
+            std::cout << "FAILED (Manifest does not hold the CRC32C of check.dat)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+        if (fs::exists(dir + "/restore.000050/.checksums")) {
+            std::cout << "FAILED (Verification wrote into a restart directory)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // A missing rank file protects the next older restart
+        create_restart_tree(dir, {10, 20, 30, 40, 50}, 4);
+        fs::remove(dir + "/restore.000040/samrai.00002");
+        {
+            RestartCleaner cleaner(dir, 2, "KEEP_RECENT_N", false);
+            cleaner.setVerification("INCREMENTAL");
+            std::cout.setstate(std::ios::failbit);
+            std::cerr.setstate(std::ios::failbit);
+            cleaner.cleanup();
+            std::cout.clear();
+            std::cerr.clear();
+            if (cleaner.getAvailableIterations() != std::vector<int>({30, 40, 50})) {
+                std::cout << "FAILED (Incomplete restart did not protect its predecessor)" << std::endl;
+                fs::remove_all(dir);
+                return false;
+            }
+        }
+
+        // Silent corruption (same size and modification time) is found by a full verification
+        create_restart_tree(dir, {10, 20, 30, 40, 50}, 4);
+        {
+            RestartCleaner cleaner(dir, 4, "KEEP_RECENT_N", false);
+            cleaner.setVerification("INCREMENTAL");
+            std::cout.setstate(std::ios::failbit);
+            cleaner.cleanup();
+            std::cout.clear();
+        }
+        const std::string damaged = dir + "/restore.000040/samrai.00001";
+        const auto mtime = fs::last_write_time(damaged);
+        std::ofstream(damaged) << "SAMRAI restart dat?";
+        fs::last_write_time(damaged, mtime);
+        {
+            RestartCleaner cleaner(dir, 2, "KEEP_RECENT_N", false);
+            cleaner.setVerification("FULL");
+            std::cout.setstate(std::ios::failbit);
+            std::cerr.setstate(std::ios::failbit);
+            cleaner.cleanup();
+            std::cout.clear();
+            std::cerr.clear();
+            if (cleaner.getAvailableIterations() != std::vector<int>({30, 40, 50})) {
+                std::cout << "FAILED (Corrupted restart did not protect its predecessor)" << std::endl;
+                fs::remove_all(dir);
+                return false;
+            }
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cerr.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
+/**
+ * Test the report returned by cleanup()
+ * Counts must match the tree that was removed and the JSON must carry them
+ */
+bool test_cleanup_report() {
+    std::cout << "Testing cleanup report... ";
+
+    const std::string dir = "report_test_dir";
+    try {
+        // Each tree: 3 files per rank, the "latest" link and 3 directories
+        create_restart_tree(dir, {10, 20, 30, 40, 50, 60}, 20);
+        RestartCleaner cleaner(dir, 2, "KEEP_RECENT_N", false);
+        cleaner.setNumJobs(2);
+        std::cout.setstate(std::ios::failbit);
+        RestartCleaner::CleanupReport report = cleaner.cleanup();
+        std::cout.clear();
+
+        if (report.num_found != 6 || report.num_selected != 4 || report.num_deleted != 4 ||
+            report.directories.size() != 4 || !report.errors.empty() || report.bytes_known) {
+            std::cout << "FAILED (Unexpected counts in report)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+        for (const auto& directory : report.directories) {
+            if (!directory.removed || directory.entries != 3 * 20 + 1 + 3) {
+                std::cout << "FAILED (" << directory.name << " reports " << directory.entries << " entries)" << std::endl;
+                fs::remove_all(dir);
+                return false;
+            }
+        }
+        if (report.entries_unlinked != 4 * 64 || report.syscalls.unlink + report.syscalls.rmdir != 4 * 64 ||
+            report.syscalls.getdents == 0 || report.entries_scanned != 6) {
+            std::cout << "FAILED (Unexpected entry or system call counts)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+        const std::string json = report.toJson();
+        if (json.find("\"num_deleted\": 4") == std::string::npos || json.find("\"bytes_unlinked\": null") == std::string::npos ||
+            json.find("\"name\": \"restore.000010\"") == std::string::npos) {
+            std::cout << "FAILED (JSON report is incomplete)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // Byte counts are known when the strategy measured them
+        create_restart_tree(dir, {10, 20, 30}, 5);
+        RestartCleaner sized_cleaner(dir, 1, "MAX_BYTES", false);
+        sized_cleaner.setMaxBytes(1);
+        std::cout.setstate(std::ios::failbit);
+        report = sized_cleaner.cleanup();
+        std::cout.clear();
+        if (!report.bytes_known || report.bytes_unlinked == 0 || report.num_deleted != 2) {
+            std::cout << "FAILED (MAX_BYTES report lacks byte counts)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
+/**
+ * Test deletion rate limits
+ * A throttled cleanup must still remove everything, but take at least as
+ * long as the token buckets allow
+ */
+bool test_rate_limits() {
+    std::cout << "Testing deletion rate limits... ";
+
+    const std::string dir = "throttle_test_dir";
+    try {
+        // 4 victims of 3 * 10 files, a link and 3 directories each: 136 unlinks
+        create_restart_tree(dir, {10, 20, 30, 40, 50, 60}, 10);
+        RestartCleaner cleaner(dir, 2, "KEEP_RECENT_N", false);
+        RestartCleaner::RateLimits limits;
+        limits.unlinks_per_second = 400.0;
+        cleaner.setRateLimits(limits);
+        std::cout.setstate(std::ios::failbit);
+        auto start = std::chrono::steady_clock::now();
+        RestartCleaner::CleanupReport report = cleaner.cleanup();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cout.clear();
+        if (report.num_deleted != 4 || elapsed < 0.2 || report.throttle_seconds <= 0.0) {
+            std::cout << "FAILED (Unlink rate limit not enforced: " << elapsed << " s)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // Adaptive throttling must still finish the job
+        create_restart_tree(dir, {10, 20, 30, 40}, 10);
+        limits.unlinks_per_second = 2000.0;
+        limits.adaptive = true;
+        cleaner.setRateLimits(limits);
+        std::cout.setstate(std::ios::failbit);
+        report = cleaner.cleanup();
+        std::cout.clear();
+        if (report.num_deleted != 2 || cleaner.getAvailableIterations().size() != 2) {
+            std::cout << "FAILED (Adaptive throttling did not complete the cleanup)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // Invalid combinations
+        limits.unlinks_per_second = 0.0;
+        bool rejected = false;
+        try {
+            cleaner.setRateLimits(limits);
+        } catch (const std::invalid_argument&) {
+            rejected = true;
+        }
+        try {
+            cleaner.setDeletionEngine("SERIAL");
+            rejected = false;
+        } catch (const std::invalid_argument&) {
+        }
+        if (!rejected) {
+            std::cout << "FAILED (Invalid rate limit settings were accepted)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
+/**
+ * Function: wait_for
+ * Purpose: Poll a condition for up to the given number of seconds
+ */
+template <class Condition>
+bool wait_for(Condition condition, double seconds) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(seconds);
+    while (!condition()) {
+        if (std::chrono::steady_clock::now() > deadline) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return true;
+}
+
+/**
+ * Test watch mode
+ * New restart directories must only trigger a cleanup once they are
+ * finalized, by quiescence or by a marker file
+ */
+bool test_watch_mode() {
+    std::cout << "Testing watch mode... ";
+
+    const std::string dir = "watch_test_dir";
+    try {
+        create_restart_tree(dir, {10, 20, 30}, 2);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1100));
+
+        std::string failure;
+        {
+            // Quiescence: the startup cleanup trims to 2, a new directory
+            // only counts once it has been idle for the window
+            RestartCleaner cleaner(dir, 2, "KEEP_RECENT_N", false);
+            RestartWatcher watcher(cleaner, 0.3);
+            std::cout.setstate(std::ios::failbit);
+            std::thread thread([&]() { watcher.run(); });
+
+            if (!wait_for([&]() { return !fs::exists(dir + "/restore.000010"); }, 5.0)) {
+                failure = "startup cleanup did not run";
+            }
+            fs::create_directories(dir + "/restore.000040/nodes");
+            std::ofstream(dir + "/restore.000040/samrai.00000") << "partial";
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            if (failure.empty() && !fs::exists(dir + "/restore.000020")) {
+                failure = "a restart still being written was counted";
+            }
+            if (failure.empty() && !wait_for([&]() { return !fs::exists(dir + "/restore.000020"); }, 5.0)) {
+                failure = "quiescent restart did not trigger a cleanup";
+            }
+            watcher.stop();
+            thread.join();
+            std::cout.clear();
+        }
+
+        if (failure.empty()) {
+            // Marker: nothing happens until the marker appears
+            RestartCleaner cleaner(dir, 2, "KEEP_RECENT_N", false);
+            RestartWatcher watcher(cleaner, 0.1, "restart.done");
+            std::cout.setstate(std::ios::failbit);
+            std::thread thread([&]() { watcher.run(); });
+
+            fs::create_directories(dir + "/restore.000050");
+            std::this_thread::sleep_for(std::chrono::milliseconds(400));
+            if (!fs::exists(dir + "/restore.000030")) {
+                failure = "restart without marker was counted";
+            }
+            std::ofstream(dir + "/restore.000050/restart.done") << "";
+            if (failure.empty() && !wait_for([&]() { return !fs::exists(dir + "/restore.000030"); }, 5.0)) {
+                failure = "marker did not trigger a cleanup";
+            }
+            watcher.stop();
+            thread.join();
+            std::cout.clear();
+        }
+
+        if (!failure.empty()) {
+            std::cout << "FAILED (" << failure << ")" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
+/**
+ * Test streaming KEEP_RECENT_N selection
+ * Directories arrive in file system order, so the newest ones must survive
+ * however they are interleaved with older ones and with non-restart entries
+ */
+bool test_streaming_selection() {
+    std::cout << "Testing streaming selection... ";
+
+    const std::string dir = "streaming_test_dir";
+    try {
+        std::vector<int> iterations;
+        for (int i = 0; i < 300; ++i) {
+            iterations.push_back((i * 7919) % 1000);
+        }
+        create_restart_tree(dir, iterations, 1);
+        std::ofstream(dir + "/restore.999999") << "not a directory";
+        std::ofstream(dir + "/notes.txt") << "not a restart";
+
+        RestartCleaner cleaner(dir, 7, "KEEP_RECENT_N", false);
+        cleaner.setNumJobs(3);
+        std::cout.setstate(std::ios::failbit);
+        RestartCleaner::CleanupReport report = cleaner.cleanup();
+        std::cout.clear();
+
+        std::vector<int> expected(iterations);
+        std::sort(expected.begin(), expected.end());
+        expected.erase(expected.begin(), expected.end() - 7);
+        if (cleaner.getAvailableIterations() != expected) {
+            std::cout << "FAILED (Wrong directories kept)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+        if (report.num_found != 300 || report.num_selected != 293 || report.num_deleted != 293 ||
+            report.entries_scanned != 302 || !report.errors.empty()) {
+            std::cout << "FAILED (Unexpected counts in report)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // A second run finds nothing to do
+        std::cout.setstate(std::ios::failbit);
+        report = cleaner.cleanup();
+        std::cout.clear();
+        if (report.num_found != 7 || report.num_selected != 0 || !fs::exists(dir + "/restore.999999")) {
+            std::cout << "FAILED (Second run changed the tree)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
+/**
+ * Test configurable directory name patterns
+ * Covers the pattern syntax, runs past iteration 999999 and VisIt dump directories
+ */
+bool test_name_patterns() {
+    std::cout << "Testing name patterns... ";
+
+    const std::string dir = "pattern_test_dir";
+    try {
+        const RestartNamePattern wide("restore.{6+}");
+        const RestartNamePattern any("lag_data.cycle_{}");
+        const RestartNamePattern tar("restore.{6}[.tar]");
+        if (wide.match("restore.1234567") != 1234567 || wide.match("restore.000042") != 42 ||
+            wide.match("restore.0000042") != -1 || wide.match("restore.12345") != -1 ||
+            any.match("lag_data.cycle_7") != 7 || any.match("lag_data.cycle_") != -1 ||
+            tar.match("restore.000042.tar") != 42 || tar.match("restore.000042") != 42 ||
+            tar.match("restore.000042.tgz") != -1 || RestartNamePattern().match("restore.1234567") != -1) {
+            std::cout << "FAILED (Pattern matched the wrong names)" << std::endl;
+            return false;
+        }
+        for (const std::string spec : {"restore.", "restore.{x}", "restore.{+}", "restore.{0}", "a/{6}", "r{6}{6}"}) {
+            try {
+                RestartNamePattern pattern(spec);
+                std::cout << "FAILED (Should reject pattern " << spec << ")" << std::endl;
+                return false;
+            } catch (const std::invalid_argument&) {
+                // Expected exception
+            }
+        }
+
+        // A run that went past iteration 999999
+        create_restart_tree(dir, {999998, 999999}, 1);
+        fs::create_directories(dir + "/restore.1000000");
+        fs::create_directories(dir + "/restore.1000001");
+        RestartCleaner cleaner(dir, 2, "KEEP_RECENT_N", false);
+        cleaner.setNamePattern(wide);
+        std::cout.setstate(std::ios::failbit);
+        cleaner.cleanup();
+        std::cout.clear();
+        if (cleaner.getAvailableIterations() != std::vector<int>({1000000, 1000001})) {
+            std::cout << "FAILED (Wide pattern kept the wrong directories)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // With an optional suffix two directories share an iteration; both
+        // count, whether the selection is streamed or made from the index
+        for (const std::string engine : {"PARALLEL", "SERIAL"}) {
+            fs::remove_all(dir);
+            for (const std::string name : {"restore.000010", "restore.000020", "restore.000020.tar", "restore.000030"}) {
+                fs::create_directories(dir + "/" + name);
+            }
+            RestartCleaner tar_cleaner(dir, 3, "KEEP_RECENT_N", false);
+            tar_cleaner.setNamePattern(tar);
+            tar_cleaner.setDeletionEngine(engine);
+            std::cout.setstate(std::ios::failbit);
+            const RestartCleaner::CleanupReport report = tar_cleaner.cleanup();
+            std::cout.clear();
+            if (tar_cleaner.getAvailableIterations() != std::vector<int>({20, 20, 30}) || report.num_found != 4 ||
+                report.num_deleted != 1 || !fs::exists(dir + "/restore.000020.tar")) {
+                std::cout << "FAILED (" << engine << " selection with a shared iteration)" << std::endl;
+                fs::remove_all(dir);
+                return false;
+            }
+        }
+
+        // VisIt dumps next to the index file that must stay
+        fs::remove_all(dir);
+        for (const std::string name : {"visit_dump.00010", "visit_dump.00020", "visit_dump.00030"}) {
+            fs::create_directories(dir + "/" + name);
+        }
+        std::ofstream(dir + "/dumps.visit") << "visit_dump.00030/summary.samrai";
+        RestartCleaner visit_cleaner(dir, 1, "KEEP_RECENT_N", false);
+        visit_cleaner.setNamePattern(RestartNamePattern("visit_dump.{5+}"));
+        std::cout.setstate(std::ios::failbit);
+        visit_cleaner.cleanup();
+        std::cout.clear();
+        if (visit_cleaner.getAvailableIterations() != std::vector<int>({30}) || !fs::exists(dir + "/dumps.visit")) {
+            std::cout << "FAILED (VisIt dump cleanup)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+        if (RestartCleaner::findRestartRoots(".", RestartNamePattern("visit_dump.{5+}")) !=
+            std::vector<std::string>({"./" + dir})) {
+            std::cout << "FAILED (findRestartRoots ignored the pattern)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
+/**
+ * Test migration of old restarts to an archive directory
+ * Covers renames within a file system, copies to another file system (when
+ * /dev/shm is a separate one) and archive entries that must not be replaced
+ */
+bool test_migration() {
+    std::cout << "Testing migration... ";
+
+    const std::string dir = "migrate_test_dir";
+    const std::string archive = "migrate_test_archive";
+    const std::string remote_archive = "/dev/shm/restart_cleaner_migrate_test";
+    const auto cleanup_dirs = [&]() {
+        fs::remove_all(dir);
+        fs::remove_all(archive);
+        std::error_code ec;
+        fs::remove_all(remote_archive, ec);
+    };
+    const auto read_file = [](const std::string& path) {
+        std::ifstream in(path);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+    try {
+        cleanup_dirs();
+        create_restart_tree(dir, {10, 20, 30, 40}, 3);
+        RestartCleaner cleaner(dir, 2, "KEEP_RECENT_N", false);
+        cleaner.setAction("MIGRATE", archive);
+        std::cout.setstate(std::ios::failbit);
+        RestartCleaner::CleanupReport report = cleaner.cleanup();
+        std::cout.clear();
+        if (cleaner.getAvailableIterations() != std::vector<int>({30, 40}) || report.action != "MIGRATE" ||
+            report.num_deleted != 2 || !fs::exists(archive + "/restore.000010/nodes/level_0/patch.00002") ||
+            !fs::exists(archive + "/restore.000020/samrai.00000")) {
+            std::cout << "FAILED (Rename into the archive)" << std::endl;
+            cleanup_dirs();
+            return false;
+        }
+
+        // An archive entry is never replaced
+        fs::create_directories(archive + "/restore.000030");
+        create_restart_tree(dir, {30, 40, 50}, 3);
+        std::cout.setstate(std::ios::failbit);
+        std::cerr.setstate(std::ios::failbit);
+        report = cleaner.cleanup();
+        std::cout.clear();
+        std::cerr.clear();
+        if (report.errors.size() != 1 || !fs::exists(dir + "/restore.000030/samrai.00002")) {
+            std::cout << "FAILED (Existing archive entry was not protected)" << std::endl;
+            cleanup_dirs();
+            return false;
+        }
+
+        // Copies to another file system are verified before the source goes
+        struct stat local_st;
+        struct stat remote_st;
+        fs::create_directories(remote_archive);
+        if (::stat(dir.c_str(), &local_st) == 0 && ::stat(remote_archive.c_str(), &remote_st) == 0 &&
+            local_st.st_dev != remote_st.st_dev) {
+            const std::string expected = read_file(dir + "/restore.000030/hier_data.00001.samrai.00001");
+            RestartCleaner remote_cleaner(dir, 1, "KEEP_RECENT_N", false);
+            remote_cleaner.setAction("MIGRATE", remote_archive);
+            remote_cleaner.setNumJobs(3);
+            std::cout.setstate(std::ios::failbit);
+            report = remote_cleaner.cleanup();
+            std::cout.clear();
+            const std::string copied = remote_archive + "/restore.000030";
+            if (remote_cleaner.getAvailableIterations() != std::vector<int>({50}) || !report.errors.empty() ||
+                report.bytes_copied == 0 || read_file(copied + "/hier_data.00001.samrai.00001") != expected ||
+                fs::read_symlink(copied + "/latest") != "samrai.00000" ||
+                fs::exists(remote_archive + "/restore.000030.migrating")) {
+                std::cout << "FAILED (Copy to another file system)" << std::endl;
+                cleanup_dirs();
+                return false;
+            }
+        }
+
+        for (const auto& bad : {std::make_pair("MIGRATE", ""), std::make_pair("ARCHIVE", "x")}) {
+            try {
+                cleaner.setAction(bad.first, bad.second);
+                std::cout << "FAILED (Should reject action " << bad.first << ")" << std::endl;
+                cleanup_dirs();
+                return false;
+            } catch (const std::invalid_argument&) {
+                // Expected exception
+            }
+        }
+
+        cleanup_dirs();
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cerr.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        cleanup_dirs();
+        return false;
+    }
+}
+
+/**
+ * Function: write_raw_pack
+ * Purpose: Write a pack with the given (path, type, data) entries as is, so
+ * that tests can hand-craft packs writePack() would never produce
+ */
+void write_raw_pack(const std::string& path,
+                    const std::vector<std::tuple<std::string, RestartPack::EntryType, std::string>>& entries) {
+    const auto put = [](std::string& out, std::uint64_t value, int bytes) {
+        for (int i = 0; i < bytes; ++i) out.push_back(static_cast<char>((value >> (8 * i)) & 0xFF));
+    };
+    const auto crc32c = [](const std::string& data) {
+        std::uint32_t crc = 0xFFFFFFFFu;
+        for (unsigned char c : data) {
+            crc ^= c;
+            for (int bit = 0; bit < 8; ++bit) crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1u)));
+        }
+        return ~crc;
+    };
+    std::string pack = "IBRPACK1";
+    std::string index;
+    for (const auto& entry : entries) {
+        const std::string& data = std::get<2>(entry);
+        put(index, static_cast<std::uint8_t>(std::get<1>(entry)), 1);
+        put(index, 0, 1);
+        put(index, 0, 2);
+        put(index, std::get<1>(entry) == RestartPack::EntryType::DIRECTORY ? 0755 : 0644, 4);
+        put(index, 0, 8);
+        put(index, 0, 4);
+        put(index, crc32c(data), 4);
+        put(index, pack.size(), 8);
+        put(index, data.size(), 8);
+        put(index, data.size(), 8);
+        put(index, std::get<0>(entry).size(), 4);
+        index += std::get<0>(entry);
+        pack += data;
+    }
+    const std::size_t index_offset = pack.size();
+    pack += index;
+    put(pack, index_offset, 8);
+    put(pack, index.size(), 8);
+    put(pack, entries.size(), 8);
+    put(pack, crc32c(index), 4);
+    put(pack, 0, 4);
+    pack += "IBRPIDX1";
+    std::ofstream(path, std::ios::binary) << pack;
+}
+
+/**
+ * Test packing old restart directories into indexed pack files
+ * A pack must list, read back and unpack the tree it replaced, and reject damage
+ */
+bool test_pack() {
+    std::cout << "Testing pack files... ";
+
+    const std::string dir = "pack_test_dir";
+    const auto read_file = [](const std::string& path) {
+        std::ifstream in(path);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+    try {
+        create_restart_tree(dir, {10, 20, 30, 40}, 3);
+        std::ofstream(dir + "/restore.000010/nodes/level_0/patch.00001") << std::string(100000, 'x');
+        fs::permissions(dir + "/restore.000010/samrai.00002", fs::perms::owner_read);
+        const std::string expected = read_file(dir + "/restore.000010/nodes/level_0/patch.00001");
+
+        RestartCleaner cleaner(dir, 2, "KEEP_RECENT_N", false);
+        cleaner.setAction("PACK");
+        cleaner.setNumJobs(3);
+        std::cout.setstate(std::ios::failbit);
+        RestartCleaner::CleanupReport report = cleaner.cleanup();
+        std::cout.clear();
+        if (report.action != "PACK" || report.num_deleted != 2 || !report.errors.empty() ||
+            fs::exists(dir + "/restore.000010") || !fs::is_regular_file(dir + "/restore.000010.pack") ||
+            fs::exists(dir + "/restore.000010.pack.tmp") || report.bytes_copied == 0) {
+            std::cout << "FAILED (Directories were not replaced by packs)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+        if (cleaner.getAvailableIterations() != std::vector<int>({10, 20, 30, 40})) {
+            std::cout << "FAILED (Packed iterations are not listed)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // Packs are never selected again
+        std::cout.setstate(std::ios::failbit);
+        report = cleaner.cleanup();
+        std::cout.clear();
+        if (report.num_deleted != 0 || !fs::exists(dir + "/restore.000010.pack")) {
+            std::cout << "FAILED (Packs were managed as restart directories)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        RestartPack pack(dir + "/restore.000010.pack");
+        const RestartPack::Entry* link = pack.findEntry("latest");
+        if (pack.readFile("nodes/level_0/patch.00001") != expected || !link ||
+            link->type != RestartPack::EntryType::SYMLINK || pack.findEntry("missing") != nullptr) {
+            std::cout << "FAILED (Reading single entries)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        const std::string unpacked = dir + "/restore.000010";
+        pack.unpack(unpacked);
+        if (read_file(unpacked + "/nodes/level_0/patch.00001") != expected ||
+            read_file(unpacked + "/hier_data.00002.samrai.00002") != "Hierarchy data" ||
+            fs::read_symlink(unpacked + "/latest") != "samrai.00000" ||
+            fs::status(unpacked + "/samrai.00002").permissions() != fs::perms::owner_read) {
+            std::cout << "FAILED (Unpacked tree differs)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+        try {
+            pack.unpack(unpacked);
+            std::cout << "FAILED (Unpacked over an existing directory)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        } catch (const std::runtime_error&) {
+            // Expected exception
+        }
+
+        // Entries below a symbolic link (or below no directory entry at all)
+        // are rejected, so that unpacking cannot write outside its destination
+        const std::string outside = dir + "/outside";
+        fs::create_directories(outside);
+        const std::string evil = dir + "/evil.pack";
+        write_raw_pack(evil, {{"a", RestartPack::EntryType::SYMLINK, fs::absolute(outside).string()},
+                              {"a/evil", RestartPack::EntryType::FILE, "escaped"}});
+        write_raw_pack(dir + "/orphan.pack", {{"b/evil", RestartPack::EntryType::FILE, "escaped"}});
+        for (const std::string& name : {evil, dir + "/orphan.pack"}) {
+            try {
+                RestartPack(name).unpack(dir + "/unpacked_evil");
+                std::cout << "FAILED (Accepted an entry whose parent is not a directory: " << name << ")" << std::endl;
+                fs::remove_all(dir);
+                return false;
+            } catch (const std::runtime_error&) {
+                // Expected exception
+            }
+        }
+        if (fs::exists(outside + "/evil")) {
+            std::cout << "FAILED (Unpacking wrote outside its destination)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+        write_raw_pack(dir + "/sane.pack", {{"a", RestartPack::EntryType::DIRECTORY, ""},
+                                            {"a/b", RestartPack::EntryType::FILE, "inside"}});
+        RestartPack(dir + "/sane.pack").unpack(dir + "/unpacked_sane");
+        if (read_file(dir + "/unpacked_sane/a/b") != "inside") {
+            std::cout << "FAILED (Hand-written pack did not unpack)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // A damaged index is detected when the pack is opened
+        const std::string damaged = dir + "/restore.000020.pack";
+        {
+            std::fstream file(damaged, std::ios::in | std::ios::out | std::ios::binary);
+            file.seekp(-60, std::ios::end);
+            file.put('\x7f');
+        }
+        try {
+            RestartPack broken(damaged);
+            std::cout << "FAILED (Damaged pack was accepted)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        } catch (const std::runtime_error&) {
+            // Expected exception
+        }
+
+        try {
+            cleaner.setPackCompression("GZIP");
+            std::cout << "FAILED (Should reject unknown compression)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        } catch (const std::invalid_argument&) {
+            // Expected exception
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cerr.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
+/**
+ * Test deduplication of identical files across kept restart directories
+ * Shared files must keep their contents when older restarts are deleted
+ */
+bool test_deduplication() {
+    std::cout << "Testing deduplication... ";
+
+    const std::string dir = "dedup_test_dir";
+    const auto read_file = [](const std::string& path) {
+        std::ifstream in(path);
+        return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    };
+    const auto same_inode = [](const std::string& a, const std::string& b) {
+        struct stat st_a;
+        struct stat st_b;
+        return ::stat(a.c_str(), &st_a) == 0 && ::stat(b.c_str(), &st_b) == 0 && st_a.st_ino == st_b.st_ino;
+    };
+    try {
+        create_restart_tree(dir, {10, 20, 30, 40}, 2);
+        const std::string structure(20000, 's');
+        for (const std::string name : {"restore.000010", "restore.000020", "restore.000030", "restore.000040"}) {
+            std::ofstream(dir + "/" + name + "/structure.vertex") << structure;
+            std::ofstream(dir + "/" + name + "/nodes/level_0/patch.00000") << std::string(20000, name[12]);
+        }
+
+        RestartCleaner cleaner(dir, 3, "KEEP_RECENT_N", false);
+        cleaner.setDeduplication("AUTO");
+        std::cout.setstate(std::ios::failbit);
+        RestartCleaner::CleanupReport report = cleaner.cleanup();
+        std::cout.clear();
+        const std::string newest = dir + "/restore.000040/structure.vertex";
+        if (report.files_deduplicated != 2 || report.bytes_deduplicated == 0 || !report.errors.empty() ||
+            !same_inode(dir + "/restore.000020/structure.vertex", newest) ||
+            !same_inode(dir + "/restore.000030/structure.vertex", newest) ||
+            same_inode(dir + "/restore.000030/nodes/level_0/patch.00000",
+                       dir + "/restore.000040/nodes/level_0/patch.00000")) {
+            std::cout << "FAILED (Duplicates were not shared: " << report.files_deduplicated << " files)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // Checksums come from the manifest, and nothing is left to share
+        std::cout.setstate(std::ios::failbit);
+        report = cleaner.cleanup();
+        std::cout.clear();
+        if (report.files_deduplicated != 0 || !fs::exists(dir + "/.restart_cleaner_hashes")) {
+            std::cout << "FAILED (Second pass was not a no-op)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // Deleting an older restart leaves the shared data to the newer ones
+        RestartCleaner pruner(dir, 1, "KEEP_RECENT_N", false);
+        std::cout.setstate(std::ios::failbit);
+        pruner.cleanup();
+        std::cout.clear();
+        if (read_file(newest) != structure || fs::exists(dir + "/restore.000030")) {
+            std::cout << "FAILED (Shared file damaged by deletion)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        try {
+            cleaner.setDeduplication("HARDLINK");
+            std::cout << "FAILED (Should reject unknown mode)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        } catch (const std::invalid_argument&) {
+            // Expected exception
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cerr.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
+/**
+ * Test the unlink orders of the parallel engine
+ * Every order must remove exactly the old trees and count every entry
+ */
+bool test_unlink_orders() {
+    std::cout << "Testing unlink orders... ";
+
+    const std::string dir = "unlink_order_test_dir";
+    try {
+        std::uintmax_t expected_entries = 0;
+        for (const std::string order : {"READDIR", "INODE", "REVERSE"}) {
+            create_restart_tree(dir, {10, 20, 30}, 700);
+
+            RestartCleaner cleaner(dir, 1, "KEEP_RECENT_N", false);
+            cleaner.setUnlinkOrder(order);
+            cleaner.setNumJobs(3);
+            std::cout.setstate(std::ios::failbit);
+            RestartCleaner::CleanupReport report = cleaner.cleanup();
+            std::cout.clear();
+
+            if (expected_entries == 0) expected_entries = report.entries_unlinked;
+            if (cleaner.getAvailableIterations() != std::vector<int>({30}) || !report.errors.empty() ||
+                report.entries_unlinked != expected_entries ||
+                !fs::exists(dir + "/restore.000030/nodes/level_0/patch.00699")) {
+                std::cout << "FAILED (" << order << " order removed " << report.entries_unlinked << " entries)"
+                          << std::endl;
+                fs::remove_all(dir);
+                return false;
+            }
+        }
+
+        try {
+            RestartCleaner cleaner(dir, 1, "KEEP_RECENT_N", false);
+            cleaner.setUnlinkOrder("RANDOM");
+            std::cout << "FAILED (Should reject unknown order)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        } catch (const std::invalid_argument&) {
+            // Expected exception
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
+/**
+ * Test advisory locking and partitioned cleanup
+ * A locked base path must be skipped, and partitions must share the victims without overlap
+ */
+bool test_locking_and_partitions() {
+    std::cout << "Testing locking and partitions... ";
+
+    const std::string dir = "lock_test_dir";
+    int lock_fd = -1;
+    const auto lock_range = [&](off_t start, off_t length) {
+        lock_fd = ::open((dir + "/.restart_cleaner.lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        struct flock range = {};
+        range.l_type = F_WRLCK;
+        range.l_whence = SEEK_SET;
+        range.l_start = start;
+        range.l_len = length;
+        return lock_fd >= 0 && ::fcntl(lock_fd, F_OFD_SETLK, &range) == 0;
+    };
+    const auto unlock = [&]() {
+        if (lock_fd >= 0) ::close(lock_fd);
+        lock_fd = -1;
+    };
+    try {
+        std::vector<int> iterations;
+        for (int i = 1; i <= 12; ++i) iterations.push_back(i * 100);
+        create_restart_tree(dir, iterations, 1);
+
+        // Another process holds the whole lock file
+        if (!lock_range(0, 0)) {
+            std::cout << "FAILED (Cannot take the test lock)" << std::endl;
+            unlock();
+            fs::remove_all(dir);
+            return false;
+        }
+        RestartCleaner cleaner(dir, 2, "KEEP_RECENT_N", false);
+        cleaner.setLocking("SKIP");
+        std::cout.setstate(std::ios::failbit);
+        RestartCleaner::CleanupReport report = cleaner.cleanup();
+        std::cout.clear();
+        unlock();
+        if (!report.skipped || report.num_deleted != 0 || cleaner.getAvailableIterations().size() != 12) {
+            std::cout << "FAILED (Locked base path was not skipped)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // Watch mode takes the lock for every cleanup and retries once it is free
+        {
+            lock_range(0, 0);
+            RestartWatcher watcher(cleaner, 0.1);
+            std::cout.setstate(std::ios::failbit);
+            std::thread thread([&]() { watcher.run(); });
+            std::this_thread::sleep_for(std::chrono::milliseconds(300));
+            const bool skipped = cleaner.getAvailableIterations().size() == 12 && watcher.getNumCleanups() == 0;
+            unlock();
+            const bool retried = wait_for([&]() { return watcher.getNumCleanups() > 0; }, 5.0);
+            watcher.stop();
+            thread.join();
+            std::cout.clear();
+            if (!skipped || !retried) {
+                std::cout << "FAILED (Watch mode " << (skipped ? "did not retry" : "ignored the lock") << ")" << std::endl;
+                fs::remove_all(dir);
+                return false;
+            }
+            create_restart_tree(dir, iterations, 1);
+        }
+
+        // Partitions lock one byte each: partition 1 being busy only stops partition 1
+        std::size_t num_deleted = 0;
+        lock_range(1, 1);
+        for (int index : {0, 1, 2}) {
+            RestartCleaner partition(dir, 2, "KEEP_RECENT_N", false);
+            partition.setLocking("SKIP");
+            partition.setPartition(index, 3);
+            std::cout.setstate(std::ios::failbit);
+            report = partition.cleanup();
+            std::cout.clear();
+            if (report.skipped != (index == 1)) {
+                std::cout << "FAILED (Partition " << index << " locking)" << std::endl;
+                unlock();
+                fs::remove_all(dir);
+                return false;
+            }
+            num_deleted += report.num_deleted;
+        }
+        std::cout.setstate(std::ios::failbit);
+        report = cleaner.cleanup();
+        std::cout.clear();
+        unlock();
+        if (!report.skipped) {
+            std::cout << "FAILED (Unpartitioned cleanup ran next to a partition)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+        RestartCleaner partition(dir, 2, "KEEP_RECENT_N", false);
+        partition.setPartition(1, 3);
+        std::cout.setstate(std::ios::failbit);
+        num_deleted += partition.cleanup().num_deleted;
+        std::cout.clear();
+        if (num_deleted != 10 || partition.getAvailableIterations() != std::vector<int>({1100, 1200})) {
+            std::cout << "FAILED (Partitions deleted " << num_deleted << " directories)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        for (const auto& bad : {std::make_pair(3, 3), std::make_pair(-1, 2), std::make_pair(0, 0)}) {
+            try {
+                partition.setPartition(bad.first, bad.second);
+                std::cout << "FAILED (Should reject partition " << bad.first << "/" << bad.second << ")" << std::endl;
+                fs::remove_all(dir);
+                return false;
+            } catch (const std::invalid_argument&) {
+                // Expected exception
+            }
+        }
+        try {
+            partition.setTombstoneDeletion(true);
+            std::cout << "FAILED (Should reject tombstones with partitions)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        } catch (const std::invalid_argument&) {
+            // Expected exception
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        unlock();
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
+/**
+ * Test the rank-parallel cleanup with threads standing in for MPI ranks
+ * Every rank unlinks its own files, rank 0 removes the rest, and errors reach all ranks
+ */
+bool test_distributed_cleanup() {
+    std::cout << "Testing distributed cleanup... ";
+
+    const std::string dir = "distributed_test_dir";
+    const auto run_ranks = [](const std::string& base, int num_ranks, std::vector<RestartCleaner::CleanupReport>& reports,
+                              std::vector<std::string>& errors) {
+        auto comms = RestartThreadCommunicator::create(num_ranks);
+        reports.assign(num_ranks, RestartCleaner::CleanupReport());
+        errors.assign(num_ranks, std::string());
+        std::vector<std::thread> ranks;
+        std::cout.setstate(std::ios::failbit);
+        for (int rank = 0; rank < num_ranks; ++rank) {
+            ranks.emplace_back([&, rank]() {
+                try {
+                    RestartCleaner cleaner(base, 2, "KEEP_RECENT_N", false);
+                    reports[rank] = cleaner.cleanupDistributed(*comms[rank]);
+                } catch (const std::exception& e) {
+                    errors[rank] = e.what();
+                }
+            });
+        }
+        for (auto& rank : ranks) rank.join();
+        std::cout.clear();
+    };
+    try {
+        create_restart_tree(dir, {100, 200, 300, 400, 500, 600}, 16);
+
+        std::vector<RestartCleaner::CleanupReport> reports;
+        std::vector<std::string> errors;
+        run_ranks(dir, 4, reports, errors);
+        std::uintmax_t num_unlinked = 0;
+        for (int rank = 0; rank < 4; ++rank) {
+            if (!errors[rank].empty()) {
+                std::cout << "FAILED (Rank " << rank << ": " << errors[rank] << ")" << std::endl;
+                fs::remove_all(dir);
+                return false;
+            }
+            if (reports[rank].num_selected != 4) {
+                std::cout << "FAILED (Rank " << rank << " saw " << reports[rank].num_selected << " selected)" << std::endl;
+                fs::remove_all(dir);
+                return false;
+            }
+            if (rank != 0) num_unlinked += reports[rank].entries_unlinked;
+        }
+        if (reports[0].num_deleted != 4 || num_unlinked == 0 || !reports[0].errors.empty()) {
+            std::cout << "FAILED (Rank 0 deleted " << reports[0].num_deleted << ", other ranks unlinked "
+                      << num_unlinked << ")" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+        RestartCleaner check(dir, 2);
+        if (check.getAvailableIterations() != std::vector<int>({500, 600}) ||
+            !fs::exists(dir + "/restore.000500/nodes/level_0/patch.00015") ||
+            !fs::exists(dir + "/restore.000600/samrai.00003")) {
+            std::cout << "FAILED (Kept restarts were touched)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // A failure while planning reaches every rank instead of leaving them waiting
+        run_ranks(dir + "/missing", 3, reports, errors);
+        for (int rank = 0; rank < 3; ++rank) {
+            if (errors[rank].empty()) {
+                std::cout << "FAILED (Rank " << rank << " did not see the planning error)" << std::endl;
+                fs::remove_all(dir);
+                return false;
+            }
+        }
+
+        try {
+            RestartThreadCommunicator::create(0);
+            std::cout << "FAILED (Should reject an empty communicator)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        } catch (const std::invalid_argument&) {
+            // Expected exception
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
+/**
+ * Test the TIME_BASED strategy on restart directories with set completion times
+ * Everything recent is kept, older restarts are thinned to the oldest one per day
+ */
+bool test_time_based_retention() {
+    std::cout << "Testing time-based retention... ";
+
+    const std::string dir = "time_test_dir";
+    try {
+        const std::int64_t hour = 3600;
+        const std::int64_t day = 24 * hour;
+        const std::int64_t now = static_cast<std::int64_t>(std::time(nullptr));
+        const std::int64_t noon = now / day * day - 10 * day + 12 * hour;
+        const std::vector<std::pair<int, std::int64_t>> completed = {
+            {100, noon - hour}, {200, noon}, {300, noon + day}, {400, noon + day + 2 * hour},
+            {500, noon + day + 3 * hour}, {600, noon + 2 * day}, {700, now - 5 * hour}, {800, now - 4 * hour},
+            {900, now - 3 * hour}, {1000, now - 2 * hour}, {1100, now - hour}, {1200, now - 60}};
+        std::vector<int> iterations;
+        for (const auto& entry : completed) iterations.push_back(entry.first);
+        create_restart_tree(dir, iterations, 1);
+        for (const auto& entry : completed) {
+            char name[32];
+            std::snprintf(name, sizeof(name), "/restore.%06d", entry.first);
+            struct timespec times[2] = {{entry.second, 0}, {entry.second, 0}};
+            if (::utimensat(AT_FDCWD, (dir + name).c_str(), times, 0) != 0) {
+                std::cout << "FAILED (Cannot set the time of " << name << ")" << std::endl;
+                fs::remove_all(dir);
+                return false;
+            }
+        }
+
+        RestartCleaner cleaner(dir, 2, "TIME_BASED", false);
+        cleaner.setTimeRetention({6 * hour, day, 0});
+        std::cout.setstate(std::ios::failbit);
+        RestartCleaner::CleanupReport report = cleaner.cleanup();
+        std::cout.clear();
+        const std::vector<int> expected = {100, 300, 600, 700, 800, 900, 1000, 1100, 1200};
+        if (report.strategy != "TIME_BASED" || cleaner.getAvailableIterations() != expected) {
+            std::cout << "FAILED (Did not keep one restart per day)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+        if (!fs::exists(dir + "/.restart_cleaner_times")) {
+            std::cout << "FAILED (Completion times were not cached)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // From the cache, with a maximum age that only the oldest restart exceeds
+        RestartCleaner aged(dir, 2, "TIME_BASED", false);
+        aged.setTimeRetention({6 * hour, day, 9 * day + 12 * hour});
+        std::cout.setstate(std::ios::failbit);
+        report = aged.cleanup();
+        std::cout.clear();
+        if (report.num_deleted != 1 || aged.getAvailableIterations().front() != 300) {
+            std::cout << "FAILED (Maximum age deleted " << report.num_deleted << " directories)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        for (const RestartCleaner::TimeRetention& bad :
+             {RestartCleaner::TimeRetention{hour, 0, 0}, RestartCleaner::TimeRetention{day, hour, hour}}) {
+            try {
+                aged.setTimeRetention(bad);
+                std::cout << "FAILED (Should reject invalid time windows)" << std::endl;
+                fs::remove_all(dir);
+                return false;
+            } catch (const std::invalid_argument&) {
+                // Expected exception
+            }
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
+/**
+ * Test planning a cleanup, saving the plan and executing it later
+ * Directories replaced after planning must survive, and deletions feed the cost model
+ */
+bool test_plan_and_execute() {
+    std::cout << "Testing plan and execute... ";
+
+    const std::string dir = "plan_test_dir";
+    const std::string plan_file = "plan_test.plan";
+    try {
+        create_restart_tree(dir, {100, 200, 300, 400, 500, 600}, 300);
+
+        RestartCleaner planner(dir, 2);
+        std::cout.setstate(std::ios::failbit);
+        const RestartCleaner::CleanupPlan plan = planner.plan();
+        std::cout.clear();
+        if (plan.directories.size() != 4 || plan.num_found != 6 || plan.total_entries < 4 * 900 ||
+            plan.total_bytes == 0 || plan.predicted_seconds <= 0.0 || plan.cost_source != "DEFAULT") {
+            std::cout << "FAILED (Plan does not describe the old restarts)" << std::endl;
+            fs::remove_all(dir);
+            fs::remove(plan_file);
+            return false;
+        }
+        if (planner.getAvailableIterations().size() != 6) {
+            std::cout << "FAILED (Planning deleted directories)" << std::endl;
+            fs::remove_all(dir);
+            fs::remove(plan_file);
+            return false;
+        }
+
+        plan.save(plan_file);
+        const RestartCleaner::CleanupPlan loaded = RestartCleaner::CleanupPlan::load(plan_file);
+        if (loaded.directories.size() != 4 || loaded.directories[1].name != "restore.000200" ||
+            loaded.directories[1].inode != plan.directories[1].inode ||
+            loaded.directories[1].mtime_ns != plan.directories[1].mtime_ns ||
+            loaded.total_entries != plan.total_entries || loaded.keep_restart_count != 2) {
+            std::cout << "FAILED (Saved plan does not load back)" << std::endl;
+            fs::remove_all(dir);
+            fs::remove(plan_file);
+            return false;
+        }
+
+        // A restart written again under a planned name is not deleted
+        fs::remove_all(dir + "/restore.000200");
+        fs::create_directories(dir + "/restore.000200/nodes");
+        RestartCleaner executor(dir, 2);
+        std::cout.setstate(std::ios::failbit);
+        RestartCleaner::CleanupReport report = executor.execute(loaded);
+        std::cout.clear();
+        if (report.num_deleted != 3 || executor.getAvailableIterations() != std::vector<int>({200, 500, 600})) {
+            std::cout << "FAILED (Executed " << report.num_deleted << " deletions)" << std::endl;
+            fs::remove_all(dir);
+            fs::remove(plan_file);
+            return false;
+        }
+
+        // The deletion measured the cost per entry for the next plan
+        std::cout.setstate(std::ios::failbit);
+        const RestartCleaner::CleanupPlan replan = executor.plan();
+        std::cout.clear();
+        if (!fs::exists(dir + "/.restart_cleaner_cost") || replan.cost_source != "MEASURED" ||
+            replan.directories.size() != 1) {
+            std::cout << "FAILED (Deletion cost was not recorded)" << std::endl;
+            fs::remove_all(dir);
+            fs::remove(plan_file);
+            return false;
+        }
+
+        RestartCleaner other(".", 1);
+        try {
+            other.execute(loaded);
+            std::cout << "FAILED (Should reject a plan for another directory)" << std::endl;
+            fs::remove_all(dir);
+            fs::remove(plan_file);
+            return false;
+        } catch (const std::invalid_argument&) {
+            // Expected exception
+        }
+        std::ofstream(plan_file) << "not a plan\n";
+        try {
+            RestartCleaner::CleanupPlan::load(plan_file);
+            std::cout << "FAILED (Should reject an invalid plan file)" << std::endl;
+            fs::remove_all(dir);
+            fs::remove(plan_file);
+            return false;
+        } catch (const std::runtime_error&) {
+            // Expected exception
+        }
+
+        fs::remove_all(dir);
+        fs::remove(plan_file);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        fs::remove(plan_file);
+        return false;
+    }
+}
+
+/**
+ * Test pinned restarts from all three sources, with the streaming and the indexed selection
+ * Pinned restarts must survive and must not count towards the restarts kept
+ */
+bool test_pinned_restarts() {
+    std::cout << "Testing pinned restarts... ";
+
+    const std::string dir = "pin_test_dir";
+    try {
+        // The parallel engine streams KEEP_RECENT_N, the serial engine selects from the index
+        for (const std::string engine : {"PARALLEL", "SERIAL"}) {
+            create_restart_tree(dir, {100, 200, 300, 400, 500, 600, 700, 800}, 1);
+            std::ofstream(dir + "/.restart_cleaner_pins") << "restore.000300\n# branched runs\n  400  # study B\n";
+            std::ofstream(dir + "/restore.000500/.pinned");
+
+            RestartCleaner cleaner(dir, 2, "KEEP_RECENT_N", false);
+            cleaner.setDeletionEngine(engine);
+            cleaner.setPinnedIterations({200});
+            cleaner.setPinMarkers(true);
+            std::cout.setstate(std::ios::failbit);
+            RestartCleaner::CleanupReport report = cleaner.cleanup();
+            std::cout.clear();
+            if (report.num_pinned != 4 || report.num_deleted != 2 ||
+                cleaner.getAvailableIterations() != std::vector<int>({200, 300, 400, 500, 700, 800})) {
+                std::cout << "FAILED (" << engine << " selection pinned " << report.num_pinned << " and deleted "
+                          << report.num_deleted << ")" << std::endl;
+                fs::remove_all(dir);
+                return false;
+            }
+        }
+
+        // Restarts pinned after planning do not count as kept when the plan runs
+        create_restart_tree(dir, {100, 200, 300, 400, 500, 600, 700, 800}, 1);
+        RestartCleaner planner(dir, 2);
+        std::cout.setstate(std::ios::failbit);
+        const RestartCleaner::CleanupPlan plan = planner.plan();
+        RestartCleaner executor(dir, 2);
+        executor.setPinnedIterations({700, 800});
+        RestartCleaner::CleanupReport report = executor.execute(plan);
+        std::cout.clear();
+        if (plan.directories.size() != 6 || report.num_pinned != 2 || report.num_deleted != 4 ||
+            executor.getAvailableIterations() != std::vector<int>({500, 600, 700, 800})) {
+            std::cout << "FAILED (Executed plan deleted " << report.num_deleted << " with "
+                      << report.num_pinned << " pinned)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        try {
+            RestartCleaner cleaner(dir, 2);
+            cleaner.setPinnedIterations({-1});
+            std::cout << "FAILED (Should reject a negative pinned iteration)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        } catch (const std::invalid_argument&) {
+            // Expected exception
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
+/**
+ * Test the restart catalog
+ * An unchanged base directory is listed and sized from the catalog; a
+ * rebuild or a damaged catalog goes back to the file system
+ */
+bool test_catalog() {
+    std::cout << "Testing restart catalog... ";
+
+    const std::string dir = "catalog_test_dir";
+    try {
+        // A base directory last changed a minute ago has settled
+        const auto age_base = [&dir]() {
+            const std::time_t old = std::time(nullptr) - 60;
+            struct timespec times[2] = {{old, 0}, {old, 0}};
+            return ::utimensat(AT_FDCWD, dir.c_str(), times, 0) == 0;
+        };
+        const auto sized_cleanup = [&dir](const std::string& mode) {
+            RestartCleaner cleaner(dir, 3, "MAX_BYTES", false);
+            cleaner.setMaxBytes(std::uintmax_t(1) << 40);
+            cleaner.setCatalog(mode);
+            std::cout.setstate(std::ios::failbit);
+            RestartCleaner::CleanupReport report = cleaner.cleanup();
+            std::cout.clear();
+            return report;
+        };
+
+        // A dry run leaves the base directory as it is
+        create_restart_tree(dir, {10, 20, 30, 40, 50, 60}, 1);
+        {
+            RestartCleaner dry_cleaner(dir, 3, "MAX_BYTES", true);
+            dry_cleaner.setMaxBytes(1);
+            dry_cleaner.setCatalog("ON");
+            std::cout.setstate(std::ios::failbit);
+            dry_cleaner.cleanup();
+            dry_cleaner.getAvailableIterations();
+            std::cout.clear();
+            if (fs::exists(dir + "/.restart_cleaner_catalog")) {
+                std::cout << "FAILED (Dry run wrote the catalog)" << std::endl;
+                fs::remove_all(dir);
+                return false;
+            }
+        }
+
+        RestartCleaner::CleanupReport report = sized_cleanup("ON");
+        if (report.catalog_used || !fs::exists(dir + "/.restart_cleaner_catalog")) {
+            std::cout << "FAILED (Catalog was not written)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // The first scan after the base directory changed refreshes the
+        // catalog, the next one is answered by it
+        if (!age_base() || sized_cleanup("ON").catalog_used) {
+            std::cout << "FAILED (Catalog used for a changed base directory)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+        report = sized_cleanup("ON");
+        if (!report.catalog_used || report.syscalls.getdents != 0 || report.entries_scanned != 0 ||
+            report.num_found != 6 || report.num_deleted != 0) {
+            std::cout << "FAILED (Unchanged base directory was scanned)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // A change that leaves the base directory looking the same is only
+        // seen after a rebuild
+        std::ofstream(dir + "/restore.000005.pack") << "packed";
+        if (!age_base()) {
+            std::cout << "FAILED (Cannot set the time of " << dir << ")" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+        RestartCleaner reader(dir, 3);
+        RestartCleaner rebuilder(dir, 3);
+        rebuilder.setCatalog("REBUILD");
+        if (reader.getAvailableIterations() != std::vector<int>({10, 20, 30, 40, 50, 60}) ||
+            rebuilder.getAvailableIterations() != std::vector<int>({5, 10, 20, 30, 40, 50, 60})) {
+            std::cout << "FAILED (Iterations were not listed from the catalog)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // A damaged catalog is ignored and rewritten
+        {
+            std::fstream catalog(dir + "/.restart_cleaner_catalog", std::ios::in | std::ios::out | std::ios::binary);
+            catalog.seekp(64);
+            catalog.put('\xff');
+        }
+        report = sized_cleanup("ON");
+        if (report.catalog_used || report.num_found != 6) {
+            std::cout << "FAILED (Damaged catalog was used)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        // KEEP_RECENT_N selects from a current catalog instead of streaming
+        RestartCleaner cleaner(dir, 2);
+        std::cout.setstate(std::ios::failbit);
+        report = cleaner.cleanup();
+        std::cout.clear();
+        if (!report.catalog_used || report.num_deleted != 4 ||
+            cleaner.getAvailableIterations() != std::vector<int>({5, 50, 60})) {
+            std::cout << "FAILED (KEEP_RECENT_N from the catalog deleted " << report.num_deleted << ")" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        }
+
+        try {
+            cleaner.setCatalog("SOMETIMES");
+            std::cout << "FAILED (Should reject an unknown catalog mode)" << std::endl;
+            fs::remove_all(dir);
+            return false;
+        } catch (const std::invalid_argument&) {
+            // Expected exception
+        }
+
+        fs::remove_all(dir);
+        std::cout << "PASSED" << std::endl;
+        return true;
+
+    } catch (const std::exception& e) {
+        std::cout.clear();
+        std::cout << "FAILED (Exception: " << e.what() << ")" << std::endl;
+        fs::remove_all(dir);
+        return false;
+    }
+}
+
 /**
  * Main test runner
  */
@@ -338,6 +2328,29 @@ int main() {
     all_tests_passed &= test_directory_filtering(env);  
     all_tests_passed &= test_cleanup_dry_run(env);
     all_tests_passed &= test_error_handling();
+    all_tests_passed &= test_deletion_engines();
+    all_tests_passed &= test_async_cleanup();
+    all_tests_passed &= test_restart_index();
+    all_tests_passed &= test_smart_retention();
+    all_tests_passed &= test_max_bytes();
+    all_tests_passed &= test_batch_cleanup();
+    all_tests_passed &= test_tombstone_deletion();
+    all_tests_passed &= test_verification();
+    all_tests_passed &= test_cleanup_report();
+    all_tests_passed &= test_rate_limits();
+    all_tests_passed &= test_watch_mode();
+    all_tests_passed &= test_streaming_selection();
+    all_tests_passed &= test_name_patterns();
+    all_tests_passed &= test_migration();
+    all_tests_passed &= test_pack();
+    all_tests_passed &= test_deduplication();
+    all_tests_passed &= test_unlink_orders();
+    all_tests_passed &= test_locking_and_partitions();
+    all_tests_passed &= test_distributed_cleanup();
+    all_tests_passed &= test_time_based_retention();
+    all_tests_passed &= test_plan_and_execute();
+    all_tests_passed &= test_pinned_restarts();
+    all_tests_passed &= test_catalog();
 
     // Final report
     std::cout << std::endl;